@@ -0,0 +1,245 @@
+/*
+  Created by Fabrizio Di Vittorio (fdivitto2013@gmail.com) - www.fabgl.com
+  Copyright (c) 2019 Fabrizio Di Vittorio.
+  All rights reserved.
+
+  This file is part of FabGL Library.
+
+  FabGL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  FabGL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with FabGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "fabgl.h"
+
+
+/* * * *  C O N F I G U R A T I O N  * * * */
+
+// select one color configuration
+#define USE_8_COLORS  0
+#define USE_64_COLORS 1
+
+// indicate VGA GPIOs to use for selected color configuration
+#if USE_8_COLORS
+  #define VGA_RED    GPIO_NUM_22
+  #define VGA_GREEN  GPIO_NUM_21
+  #define VGA_BLUE   GPIO_NUM_19
+  #define VGA_HSYNC  GPIO_NUM_18
+  #define VGA_VSYNC  GPIO_NUM_5
+#elif USE_64_COLORS
+  #define VGA_RED1   GPIO_NUM_22
+  #define VGA_RED0   GPIO_NUM_21
+  #define VGA_GREEN1 GPIO_NUM_19
+  #define VGA_GREEN0 GPIO_NUM_18
+  #define VGA_BLUE1  GPIO_NUM_5
+  #define VGA_BLUE0  GPIO_NUM_4
+  #define VGA_HSYNC  GPIO_NUM_23
+  #define VGA_VSYNC  GPIO_NUM_15
+#endif
+
+// number of primitives executed by each test
+#define OPS_COUNT 200
+
+/* * * *  E N D   O F   C O N F I G U R A T I O N  * * * */
+
+
+
+// Each primitive is measured twice:
+//   - "us/op"  : rasterization. Primitives are queued with background execution suspended and executed by
+//                processPrimitives() (or by this task when the queue or the arena is full). With double buffering
+//                primitives are executed while added. Timed with the CPU cycles counter, queueing included.
+//   - "ops/s"  : whole pipeline. Primitives are queued while executed by the vertical sync interrupt, timed with
+//                esp_timer_get_time() up to the end of execution.
+
+
+const char * Modelines[] = {
+  QVGA_320x240_60Hz,
+  VGA_400x300_60Hz,
+  VGA_640x240_60Hz,
+  VGA_640x350_70Hz,
+  VGA_640x480_60Hz,
+  SVGA_800x300_60Hz,
+  SVGA_800x600_60Hz,
+};
+
+
+struct Benchmark {
+  char const * name;
+  void (*prepare)();     // called once before the test (state primitives)
+  void (*exec)(int i);   // queues the i-th primitive
+};
+
+
+uint8_t  bitmapData[32 * 32];
+Bitmap * bitmap;
+Point    star[10];
+uint32_t seed;
+
+
+// deterministic pseudo random numbers, so every run draws the same things
+int rnd(int max)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) % max;
+}
+
+
+void prepareColors()
+{
+  Canvas.setPenColor(Color::BrightYellow);
+  Canvas.setBrushColor(Color::Blue);
+}
+
+
+void prepareGlyphs()
+{
+  prepareColors();
+  Canvas.setGlyphOptions(GlyphOptions().FillBackground(true));
+}
+
+
+void prepareScroll()
+{
+  prepareColors();
+  Canvas.setScrollingRegion(0, 0, Canvas.getWidth() - 1, Canvas.getHeight() - 1);
+}
+
+
+void execFillRectangle(int i)
+{
+  int x = rnd(Canvas.getWidth() - 32), y = rnd(Canvas.getHeight() - 32);
+  Canvas.fillRectangle(x, y, x + 31, y + 31);
+}
+
+
+void execDrawGlyph(int i)
+{
+  fabgl::FontInfo const * font = Canvas.getFontInfo();
+  Canvas.drawGlyph(rnd(Canvas.getWidth() - font->width), rnd(Canvas.getHeight() - font->height), font->width, font->height, font->data, 'A' + i % 26);
+}
+
+
+void execCopyRect(int i)
+{
+  Canvas.copyRect(rnd(Canvas.getWidth() - 64), rnd(Canvas.getHeight() - 64), rnd(Canvas.getWidth() - 64), rnd(Canvas.getHeight() - 64), 64, 64);
+}
+
+
+void execDrawBitmap(int i)
+{
+  Canvas.drawBitmap(rnd(Canvas.getWidth() - bitmap->width), rnd(Canvas.getHeight() - bitmap->height), bitmap);
+}
+
+
+void execFillPath(int i)
+{
+  Canvas.fillPath(star, 10);
+}
+
+
+void execScroll(int i)
+{
+  Canvas.scroll(0, -8);
+}
+
+
+const Benchmark Benchmarks[] = {
+  { "fillRectangle", prepareColors, execFillRectangle },
+  { "drawGlyph",     prepareGlyphs, execDrawGlyph },
+  { "copyRect",      prepareColors, execCopyRect },
+  { "drawBitmap",    prepareColors, execDrawBitmap },
+  { "fillPath",      prepareColors, execFillPath },
+  { "scroll",        prepareScroll, execScroll },
+};
+
+
+void runBenchmark(Benchmark const & benchmark, char const * modeName, bool doubleBuffered)
+{
+  // rasterization
+  VGAController.suspendBackgroundPrimitiveExecution();
+  benchmark.prepare();
+  VGAController.processPrimitives();
+  seed = 1;
+  uint32_t startCycles = ESP.getCycleCount();
+  for (int i = 0; i < OPS_COUNT; ++i)
+    benchmark.exec(i);
+  VGAController.processPrimitives();
+  uint32_t cycles = ESP.getCycleCount() - startCycles;
+  VGAController.resumeBackgroundPrimitiveExecution();
+
+  // whole pipeline
+  seed = 1;
+  int64_t startTime = esp_timer_get_time();
+  for (int i = 0; i < OPS_COUNT; ++i)
+    benchmark.exec(i);
+  Canvas.waitCompletion();
+  int64_t elapsed = esp_timer_get_time() - startTime;
+
+  double usPerOp = (double) cycles / ESP.getCpuFreqMHz() / OPS_COUNT;
+  Serial.printf("%-16s %-6s %-14s %10.2f %10d\n", modeName, doubleBuffered ? "double" : "single", benchmark.name, usPerOp, (int) (OPS_COUNT * 1000000LL / (elapsed > 0 ? elapsed : 1)));
+}
+
+
+void setup()
+{
+  Serial.begin(115200);
+  delay(500);
+
+  #if USE_8_COLORS
+  VGAController.begin(VGA_RED, VGA_GREEN, VGA_BLUE, VGA_HSYNC, VGA_VSYNC);
+  #elif USE_64_COLORS
+  VGAController.begin(VGA_RED1, VGA_RED0, VGA_GREEN1, VGA_GREEN0, VGA_BLUE1, VGA_BLUE0, VGA_HSYNC, VGA_VSYNC);
+  #endif
+
+  // 32x32 opaque checkerboard
+  for (int y = 0; y < 32; ++y)
+    for (int x = 0; x < 32; ++x)
+      bitmapData[x + y * 32] = ((x ^ y) & 4) ? 0xC3 : 0xFC;
+  bitmap = new Bitmap(32, 32, bitmapData);
+
+  Serial.printf("FabGL benchmarks\n");
+  Serial.printf("Chip Revision: %d   Chip Frequency: %d MHz   Primitives per test: %d\n\n", ESP.getChipRevision(), ESP.getCpuFreqMHz(), OPS_COUNT);
+  Serial.printf("%-16s %-6s %-14s %10s %10s\n", "Mode", "Buffer", "Primitive", "us/op", "ops/s");
+
+  for (int m = 0; m < sizeof(Modelines) / sizeof(Modelines[0]); ++m) {
+    for (int doubleBuffered = 0; doubleBuffered < 2; ++doubleBuffered) {
+
+      VGAController.setResolution(Modelines[m], -1, -1, doubleBuffered);
+      Canvas.selectFont(Canvas.getPresetFontInfo(80, 25));
+      Canvas.setBrushColor(Color::Black);
+      Canvas.clear();
+
+      char modeName[32];
+      snprintf(modeName, sizeof(modeName), "%dx%d", VGAController.getViewPortWidth(), VGAController.getViewPortHeight());
+      if (VGAController.getViewPortHeight() < VGAController.getScreenHeight())
+        strcat(modeName, "*"); // not enough memory for the whole screen
+
+      // a 5 pointed star (concave polygon) at the center of the screen
+      for (int i = 0; i < 10; ++i) {
+        double a = i * PI / 5, r = (i & 1) ? 40 : 100;
+        star[i] = Point(Canvas.getWidth() / 2 + r * sin(a), Canvas.getHeight() / 2 - r * cos(a));
+      }
+
+      for (auto const & benchmark : Benchmarks)
+        runBenchmark(benchmark, modeName, doubleBuffered);
+
+    }
+  }
+
+  Serial.printf("\n* = viewport reduced, not enough memory\n");
+}
+
+
+void loop()
+{
+}
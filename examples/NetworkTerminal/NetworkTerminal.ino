@@ -77,6 +77,94 @@ bool         error = false;
 TerminalClass Terminal;
 
 
+// Received data is stored directly into the terminal input queue, telnet commands are removed in place
+class TelnetTransport : public TerminalTransport {
+
+public:
+
+  TelnetTransport(WiFiClient & client) : m_client(client), m_state(Data) { }
+
+  void begin() { m_state = Data; }
+
+  int receive(uint8_t * buffer, int maxSize)
+  {
+    int avail = m_client.available();
+    if (avail <= 0)
+      return m_client.connected() ? 0 : -1;
+    int count = m_client.read(buffer, min(avail, maxSize));
+    int len = 0;
+    for (int i = 0; i < count; ++i) {
+      uint8_t c = buffer[i];
+      switch (m_state) {
+        case Data:
+          if (c == 0xFF)
+            m_state = IAC;
+          else
+            buffer[len++] = c;
+          break;
+        case IAC:
+          if (c == 0xFF) {
+            buffer[len++] = c;  // escaped 0xFF
+            m_state = Data;
+          } else {
+            m_cmd   = c;
+            m_state = (c >= 0xFA) ? Option : Data;  // SB, WILL, WONT, DO and DONT have an option
+          }
+          break;
+        case Option:
+          command(m_cmd, c);
+          m_state = (m_cmd == 0xFA) ? SubNeg : Data;
+          break;
+        case SubNeg:
+          // bypass subnegotiation up to IAC SE
+          if (c == 0xFF)
+            m_state = SubNegIAC;
+          break;
+        case SubNegIAC:
+          m_state = (c == 0xF0) ? Data : SubNeg;
+          break;
+      }
+    }
+    return len;
+  }
+
+  void send(uint8_t const * data, int size)
+  {
+    m_client.write(data, size);
+  }
+
+private:
+
+  void command(uint8_t cmd, uint8_t opt)
+  {
+    if (cmd == 0xFD && opt == 0x1F) {
+      // DO WINDOWSIZE
+      m_client.write("\xFF\xFB\x1F", 3); // IAC WILL WINDOWSIZE
+      m_client.write("\xFF\xFA\x1F" "\x00\x50\x00\x19" "\xFF\xF0", 9);  // IAC SB WINDOWSIZE 0 80 0 25 IAC SE
+    } else if (cmd == 0xFD && opt == 0x18) {
+      // DO TERMINALTYPE
+      m_client.write("\xFF\xFB\x18", 3); // IAC WILL TERMINALTYPE
+    } else if (cmd == 0xFA && opt == 0x18) {
+      // SB TERMINALTYPE
+      m_client.write("\xFF\xFA\x18\x00" "wsvt25" "\xFF\xF0", 12); // IAC SB TERMINALTYPE 0 "...." IAC SE
+    } else if (cmd == 0xFD || cmd == 0xFB) {
+      uint8_t pck[3] = {0xFF, (uint8_t)(cmd == 0xFD ? 0xFC : 0xFD), opt};  // DO -> WONT, WILL -> DO
+      m_client.write(pck, 3);
+    }
+  }
+
+  enum State { Data, IAC, Option, SubNeg, SubNegIAC };
+
+  WiFiClient & m_client;
+  State        m_state;
+  uint8_t      m_cmd;
+
+};
+
+
+TelnetTransport telnet(client);
+
+
 void exe_info()
 {
   Terminal.write("\e[37m* * FabGL - Network VT/ANSI Terminal\r\n");
@@ -251,6 +339,8 @@ void exe_telnetInit()
     Terminal.printf("Trying %s...\r\n", host);
     if (client.connect(host, port)) {
       Terminal.printf("Connected to %s\r\n", host);
+      telnet.begin();
+      Terminal.connectTransport(&telnet);
       error = false;
       state = State::Telnet;
     } else {
@@ -264,56 +354,16 @@ void exe_telnetInit()
 }
 
 
-int clientWaitForChar()
-{
-  // not so good...:-)
-  while (!client.available())
-    ;
-  return client.read();
-}
-
-
 void exe_telnet()
 {
-  // process data from remote host (up to 1024 codes at the time)
-  for (int i = 0; client.available() && i < 1024; ++i) {
-    int c = client.read();
-    if (c == 0xFF) {
-      // IAC (Interpret As Command)
-      uint8_t cmd = clientWaitForChar();
-      uint8_t opt = clientWaitForChar();
-      if (cmd == 0xFD && opt == 0x1F) {
-        // DO WINDOWSIZE
-        client.write("\xFF\xFB\x1F", 3); // IAC WILL WINDOWSIZE
-        client.write("\xFF\xFA\x1F" "\x00\x50\x00\x19" "\xFF\xF0", 9);  // IAC SB WINDOWSIZE 0 80 0 25 IAC SE
-      } else if (cmd == 0xFD && opt == 0x18) {
-        // DO TERMINALTYPE
-        client.write("\xFF\xFB\x18", 3); // IAC WILL TERMINALTYPE
-      } else if (cmd == 0xFA && opt == 0x18) {
-        // SB TERMINALTYPE
-        c = clientWaitForChar();  // bypass '1'
-        c = clientWaitForChar();  // bypass IAC
-        c = clientWaitForChar();  // bypass SE
-        client.write("\xFF\xFA\x18\x00" "wsvt25" "\xFF\xF0", 12); // IAC SB TERMINALTYPE 0 "...." IAC SE
-      } else {
-        uint8_t pck[3] = {0xFF, 0, opt};
-        if (cmd == 0xFD)  // DO -> WONT
-          pck[1] = 0xFC;
-        else if (cmd == 0xFB) // WILL -> DO
-          pck[1] = 0xFD;
-        client.write(pck, 3);
-      }
-    } else {
-      Terminal.write(c);
-    }
-  }
-  // process data from terminal (keyboard)
-  while (Terminal.available()) {
-    client.write( Terminal.read() );
-  }
-  // return to prompt?
-  if (!client.connected()) {
+  // data from remote host goes directly to the terminal, keys are sent by the terminal
+  if (Terminal.pollTransport() < 0) {
+    // return to prompt
+    Terminal.connectTransport(NULL);
     client.stop();
+    TerminalTransferStats stats;
+    Terminal.getTransferStats(&stats);
+    Terminal.printf("\r\nConnection closed (%u bytes received, %u bytes sent)\r\n", stats.receivedBytes, stats.sentBytes);
     state = State::Prompt;
   }
 }
@@ -564,6 +564,8 @@ struct GameScene : public Scene {
       int py = iclamp(y + random(-4, 5), 0, shield->getHeight() - 1);
       *(data + px + shield->getWidth() * py) = 0;
     }
+    // collision mask and opaque spans must be rebuilt from damaged pixels
+    shield->getFrame()->invalidate();
   }
 
   void showLives()
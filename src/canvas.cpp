@@ -112,6 +112,17 @@ void CanvasClass::scroll(int offsetX, int offsetY)
 }
 
 
+void CanvasClass::smoothScroll(int offsetY)
+{
+  if (offsetY != 0) {
+    Primitive p;
+    p.cmd    = PrimitiveCmd::SmoothVScroll;
+    p.ivalue = offsetY;
+    VGAController.addPrimitive(p);
+  }
+}
+
+
 void CanvasClass::setScrollingRegion(int X1, int Y1, int X2, int Y2)
 {
   Primitive p;
@@ -225,6 +236,20 @@ void CanvasClass::fillRectangle(Rect const & rect)
 }
 
 
+void CanvasClass::fillRoundRectangle(int X1, int Y1, int X2, int Y2, int radius)
+{
+  if (X1 > X2)
+    tswap(X1, X2);
+  if (Y1 > Y2)
+    tswap(Y1, Y2);
+  moveTo(X1, Y1);
+  Primitive p;
+  p.cmd       = PrimitiveCmd::FillRoundRect;
+  p.roundRect = RoundRectInfo(X2 - X1 + 1, Y2 - Y1 + 1, radius);
+  VGAController.addPrimitive(p);
+}
+
+
 #if FABGLIB_HAS_INVERTRECT
 void CanvasClass::invertRectangle(int X1, int Y1, int X2, int Y2)
 {
@@ -268,17 +293,19 @@ void CanvasClass::drawEllipse(int X, int Y, int width, int height)
 void CanvasClass::drawGlyph(int X, int Y, int width, int height, uint8_t const * data, int index)
 {
   Primitive p;
-  p.cmd   = PrimitiveCmd::DrawGlyph;
-  p.glyph = Glyph(X, Y, width, height, data + index * height * ((width + 7) / 8));
+  p.cmd         = PrimitiveCmd::DrawGlyph;
+  p.glyphWidth  = width;
+  p.glyphHeight = height;
+  p.glyph       = GlyphDrawingInfo(X, Y, data + index * height * ((width + 7) / 8));
   VGAController.addPrimitive(p);
 }
 
 
-void CanvasClass::renderGlyphsBuffer(int itemX, int itemY, GlyphsBuffer const * glyphsBuffer)
+void CanvasClass::renderGlyphsBuffer(int itemX, int itemY, GlyphsBuffer const * glyphsBuffer, int count, int rowsCount)
 {
   Primitive p;
   p.cmd                    = PrimitiveCmd::RenderGlyphsBuffer;
-  p.glyphsBufferRenderInfo = GlyphsBufferRenderInfo(itemX, itemY, glyphsBuffer);
+  p.glyphsBufferRenderInfo = GlyphsBufferRenderInfo(itemX, itemY, glyphsBuffer, count, rowsCount);
   VGAController.addPrimitive(p);
 }
 
@@ -322,29 +349,59 @@ void CanvasClass::drawText(int X, int Y, char const * text, bool wrap)
 }
 
 
+// Each row of text (or each part of long texts) is drawn by a single DrawText primitive
 void CanvasClass::drawText(FontInfo const * fontInfo, int X, int Y, char const * text, bool wrap)
 {
-  for (; *text; ++text, X += fontInfo->width * m_textHorizRate) {
+  const int advance = fontInfo->width * m_textHorizRate;
+  // texts are copied into the primitives arena, long texts are split to keep arena blocks small
+  const int maxRunLength = 128;
+  char run[maxRunLength + 1];
+  while (*text) {
     if (wrap && X >= getWidth()) {    // TODO: clipX2 instead of getWidth()?
       X = 0;
       Y += fontInfo->height;
     }
-    drawGlyph(X, Y, fontInfo->width, fontInfo->height, fontInfo->data, *text);
+    int count = wrap ? tmin(maxRunLength, (getWidth() - X + advance - 1) / advance) : maxRunLength;
+    int length = 0;
+    while (length < count && text[length])
+      ++length;
+    char const * runText = text;
+    if (text[length]) {
+      memcpy(run, text, length);
+      run[length] = 0;
+      runText = run;
+    }
+    DrawTextInfo info(X, Y, fontInfo, runText);
+    Primitive p;
+    p.cmd  = PrimitiveCmd::DrawText;
+    p.text = &info;
+    VGAController.addPrimitive(p);
+    text += length;
+    X    += length * advance;
   }
 }
 
 
+// formats into a stack buffer, allocates from the heap only when it is not large enough
 void CanvasClass::drawTextFmt(int X, int Y, const char *format, ...)
 {
+  char buf[128];
   va_list ap;
   va_start(ap, format);
-  int size = vsnprintf(NULL, 0, format, ap) + 1;
-  if (size > 0) {
-    char buf[size + 1];
-    vsnprintf(buf, size, format, ap);
+  int size = vsnprintf(buf, sizeof(buf), format, ap) + 1;
+  va_end(ap);
+  if (size <= (int) sizeof(buf)) {
     drawText(X, Y, buf, false);
+  } else if (size > 0) {
+    char * text = (char*) malloc(size);
+    if (text) {
+      va_start(ap, format);
+      vsnprintf(text, size, format, ap);
+      va_end(ap);
+      drawText(X, Y, text, false);
+      free(text);
+    }
   }
-  va_end(ap);
 }
 
 
@@ -363,18 +420,20 @@ void CanvasClass::copyRect(int sourceX, int sourceY, int destX, int destY, int w
 #if FABGLIB_HAS_READWRITE_RAW_DATA
 void CanvasClass::readRawData(int sourceX, int sourceY, int width, int height, uint8_t * dest)
 {
+  RawData rawData(sourceX, sourceY, width, height, dest);
   Primitive p;
   p.cmd     = PrimitiveCmd::ReadRawData;
-  p.rawData = RawData(sourceX, sourceY, width, height, dest);
+  p.rawData = &rawData;
   VGAController.addPrimitive(p);
 }
 
 
 void CanvasClass::writeRawData(uint8_t * source, int destX, int destY, int width, int height)
 {
+  RawData rawData(destX, destY, width, height, source);
   Primitive p;
   p.cmd     = PrimitiveCmd::WriteRawData;
-  p.rawData = RawData(destX, destY, width, height, source);
+  p.rawData = &rawData;
   VGAController.addPrimitive(p);
 }
 #endif
@@ -405,6 +464,7 @@ void CanvasClass::drawBitmap(int X, int Y, Bitmap const * bitmap)
   Primitive p;
   p.cmd               = PrimitiveCmd::DrawBitmap;
   p.bitmapDrawingInfo = BitmapDrawingInfo(X, Y, bitmap);
+  bitmap->updateOpaqueSpans();
   VGAController.addPrimitive(p);
 }
 
@@ -418,26 +478,64 @@ void CanvasClass::swapBuffers()
 }
 
 
-// warn: points memory must survive until next vsync interrupt when primitive is not executed immediately
 void CanvasClass::drawPath(Point const * points, int pointsCount)
 {
+  Path path;
+  path.points = points;
+  path.pointsCount = pointsCount;
+  path.pathsCount = 1;
+  path.pathsSizes = NULL;
   Primitive p;
-  p.cmd = PrimitiveCmd::DrawPath;
-  p.path.points = points;
-  p.path.pointsCount = pointsCount;
+  p.cmd  = PrimitiveCmd::DrawPath;
+  p.path = &path;
   VGAController.addPrimitive(p);
 }
 
-  // warn: points memory must survive until next vsync interrupt when primitive is not executed immediately
+
 void CanvasClass::fillPath(Point const * points, int pointsCount)
 {
+  Path path;
+  path.points = points;
+  path.pointsCount = pointsCount;
+  path.pathsCount = 1;
+  path.pathsSizes = NULL;
+  Primitive p;
+  p.cmd  = PrimitiveCmd::FillPath;
+  p.path = &path;
+  VGAController.addPrimitive(p);
+}
+
+
+void CanvasClass::drawPaths(Point const * points, int16_t const * pathsSizes, int pathsCount)
+{
+  Path path;
+  path.points = points;
+  path.pointsCount = 0;
+  for (int i = 0; i < pathsCount; ++i)
+    path.pointsCount += pathsSizes[i];
+  path.pathsCount = pathsCount;
+  path.pathsSizes = pathsSizes;
   Primitive p;
-  p.cmd = PrimitiveCmd::FillPath;
-  p.path.points = points;
-  p.path.pointsCount = pointsCount;
+  p.cmd  = PrimitiveCmd::DrawPath;
+  p.path = &path;
   VGAController.addPrimitive(p);
 }
 
 
+void CanvasClass::fillPaths(Point const * points, int16_t const * pathsSizes, int pathsCount)
+{
+  Path path;
+  path.points = points;
+  path.pointsCount = 0;
+  for (int i = 0; i < pathsCount; ++i)
+    path.pointsCount += pathsSizes[i];
+  path.pathsCount = pathsCount;
+  path.pathsSizes = pathsSizes;
+  Primitive p;
+  p.cmd  = PrimitiveCmd::FillPath;
+  p.path = &path;
+  VGAController.addPrimitive(p);
+}
+
 
 } // end of namespace
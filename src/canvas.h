@@ -40,30 +40,14 @@
 namespace fabgl {
 
 
-#ifndef FONTINFO
-#define FONTINFO
-
-#define FONTINFOFLAGS_ITALIC    1
-#define FONTINFOFLAGS_UNDERLINE 2
-#define FONTINFODLAFS_STRIKEOUT 4
-
-struct FontInfo {
-  uint8_t  pointSize;
-  uint8_t  width;
-  uint8_t  height;
-  uint8_t  ascent;
-  uint8_t  inleading;
-  uint8_t  exleading;
-  uint8_t  flags;
-  uint16_t weight;
-  uint16_t charset;
-  uint8_t const * data;
-};
-
+// placement of embedded fonts data (see FABGLIB_FONTS_IN_DRAM)
+#if FABGLIB_FONTS_IN_DRAM
+  #define FONT_DATA_ATTR DRAM_ATTR
+#else
+  #define FONT_DATA_ATTR
 #endif
 
 
-
 /**
 * @brief A class with a set of drawing methods.
 *
@@ -181,6 +165,22 @@ public:
    */
   void scroll(int offsetX, int offsetY);
 
+  /**
+   * @brief Scroll vertically the scrolling region, few lines at each vertical sync.
+   *
+   * Scrolling proceeds by FABGLIB_SMOOTH_SCROLL_LINES_PER_FRAME lines at each vertical sync, without blocking the caller.
+   * Primitives added after this call are executed when scrolling ends.<br>
+   * When background primitive execution is disabled or in double buffered mode the area is scrolled at once.
+   *
+   * @param offsetY Number of lines to scroll. A negative value scrolls up, a positive value scrolls down.
+   *
+   * Example:
+   *
+   *     // smoothly scroll up by 14 lines
+   *     Canvas.smoothScroll(-14);
+   */
+  void smoothScroll(int offsetY);
+
   /**
    * @brief Move current pen position to the spcified coordinates.
    *
@@ -361,6 +361,24 @@ public:
    */
   void fillRectangle(Rect const & rect);
 
+  /**
+   * @brief Fill a rectangle with rounded corners using the current brush color.
+   *
+   * Sets current pen position to the top-left corner.
+   *
+   * @param X1 Top left horizontal coordinate.
+   * @param Y1 Top left vertical coordiante.
+   * @param X2 Bottom right horizontal coordinate.
+   * @param Y2 Bottom right vertical coordiante.
+   * @param radius Radius of the corners (0 = square corners). It is limited to half of the rectangle width and height.
+   *
+   * Example:
+   *
+   *     Canvas.setBrushColor(Color::Red);
+   *     Canvas.fillRoundRectangle(10, 10, 100, 100, 8);
+   */
+  void fillRoundRectangle(int X1, int Y1, int X2, int Y2, int radius);
+
 #if FABGLIB_HAS_INVERTRECT
 
   /**
@@ -432,6 +450,28 @@ public:
    */
   void waitCompletion(bool waitVSync = true);
 
+  /**
+   * @brief Begin collecting drawings into a batch.
+   *
+   * Drawings performed between beginBatch() and endBatch() are sent to the VGA controller in a single operation, reducing queue
+   * overhead when painting many small primitives (ie glyphs). Look at VGAControllerClass.beginPrimitivesBatch() for details.<br>
+   * Calls can be nested.
+   *
+   * Example:
+   *
+   *     Canvas.beginBatch();
+   *     for (int y = 0; y < 25; ++y)
+   *       for (int x = 0; x < 80; ++x)
+   *         Canvas.drawChar(x * 8, y * 14, screen[y][x]);
+   *     Canvas.endBatch();
+   */
+  void beginBatch() { VGAController.beginPrimitivesBatch(); }
+
+  /**
+   * @brief Send drawings collected after beginBatch() to the VGA controller.
+   */
+  void endBatch() { VGAController.endPrimitivesBatch(); }
+
   /**
    * @brief Draw a glyph at specified position.
    *
@@ -482,7 +522,19 @@ public:
    */
   void setGlyphOptions(GlyphOptions options);
 
-  void renderGlyphsBuffer(int itemX, int itemY, GlyphsBuffer const * glyphsBuffer);
+  /**
+   * @brief Render items of a glyphs buffer.
+   *
+   * Renders a rectangle of "count" items per row and "rowsCount" rows, starting from itemX and itemY, with a single primitive.<br>
+   * Rendering a large rectangle may take more than vertical retracing time, so it is better to render large areas a row at the time.
+   *
+   * @param itemX Column of the first item to render (0 = first column).
+   * @param itemY Row of the first item to render (0 = first row).
+   * @param glyphsBuffer Glyphs buffer to render. Its map (and glyphs data) must survive until items are painted.
+   * @param count Number of items to render on each row.
+   * @param rowsCount Number of rows to render.
+   */
+  void renderGlyphsBuffer(int itemX, int itemY, GlyphsBuffer const * glyphsBuffer, int count = 1, int rowsCount = 1);
 
   /**
    * @brief Set paint options.
@@ -540,7 +592,8 @@ public:
   /**
    * @brief Draw a string at specified position.
    *
-   * drawText() uses currently selected font (selectFont() method) and currently selected glyph options (setGlyphOptions() method).
+   * drawText() uses currently selected font (selectFont() method) and currently selected glyph options (setGlyphOptions() method).<br>
+   * Each row of text is drawn by a single primitive. The string is copied, so it doesn't need to remain valid after the call.
    *
    * @param X Horizontal position of first character left side.
    * @param Y Vertical position of first character top side.
@@ -557,7 +610,8 @@ public:
   /**
    * @brief Draw a string at specified position.
    *
-   * drawText() uses the specified font and currently selected glyph options (setGlyphOptions() method).
+   * drawText() uses the specified font and currently selected glyph options (setGlyphOptions() method).<br>
+   * Each row of text is drawn by a single primitive. The string is copied, so it doesn't need to remain valid after the call.
    *
    * @param fontInfo Pointer to font structure containing font info and glyphs data.
    * @param X Horizontal position of first character left side.
@@ -633,9 +687,7 @@ public:
   /**
    * @brief Draw a sequence of lines.
    *
-   * Because the path is drawn on VSync (vertical retracing) the provided array of points must survive until the path is completely painted.<br>
-   * To avoid it, application can disable drawing on vsync (calling VGAControllerClass.enableBackgroundPrimitiveExecution()) or just wait
-   * until all the drawing have been completed(calling CanvasClass.waitCompletion()).
+   * Points are copied when the primitive is queued, so the provided array can be reused as soon as this method returns.
    *
    * @param points A pointer to an array of Point objects.
    * @param pointsCount Number of points in the array.
@@ -645,16 +697,13 @@ public:
    *     Point points[3] = { {10, 10}, {20, 10}, {15, 20} };
    *     Canvas.setPenColor(Color::Red);
    *     Canvas.drawPath(points, 3);
-   *     Canvas.waitCompletion();
    */
   void drawPath(Point const * points, int pointsCount);
 
   /**
    * @brief Fill the polygon enclosed in a sequence of lines.
    *
-   * Because the path is drawn on VSync (vertical retracing) the provided array of points must survive until the path is completely painted.<br>
-   * To avoid it, application can disable drawing on vsync (calling VGAControllerClass.enableBackgroundPrimitiveExecution()) or just wait
-   * until all the drawing have been completed(calling CanvasClass.waitCompletion()).
+   * Points are copied when the primitive is queued, so the provided array can be reused as soon as this method returns.
    *
    * @param points A pointer to an array of Point objects.
    * @param pointsCount Number of points in the array.
@@ -664,10 +713,49 @@ public:
    *     Point points[3] = { {10, 10}, {20, 10}, {15, 20} };
    *     Canvas.setBrushColor(Color::Red);
    *     Canvas.fillPath(points, 3);
-   *     Canvas.waitCompletion();
    */
   void fillPath(Point const * points, int pointsCount);
 
+  /**
+   * @brief Draw a list of polygons using a single primitive.
+   *
+   * Points of all polygons are stored consecutively in the same array. Both arrays are copied when the primitive is queued (see drawPath()).
+   *
+   * @param points A pointer to an array of Point objects, containing points of all polygons.
+   * @param pathsSizes A pointer to an array containing number of points of each polygon.
+   * @param pathsCount Number of polygons.
+   *
+   * Example:
+   *
+   *     // two triangles
+   *     Point points[6] = { {10, 10}, {20, 10}, {15, 20},  {30, 10}, {40, 10}, {35, 20} };
+   *     int16_t sizes[2] = { 3, 3 };
+   *     Canvas.setPenColor(Color::Red);
+   *     Canvas.drawPaths(points, sizes, 2);
+   */
+  void drawPaths(Point const * points, int16_t const * pathsSizes, int pathsCount);
+
+  /**
+   * @brief Fill a list of polygons using a single primitive.
+   *
+   * Points of all polygons are stored consecutively in the same array. Each polygon is filled independently. Both arrays are copied
+   * when the primitive is queued (see fillPath()).<br>
+   * Polygons with more than FABGLIB_MAX_PATH_EDGES points are not filled.
+   *
+   * @param points A pointer to an array of Point objects, containing points of all polygons.
+   * @param pathsSizes A pointer to an array containing number of points of each polygon.
+   * @param pathsCount Number of polygons.
+   *
+   * Example:
+   *
+   *     // two triangles
+   *     Point points[6] = { {10, 10}, {20, 10}, {15, 20},  {30, 10}, {40, 10}, {35, 20} };
+   *     int16_t sizes[2] = { 3, 3 };
+   *     Canvas.setBrushColor(Color::Red);
+   *     Canvas.fillPaths(points, sizes, 2);
+   */
+  void fillPaths(Point const * points, int16_t const * pathsSizes, int pathsCount);
+
 private:
 
   FontInfo const * m_fontInfo;
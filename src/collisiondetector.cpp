@@ -20,6 +20,8 @@
  */
 
 
+#include <limits.h>
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
@@ -78,6 +80,10 @@ void QuadTree::detachFromParent()
 
 void QuadTree::insert(QuadTreeObject * object)
 {
+  #if FABGLIB_HAS_COLLISIONDETECTOR_STATS
+  ++m_collisionDetector->m_stats.nodesVisited;
+  #endif
+
   QuadTreeQuadrant quadrant = getQuadrant(object);
   if (quadrant != None && m_children[quadrant]) {
     m_children[quadrant]->insert(object);
@@ -85,7 +91,10 @@ void QuadTree::insert(QuadTreeObject * object)
   }
 
   object->owner = this;
-  object->next = m_objects;
+  object->prev  = NULL;
+  object->next  = m_objects;
+  if (m_objects)
+    m_objects->prev = object;
   m_objects = object;
   ++m_objectsCount;
 
@@ -95,20 +104,13 @@ void QuadTree::insert(QuadTreeObject * object)
   // split m_objects inside sub trees (4 quadrants)
 
   QuadTreeObject * obj = m_objects;
-  QuadTreeObject * prev = NULL;
   while (obj) {
     QuadTreeObject * next = obj->next;
     QuadTreeQuadrant quadrant = getQuadrant(obj);
     if (quadrant != None) {
       createQuadrant(quadrant);
+      remove(obj);
       m_children[quadrant]->insert(obj);
-      --m_objectsCount;
-      if (prev == NULL)
-        m_objects = next;
-      else
-        prev->next = next;
-    } else {
-      prev = obj;
     }
     obj = next;
   }
@@ -117,22 +119,16 @@ void QuadTree::insert(QuadTreeObject * object)
 
 void QuadTree::remove(QuadTreeObject * object)
 {
-  // rebuild the list removing this object
-  QuadTreeObject * obj = object->owner->m_objects;
-  QuadTreeObject * prev = NULL;
-  while (obj) {
-    if (obj == object) {
-      if (prev == NULL)
-        object->owner->m_objects = object->next;
-      else
-        prev->next = object->next;
-      break;
-    }
-    prev = obj;
-    obj = obj->next;
-  }
-  object->owner->m_objectsCount -= 1;
+  QuadTree * owner = object->owner;
+  if (object->prev)
+    object->prev->next = object->next;
+  else
+    owner->m_objects = object->next;
+  if (object->next)
+    object->next->prev = object->prev;
+  owner->m_objectsCount -= 1;
   object->owner = NULL;
+  object->prev  = NULL;
   object->next  = NULL;
 }
 
@@ -191,12 +187,23 @@ QuadTreeQuadrant QuadTree::getQuadrant(QuadTreeObject * object)
 void QuadTree::update(QuadTreeObject * object)
 {
   QuadTree * qtree = object->owner;
+  #if FABGLIB_HAS_COLLISIONDETECTOR_STATS
+  CollisionDetectorStats & stats = qtree->m_collisionDetector->m_stats;
+  ++stats.updates;
+  #endif
   while (true) {
+    #if FABGLIB_HAS_COLLISIONDETECTOR_STATS
+    ++stats.nodesVisited;
+    #endif
     if (qtree->m_parent == NULL || objectInRect(object, qtree->m_x, qtree->m_y, qtree->m_width, qtree->m_height)) {
-      // need to reinsert?
+      // still inside its node and cannot go down to a child? Then nothing to do.
       QuadTreeQuadrant quadrant = qtree->getQuadrant(object);
-      if (qtree == object->owner && qtree->m_children[quadrant] == NULL)
-        return; // don't need to reinsert
+      if (qtree == object->owner && (quadrant == None || qtree->m_children[quadrant] == NULL))
+        return;
+
+      #if FABGLIB_HAS_COLLISIONDETECTOR_STATS
+      ++stats.reinserts;
+      #endif
 
       // need to be reinserted, remove from owner...
       remove(object);
@@ -214,6 +221,10 @@ void QuadTree::update(QuadTreeObject * object)
 // ret NULL = no collision detected
 QuadTreeObject * QuadTree::detectCollision(QuadTreeObject * object, CollisionDetectionCallback callbackFunc, void * callbackObj)
 {
+  #if FABGLIB_HAS_COLLISIONDETECTOR_STATS
+  ++m_collisionDetector->m_stats.nodesVisited;
+  #endif
+
   if (!object->sprite->visible)
     return NULL;
 
@@ -271,23 +282,63 @@ bool QuadTree::objectIntersectsQuadTree(QuadTreeObject * object, QuadTree * quad
 }
 
 
+// 32 bits of a collision mask row starting at pixel "pos", only the first "count" (1..32) are kept
+static inline uint32_t maskRowBits(uint32_t const * row, int pos, int count)
+{
+  uint32_t const * word = row + (pos >> 5);
+  int shift = pos & 31;
+  uint32_t bits = shift ? (word[0] << shift) | (word[1] >> (32 - shift)) : word[0];
+  return bits & (0xFFFFFFFF << (32 - count));
+}
+
+
 bool QuadTree::checkMaskCollision(QuadTreeObject * objectA, QuadTreeObject * objectB, Point * collisionPoint)
 {
-  // intersection rectangle
-  int x1 = tmax(objectA->sprite->x, objectB->sprite->x);
-  int y1 = tmax(objectA->sprite->y, objectB->sprite->y);
-  int x2 = tmin(objectA->sprite->x + objectA->sprite->getWidth() - 1, objectB->sprite->x + objectB->sprite->getWidth() - 1);
-  int y2 = tmin(objectA->sprite->y + objectA->sprite->getHeight() - 1, objectB->sprite->y + objectB->sprite->getHeight() - 1);
+  Sprite * spriteA = objectA->sprite;
+  Sprite * spriteB = objectB->sprite;
+  Bitmap const * bitmapA = spriteA->getFrame();
+  Bitmap const * bitmapB = spriteB->getFrame();
+  uint32_t const * maskA = bitmapA->getCollisionMask();
+  uint32_t const * maskB = bitmapB->getCollisionMask();
+
+  if (maskA == NULL || maskB == NULL) {
+    // not enough memory for masks, look for matching non trasparent pixels inside the intersection area
+    if (bitmapA->encoding == RLEBitmap || bitmapB->encoding == RLEBitmap)
+      return false; // RLE bitmaps cannot be addressed by pixel
+    int x1 = tmax(spriteA->x, spriteB->x);
+    int y1 = tmax(spriteA->y, spriteB->y);
+    int x2 = tmin(spriteA->x + bitmapA->width - 1, spriteB->x + bitmapB->width - 1);
+    int y2 = tmin(spriteA->y + bitmapA->height - 1, spriteB->y + bitmapB->height - 1);
+    for (int y = y1; y <= y2; ++y) {
+      uint8_t const * rowA = bitmapA->data + bitmapA->width * (y - spriteA->y) - spriteA->x;
+      uint8_t const * rowB = bitmapB->data + bitmapB->width * (y - spriteB->y) - spriteB->x;
+      for (int x = x1; x <= x2; ++x) {
+        if ((rowA[x] >> 6) && (rowB[x] >> 6)) {
+          *collisionPoint = (Point){(int16_t)x, (int16_t)y};
+          return true;  // collision
+        }
+      }
+    }
+    return false;
+  }
 
-  // look for matching non trasparent pixels inside the intersection area
+  // intersection of opaque bounding boxes
+  Rect const & rectA = bitmapA->collisionMaskRect;
+  Rect const & rectB = bitmapB->collisionMaskRect;
+  int x1 = tmax(spriteA->x + rectA.X1, spriteB->x + rectB.X1);
+  int y1 = tmax(spriteA->y + rectA.Y1, spriteB->y + rectB.Y1);
+  int x2 = tmin(spriteA->x + rectA.X2, spriteB->x + rectB.X2);
+  int y2 = tmin(spriteA->y + rectA.Y2, spriteB->y + rectB.Y2);
+
+  // AND mask rows, 32 pixels at the time
   for (int y = y1; y <= y2; ++y) {
-    uint8_t const * rowA = objectA->sprite->getFrame()->data + objectA->sprite->getWidth() * (y - objectA->sprite->y);
-    uint8_t const * rowB = objectB->sprite->getFrame()->data + objectB->sprite->getWidth() * (y - objectB->sprite->y);
-    for (int x = x1; x <= x2; ++x) {
-      int alphaA = rowA[x - objectA->sprite->x] >> 6;
-      int alphaB = rowB[x - objectB->sprite->x] >> 6;
-      if (alphaA && alphaB) {
-        *collisionPoint = (Point){(int16_t)x, (int16_t)y};
+    uint32_t const * rowA = maskA + bitmapA->collisionMaskWords * (y - spriteA->y);
+    uint32_t const * rowB = maskB + bitmapB->collisionMaskWords * (y - spriteB->y);
+    for (int x = x1; x <= x2; x += 32) {
+      int count = tmin(32, x2 - x + 1);
+      uint32_t bits = maskRowBits(rowA, x - spriteA->x, count) & maskRowBits(rowB, x - spriteB->x, count);
+      if (bits) {
+        *collisionPoint = (Point){(int16_t)(x + __builtin_clz(bits)), (int16_t)y};
         return true;  // collision
       }
     }
@@ -322,7 +373,7 @@ void QuadTree::dump(int level)
 
 
 CollisionDetector::CollisionDetector(int maxObjectsCount, int width, int height)
-  : m_quadTreePool(NULL), m_objectPool(NULL)
+  : m_quadTreePool(NULL), m_objectPool(NULL), m_sweepList(NULL)
 {
   m_objectPoolSize = maxObjectsCount;
   m_quadTreePoolSize = (5 * maxObjectsCount + 1) / 3;
@@ -345,7 +396,15 @@ CollisionDetector::CollisionDetector(int maxObjectsCount, int width, int height)
     for (int i = 0; i < m_objectPoolSize; ++i)
       m_objectPool[i] = QuadTreeObject(NULL, NULL);
 
+    m_sweepList = (QuadTreeObject**) malloc(sizeof(QuadTreeObject*) * m_objectPoolSize);
+    for (int i = 0; i < m_objectPoolSize; ++i)
+      m_sweepList[i] = &m_objectPool[i];
+
   }
+
+  #if FABGLIB_HAS_COLLISIONDETECTOR_STATS
+  resetStats();
+  #endif
 }
 
 
@@ -353,6 +412,7 @@ CollisionDetector::~CollisionDetector()
 {
   free(m_quadTreePool);
   free(m_objectPool);
+  free(m_sweepList);
 }
 
 
@@ -439,6 +499,46 @@ void CollisionDetector::updateAndDetectCollision(Sprite * sprite, CollisionDetec
 }
 
 
+// unused objects and invisible sprites go to the end of sweep list
+static inline int sweepKey(QuadTreeObject * object)
+{
+  return object->sprite && object->sprite->visible ? object->sprite->x : INT_MAX;
+}
+
+
+void CollisionDetector::updateAndDetectAllCollisions(CollisionDetectionCallback callbackFunc, void * callbackObj)
+{
+  // keep quad-tree updated for the per sprite methods
+  for (int i = 0; i < m_objectPoolSize; ++i)
+    if (m_objectPool[i].sprite)
+      QuadTree::update(&m_objectPool[i]);
+
+  // sort by left side. Insertion sort is almost linear here because sprites order changes little between updates.
+  for (int i = 1; i < m_objectPoolSize; ++i) {
+    QuadTreeObject * obj = m_sweepList[i];
+    int key = sweepKey(obj);
+    int j = i - 1;
+    for (; j >= 0 && sweepKey(m_sweepList[j]) > key; --j)
+      m_sweepList[j + 1] = m_sweepList[j];
+    m_sweepList[j + 1] = obj;
+  }
+
+  // sweep: each sprite is checked against following sprites starting before its right side
+  for (int i = 0; i < m_objectPoolSize && sweepKey(m_sweepList[i]) != INT_MAX; ++i) {
+    QuadTreeObject * objA = m_sweepList[i];
+    for (int j = i + 1; j < m_objectPoolSize; ++j) {
+      QuadTreeObject * objB = m_sweepList[j];
+      // callback may have removed or hidden objA
+      if (sweepKey(objA) == INT_MAX || sweepKey(objB) > objA->sprite->x + objA->sprite->getWidth())
+        break;
+      Point collisionPoint;
+      if (objB->sprite && objB->sprite->visible && QuadTree::objectsIntersect(objA, objB) && QuadTree::checkMaskCollision(objA, objB, &collisionPoint))
+        callbackFunc(callbackObj, objA->sprite, objB->sprite, collisionPoint);
+    }
+  }
+}
+
+
 
 
 } // end of namespace
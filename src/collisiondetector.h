@@ -33,6 +33,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "fabglconf.h"
 #include "vgacontroller.h"
@@ -48,18 +49,34 @@ class CollisionDetector;
 class QuadTree;
 
 
+// objects of a quad-tree node are double linked, so they can be removed without walking the list
 struct QuadTreeObject {
   QuadTree *       owner;
+  QuadTreeObject * prev;
   QuadTreeObject * next;
   Sprite *         sprite;
 
   QuadTreeObject(QuadTreeObject * next_, Sprite * sprite_)
-    : owner(NULL), next(next_), sprite(sprite_)
+    : owner(NULL), prev(NULL), next(next_), sprite(sprite_)
   {
   }
 };
 
 
+#if FABGLIB_HAS_COLLISIONDETECTOR_STATS
+/**
+ * @brief Collision detector quad-tree counters.
+ *
+ * Use CollisionDetector.getStats() to read them and CollisionDetector.resetStats() to reset them.
+ */
+struct CollisionDetectorStats {
+  uint32_t updates;       /**< Number of sprite updates */
+  uint32_t reinserts;     /**< Number of updates that moved the sprite to another quad-tree node */
+  uint32_t nodesVisited;  /**< Number of quad-tree nodes visited by updates, insertions and collision detections */
+};
+#endif
+
+
 #define QUADTREE_LEVEL_SPLIT_THRESHOLD 3
 
 
@@ -95,13 +112,14 @@ public:
 
   static void update(QuadTreeObject * object);
 
+  static bool objectsIntersect(QuadTreeObject * objectA, QuadTreeObject * objectB);
+  static bool checkMaskCollision(QuadTreeObject * objectA, QuadTreeObject * objectB, Point * collisionPoint);
+
 private:
 
   QuadTreeQuadrant getQuadrant(QuadTreeObject * object);
   void createQuadrant(QuadTreeQuadrant quadrant);
-  bool objectsIntersect(QuadTreeObject * objectA, QuadTreeObject * objectB);
   bool objectIntersectsQuadTree(QuadTreeObject * object, QuadTree * quadTree);
-  bool checkMaskCollision(QuadTreeObject * objectA, QuadTreeObject * objectB, Point * collisionPoint);
 
   static bool objectInRect(QuadTreeObject * object, int x, int y, int width, int height);
 
@@ -220,8 +238,40 @@ public:
    */
   void updateAndDetectCollision(Sprite * sprite, CollisionDetectionCallback callbackFunc, void * callbackObj);
 
+  /**
+   * @brief Update collision detector for all sprites and detect all collisions.
+   *
+   * Use it instead of calling updateAndDetectCollision() for each sprite when most sprites move at every update.<br>
+   * Visible sprites are sorted by horizontal position and swept once, so each colliding pair is reported just once.
+   * Sprites order inside the pair is not specified.<br>
+   * The callback function may remove sprites or make them invisible.
+   *
+   * @param callbackFunc The callback function called whenever a collision is detected.
+   * @param callbackObj Pointer passed as parameter to the callback function.
+   */
+  void updateAndDetectAllCollisions(CollisionDetectionCallback callbackFunc, void * callbackObj);
+
   //void dump();
 
+#if FABGLIB_HAS_COLLISIONDETECTOR_STATS
+  /**
+   * @brief Get quad-tree updates and nodes visit counters.
+   *
+   * @return Reference to collision detector counters.
+   *
+   * Example:
+   *
+   *     CollisionDetectorStats const & stats = collisionDetector.getStats();
+   *     Serial.printf("updates = %d, reinserts = %d, visited nodes = %d\n", stats.updates, stats.reinserts, stats.nodesVisited);
+   */
+  CollisionDetectorStats const & getStats() { return m_stats; }
+
+  /**
+   * @brief Reset quad-tree updates and nodes visit counters.
+   */
+  void resetStats() { memset(&m_stats, 0, sizeof(CollisionDetectorStats)); }
+#endif
+
 
 private:
 
@@ -233,6 +283,13 @@ private:
   int              m_quadTreePoolSize;
   QuadTreeObject * m_objectPool;
   int              m_objectPoolSize;
+
+  // all items of m_objectPool, sorted by sprite horizontal position by updateAndDetectAllCollisions()
+  QuadTreeObject * * m_sweepList;
+
+  #if FABGLIB_HAS_COLLISIONDETECTOR_STATS
+  CollisionDetectorStats m_stats;
+  #endif
 };
 
 
@@ -272,6 +272,7 @@
 
 
 #include "fabutils.h"
+#include "fabtrace.h"
 #include "terminal.h"
 #include "vgacontroller.h"
 #include "ps2controller.h"
@@ -279,6 +280,7 @@
 #include "mouse.h"
 #include "scene.h"
 #include "collisiondetector.h"
+#include "soundgen.h"
 
 
 
@@ -297,6 +299,11 @@ using fabgl::MouseDelta;
 using fabgl::MouseStatus;
 using fabgl::CursorName;
 using fabgl::TerminalClass;
+using fabgl::TerminalTransport;
+using fabgl::ClientTerminalTransport;
+using fabgl::SocketTerminalTransport;
+using fabgl::TerminalTransferStats;
+using fabgl::SoundEnvelope;
 
 
 
@@ -55,7 +55,35 @@
 #define FABGLIB_EXEC_QUEUE_SIZE 1024
 
 
-/** Number of characters the terminal can "write" without pause (increase if you have loss of characters in serial port). */
+/** Number of primitives the batch ring can contain (see VGAControllerClass.beginPrimitivesBatch()). Must be a power of two. */
+#define FABGLIB_PRIMITIVES_BATCH_SIZE 256
+
+
+/** Stack size of the task that executes primitives when VGAControllerClass.enableRenderTask() is used. */
+#define FABGLIB_RENDER_TASK_STACK_SIZE 2048
+
+
+/** Priority of the task that executes primitives when VGAControllerClass.enableRenderTask() is used. */
+#define FABGLIB_RENDER_TASK_PRIORITY 20
+
+
+/** Core where the task that executes primitives runs (Arduino loop() runs on core 1). */
+#define FABGLIB_RENDER_TASK_CORE 0
+
+
+/** Size (in bytes) of the arena where variable length parameters of queued primitives (texts, paths, small bitmaps...) are copied. */
+#define FABGLIB_PRIMITIVES_ARENA_SIZE 4096
+
+
+/** Maximum number of edges (points) of a single polygon filled by VGAControllerClass (see CanvasClass.fillPath()). Larger polygons are not filled. */
+#define FABGLIB_MAX_PATH_EDGES 256
+
+
+/** Number of lines scrolled at each vertical sync by smooth scrolling (see CanvasClass.smoothScroll()). */
+#define FABGLIB_SMOOTH_SCROLL_LINES_PER_FRAME 2
+
+
+/** Number of characters the terminal can "write" without pause (increase if you have loss of characters in serial port). Must be a power of two. */
 #define FABGLIB_TERMINAL_INPUT_QUEUE_SIZE 1024
 
 
@@ -63,6 +91,14 @@
 #define FABGLIB_TERMINAL_OUTPUT_QUEUE_SIZE 32
 
 
+/** Number of characters (keys and replies) the terminal collects before sending them to the transport (see TerminalClass.connectTransport()). */
+#define FABGLIB_TERMINAL_OUTPUT_BATCH_SIZE 128
+
+
+/** Average number of bytes reserved for each terminal scrollback line (see TerminalClass.setScrollbackLines()). A line takes 2 bytes, plus one byte per character (trailing blanks excluded), plus 4 bytes per attributes run. */
+#define FABGLIB_TERMINAL_SCROLLBACK_BYTES_PER_LINE 48
+
+
 #define FABGLIB_TERMINAL_XOFF_THRESHOLD (FABGLIB_TERMINAL_INPUT_QUEUE_SIZE / 2)
 #define FABGLIB_TERMINAL_XON_THRESHOLD  (FABGLIB_TERMINAL_INPUT_QUEUE_SIZE / 4)
 
@@ -91,22 +127,70 @@
 #define FABGLIB_SCODETOVK_TASK_PRIORITY 5
 
 
+/** Stack size of the task that updates the Scene when Scene.setVSyncScheduler() is enabled. */
+#define FABGLIB_SCENE_TASK_STACK_SIZE 4096
+
+
+/** Priority of the task that updates the Scene when Scene.setVSyncScheduler() is enabled. */
+#define FABGLIB_SCENE_TASK_PRIORITY 5
+
+
+/** Core where the task that updates the Scene runs when Scene.setVSyncScheduler() is enabled. */
+#define FABGLIB_SCENE_TASK_CORE 1
+
+
 /** Defines the underline position starting from character bottom (0 = bottom of the character). */
 #define FABGLIB_UNDERLINE_POSITION 0
 
 
-/** Optional feature. Enables readRawData() and writeRawData() methods in VGA Canvas. */
+/** Optional feature. Enables readRawData() and writeRawData() methods in VGA Canvas, VGAControllerClass.captureScreen() and VGAControllerClass.restoreScreenChunk(). */
 #define FABGLIB_HAS_READWRITE_RAW_DATA 0
 
 
+/** Number of rows encoded at the time by VGAControllerClass.captureScreen() (requires FABGLIB_HAS_READWRITE_RAW_DATA). */
+#define FABGLIB_CAPTURE_ROWS_PER_CHUNK 4
+
+
 /** Optional feature. Enables invertRectangle() method in VGA Canvas. */
 #define FABGLIB_HAS_INVERTRECT 0
 
 
+/** Optional feature. Bitmap pixels with alpha 1 and 2 are blended with the background (one third and two thirds of bitmap color) using a 4KB lookup table. When disabled any non zero alpha is opaque. */
+#define FABGLIB_HAS_ALPHA_BLENDING 1
+
+
+/** Optional feature. Enables VGAControllerClass.getFrameStats() and VGAControllerClass.resetFrameStats() methods (primitives timing and exec queue usage counters). */
+#define FABGLIB_HAS_FRAME_STATS 0
+
+
+/** Optional feature. Enables CollisionDetector.getStats() and CollisionDetector.resetStats() methods (quad-tree updates and nodes visit counters). */
+#define FABGLIB_HAS_COLLISIONDETECTOR_STATS 0
+
+
+/** Optional feature. Enables the trace ring (see fabtrace.h): timestamped VSync, primitives, sprites, terminal, PS/2 and scene events, exported as Chrome trace JSON. */
+#define FABGLIB_HAS_TRACE 0
+
+
+/** Number of events stored by the trace ring (see FABGLIB_HAS_TRACE). Must be a power of two. Each event takes 8 bytes. */
+#define FABGLIB_TRACE_RING_SIZE 1024
+
+
+/** Optional feature. Enables uiApp.getStats() and uiApp.resetStats() methods (dispatched and coalesced events counters). */
+#define FABGLIB_HAS_UI_STATS 0
+
+
+/** Optional feature. Enables SoundGenerator.getStats() and SoundGenerator.resetStats() methods (mixer time and underruns counters). */
+#define FABGLIB_HAS_SOUND_STATS 0
+
+
 /** Optional feature. If enabled terminal fonts are cached in RAM for better performance. */
 #define FABGLIB_CACHE_FONT_IN_RAM 0
 
 
+/** Optional feature. If enabled embedded fonts data is placed in internal RAM instead of flash, so glyphs are drawn without flash cache misses and terminal doesn't need to copy them (see FABGLIB_CACHE_FONT_IN_RAM). Only fonts used by the application take RAM (up to 3.5KB each). */
+#define FABGLIB_FONTS_IN_DRAM 0
+
+
 /** Optional feature. Enables KeyboardClass.virtualKeyToString() method */
 #define FABGLIB_HAS_VirtualKeyO_STRING 1
 
@@ -123,10 +207,30 @@
 #define FABGLIB_MAX_DCS_CONTENT 12
 
 
-/** To reduce memory overhead the viewport is allocated as few big buffers. This parameter defines the maximum number of these big buffers. */
+/** Video memory (DMA descriptors, blank lines, line buffers and viewport) is allocated as few big buffers, retained across resolution changes. This parameter defines the maximum number of these big buffers. */
 #define FABGLIB_VIEWPORT_MEMORY_POOL_COUNT 10
 
 
+/** Bytes of video memory reserved by VGAControllerClass.begin(), so later resolution changes don't depend on heap fragmentation. Video memory grows when a resolution needs more, VGAControllerClass.freeUnusedVideoMemory() gives back unused blocks. 0 = allocated by first setResolution(). */
+#define FABGLIB_VIDEO_MEMORY_SIZE 0
+
+
+/** 1 = Whole viewport vertical scrolling re-links DMA descriptors instead of moving lines (not applied when double buffered). Requires memory for additional viewport height pointers. */
+#define FABGLIB_HARDWARE_VSCROLL 1
+
+
+/** 1 = Mouse cursor is composited at vertical sync instead of being painted as a sprite (not applied when double buffered or in scanline mode). Rows under the cursor are copied to line buffers, where the cursor is painted, and their DMA descriptors are redirected there. Palette formats paint it directly into the DMA line buffers. */
+#define FABGLIB_MOUSE_CURSOR_OVERLAY 0
+
+
+/** Maximum number of mouse cursor rows composited by the mouse cursor overlay (taller cursors are cut). Each row requires a viewport line of video memory. */
+#define FABGLIB_MOUSE_CURSOR_OVERLAY_HEIGHT 32
+
+
+/** Number of DMA line buffers prepared while lines are sent, in palette pixel formats (see VGAControllerClass.setPixelFormat()) and scanline mode (see VGAControllerClass.setScanlineCallback()). Viewport height is rounded to a multiple of this value. */
+#define FABGLIB_LINE_BUFFERS_COUNT 2
+
+
 /** Size of virtualkey queue */
 #define FABGLIB_KEYBOARD_VIRTUALKEY_QUEUE_SIZE 32
 
@@ -135,6 +239,42 @@
 #define FABGLIB_MOUSE_EVENTS_QUEUE_SIZE 64
 
 
+/** Number of bytes received by each PS/2 port that can be stored until read. Must be a power of two. */
+#define FABGLIB_PS2_RX_RING_SIZE 64
+
+
+/** Stack size of the task that updates mouse absolute position (see MouseClass.setupAbsolutePositioner()). */
+#define FABGLIB_MOUSE_TASK_STACK_SIZE 2048
+
+
+/** Priority of the task that updates mouse absolute position (see MouseClass.setupAbsolutePositioner()). */
+#define FABGLIB_MOUSE_TASK_PRIORITY 5
+
+
+/** Default sound generator sample rate, in Hertz */
+#define FABGLIB_SOUND_SAMPLE_RATE 16000
+
+
+/** Number of samples of each sound generator DMA buffer (two buffers are allocated, max 1023) */
+#define FABGLIB_SOUND_BUFFER_SAMPLES 256
+
+
+/** Number of sound generator voices */
+#define FABGLIB_SOUND_VOICES 8
+
+
+/** Stack size of the task that mixes sound generator voices */
+#define FABGLIB_SOUND_TASK_STACK_SIZE 2048
+
+
+/** Priority of the task that mixes sound generator voices */
+#define FABGLIB_SOUND_TASK_PRIORITY 10
+
+
+/** Core of the task that mixes sound generator voices */
+#define FABGLIB_SOUND_TASK_CORE 1
+
+
 // debug options
 #define FABGLIB_TERMINAL_DEBUG_REPORT_IN_CODES   0
 #define FABGLIB_TERMINAL_DEBUG_REPORT_OUT_CODES  0
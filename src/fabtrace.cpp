@@ -0,0 +1,91 @@
+/*
+  Created by Fabrizio Di Vittorio (fdivitto2013@gmail.com) - <http://www.fabgl.com>
+  Copyright (c) 2019 Fabrizio Di Vittorio.
+  All rights reserved.
+
+  This file is part of FabGL Library.
+
+  FabGL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  FabGL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with FabGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include "rom/ets_sys.h"
+
+#include "fabutils.h"
+#include "fabtrace.h"
+
+
+
+namespace fabgl {
+
+
+#if FABGLIB_HAS_TRACE
+
+
+static const char * TRACEEVENT_NAME[] = { "VSync", "Primitive", "HideSprites", "ShowSprites", "TerminalAction", "PS2Byte", "SceneUpdate", "User" };
+static const char   TRACEPHASE_CODE[] = { 'B', 'E', 'i' };
+
+
+TraceItem         TraceRing[FABGLIB_TRACE_RING_SIZE];
+volatile uint32_t TraceRingHead = 0;
+volatile bool     TraceEnabled  = true;
+
+
+void traceStart()
+{
+  TraceEnabled  = false;
+  TraceRingHead = 0;
+  TraceEnabled  = true;
+}
+
+
+void traceStop()
+{
+  TraceEnabled = false;
+}
+
+
+void traceExport(Print & stream)
+{
+  bool enabled = TraceEnabled;
+  TraceEnabled = false;
+
+  uint32_t head  = TraceRingHead;
+  uint32_t count = tmin<uint32_t>(head, FABGLIB_TRACE_RING_SIZE);
+  double   cyclesPerUS = ets_get_cpu_frequency();
+
+  // cycles counters wrap around every few seconds: timestamps are accumulated from the (signed) distance to the previous event
+  int64_t  time       = 0;
+  uint32_t lastCycles = count > 0 ? TraceRing[(head - count) & (FABGLIB_TRACE_RING_SIZE - 1)].cycles : 0;
+
+  stream.print("{\"traceEvents\":[\n");
+  for (uint32_t i = head - count; i != head; ++i) {
+    TraceItem const & item = TraceRing[i & (FABGLIB_TRACE_RING_SIZE - 1)];
+    time += (int32_t) (item.cycles - lastCycles);
+    lastCycles = item.cycles;
+    stream.printf("{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":0,\"tid\":%d,%s\"args\":{\"arg\":%d}}%s\n",
+                  TRACEEVENT_NAME[(int) item.event], TRACEPHASE_CODE[(int) item.phase], time / cyclesPerUS, item.core,
+                  item.phase == TracePhase::Instant ? "\"s\":\"t\"," : "", item.arg, i + 1 != head ? "," : "");
+  }
+  stream.print("],\"displayTimeUnit\":\"ms\"}\n");
+
+  TraceEnabled = enabled;
+}
+
+
+#endif  // FABGLIB_HAS_TRACE
+
+
+} // end of namespace
@@ -0,0 +1,157 @@
+/*
+  Created by Fabrizio Di Vittorio (fdivitto2013@gmail.com) - <http://www.fabgl.com>
+  Copyright (c) 2019 Fabrizio Di Vittorio.
+  All rights reserved.
+
+  This file is part of FabGL Library.
+
+  FabGL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  FabGL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with FabGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef _FABTRACE_H_INCLUDED
+#define _FABTRACE_H_INCLUDED
+
+
+/**
+ * @file
+ *
+ * @brief This file contains the trace ring, a timeline of timestamped events of FabGL hot paths.
+ *
+ * Tracing is enabled by FABGLIB_HAS_TRACE in fabglconf.h. When disabled FABGLIB_TRACE() generates no code.
+ */
+
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "Print.h"
+
+#include "fabglconf.h"
+
+
+namespace fabgl {
+
+
+
+/** @brief Traced events. */
+enum class TraceEvent : uint8_t {
+  VSync,           /**< Vertical sync interrupt. */
+  Primitive,       /**< Execution of a drawing primitive. Argument is the PrimitiveCmd. */
+  HideSprites,     /**< Sprites removed from the screen before drawing. */
+  ShowSprites,     /**< Sprites painted over the screen after drawing. */
+  TerminalAction,  /**< Execution of a terminal parser action. Argument is the VTAction. */
+  PS2Byte,         /**< Byte received from a PS/2 port. Argument is port index * 256 + byte. */
+  SceneUpdate,     /**< Scene.update() call. Argument is the update count (low 16 bits). */
+  User,            /**< Application defined. */
+};
+
+
+/** @brief Phases of traced events. */
+enum class TracePhase : uint8_t {
+  Begin,    /**< Start of a duration. */
+  End,      /**< End of a duration. */
+  Instant,  /**< Single point in time. */
+};
+
+
+/** @brief An item of the trace ring. */
+struct TraceItem {
+  uint32_t   cycles;     /**< CPU cycles counter of the core that recorded the event. */
+  TraceEvent event;
+  TracePhase phase;
+  uint8_t    core;
+  uint16_t   arg;
+};
+
+
+#if FABGLIB_HAS_TRACE
+
+extern TraceItem         TraceRing[FABGLIB_TRACE_RING_SIZE];
+extern volatile uint32_t TraceRingHead;   // total number of recorded events
+extern volatile bool     TraceEnabled;
+
+
+/**
+ * @brief Records an event in the trace ring.
+ *
+ * Callable from interrupts and from both cores. Recording takes a few CPU cycles. Use FABGLIB_TRACE() instead of calling it directly.
+ *
+ * @param event Traced event.
+ * @param phase Event phase.
+ * @param arg Event argument.
+ */
+inline __attribute__((always_inline)) void traceEvent(TraceEvent event, TracePhase phase, uint16_t arg)
+{
+  if (TraceEnabled) {
+    uint32_t cycles;
+    __asm__ __volatile__("rsr %0, ccount" : "=a"(cycles));
+    TraceItem & item = TraceRing[__sync_fetch_and_add(&TraceRingHead, 1) & (FABGLIB_TRACE_RING_SIZE - 1)];
+    item.cycles = cycles;
+    item.event  = event;
+    item.phase  = phase;
+    item.core   = xPortGetCoreID();
+    item.arg    = arg;
+  }
+}
+
+
+/**
+ * @brief Clears the trace ring and starts recording.
+ *
+ * Recording is already active at startup.
+ */
+void traceStart();
+
+
+/**
+ * @brief Stops recording, the trace ring maintains its content.
+ */
+void traceStop();
+
+
+/**
+ * @brief Writes the content of the trace ring in Chrome trace JSON format.
+ *
+ * Recording is suspended while exporting. The output can be loaded by chrome://tracing or https://ui.perfetto.dev.
+ * Timestamps are in microseconds from the first exported event, each CPU core is a thread.
+ *
+ * @param stream Destination of JSON text.
+ *
+ * Example:
+ *
+ *     // dump last events when a frame has been dropped
+ *     if (scene.getStats().missedFrames > missedFrames)
+ *       fabgl::traceExport(Serial);
+ */
+void traceExport(Print & stream);
+
+
+/** @brief Records an event in the trace ring, when FABGLIB_HAS_TRACE is enabled. Example: FABGLIB_TRACE(User, Instant, 1) */
+#define FABGLIB_TRACE(event, phase, arg) fabgl::traceEvent(fabgl::TraceEvent::event, fabgl::TracePhase::phase, (uint16_t) (arg))
+
+#else
+
+#define FABGLIB_TRACE(event, phase, arg)
+
+#endif  // FABGLIB_HAS_TRACE
+
+
+
+} // end of namespace
+
+
+
+#endif  // _FABTRACE_H_INCLUDED
@@ -121,9 +121,14 @@ uiApp::uiApp()
   : uiEvtHandler(NULL),
     m_rootWindow(NULL),
     m_activeWindow(NULL),
-    m_capturedMouseWindow(NULL)
+    m_capturedMouseWindow(NULL),
+    m_pendingPaintRectsCount(0),
+    m_paintEventsCount(0)
 {
   m_eventsQueue = xQueueCreate(FABGLIB_UI_EVENTS_QUEUE_SIZE, sizeof(uiEvent));
+  #if FABGLIB_HAS_UI_STATS
+  resetStats();
+  #endif
 }
 
 
@@ -156,16 +161,73 @@ void uiApp::run()
   // dispatch events
   while (true) {
     uiEvent event;
+
+    #if FABGLIB_HAS_READWRITE_RAW_DATA
+    // nothing else to do, copy painted windows to their backing stores
+    if (uxQueueMessagesWaiting(m_eventsQueue) == 0)
+      updateBackingStores(m_rootWindow);
+    #endif
+
     if (getEvent(&event, -1)) {
 
+      if (event.id == UIEVT_PAINT && m_paintEventsCount > 0)
+        --m_paintEventsCount;
+
+      coalesceEvents(&event);
+
+      #if FABGLIB_HAS_UI_STATS
+      ++m_stats.eventsDispatched;
+      #endif
+
       preprocessEvent(&event);
 
       // debug
       //dumpEvent(&event);
 
+      // drawings performed while processing the event are sent to the VGA controller at once
+      Canvas.beginBatch();
       if (event.dest)
         event.dest->processEvent(&event);
+      Canvas.endBatch();
+
+      if (event.id == UIEVT_PAINT && event.dest && event.dest->evtHandlerProps().isWindow)
+        windowPainted((uiWindow*) event.dest);
+    }
+  }
+}
+
+
+// merge the following events of the same type and destination: mouse movements (last position is kept) and paints (rectangles are joined)
+// only movements and paints are merged, so the order of other events is retained
+void uiApp::coalesceEvents(uiEvent * event)
+{
+  if (event->id != UIEVT_MOUSEMOVE && event->id != UIEVT_PAINT && event->id != UIEVT_ABSPAINT)
+    return;
+  uiEvent next;
+  // the application task is the only consumer, so the peeked event is the one received
+  while (xQueuePeek(m_eventsQueue, &next, 0) == pdTRUE && next.id == event->id && next.dest == event->dest) {
+    if (event->id == UIEVT_MOUSEMOVE) {
+      event->params.mouse = next.params.mouse;
+      #if FABGLIB_HAS_UI_STATS
+      ++m_stats.mouseMovesCoalesced;
+      #endif
+    } else {
+      Rect paintRect = rectUnion(event->params.paintRect, next.params.paintRect);
+      if (event->id == UIEVT_PAINT) {
+        // joined rectangle cannot include windows over dest (generatePaintEvents() has cut the rectangles around them), they would be painted over
+        if (event->dest == NULL || !event->dest->evtHandlerProps().isWindow)
+          break;
+        if (isCoveredByUpperWindows((uiWindow*) event->dest, paintRect))
+          break;
+        if (m_paintEventsCount > 0)
+          --m_paintEventsCount;
+      }
+      event->params.paintRect = paintRect;
+      #if FABGLIB_HAS_UI_STATS
+      ++m_stats.paintsCoalesced;
+      #endif
     }
+    xQueueReceive(m_eventsQueue, &next, 0);
   }
 }
 
@@ -267,6 +329,11 @@ void uiApp::processEvent(uiEvent * event)
       OnInit();
       break;
 
+    case UIEVT_ABSPAINT:
+      // posted by repaintRect()
+      paintPendingRects();
+      break;
+
     default:
       break;
 
@@ -309,24 +376,169 @@ uiWindow * uiApp::setActiveWindow(uiWindow * value)
 
 void uiApp::repaintWindow(uiWindow * window)
 {
+  invalidateBackingStores(window);
   repaintRect(window->rect(uiRect_ScreenBased));
 }
 
 
+// rectangles are collected and painted by a single UIEVT_ABSPAINT event, overlapping rectangles are merged
 void uiApp::repaintRect(Rect const & rect)
 {
-  uiEvent evt = uiEvent(NULL, UIEVT_ABSPAINT);
-  evt.params.paintRect = rect;
-  postEvent(&evt);
+  if (m_pendingPaintRectsCount == 0) {
+    uiEvent evt = uiEvent(this, UIEVT_ABSPAINT);
+    evt.params.paintRect = rect;
+    if (!postEvent(&evt))
+      return;
+  }
+
+  // merge with overlapping rectangles, the merged one may overlap other rectangles
+  Rect newRect = rect;
+  for (int i = 0; i < m_pendingPaintRectsCount; ) {
+    if (intersect(newRect, m_pendingPaintRects[i])) {
+      newRect = rectUnion(newRect, m_pendingPaintRects[i]);
+      m_pendingPaintRects[i] = m_pendingPaintRects[--m_pendingPaintRectsCount];
+      i = 0;
+    } else
+      ++i;
+  }
+
+  // no more room, merge all
+  if (m_pendingPaintRectsCount == FABGLIB_UI_PENDING_PAINT_RECTS) {
+    for (int i = 0; i < m_pendingPaintRectsCount; ++i)
+      newRect = rectUnion(newRect, m_pendingPaintRects[i]);
+    m_pendingPaintRectsCount = 0;
+  }
+
+  m_pendingPaintRects[m_pendingPaintRectsCount++] = newRect;
+}
+
+
+void uiApp::paintPendingRects()
+{
+  int count = m_pendingPaintRectsCount;
+  m_pendingPaintRectsCount = 0;
+  for (int i = 0; i < count; ++i)
+    generatePaintEvents(m_rootWindow, m_pendingPaintRects[i]);
+}
+
+
+// true if a pending repaint (screen based) intersects the specified screen rectangle
+bool uiApp::isPaintPending(Rect const & rect)
+{
+  for (int i = 0; i < m_pendingPaintRectsCount; ++i)
+    if (intersect(rect, m_pendingPaintRects[i]))
+      return true;
+  return m_paintEventsCount > 0 && intersect(rect, m_paintEventsRect);
+}
+
+
+// true if the window is shown, inside the client area of its parents and not covered by other windows
+bool uiApp::isWindowFullyVisible(uiWindow * window)
+{
+  Rect winRect = window->rect(uiRect_ScreenBased);
+  for (uiWindow * win = window; win->parent(); win = win->parent()) {
+    uiWindow * parent = win->parent();
+    Rect parentRect = parent->rect(uiRect_ScreenBased);
+    if (!win->isShown() || !contains(translate(parent->rect(uiRect_ClientAreaWindowBased), parentRect.X1, parentRect.Y1), winRect))
+      return false;
+    for (uiWindow * sibling = win->next(); sibling; sibling = sibling->next())
+      if (sibling->isShown() && intersect(sibling->rect(uiRect_ScreenBased), winRect))
+        return false;
+  }
+  return window->isShown();
+}
+
+
+// true if "rect" (window based) intersects a shown window over "window": its children, its following siblings and following siblings of its parents
+bool uiApp::isCoveredByUpperWindows(uiWindow * window, Rect const & rect)
+{
+  Rect winRect = window->rect(uiRect_ScreenBased);
+  Rect screenRect = translate(rect, winRect.X1, winRect.Y1);
+  for (uiWindow * child = window->firstChild(); child; child = child->next())
+    if (child->isShown() && intersect(child->rect(uiRect_ScreenBased), screenRect))
+      return true;
+  for (uiWindow * win = window; win->parent(); win = win->parent())
+    for (uiWindow * sibling = win->next(); sibling; sibling = sibling->next())
+      if (sibling->isShown() && intersect(sibling->rect(uiRect_ScreenBased), screenRect))
+        return true;
+  return false;
+}
+
+
+// window has been painted, update the state of its backing store and of its parents backing stores
+void uiApp::windowPainted(uiWindow * window)
+{
+  #if FABGLIB_HAS_READWRITE_RAW_DATA
+  for (; window; window = window->parent()) {
+    if (window->m_backingStore) {
+      if (isWindowFullyVisible(window)) {
+        window->m_backingStoreDirty = true;
+      } else {
+        // covered areas have not been painted
+        window->m_backingStoreValid = false;
+        window->m_backingStoreDirty = false;
+      }
+    }
+  }
+  #endif
+}
+
+
+// window content is going to change, invalidate its backing store and its parents backing stores
+void uiApp::invalidateBackingStores(uiWindow * window)
+{
+  #if FABGLIB_HAS_READWRITE_RAW_DATA
+  for (; window; window = window->parent()) {
+    window->m_backingStoreValid = false;
+    window->m_backingStoreDirty = false;
+  }
+  #endif
+}
+
+
+#if FABGLIB_HAS_READWRITE_RAW_DATA
+void uiApp::updateBackingStores(uiWindow * window)
+{
+  if (window->m_backingStoreDirty && isWindowFullyVisible(window)) {
+    Rect winRect = window->rect(uiRect_ScreenBased);
+    Canvas.readRawData(winRect.X1, winRect.Y1, window->m_size.width, window->m_size.height, window->m_backingStore);
+    window->m_backingStoreValid = true;
+    window->m_backingStoreDirty = false;
+  }
+  for (uiWindow * child = window->firstChild(); child; child = child->next())
+    updateBackingStores(child);
 }
 
 
+// copy "rect" (window based) from the backing store to the screen
+void uiApp::restoreFromBackingStore(uiWindow * window, Rect const & rect)
+{
+  Rect winRect = window->rect(uiRect_ScreenBased);
+  int storeWidth = window->m_size.width;
+  int width = rect.X2 - rect.X1 + 1;
+  uint8_t * src = window->m_backingStore + rect.Y1 * storeWidth + rect.X1;
+  if (width == storeWidth) {
+    // whole rows are contiguous
+    Canvas.writeRawData(src, winRect.X1 + rect.X1, winRect.Y1 + rect.Y1, width, rect.Y2 - rect.Y1 + 1);
+  } else {
+    for (int y = rect.Y1; y <= rect.Y2; ++y, src += storeWidth)
+      Canvas.writeRawData(src, winRect.X1 + rect.X1, winRect.Y1 + y, width, 1);
+  }
+}
+#endif
+
+
 // move to position (x, y) relative to the parent window
 void uiApp::moveWindow(uiWindow * window, int x, int y)
 {
   Point prevPos = window->pos();
+  Rect prevRect = window->rect(uiRect_ScreenBased);
+  bool canCopy = isWindowFullyVisible(window) && !isPaintPending(prevRect);
   window->setPos(x, y);
 
+  // parents contain this window
+  invalidateBackingStores(window->parent());
+
   //// repaint discovered areas
 
   int dx = x - prevPos.X;
@@ -361,8 +573,13 @@ void uiApp::moveWindow(uiWindow * window, int x, int y)
     repaintRect(BURect);
 
   //// repaint the window
-  // TODO: what about just moving the screen buffer? - when is top and fully visible window
-  repaintRect(winRect);
+  if (canCopy && isWindowFullyVisible(window) && !isPaintPending(winRect)) {
+    // window is on top and fully visible at both positions, with no pending paints: just move screen pixels
+    Canvas.setOrigin(0, 0);
+    Canvas.setClippingRect(Rect(0, 0, Canvas.getWidth() - 1, Canvas.getHeight() - 1));
+    Canvas.copyRect(prevRect.X1, prevRect.Y1, winRect.X1, winRect.Y1, winRect.X2 - winRect.X1 + 1, winRect.Y2 - winRect.Y1 + 1);
+  } else
+    repaintRect(winRect);
 }
 
 
@@ -371,6 +588,15 @@ void uiApp::resizeWindow(uiWindow * window, int width, int height)
   Size prevSize = window->size();
   window->setSize(width, height);
 
+  invalidateBackingStores(window);
+  #if FABGLIB_HAS_READWRITE_RAW_DATA
+  if (window->hasBackingStore()) {
+    // reallocate for the new size
+    window->enableBackingStore(false);
+    window->enableBackingStore(true);
+  }
+  #endif
+
   //// repaint discovered areas
 
   int dx = width - prevSize.width;
@@ -411,6 +637,11 @@ void uiApp::generatePaintEvents(uiWindow * baseWindow, Rect const & rect)
         noIntesections = false;
         removeRectangle(rects, thisRect, winRect);
         Rect newRect = translate(intersection(thisRect, winRect), -win->pos().X, -win->pos().Y);
+        #if FABGLIB_HAS_READWRITE_RAW_DATA
+        if (win->m_backingStoreValid)
+          restoreFromBackingStore(win, newRect);
+        else
+        #endif
         generatePaintEvents(win, newRect);
         break;
       }
@@ -419,7 +650,11 @@ void uiApp::generatePaintEvents(uiWindow * baseWindow, Rect const & rect)
       uiEvent evt = uiEvent(NULL, UIEVT_PAINT);
       evt.dest = baseWindow;
       evt.params.paintRect = thisRect;
-      postEvent(&evt);
+      if (postEvent(&evt)) {
+        Rect baseRect = baseWindow->rect(uiRect_ScreenBased);
+        Rect screenRect = translate(thisRect, baseRect.X1, baseRect.Y1);
+        m_paintEventsRect = m_paintEventsCount++ > 0 ? rectUnion(m_paintEventsRect, screenRect) : screenRect;
+      }
     }
   }
 }
@@ -447,6 +682,11 @@ uiWindow::uiWindow(uiWindow * parent, const Point & pos, const Size & size, bool
     m_firstChild(NULL),
     m_lastChild(NULL)
 {
+  #if FABGLIB_HAS_READWRITE_RAW_DATA
+  m_backingStore      = NULL;
+  m_backingStoreValid = false;
+  m_backingStoreDirty = false;
+  #endif
   evtHandlerProps().isWindow = true;
   if (parent)
     parent->addChild(this);
@@ -456,6 +696,9 @@ uiWindow::uiWindow(uiWindow * parent, const Point & pos, const Size & size, bool
 uiWindow::~uiWindow()
 {
   freeChildren();
+  #if FABGLIB_HAS_READWRITE_RAW_DATA
+  enableBackingStore(false);
+  #endif
 }
 
 
@@ -534,6 +777,27 @@ Rect uiWindow::rect(uiWindowRectType rectType)
 }
 
 
+#if FABGLIB_HAS_READWRITE_RAW_DATA
+void uiWindow::enableBackingStore(bool value)
+{
+  if (value == hasBackingStore())
+    return;
+  if (value) {
+    // stays disabled when there isn't enough memory
+    m_backingStore = (uint8_t*) malloc(m_size.width * m_size.height);
+  } else {
+    // a pending readRawData() may still write to the backing store
+    Canvas.waitCompletion();
+    free(m_backingStore);
+    m_backingStore = NULL;
+  }
+  // the backing store is filled after the next paint of the window
+  m_backingStoreValid = false;
+  m_backingStoreDirty = false;
+}
+#endif
+
+
 void uiWindow::show(bool value)
 {
   m_isVisible = value;
@@ -640,6 +904,10 @@ Rect uiFrame::rect(uiWindowRectType rectType)
 
 void uiFrame::paintFrame()
 {
+  if (m_style.cornerRadius > 0) {
+    paintRoundFrame();
+    return;
+  }
   Rect bkgRect = Rect(0, 0, size().width - 1, size().height - 1);
   // title bar
   if (strlen(m_title)) {
@@ -647,9 +915,7 @@ void uiFrame::paintFrame()
     Canvas.setBrushColor(isActive() ? m_style.activeTitleBackgroundColor : m_style.normalTitleBackgroundColor);
     Canvas.fillRectangle(m_style.borderSize, m_style.borderSize, size().width - 1 - m_style.borderSize, 1 + m_style.titleFont->height + m_style.borderSize);
     // title
-    Canvas.setPenColor(m_style.titleFontColor);
-    Canvas.setGlyphOptions(GlyphOptions().FillBackground(true).DoubleWidth(0).Bold(false).Italic(false).Underline(false).Invert(0));
-    Canvas.drawText(m_style.titleFont, 1 + m_style.borderSize, 1 + m_style.borderSize, m_title);
+    paintTitle(0);
     // adjust background rect
     bkgRect.Y1 += 1 + m_style.titleFont->height;
   }
@@ -670,6 +936,45 @@ void uiFrame::paintFrame()
 }
 
 
+// frame with rounded corners, painted with filled rounded rectangles from outside to inside (pixels outside the corners are not painted)
+void uiFrame::paintRoundFrame()
+{
+  Rect inner = Rect(0, 0, size().width - 1, size().height - 1);
+  int radius = m_style.cornerRadius;
+  // border
+  if (m_style.borderSize > 0) {
+    Canvas.setBrushColor(isActive() ? m_style.activeBorderColor : m_style.normalBorderColor);
+    Canvas.fillRoundRectangle(inner.X1, inner.Y1, inner.X2, inner.Y2, radius);
+    inner = Rect(inner.X1 + m_style.borderSize, inner.Y1 + m_style.borderSize, inner.X2 - m_style.borderSize, inner.Y2 - m_style.borderSize);
+    radius = tmax(0, radius - m_style.borderSize);
+  }
+  if (strlen(m_title)) {
+    // title bar background fills the whole inner area, then background covers it below the title bar: bottom corners
+    // first, rows between title bar and bottom corners last
+    Canvas.setBrushColor(isActive() ? m_style.activeTitleBackgroundColor : m_style.normalTitleBackgroundColor);
+    Canvas.fillRoundRectangle(inner.X1, inner.Y1, inner.X2, inner.Y2, radius);
+    paintTitle(radius);
+    const int bkgY1 = inner.Y1 + 1 + m_style.titleFont->height;
+    Canvas.setBrushColor(m_style.backgroundColor);
+    Canvas.fillRoundRectangle(inner.X1, tmax(bkgY1, inner.Y2 - 2 * radius), inner.X2, inner.Y2, radius);
+    if (bkgY1 <= inner.Y2 - radius)
+      Canvas.fillRectangle(inner.X1, bkgY1, inner.X2, inner.Y2 - radius);
+  } else {
+    Canvas.setBrushColor(m_style.backgroundColor);
+    Canvas.fillRoundRectangle(inner.X1, inner.Y1, inner.X2, inner.Y2, radius);
+  }
+}
+
+
+// indent: horizontal space to leave before the title
+void uiFrame::paintTitle(int indent)
+{
+  Canvas.setPenColor(m_style.titleFontColor);
+  Canvas.setGlyphOptions(GlyphOptions().FillBackground(true).DoubleWidth(0).Bold(false).Italic(false).Underline(false).Invert(0));
+  Canvas.drawText(m_style.titleFont, 1 + m_style.borderSize + indent, 1 + m_style.borderSize, m_title);
+}
+
+
 void uiFrame::processEvent(uiEvent * event)
 {
   uiWindow::processEvent(event);
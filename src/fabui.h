@@ -67,6 +67,9 @@ namespace fabgl {
 
 #define FABGLIB_UI_EVENTS_QUEUE_SIZE 32
 
+// maximum number of not overlapping rectangles waiting to be repainted (see uiApp::repaintRect())
+#define FABGLIB_UI_PENDING_PAINT_RECTS 8
+
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -227,6 +230,14 @@ public:
 
   Point mouseDownPos() { return m_mouseDownPos; }
 
+#if FABGLIB_HAS_READWRITE_RAW_DATA
+  // when enabled the window content (children included) is copied offscreen while fully visible, then
+  // areas uncovered by other windows are restored from this copy instead of being repainted
+  void enableBackingStore(bool value);
+
+  bool hasBackingStore() { return m_backingStore != NULL; }
+#endif
+
 
 protected:
 
@@ -256,6 +267,12 @@ private:
   Point      m_posAtMouseDown;  // used to resize
   Size       m_sizeAtMouseDown; // used to resize
 
+#if FABGLIB_HAS_READWRITE_RAW_DATA
+  uint8_t *  m_backingStore;        // raw pixels of the window (m_size.width * m_size.height), NULL = disabled
+  bool       m_backingStoreValid;   // m_backingStore contains the current window content
+  bool       m_backingStoreDirty;   // window has been painted, m_backingStore needs to be updated
+#endif
+
   // double linked list, order is: bottom (first items) -> up (last items)
   uiWindow * m_next;
   uiWindow * m_prev;
@@ -277,6 +294,7 @@ struct uiFrameStyle {
   Color titleFontColor;
   FontInfo const * titleFont;
   int   borderSize;
+  int   cornerRadius;   // 0 = square corners
 
   uiFrameStyle() :
     backgroundColor(Color::White),
@@ -286,7 +304,8 @@ struct uiFrameStyle {
     activeTitleBackgroundColor(Color::BrightWhite),
     titleFontColor(Color::BrightBlack),
     titleFont(Canvas.getPresetFontInfo(80, 25)),
-    borderSize(1)
+    borderSize(1),
+    cornerRadius(0)
   { }
 };
 
@@ -334,6 +353,8 @@ protected:
 private:
 
   void paintFrame();
+  void paintRoundFrame();
+  void paintTitle(int indent);
   void movingCapturedMouse(int mouseX, int mouseY);
   void movingFreeMouse(int mouseX, int mouseY);
   uiFrameSensiblePos getSensiblePosAt(int x, int y);
@@ -358,6 +379,16 @@ private:
 // uiApp
 
 
+#if FABGLIB_HAS_UI_STATS
+// events counters, see uiApp::getStats()
+struct uiAppStats {
+  uint32_t eventsDispatched;     // number of events dispatched (after coalescing)
+  uint32_t mouseMovesCoalesced;  // number of UIEVT_MOUSEMOVE events merged into the following one
+  uint32_t paintsCoalesced;      // number of UIEVT_PAINT and UIEVT_ABSPAINT events merged into the previous one
+};
+#endif
+
+
 class uiApp : public uiEvtHandler {
 
 public:
@@ -392,6 +423,12 @@ public:
 
   uiWindow * screenToWindow(Point & point);
 
+#if FABGLIB_HAS_UI_STATS
+  uiAppStats const & getStats() { return m_stats; }
+
+  void resetStats() { memset(&m_stats, 0, sizeof(uiAppStats)); }
+#endif
+
 
   // events
 
@@ -404,9 +441,20 @@ protected:
 
 private:
 
+  void coalesceEvents(uiEvent * event);
   void preprocessEvent(uiEvent * event);
   void translateMouseEvent(uiEvent * event);
   void generatePaintEvents(uiWindow * baseWindow, Rect const & rect);
+  void paintPendingRects();
+  bool isPaintPending(Rect const & rect);
+  bool isWindowFullyVisible(uiWindow * window);
+  bool isCoveredByUpperWindows(uiWindow * window, Rect const & rect);
+  void windowPainted(uiWindow * window);
+  void invalidateBackingStores(uiWindow * window);
+#if FABGLIB_HAS_READWRITE_RAW_DATA
+  void updateBackingStores(uiWindow * window);
+  void restoreFromBackingStore(uiWindow * window, Rect const & rect);
+#endif
 
   QueueHandle_t m_eventsQueue;
 
@@ -414,6 +462,18 @@ private:
   uiWindow * m_activeWindow;
 
   uiWindow * m_capturedMouseWindow; // window that has captured mouse
+
+  // screen rectangles to repaint, overlapping rectangles are merged
+  Rect m_pendingPaintRects[FABGLIB_UI_PENDING_PAINT_RECTS];
+  int  m_pendingPaintRectsCount;
+
+  // UIEVT_PAINT events generated and not yet dispatched, and their screen bounding rectangle
+  int  m_paintEventsCount;
+  Rect m_paintEventsRect;
+
+  #if FABGLIB_HAS_UI_STATS
+  uiAppStats m_stats;
+  #endif
 };
 
 
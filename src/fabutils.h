@@ -257,6 +257,13 @@ inline bool pointInRect(int x, int y, Rect const & rect)
 bool clipLine(int & x1, int & y1, int & x2, int & y2, Rect const & clipRect);
 
 
+// Returns the smallest rectangle containing both rect1 and rect2
+inline Rect rectUnion(Rect const & rect1, Rect const & rect2)
+{
+  return Rect(tmin(rect1.X1, rect2.X1), tmin(rect1.Y1, rect2.Y1), tmax(rect1.X2, rect2.X2), tmax(rect1.Y2, rect2.Y2));
+}
+
+
 // Checks if the rect1 contains rect2
 inline bool contains(Rect const & rect1, Rect const & rect2)
 {
@@ -4,7 +4,7 @@
 namespace fabgl {
 
 
-static const uint8_t FONT_4x6_DATA[] = {
+static const uint8_t FONT_DATA_ATTR FONT_4x6_DATA[] = {
    0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
    0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
    0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
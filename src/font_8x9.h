@@ -4,7 +4,7 @@
 namespace fabgl {
 
 
-static const uint8_t FONT_8x9_DATA[] = {
+static const uint8_t FONT_DATA_ATTR FONT_8x9_DATA[] = {
    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
    0x7e, 0x81, 0xa5, 0x81, 0xa5, 0x99, 0x81, 0x7e, 0x00,
    0x7e, 0xff, 0xdb, 0xff, 0xdb, 0xe7, 0xff, 0x7e, 0x00,
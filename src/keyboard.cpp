@@ -396,8 +396,9 @@ const KeyboardLayout ItalianLayout {
 
 
 KeyboardClass::KeyboardClass()
-  : m_keyboardAvailable(false)
+  : m_keyboardAvailable(false), m_scancodeToVK(&m_scancodeToVKTables[0])
 {
+  memset(m_scancodeToVKTables, VK_NONE, sizeof(m_scancodeToVKTables));
 }
 
 
@@ -489,12 +490,38 @@ void KeyboardClass::updateLEDs()
 }
 
 
+// virtualkeys are stored as bytes in scancode lookup tables
+static_assert(VK_LAST <= 256, "VirtualKey doesn't fit in a byte");
+
+
+// the converter task may be translating a scancode, so the tables in use are never modified: the new ones
+// are built aside and published with a single pointer store
 void KeyboardClass::setLayout(const KeyboardLayout * layout)
 {
+  ScancodeToVKTables * tables = &m_scancodeToVKTables[m_scancodeToVK == &m_scancodeToVKTables[0] ? 1 : 0];
+  memset(tables, VK_NONE, sizeof(ScancodeToVKTables));
+  fillScancodeToVKTables(layout, tables);
+  m_scancodeToVK = tables;
   m_layout = layout;
 }
 
 
+// the first association of a layout wins, inherited layouts fill only missing associations
+void KeyboardClass::fillScancodeToVKTables(KeyboardLayout const * layout, ScancodeToVKTables * tables)
+{
+  for (VirtualKeyDef const * def = layout->scancodeToVK; def->scancode; ++def)
+    if (tables->scancodeToVK[def->scancode] == VK_NONE)
+      tables->scancodeToVK[def->scancode] = def->virtualKey;
+
+  for (VirtualKeyDef const * def = layout->exScancodeToVK; def->scancode; ++def)
+    if (tables->exScancodeToVK[def->scancode] == VK_NONE)
+      tables->exScancodeToVK[def->scancode] = def->virtualKey;
+
+  if (layout->inherited)
+    fillScancodeToVKTables(layout->inherited, tables);
+}
+
+
 #if FABGLIB_HAS_VirtualKeyO_STRING
 char const * KeyboardClass::virtualKeyToString(VirtualKey virtualKey)
 {
@@ -714,27 +741,6 @@ int KeyboardClass::virtualKeyToASCII(VirtualKey virtualKey)
 }
 
 
-VirtualKey KeyboardClass::scancodeToVK(uint8_t scancode, bool isExtended, KeyboardLayout const * layout)
-{
-  VirtualKey vk = VK_NONE;
-
-  if (layout == NULL)
-    layout = m_layout;
-
-  VirtualKeyDef const * def = isExtended ? layout->exScancodeToVK : layout->scancodeToVK;
-  for (; def->scancode; ++def)
-    if (def->scancode == scancode) {
-      vk = def->virtualKey;
-      break;
-    }
-
-  if (vk == VK_NONE && layout->inherited)
-    vk = scancodeToVK(scancode, isExtended, layout->inherited);
-
-  return vk;
-}
-
-
 VirtualKey KeyboardClass::VKtoAlternateVK(VirtualKey in_vk, KeyboardLayout const * layout)
 {
   VirtualKey vk = VK_NONE;
@@ -414,7 +414,9 @@ public:
    *
    * It is possible to specify an international keyboard layout. The default is US-layout.<br>
    * There are three predefined kayboard layouts: US (USA), UK (United Kingdom), DE (German) and IT (Italian). Other layout can be added
-   * inheriting from US or from any other layout.
+   * inheriting from US or from any other layout.<br>
+   * Scancode to virtualkey associations of the layout (and of inherited layouts) are copied into flat lookup tables, so the layout
+   * must not be changed after this call (call setLayout() again in that case). It can be called while the keyboard is generating virtual keys.
    *
    * @param layout A pointer to the layout structure.
    *
@@ -559,7 +561,14 @@ public:
 
 private:
 
-  VirtualKey scancodeToVK(uint8_t scancode, bool isExtended, KeyboardLayout const * layout = NULL);
+  // scancode -> virtualkey associations of a layout, inherited layouts included
+  struct ScancodeToVKTables {
+    uint8_t scancodeToVK[256];
+    uint8_t exScancodeToVK[256];
+  };
+
+  VirtualKey scancodeToVK(uint8_t scancode, bool isExtended) { return (VirtualKey) (isExtended ? m_scancodeToVK->exScancodeToVK[scancode] : m_scancodeToVK->scancodeToVK[scancode]); }
+  static void fillScancodeToVKTables(KeyboardLayout const * layout, ScancodeToVKTables * tables);
   VirtualKey VKtoAlternateVK(VirtualKey in_vk, KeyboardLayout const * layout = NULL);
   void updateLEDs();
   VirtualKey blockingGetVirtualKey(bool * keyDown);
@@ -576,6 +585,10 @@ private:
 
   KeyboardLayout const *    m_layout;
 
+  // associations of m_layout, read by the converter task. setLayout() fills the tables not in use, then swaps m_scancodeToVK
+  ScancodeToVKTables        m_scancodeToVKTables[2];
+  ScancodeToVKTables const * volatile m_scancodeToVK;
+
   bool                      m_CTRL;
   bool                      m_ALT;
   bool                      m_SHIFT;
@@ -32,13 +32,18 @@
 fabgl::MouseClass Mouse;
 
 
+// maximum time (ms) absoluteUpdateTask() sleeps waiting for data. Another task reading the port (ie sendCommand()) takes
+// the single RX wake up slot, so the task must check the RX ring again from time to time.
+#define MOUSE_TASK_WAITDATA_TIMEOUT 100
+
+
 
 namespace fabgl {
 
 
 MouseClass::MouseClass()
   : m_mouseAvailable(false), m_mouseType(LegacyMouse), m_prevDeltaTime(0),
-    m_movementAcceleration(180), m_wheelAcceleration(60000), m_absoluteUpdateTimer(NULL),
+    m_movementAcceleration(180), m_wheelAcceleration(60000), m_absoluteUpdateTask(NULL),
     m_absoluteQueue(NULL), m_updateVGAController(false)
 {
 }
@@ -46,8 +51,8 @@ MouseClass::MouseClass()
 
 MouseClass::~MouseClass()
 {
-  if (m_absoluteUpdateTimer)
-    xTimerDelete(m_absoluteUpdateTimer, portMAX_DELAY);
+  if (m_absoluteUpdateTask)
+    vTaskDelete(m_absoluteUpdateTask);
   if (m_absoluteQueue)
     vQueueDelete(m_absoluteQueue);
 }
@@ -166,10 +171,9 @@ void MouseClass::setupAbsolutePositioner(int width, int height, bool createAbsol
     VGAController.setMouseCursorPos(m_status.X, m_status.Y);
   }
 
-  if (m_updateVGAController || createAbsolutePositionsQueue || m_uiApp) {
-    // create and start the timer
-    m_absoluteUpdateTimer = xTimerCreate("", pdMS_TO_TICKS(10), pdTRUE, this, absoluteUpdateTimerFunc);
-    xTimerStart(m_absoluteUpdateTimer, portMAX_DELAY);
+  if ((m_updateVGAController || createAbsolutePositionsQueue || m_uiApp) && m_absoluteUpdateTask == NULL) {
+    // create the task that processes incoming packets
+    xTaskCreate(&absoluteUpdateTask, "", FABGLIB_MOUSE_TASK_STACK_SIZE, this, FABGLIB_MOUSE_TASK_PRIORITY, &m_absoluteUpdateTask);
   }
 }
 
@@ -215,59 +219,79 @@ void MouseClass::updateAbsolutePosition(MouseDelta * delta)
 }
 
 
-void MouseClass::absoluteUpdateTimerFunc(TimerHandle_t xTimer)
+void MouseClass::absoluteUpdateTask(void * arg)
 {
-  MouseClass * mouse = (MouseClass*) pvTimerGetTimerID(xTimer);
-  MouseDelta delta;
-  if (mouse->deltaAvailable() && mouse->getNextDelta(&delta, 0, false)) {
-    mouse->updateAbsolutePosition(&delta);
-
-    // VGA Controller
-    if (mouse->m_updateVGAController)
-      VGAController.setMouseCursorPos(mouse->m_status.X, mouse->m_status.Y);
-
-    // queue (if you need availableStatus() or getNextStatus())
-    if (mouse->m_absoluteQueue) {
-      xQueueSend(mouse->m_absoluteQueue, &mouse->m_status, 0);
+  MouseClass * mouse = (MouseClass*) arg;
+
+  while (true) {
+
+    // commands lock the device (see PS2DeviceLock) until their replies have been received, so bytes found after
+    // the lock has been taken are packets
+    mouse->lock(-1);
+
+    if (mouse->dataAvailable() == 0) {
+      mouse->unlock();
+      // PS/2 RTC interrupt awakes this task as soon as a byte is received
+      mouse->waitData(MOUSE_TASK_WAITDATA_TIMEOUT);
+      continue;
     }
 
-    if (mouse->m_uiApp) {
-      // generate uiApp events
-      if (mouse->m_prevStatus.X != mouse->m_status.X || mouse->m_prevStatus.Y != mouse->m_status.Y) {
-        // X and Y movement: UIEVT_MOUSEMOVE
-        uiEvent evt = uiEvent(NULL, UIEVT_MOUSEMOVE);
-        evt.params.mouse.status = mouse->m_status;
-        evt.params.mouse.changedButton = 0;
-        mouse->m_uiApp->postEvent(&evt);
-      }
-      if (mouse->m_status.wheelDelta != 0) {
-        // wheel movement: UIEVT_MOUSEWHEEL
-        uiEvent evt = uiEvent(NULL, UIEVT_MOUSEWHEEL);
-        evt.params.mouse.status = mouse->m_status;
-        evt.params.mouse.changedButton = 0;
-        mouse->m_uiApp->postEvent(&evt);
-      }
-      if (mouse->m_prevStatus.buttons.left != mouse->m_status.buttons.left) {
-        // left button: UIEVT_MOUSEBUTTONDOWN, UIEVT_MOUSEBUTTONUP
-        uiEvent evt = uiEvent(NULL, mouse->m_status.buttons.left ? UIEVT_MOUSEBUTTONDOWN : UIEVT_MOUSEBUTTONUP);
-        evt.params.mouse.status = mouse->m_status;
-        evt.params.mouse.changedButton = 1;
-        mouse->m_uiApp->postEvent(&evt);
-      }
-      if (mouse->m_prevStatus.buttons.middle != mouse->m_status.buttons.middle) {
-        // middle button: UIEVT_MOUSEBUTTONDOWN, UIEVT_MOUSEBUTTONUP
-        uiEvent evt = uiEvent(NULL, mouse->m_status.buttons.middle ? UIEVT_MOUSEBUTTONDOWN : UIEVT_MOUSEBUTTONUP);
-        evt.params.mouse.status = mouse->m_status;
-        evt.params.mouse.changedButton = 2;
-        mouse->m_uiApp->postEvent(&evt);
+    // other bytes of the packet follow in few milliseconds
+    MouseDelta delta;
+    bool received = mouse->getNextDelta(&delta, 50, false);
+    mouse->unlock();
+
+    if (received) {
+      mouse->updateAbsolutePosition(&delta);
+
+      // VGA Controller
+      if (mouse->m_updateVGAController)
+        VGAController.setMouseCursorPos(mouse->m_status.X, mouse->m_status.Y);
+
+      // queue (if you need availableStatus() or getNextStatus())
+      if (mouse->m_absoluteQueue) {
+        xQueueSend(mouse->m_absoluteQueue, &mouse->m_status, 0);
       }
-      if (mouse->m_prevStatus.buttons.right != mouse->m_status.buttons.right) {
-        // right button: UIEVT_MOUSEBUTTONDOWN, UIEVT_MOUSEBUTTONUP
-        uiEvent evt = uiEvent(NULL, mouse->m_status.buttons.right ? UIEVT_MOUSEBUTTONDOWN : UIEVT_MOUSEBUTTONUP);
-        evt.params.mouse.status = mouse->m_status;
-        evt.params.mouse.changedButton = 3;
-        mouse->m_uiApp->postEvent(&evt);
+
+      if (mouse->m_uiApp) {
+        // generate uiApp events
+        if (mouse->m_prevStatus.X != mouse->m_status.X || mouse->m_prevStatus.Y != mouse->m_status.Y) {
+          // X and Y movement: UIEVT_MOUSEMOVE
+          uiEvent evt = uiEvent(NULL, UIEVT_MOUSEMOVE);
+          evt.params.mouse.status = mouse->m_status;
+          evt.params.mouse.changedButton = 0;
+          mouse->m_uiApp->postEvent(&evt);
+        }
+        if (mouse->m_status.wheelDelta != 0) {
+          // wheel movement: UIEVT_MOUSEWHEEL
+          uiEvent evt = uiEvent(NULL, UIEVT_MOUSEWHEEL);
+          evt.params.mouse.status = mouse->m_status;
+          evt.params.mouse.changedButton = 0;
+          mouse->m_uiApp->postEvent(&evt);
+        }
+        if (mouse->m_prevStatus.buttons.left != mouse->m_status.buttons.left) {
+          // left button: UIEVT_MOUSEBUTTONDOWN, UIEVT_MOUSEBUTTONUP
+          uiEvent evt = uiEvent(NULL, mouse->m_status.buttons.left ? UIEVT_MOUSEBUTTONDOWN : UIEVT_MOUSEBUTTONUP);
+          evt.params.mouse.status = mouse->m_status;
+          evt.params.mouse.changedButton = 1;
+          mouse->m_uiApp->postEvent(&evt);
+        }
+        if (mouse->m_prevStatus.buttons.middle != mouse->m_status.buttons.middle) {
+          // middle button: UIEVT_MOUSEBUTTONDOWN, UIEVT_MOUSEBUTTONUP
+          uiEvent evt = uiEvent(NULL, mouse->m_status.buttons.middle ? UIEVT_MOUSEBUTTONDOWN : UIEVT_MOUSEBUTTONUP);
+          evt.params.mouse.status = mouse->m_status;
+          evt.params.mouse.changedButton = 2;
+          mouse->m_uiApp->postEvent(&evt);
+        }
+        if (mouse->m_prevStatus.buttons.right != mouse->m_status.buttons.right) {
+          // right button: UIEVT_MOUSEBUTTONDOWN, UIEVT_MOUSEBUTTONUP
+          uiEvent evt = uiEvent(NULL, mouse->m_status.buttons.right ? UIEVT_MOUSEBUTTONDOWN : UIEVT_MOUSEBUTTONUP);
+          evt.params.mouse.status = mouse->m_status;
+          evt.params.mouse.changedButton = 3;
+          mouse->m_uiApp->postEvent(&evt);
+        }
       }
+
     }
 
   }
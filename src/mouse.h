@@ -32,7 +32,6 @@
 
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/timers.h"
 
 #include "fabglconf.h"
 #include "fabutils.h"
@@ -215,6 +214,7 @@ public:
    * Use this method to specify the absolute mouse area inside the rectangle (0, 0) to (width - 1, height - 1).<br>
    * Optinally this method creates a queue that stores absolute positions generated by updateAbsolutePosition().<br>
    * This method must be called one time to initialize absolute positioning.<br>
+   * Mouse packets are processed by a task awakened as soon as they are received (see FABGLIB_MOUSE_TASK_STACK_SIZE and FABGLIB_MOUSE_TASK_PRIORITY).<br>
    *
    * @param width Absolute mouse area width. Mouse can travel from 0 up to width - 1.
    * @param height Absolute mouse area height. Mouse can travel from 0 up to height - 1.
@@ -308,7 +308,7 @@ public:
 private:
 
   int getPacketSize();
-  static void absoluteUpdateTimerFunc(TimerHandle_t xTimer);
+  static void absoluteUpdateTask(void * arg);
 
 
   bool          m_mouseAvailable;
@@ -321,7 +321,7 @@ private:
   int64_t       m_prevDeltaTime;
   int           m_movementAcceleration;  // reasonable values: 0...2000
   int           m_wheelAcceleration;     // reasonable values: 0...100000
-  TimerHandle_t m_absoluteUpdateTimer;
+  TaskHandle_t  m_absoluteUpdateTask;
   QueueHandle_t m_absoluteQueue;         // a queue of messages generated by updateAbsolutePosition()
   bool          m_updateVGAController;
 
@@ -30,6 +30,7 @@
 
 #include "ps2controller.h"
 #include "fabutils.h"
+#include "fabtrace.h"
 #include "ulp_macro_ex.h"
 
 
@@ -40,6 +41,14 @@ fabgl::PS2ControllerClass PS2Controller;
 namespace fabgl {
 
 
+#define RXRING_MASK (FABGLIB_PS2_RX_RING_SIZE - 1)
+
+
+// rtc_isr() and injectInRXBuffer() both write the RX rings
+static portMUX_TYPE s_RXRingMux = portMUX_INITIALIZER_UNLOCKED;
+
+
+
 ////////////////////////////////////////////////////////////////////////////
 // Support for missing macros for operations on STAGE register
 
@@ -843,6 +852,9 @@ void PS2ControllerClass::begin(gpio_num_t port0_clkGPIO, gpio_num_t port0_datGPI
   m_readPos[0] = RTCMEM_PORT0_BUFFER_START;
   m_readPos[1] = RTCMEM_PORT1_BUFFER_START;
 
+  m_RXRingWritePos[0] = m_RXRingWritePos[1] = 0;
+  m_RXRingReadPos[0]  = m_RXRingReadPos[1]  = 0;
+
   // install RTC interrupt handler (on ULP Wake() instruction)
   esp_intr_alloc(ETS_RTC_CORE_INTR_SOURCE, 0, rtc_isr, NULL, NULL);
   SET_PERI_REG_MASK(RTC_CNTL_INT_ENA_REG, RTC_CNTL_ULP_CP_INT_ENA);
@@ -851,58 +863,69 @@ void PS2ControllerClass::begin(gpio_num_t port0_clkGPIO, gpio_num_t port0_datGPI
 
 int PS2ControllerClass::dataAvailable(int PS2Port)
 {
-  uint32_t RTCMEM_PORTX_WRITE_POS    = (PS2Port == 0 ? RTCMEM_PORT0_WRITE_POS    : RTCMEM_PORT1_WRITE_POS);
-  uint32_t RTCMEM_PORTX_BUFFER_END   = (PS2Port == 0 ? RTCMEM_PORT0_BUFFER_END   : RTCMEM_PORT1_BUFFER_END);
-  uint32_t RTCMEM_PORTX_BUFFER_START = (PS2Port == 0 ? RTCMEM_PORT0_BUFFER_START : RTCMEM_PORT1_BUFFER_START);
-
-  int writePos = RTC_SLOW_MEM[RTCMEM_PORTX_WRITE_POS] & 0xFFFF;
-  if (m_readPos[PS2Port] <= writePos)
-    return writePos - m_readPos[PS2Port];
-  else
-    return (RTCMEM_PORTX_BUFFER_END - m_readPos[PS2Port]) + (writePos - RTCMEM_PORTX_BUFFER_START);
+  return m_RXRingWritePos[PS2Port] - m_RXRingReadPos[PS2Port];
 }
 
 
 // return -1 when no data is available
 int PS2ControllerClass::getData(int PS2Port)
 {
-  uint32_t RTCMEM_PORTX_WRITE_POS    = (PS2Port == 0 ? RTCMEM_PORT0_WRITE_POS    : RTCMEM_PORT1_WRITE_POS);
-  uint32_t RTCMEM_PORTX_BUFFER_END   = (PS2Port == 0 ? RTCMEM_PORT0_BUFFER_END   : RTCMEM_PORT1_BUFFER_END);
-  uint32_t RTCMEM_PORTX_BUFFER_START = (PS2Port == 0 ? RTCMEM_PORT0_BUFFER_START : RTCMEM_PORT1_BUFFER_START);
-
-  int data = -1;
-
-  int writePos = RTC_SLOW_MEM[RTCMEM_PORTX_WRITE_POS] & 0xFFFF;
-  if (m_readPos[PS2Port] != writePos) {
-    data = (RTC_SLOW_MEM[m_readPos[PS2Port]] & 0xFFFF) >> 1 & 0xFF;
-    ++m_readPos[PS2Port];
-    if (m_readPos[PS2Port] == RTCMEM_PORTX_BUFFER_END)
-      m_readPos[PS2Port] = RTCMEM_PORTX_BUFFER_START;
-  }
-
+  uint32_t readPos = m_RXRingReadPos[PS2Port];
+  if (readPos == m_RXRingWritePos[PS2Port])
+    return -1;
+  int data = m_RXRing[PS2Port][readPos & RXRING_MASK];
+  m_RXRingReadPos[PS2Port] = readPos + 1;
   return data;
 }
 
 
+// push a received byte, it is discarded when the ring is full
+static inline void IRAM_ATTR RXRingPush(uint8_t * ring, volatile uint32_t & writePos, uint32_t readPos, uint8_t value)
+{
+  if (writePos - readPos < FABGLIB_PS2_RX_RING_SIZE) {
+    ring[writePos & RXRING_MASK] = value;
+    writePos = writePos + 1;
+  }
+}
+
+
 void PS2ControllerClass::injectInRXBuffer(int value, int PS2Port)
 {
-  uint32_t RTCMEM_PORTX_WRITE_POS    = (PS2Port == 0 ? RTCMEM_PORT0_WRITE_POS    : RTCMEM_PORT1_WRITE_POS);
-  uint32_t RTCMEM_PORTX_BUFFER_END   = (PS2Port == 0 ? RTCMEM_PORT0_BUFFER_END   : RTCMEM_PORT1_BUFFER_END);
-  uint32_t RTCMEM_PORTX_BUFFER_START = (PS2Port == 0 ? RTCMEM_PORT0_BUFFER_START : RTCMEM_PORT1_BUFFER_START);
-
-  int writePos = RTC_SLOW_MEM[RTCMEM_PORTX_WRITE_POS] & 0xFFFF;
-  RTC_SLOW_MEM[writePos] = value << 1;
-  ++writePos;
-  if (writePos == RTCMEM_PORTX_BUFFER_END)
-    writePos = RTCMEM_PORTX_BUFFER_START;
-  RTC_SLOW_MEM[RTCMEM_PORTX_WRITE_POS] = writePos;
+  portENTER_CRITICAL(&s_RXRingMux);
+  RXRingPush(m_RXRing[PS2Port], m_RXRingWritePos[PS2Port], m_RXRingReadPos[PS2Port], value);
+  portEXIT_CRITICAL(&s_RXRingMux);
 }
 
 
+// only one task per port is awakened by the RTC interrupt, other waiting tasks poll the RX ring
 bool PS2ControllerClass::waitData(int timeOutMS, int PS2Port)
 {
-  m_RXWaitTask[PS2Port] = xTaskGetCurrentTaskHandle();
-  return ulTaskNotifyTake(pdTRUE, timeOutMS < 0 ? portMAX_DELAY : pdMS_TO_TICKS(timeOutMS));
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  const TickType_t start   = xTaskGetTickCount();
+  const TickType_t timeOut = timeOutMS < 0 ? portMAX_DELAY : pdMS_TO_TICKS(timeOutMS);
+  while (!dataAvailable(PS2Port)) {
+    const TickType_t elapsed = xTaskGetTickCount() - start;
+    if (timeOutMS > -1 && elapsed >= timeOut)
+      break;
+    portENTER_CRITICAL(&s_RXRingMux);
+    const bool registered = (m_RXWaitTask[PS2Port] == NULL || m_RXWaitTask[PS2Port] == task);
+    if (registered)
+      m_RXWaitTask[PS2Port] = task;
+    portEXIT_CRITICAL(&s_RXRingMux);
+    if (!registered) {
+      vTaskDelay(1);
+      continue;
+    }
+    // data may be arrived before the task has been registered. Other notifications (ie end of send) just repeat the loop
+    if (!dataAvailable(PS2Port))
+      ulTaskNotifyTake(pdTRUE, timeOutMS < 0 ? portMAX_DELAY : timeOut - elapsed);
+  }
+  // interrupt releases the slot when it notifies the task, release it also on timeout
+  portENTER_CRITICAL(&s_RXRingMux);
+  if (m_RXWaitTask[PS2Port] == task)
+    m_RXWaitTask[PS2Port] = NULL;
+  portEXIT_CRITICAL(&s_RXRingMux);
+  return dataAvailable(PS2Port);
 }
 
 
@@ -920,11 +943,15 @@ void PS2ControllerClass::sendData(uint8_t data, int PS2Port)
 
 void IRAM_ATTR PS2ControllerClass::rtc_isr(void * arg)
 {
+  BaseType_t woken = pdFALSE;
+
   for (int PS2Port = 0; PS2Port < 2; ++PS2Port) {
 
     uint32_t RTCMEM_PORTX_WORD_SENT_FLAG = (PS2Port == 0 ? RTCMEM_PORT0_WORD_SENT_FLAG : RTCMEM_PORT1_WORD_SENT_FLAG);
     uint32_t RTCMEM_PORTX_WRITE_POS      = (PS2Port == 0 ? RTCMEM_PORT0_WRITE_POS      : RTCMEM_PORT1_WRITE_POS);
     uint32_t RTCMEM_PORTX_WORD_RX_READY  = (PS2Port == 0 ? RTCMEM_PORT0_WORD_RX_READY  : RTCMEM_PORT1_WORD_RX_READY);
+    uint32_t RTCMEM_PORTX_BUFFER_END     = (PS2Port == 0 ? RTCMEM_PORT0_BUFFER_END     : RTCMEM_PORT1_BUFFER_END);
+    uint32_t RTCMEM_PORTX_BUFFER_START   = (PS2Port == 0 ? RTCMEM_PORT0_BUFFER_START   : RTCMEM_PORT1_BUFFER_START);
 
     // Received end of send interrupt?
     if (RTC_SLOW_MEM[RTCMEM_PORTX_WORD_SENT_FLAG]) {
@@ -941,13 +968,31 @@ void IRAM_ATTR PS2ControllerClass::rtc_isr(void * arg)
     if (RTC_SLOW_MEM[RTCMEM_PORTX_WORD_RX_READY]) {
       // reset flag and awake waiting task
       RTC_SLOW_MEM[RTCMEM_PORTX_WORD_RX_READY] = 0;
-      if (PS2Controller.m_RXWaitTask[PS2Port]) {
-        vTaskNotifyGiveFromISR(PS2Controller.m_RXWaitTask[PS2Port], NULL);
-        PS2Controller.m_RXWaitTask[PS2Port] = NULL;
+
+      // move received words from RTC slow memory to the RX ring, decoding data bits
+      portENTER_CRITICAL_ISR(&s_RXRingMux);
+      int writePos = RTC_SLOW_MEM[RTCMEM_PORTX_WRITE_POS] & 0xFFFF;
+      for (int readPos = PS2Controller.m_readPos[PS2Port]; readPos != writePos; ) {
+        FABGLIB_TRACE(PS2Byte, Instant, PS2Port << 8 | ((RTC_SLOW_MEM[readPos] & 0xFFFF) >> 1 & 0xFF));
+        RXRingPush(PS2Controller.m_RXRing[PS2Port], PS2Controller.m_RXRingWritePos[PS2Port], PS2Controller.m_RXRingReadPos[PS2Port], (RTC_SLOW_MEM[readPos] & 0xFFFF) >> 1 & 0xFF);
+        if (++readPos == (int) RTCMEM_PORTX_BUFFER_END)
+          readPos = RTCMEM_PORTX_BUFFER_START;
       }
+      PS2Controller.m_readPos[PS2Port] = writePos;
+      // waiting task is taken and released atomically with waitData()
+      TaskHandle_t RXWaitTask = PS2Controller.m_RXWaitTask[PS2Port];
+      PS2Controller.m_RXWaitTask[PS2Port] = NULL;
+      portEXIT_CRITICAL_ISR(&s_RXRingMux);
+
+      if (RXWaitTask)
+        vTaskNotifyGiveFromISR(RXWaitTask, &woken);
     }
 
   }
+
+  // switch immediately to the awakened task
+  if (woken)
+    portYIELD_FROM_ISR();
 }
 
 
@@ -45,7 +45,9 @@ namespace fabgl {
  * @brief The PS2 device controller class.
  *
  * The PS2 controller uses ULP coprocessor and RTC slow memory to communicate with up to two PS2 devices.<br>
- * The ULP coprocessor continuously monitor CLK and DATA lines for incoming data. Optionally can send commands to the PS2 devices.
+ * The ULP coprocessor continuously monitor CLK and DATA lines for incoming data. Optionally can send commands to the PS2 devices.<br>
+ * Received bytes are moved by the RTC interrupt from RTC slow memory to a ring of each port (see FABGLIB_PS2_RX_RING_SIZE), then the
+ * task waiting for data (see waitData()) is awakened.
  */
 class PS2ControllerClass {
 
@@ -72,6 +74,17 @@ public:
    */
   int dataAvailable(int PS2Port);
 
+  /**
+   * @brief Wait for data from the device.
+   *
+   * The calling task is awakened by the RTC interrupt as soon as a byte is received. Only one task per port is awakened,
+   * when another task is already waiting the calling task checks for data at each tick.
+   *
+   * @param timeOutMS Timeout in milliseconds (-1 = no timeout).
+   * @param PS2Port PS2 port number (0 = port 0, 1 = port1).
+   *
+   * @return True if data is available.
+   */
   bool waitData(int timeOutMS, int PS2Port);
 
   /**
@@ -105,13 +118,18 @@ private:
 
   static void IRAM_ATTR rtc_isr(void * arg);
 
-  // address of next word to read in the circular buffer
+  // address of next word to move from the RTC slow memory circular buffer to m_RXRing (used only by rtc_isr)
   int                   m_readPos[2];
 
+  // received bytes, m_RXRingWritePos and m_RXRingReadPos are free running (masked on access)
+  uint8_t               m_RXRing[2][FABGLIB_PS2_RX_RING_SIZE];
+  volatile uint32_t     m_RXRingWritePos[2];
+  volatile uint32_t     m_RXRingReadPos[2];
+
   // task that is waiting for TX ends
   volatile TaskHandle_t m_TXWaitTask[2];
 
-  // task that is waiting for RX event
+  // task that is waiting for RX event, one per port (see waitData())
   volatile TaskHandle_t m_RXWaitTask[2];
 
 };
@@ -112,12 +112,20 @@ int PS2DeviceClass::getData(int timeOutMS)
     lock(-1);
     PS2Controller.waitData((timeOutMS > -1 ? timeOutMS : PS2_CMD_GETDATA_SUBTIMEOUT), m_PS2Port);
     unlock();
-    delay(10);
+    // data is already in the RX ring when waitData() returns, just give other tasks a chance to lock the device
+    taskYIELD();
   }
   return ret;
 }
 
 
+// wait (without locking the device) until a byte is received, -1 = no timeout
+bool PS2DeviceClass::waitData(int timeOutMS)
+{
+  return PS2Controller.waitData(timeOutMS, m_PS2Port);
+}
+
+
 bool PS2DeviceClass::sendCommand(uint8_t cmd, uint8_t expectedReply)
 {
   for (int i = 0; i < PS2_CMD_RETRY_COUNT; ++i) {
@@ -100,6 +100,7 @@ protected:
 
   int dataAvailable();
   int getData(int timeOutMS);
+  bool waitData(int timeOutMS);
 
   void requestToResendLastByte();
 
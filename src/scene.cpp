@@ -24,7 +24,10 @@
 #include "freertos/task.h"
 #include "freertos/timers.h"
 
+#include "esp_timer.h"
+
 #include "fabutils.h"
+#include "fabtrace.h"
 #include "scene.h"
 
 
@@ -35,9 +38,11 @@ namespace fabgl {
 
 
 Scene::Scene(int maxSpritesCount, int updateTimeMS, int width, int height)
- : m_width(width), m_height(height), m_collisionDetector(maxSpritesCount, width, height), m_suspendedTask(NULL)
+ : m_width(width), m_height(height), m_updateTimeMS(updateTimeMS), m_VSyncScheduler(false), m_maxCatchUpUpdates(4), m_updateTask(NULL),
+   m_collisionDetector(maxSpritesCount, width, height), m_suspendedTask(NULL)
 {
   m_updateTimer = xTimerCreate("", pdMS_TO_TICKS(updateTimeMS), pdTRUE, this, updateTimerFunc);
+  resetStats();
 }
 
 
@@ -51,7 +56,11 @@ void Scene::start(bool suspendTask)
 {
   m_updateCount = 0;
   init();
-  xTimerStart(m_updateTimer, portMAX_DELAY);
+  if (m_VSyncScheduler) {
+    m_stopRequested = false;
+    xTaskCreatePinnedToCore(&updateTask, "", FABGLIB_SCENE_TASK_STACK_SIZE, this, FABGLIB_SCENE_TASK_PRIORITY, &m_updateTask, FABGLIB_SCENE_TASK_CORE);
+  } else
+    xTimerStart(m_updateTimer, portMAX_DELAY);
   if (suspendTask) {
     m_suspendedTask = xTaskGetCurrentTaskHandle();
     vTaskSuspend(m_suspendedTask);
@@ -63,7 +72,14 @@ void Scene::start(bool suspendTask)
 void Scene::stop()
 {
   VGAController.removeSprites();
-  xTimerStop(m_updateTimer, portMAX_DELAY);
+  if (m_updateTask) {
+    m_stopRequested = true;
+    // when called by Scene.update() the task ends after it returns
+    if (xTaskGetCurrentTaskHandle() != m_updateTask)
+      while (m_updateTask)
+        vTaskDelay(1);
+  } else
+    xTimerStop(m_updateTimer, portMAX_DELAY);
   if (m_suspendedTask)
     vTaskResume(m_suspendedTask);
 }
@@ -77,6 +93,69 @@ void Scene::updateTimerFunc(TimerHandle_t xTimer)
 }
 
 
+void Scene::updateTask(void * arg)
+{
+  Scene * scene = (Scene*) arg;
+  SceneStats & stats = scene->m_stats;
+
+  const int64_t timeStep  = scene->m_updateTimeMS * 1000;
+  int64_t       elapsed   = 0;  // time not yet covered by updates
+  int64_t       lastTime  = esp_timer_get_time();
+  uint32_t      lastVSync = VGAController.getVSyncCount();
+
+  while (!scene->m_stopRequested) {
+
+    VGAController.waitVSync();
+
+    int64_t frameStart = esp_timer_get_time();
+    elapsed += frameStart - lastTime;
+    lastTime = frameStart;
+
+    uint32_t VSync = VGAController.getVSyncCount();
+    if (VSync - lastVSync > 1)
+      stats.missedFrames += VSync - lastVSync - 1;
+    lastVSync = VSync;
+    ++stats.frames;
+
+    // fixed timestep updates, limited to m_maxCatchUpUpdates per frame
+    int updates = 0;
+    for (; elapsed >= timeStep && updates < scene->m_maxCatchUpUpdates && !scene->m_stopRequested; ++updates) {
+      scene->m_updateCount += 1;
+      FABGLIB_TRACE(SceneUpdate, Begin, scene->m_updateCount);
+      scene->update(scene->m_updateCount);
+      FABGLIB_TRACE(SceneUpdate, End, scene->m_updateCount);
+      elapsed -= timeStep;
+    }
+    stats.updates += updates;
+    if (elapsed >= timeStep) {
+      // too late, drop remaining time
+      stats.droppedUpdates += elapsed / timeStep;
+      elapsed %= timeStep;
+    }
+    int64_t updateEnd = esp_timer_get_time();
+
+    // wait for primitives generated by updates to be on screen, before next frame
+    if (updates)
+      VGAController.primitivesExecutionWait();
+    int64_t renderEnd = esp_timer_get_time();
+
+    stats.lastUpdateTime = updateEnd - frameStart;
+    stats.maxUpdateTime  = tmax(stats.maxUpdateTime, stats.lastUpdateTime);
+    stats.lastRenderTime = renderEnd - updateEnd;
+    stats.maxRenderTime  = tmax(stats.maxRenderTime, stats.lastRenderTime);
+  }
+
+  scene->m_updateTask = NULL;
+  vTaskDelete(NULL);
+}
+
+
+void Scene::resetStats()
+{
+  memset(&m_stats, 0, sizeof(SceneStats));
+}
+
+
 void collisionDetectionCallback(void * callbackObj, Sprite * spriteA, Sprite * spriteB, Point collisionPoint)
 {
   ((Scene*)callbackObj)->collisionDetected(spriteA, spriteB, collisionPoint);
@@ -89,6 +168,12 @@ void Scene::updateSpriteAndDetectCollisions(Sprite * sprite)
 }
 
 
+void Scene::updateSpritesAndDetectCollisions()
+{
+  m_collisionDetector.updateAndDetectAllCollisions(collisionDetectionCallback, this);
+}
+
+
 
 
 } // end of namespace
@@ -32,6 +32,8 @@
 
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
 
 #include "fabglconf.h"
 #include "canvas.h"
@@ -43,6 +45,23 @@ namespace fabgl {
 
 
 
+/**
+ * @brief Scene updates counters, when Scene.setVSyncScheduler() is enabled.
+ *
+ * Use Scene.getStats() to read them and Scene.resetStats() to reset them. Times are in microseconds.
+ */
+struct SceneStats {
+  uint32_t frames;           /**< Number of frames (vertical syncs) handled */
+  uint32_t updates;          /**< Number of Scene.update() calls */
+  uint32_t missedFrames;     /**< Number of vertical syncs occurred while previous frame was still being handled */
+  uint32_t droppedUpdates;   /**< Number of updates skipped because exceeding catch-up limit */
+  uint32_t lastUpdateTime;   /**< Time spent in Scene.update() calls of last frame */
+  uint32_t maxUpdateTime;    /**< Maximum time spent in Scene.update() calls of a frame */
+  uint32_t lastRenderTime;   /**< Time spent waiting for primitives generated by last frame to be executed */
+  uint32_t maxRenderTime;    /**< Maximum time spent waiting for primitives generated by a frame to be executed */
+};
+
+
 /**
  * @brief Scene is an abstract class useful to encapsulate functionalities of a scene (sprites, collision detector and updates).
  */
@@ -96,6 +115,40 @@ public:
    */
   void stop();
 
+  /**
+   * @brief Select how Scene.update() is scheduled. Call it before Scene.start().
+   *
+   * By default Scene.update() is called by a FreeRTOS timer every updateTimeMS milliseconds (specified in Scene constructor).<br>
+   * When VSync scheduler is enabled a dedicated task wakes up at each vertical sync, calls Scene.update() once for each elapsed
+   * updateTimeMS period (fixed timestep), then waits for generated primitives to be executed. When the scene is late at most maxCatchUpUpdates
+   * updates are performed in a single frame and remaining time is dropped.<br>
+   * VSync scheduler requires background primitive execution to be enabled.
+   *
+   * @param value If true Scene.update() is synchronized with vertical sync.
+   * @param maxCatchUpUpdates Maximum number of Scene.update() calls performed in a single frame.
+   *
+   * Example:
+   *
+   *     GameScene gameScene;
+   *     gameScene.setVSyncScheduler(true);
+   *     gameScene.start();
+   */
+  void setVSyncScheduler(bool value, int maxCatchUpUpdates = 4) { m_VSyncScheduler = value; m_maxCatchUpUpdates = maxCatchUpUpdates; }
+
+  /**
+   * @brief Return updates timing and missed frames counters.
+   *
+   * Counters are updated only when VSync scheduler is enabled (see Scene.setVSyncScheduler()).
+   *
+   * @return Reference to scene counters.
+   */
+  SceneStats const & getStats() { return m_stats; }
+
+  /**
+   * @brief Reset updates timing and missed frames counters.
+   */
+  void resetStats();
+
   /**
    * @brief This is an abstract method called when the scene needs to be initialized.
    */
@@ -158,17 +211,34 @@ public:
    */
   void updateSpriteAndDetectCollisions(Sprite * sprite);
 
+  /**
+   * @brief Update collision detector for all sprites and generate collision events.
+   *
+   * Use it (once per update) instead of calling Scene.updateSpriteAndDetectCollisions() for each sprite when most sprites move at every update.<br>
+   * Scene.collisionDetected() is called once for each colliding pair, spriteA and spriteB are in no specific order.
+   */
+  void updateSpritesAndDetectCollisions();
+
 private:
 
   static void updateTimerFunc(TimerHandle_t xTimer);
+  static void updateTask(void * arg);
 
 
   int               m_width;
   int               m_height;
 
+  int               m_updateTimeMS;
   TimerHandle_t     m_updateTimer;
   int               m_updateCount;
 
+  // VSync scheduler
+  bool              m_VSyncScheduler;
+  int               m_maxCatchUpUpdates;
+  TaskHandle_t      m_updateTask;
+  volatile bool     m_stopRequested;
+  SceneStats        m_stats;
+
   CollisionDetector m_collisionDetector;
 
   TaskHandle_t      m_suspendedTask;
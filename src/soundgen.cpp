@@ -0,0 +1,495 @@
+/*
+  Created by Fabrizio Di Vittorio (fdivitto2013@gmail.com) - <http://www.fabgl.com>
+  Copyright (c) 2019 Fabrizio Di Vittorio.
+  All rights reserved.
+
+  This file is part of FabGL Library.
+
+  FabGL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  FabGL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with FabGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "soc/i2s_struct.h"
+#include "soc/i2s_reg.h"
+#include "driver/periph_ctrl.h"
+#include "driver/dac.h"
+#include "rom/lldesc.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+
+#include "fabutils.h"
+#include "soundgen.h"
+
+
+
+fabgl::SoundGeneratorClass SoundGenerator;
+
+
+namespace fabgl {
+
+
+// envelope and stop requests are handled every SOUND_ENVELOPE_STEP samples
+#define SOUND_ENVELOPE_STEP 32
+
+// maximum envelope level (16.16 fixed point)
+#define SOUND_LEVEL_MAX (255 << 16)
+
+
+static portMUX_TYPE s_voicesMux = portMUX_INITIALIZER_UNLOCKED;
+
+
+
+/*************************************************************************************/
+/* SoundGeneratorClass definitions */
+
+
+void SoundGeneratorClass::begin(gpio_num_t gpio, int sampleRate)
+{
+  m_sampleRate   = sampleRate;
+  m_masterVolume = 127;
+
+  for (int i = 0; i < FABGLIB_SOUND_VOICES; ++i) {
+    m_voices[i].stage   = SoundVoiceIdle;
+    m_voices[i].request = SoundVoiceNoRequest;
+  }
+
+  #if FABGLIB_HAS_SOUND_STATS
+  resetStats();
+  #endif
+
+  // two buffers connected as a ring: the mixer fills one while DMA plays the other
+  m_DMABuffers = (lldesc_t volatile *) heap_caps_malloc(2 * sizeof(lldesc_t), MALLOC_CAP_DMA);
+  for (int i = 0; i < 2; ++i) {
+    m_DMAData[i] = (uint32_t *) heap_caps_malloc(FABGLIB_SOUND_BUFFER_SAMPLES * sizeof(uint32_t), MALLOC_CAP_DMA);
+    for (int j = 0; j < FABGLIB_SOUND_BUFFER_SAMPLES; ++j)
+      m_DMAData[i][j] = 0x80008000; // silence on both channels
+    m_DMABuffers[i].eof    = 1;  // generates I2SInterrupt() when played
+    m_DMABuffers[i].sosf   = 0;
+    m_DMABuffers[i].owner  = 1;
+    m_DMABuffers[i].qe.stqe_next = (lldesc_t *) &m_DMABuffers[i ^ 1];
+    m_DMABuffers[i].offset = 0;
+    m_DMABuffers[i].size   = FABGLIB_SOUND_BUFFER_SAMPLES * sizeof(uint32_t);
+    m_DMABuffers[i].length = FABGLIB_SOUND_BUFFER_SAMPLES * sizeof(uint32_t);
+    m_DMABuffers[i].buf    = (uint8_t *) m_DMAData[i];
+  }
+  m_playedBuffer = &m_DMABuffers[0];
+
+  xTaskCreatePinnedToCore(&mixerTask, "", FABGLIB_SOUND_TASK_STACK_SIZE, this, FABGLIB_SOUND_TASK_PRIORITY, &m_mixerTask, FABGLIB_SOUND_TASK_CORE);
+
+  // Power on device
+  periph_module_enable(PERIPH_I2S0_MODULE);
+
+  // Initialize I2S device
+  I2S0.conf.tx_reset = 1;
+  I2S0.conf.tx_reset = 0;
+
+  // Reset DMA
+  I2S0.lc_conf.out_rst = 1;
+  I2S0.lc_conf.out_rst = 0;
+
+  // Reset FIFO
+  I2S0.conf.tx_fifo_reset = 1;
+  I2S0.conf.tx_fifo_reset = 0;
+
+  // built-in DAC mode (LCD mode, 16 bits per channel, the upper 8 bits go to the DAC)
+  I2S0.conf2.val        = 0;
+  I2S0.conf2.lcd_en     = 1;
+  I2S0.conf2.camera_en  = 0;
+
+  I2S0.sample_rate_conf.val         = 0;
+  I2S0.sample_rate_conf.tx_bits_mod = 16;
+
+  setupClock(sampleRate);
+
+  I2S0.fifo_conf.val                  = 0;
+  I2S0.fifo_conf.tx_fifo_mod_force_en = 1;
+  I2S0.fifo_conf.tx_fifo_mod          = 0;  // 16 bits dual channel
+  I2S0.fifo_conf.tx_data_num          = 32;
+  I2S0.fifo_conf.dscr_en              = 1;
+
+  I2S0.conf1.val           = 0;
+  I2S0.conf1.tx_stop_en    = 0;
+  I2S0.conf1.tx_pcm_bypass = 1;
+
+  I2S0.conf_chan.val         = 0;
+  I2S0.conf_chan.tx_chan_mod = 0;
+
+  I2S0.conf.tx_right_first = 1;
+
+  I2S0.timing.val = 0;
+
+  // Reset AHB interface of DMA
+  I2S0.lc_conf.ahbm_rst      = 1;
+  I2S0.lc_conf.ahbm_fifo_rst = 1;
+  I2S0.lc_conf.ahbm_rst      = 0;
+  I2S0.lc_conf.ahbm_fifo_rst = 0;
+
+  // same sample is sent to both channels, enable just the DAC connected to the required GPIO
+  dac_output_enable(gpio == GPIO_NUM_26 ? DAC_CHANNEL_2 : DAC_CHANNEL_1);
+  dac_i2s_enable();
+
+  // level 1 interrupt, doesn't delay VGA interrupts
+  esp_intr_alloc(ETS_I2S0_INTR_SOURCE, ESP_INTR_FLAG_LEVEL1 | ESP_INTR_FLAG_IRAM, I2SInterrupt, this, &m_I2SInterruptHandle);
+  I2S0.int_clr.val     = 0xFFFFFFFF;
+  I2S0.int_ena.out_eof = 1;
+
+  // Start DMA
+  I2S0.lc_conf.val    = I2S_OUT_DATA_BURST_EN | I2S_OUTDSCR_BURST_EN;
+  I2S0.out_link.addr  = (uint32_t) &m_DMABuffers[0];
+  I2S0.out_link.start = 1;
+  I2S0.conf.tx_start  = 1;
+
+  m_started = true;
+}
+
+
+void SoundGeneratorClass::end()
+{
+  if (m_started) {
+    I2S0.conf.tx_start   = 0;
+    I2S0.out_link.stop   = 1;
+    I2S0.int_ena.out_eof = 0;
+    esp_intr_free(m_I2SInterruptHandle);
+
+    dac_i2s_disable();
+    periph_module_disable(PERIPH_I2S0_MODULE);
+
+    vTaskDelete(m_mixerTask);
+
+    for (int i = 0; i < 2; ++i)
+      heap_caps_free(m_DMAData[i]);
+    heap_caps_free((void *) m_DMABuffers);
+
+    m_started = false;
+  }
+}
+
+
+// uses PLL_D2_CLK (160MHz), APLL is used by VGAController
+// DAC mode uses BCK as sample clock: BCK = 2 * sampleRate, MCLK = 60 * BCK
+void SoundGeneratorClass::setupClock(int sampleRate)
+{
+  double div = 160000000.0 / ((double) sampleRate * 2 * 60);
+  int idiv = tclamp((int) div, 2, 255);
+
+  I2S0.clkm_conf.val          = 0;
+  I2S0.clkm_conf.clkm_div_num = idiv;
+  I2S0.clkm_conf.clkm_div_a   = 63;
+  I2S0.clkm_conf.clkm_div_b   = tclamp((int) ((div - idiv) * 63), 0, 62);
+  I2S0.clkm_conf.clka_en      = 0;
+
+  I2S0.sample_rate_conf.tx_bck_div_num = 60;
+}
+
+
+// returns -1 if there isn't a free voice
+// must be called inside s_voicesMux critical section
+int SoundGeneratorClass::findFreeVoice()
+{
+  for (int i = 0; i < FABGLIB_SOUND_VOICES; ++i)
+    if (m_voices[i].stage == SoundVoiceIdle)
+      return i;
+  return -1;
+}
+
+
+// calculates envelope increments and starts the voice
+// must be called inside s_voicesMux critical section, after other voice fields have been set
+void SoundGeneratorClass::startVoice(int voice, SoundEnvelope const * envelope)
+{
+  SoundVoice * v = &m_voices[voice];
+
+  // envelope steps (SOUND_ENVELOPE_STEP samples each) from milliseconds
+  const int stepsPerSec = m_sampleRate / SOUND_ENVELOPE_STEP;
+  SoundEnvelope env = envelope ? *envelope : (SoundEnvelope) { 0, 0, 255, 0 };
+  v->level        = 0;
+  v->attackInc    = SOUND_LEVEL_MAX / tmax(1, env.attackMS * stepsPerSec / 1000);
+  v->decayDec     = SOUND_LEVEL_MAX / tmax(1, env.decayMS * stepsPerSec / 1000);
+  v->releaseDec   = SOUND_LEVEL_MAX / tmax(1, env.releaseMS * stepsPerSec / 1000);
+  v->sustainLevel = env.sustainLevel << 16;
+  v->request      = SoundVoiceNoRequest;
+
+  // the mixer task (maybe running on the other core) must see all fields before the voice becomes active
+  __sync_synchronize();
+  v->stage = SoundVoiceAttack;
+}
+
+
+int SoundGeneratorClass::playSound(Waveform waveform, int frequency, int durationMS, int volume, SoundEnvelope const * envelope)
+{
+  if (waveform == SampledWaveform)
+    return -1;
+  portENTER_CRITICAL(&s_voicesMux);
+  int voice = findFreeVoice();
+  if (voice > -1) {
+    SoundVoice * v = &m_voices[voice];
+    v->waveform  = waveform;
+    v->volume    = tclamp(volume, 0, 127);
+    v->loop      = false;
+    v->phase     = 0;
+    v->phaseInc  = (uint32_t) (((uint64_t) frequency << 32) / m_sampleRate);
+    v->remaining = durationMS < 0 ? -1 : (int32_t) ((int64_t) durationMS * m_sampleRate / 1000);
+    v->samples   = NULL;
+    v->noise     = 0xACE1;
+    startVoice(voice, envelope);
+  }
+  portEXIT_CRITICAL(&s_voicesMux);
+  return voice;
+}
+
+
+int SoundGeneratorClass::playSamples(int8_t const * samples, int length, int sampleRate, int volume, bool loop, SoundEnvelope const * envelope)
+{
+  portENTER_CRITICAL(&s_voicesMux);
+  int voice = findFreeVoice();
+  if (voice > -1) {
+    SoundVoice * v = &m_voices[voice];
+    v->waveform   = SampledWaveform;
+    v->volume     = tclamp(volume, 0, 127);
+    v->loop       = loop;
+    v->phase      = 0;
+    v->phaseInc   = (uint32_t) sampleRate * 256 / m_sampleRate;
+    v->remaining  = -1;
+    v->samples    = samples;
+    v->samplesEnd = (uint32_t) length << 8;
+    startVoice(voice, envelope);
+  }
+  portEXIT_CRITICAL(&s_voicesMux);
+  return voice;
+}
+
+
+void SoundGeneratorClass::setFrequency(int voice, int frequency)
+{
+  SoundVoice * v = &m_voices[voice];
+  if (v->waveform == SampledWaveform)
+    v->phaseInc = (uint32_t) frequency * 256 / m_sampleRate;
+  else
+    v->phaseInc = (uint32_t) (((uint64_t) frequency << 32) / m_sampleRate);
+}
+
+
+void SoundGeneratorClass::setVolume(int voice, int volume)
+{
+  m_voices[voice].volume = tclamp(volume, 0, 127);
+}
+
+
+void SoundGeneratorClass::stopVoice(int voice)
+{
+  if (m_voices[voice].stage != SoundVoiceIdle)
+    m_voices[voice].request = SoundVoiceReleaseRequest;
+}
+
+
+void SoundGeneratorClass::stopAll()
+{
+  for (int i = 0; i < FABGLIB_SOUND_VOICES; ++i)
+    if (m_voices[i].stage != SoundVoiceIdle)
+      m_voices[i].request = SoundVoiceStopRequest;
+}
+
+
+// fills "buffer" (FABGLIB_SOUND_BUFFER_SAMPLES stereo samples) mixing all active voices
+void SoundGeneratorClass::mixBuffer(uint32_t * buffer)
+{
+  int16_t mix[FABGLIB_SOUND_BUFFER_SAMPLES];
+  memset(mix, 0, sizeof(mix));
+
+  #if FABGLIB_HAS_SOUND_STATS
+  uint32_t activeVoices = 0;
+  #endif
+
+  for (int i = 0; i < FABGLIB_SOUND_VOICES; ++i) {
+    SoundVoice * v = &m_voices[i];
+    if (v->stage == SoundVoiceIdle)
+      continue;
+
+    #if FABGLIB_HAS_SOUND_STATS
+    ++activeVoices;
+    #endif
+
+    for (int pos = 0; pos < FABGLIB_SOUND_BUFFER_SAMPLES && v->stage != SoundVoiceIdle; pos += SOUND_ENVELOPE_STEP) {
+
+      // application requests
+      if (v->request != SoundVoiceNoRequest) {
+        if (v->request == SoundVoiceStopRequest) {
+          v->request = SoundVoiceNoRequest;
+          v->stage   = SoundVoiceIdle;
+          break;
+        }
+        v->request = SoundVoiceNoRequest;
+        v->stage   = SoundVoiceRelease;
+      }
+
+      // duration
+      if (v->remaining >= 0) {
+        v->remaining -= SOUND_ENVELOPE_STEP;
+        if (v->remaining <= 0 && v->stage != SoundVoiceRelease) {
+          v->remaining = -1;
+          v->stage     = SoundVoiceRelease;
+        }
+      }
+
+      // envelope
+      switch (v->stage) {
+        case SoundVoiceAttack:
+          v->level += v->attackInc;
+          if (v->level >= SOUND_LEVEL_MAX) {
+            v->level = SOUND_LEVEL_MAX;
+            v->stage = SoundVoiceDecay;
+          }
+          break;
+        case SoundVoiceDecay:
+          if (v->level > v->sustainLevel + v->decayDec)
+            v->level -= v->decayDec;
+          else {
+            v->level = v->sustainLevel;
+            v->stage = SoundVoiceSustain;
+          }
+          break;
+        case SoundVoiceRelease:
+          if (v->level > v->releaseDec)
+            v->level -= v->releaseDec;
+          else {
+            v->level = 0;
+            v->stage = SoundVoiceIdle;
+          }
+          break;
+        default:
+          break;
+      }
+
+      // 0..253
+      const int gain = (v->volume * (v->level >> 16)) >> 7;
+      int16_t * dest = mix + pos;
+      uint32_t phase = v->phase;
+      const uint32_t phaseInc = v->phaseInc;
+
+      switch (v->waveform) {
+
+        case SquareWaveform:
+          for (int j = 0; j < SOUND_ENVELOPE_STEP; ++j, phase += phaseInc)
+            dest[j] += ((phase & 0x80000000) ? 127 : -127) * gain >> 8;
+          break;
+
+        case TriangleWaveform:
+          for (int j = 0; j < SOUND_ENVELOPE_STEP; ++j, phase += phaseInc) {
+            int p = phase >> 23;
+            dest[j] += (p < 256 ? p - 128 : 383 - p) * gain >> 8;
+          }
+          break;
+
+        case SawtoothWaveform:
+          for (int j = 0; j < SOUND_ENVELOPE_STEP; ++j, phase += phaseInc)
+            dest[j] += ((int) (phase >> 24) - 128) * gain >> 8;
+          break;
+
+        case NoiseWaveform:
+        {
+          uint16_t noise = v->noise;
+          for (int j = 0; j < SOUND_ENVELOPE_STEP; ++j) {
+            uint32_t prev = phase;
+            phase += phaseInc;
+            if (phase < prev)
+              noise = (noise >> 1) ^ (-(noise & 1) & 0xB400);  // 16 bit Galois LFSR
+            dest[j] += (int8_t) noise * gain >> 8;
+          }
+          v->noise = noise;
+          break;
+        }
+
+        case SampledWaveform:
+          for (int j = 0; j < SOUND_ENVELOPE_STEP; ++j, phase += phaseInc) {
+            if (phase >= v->samplesEnd) {
+              if (!v->loop) {
+                v->stage = SoundVoiceIdle;
+                break;
+              }
+              phase -= v->samplesEnd;
+            }
+            dest[j] += v->samples[phase >> 8] * gain >> 8;
+          }
+          break;
+
+      }
+
+      v->phase = phase;
+    }
+  }
+
+  // master volume and conversion to DAC format (same unsigned sample in the upper 8 bits of both channels)
+  const int masterVolume = m_masterVolume;
+  for (int i = 0; i < FABGLIB_SOUND_BUFFER_SAMPLES; ++i) {
+    uint32_t s = (uint32_t) (tclamp((mix[i] * masterVolume) >> 7, -128, 127) + 128) << 8;
+    buffer[i] = s | (s << 16);
+  }
+
+  #if FABGLIB_HAS_SOUND_STATS
+  m_stats.maxVoices = tmax(m_stats.maxVoices, activeVoices);
+  #endif
+}
+
+
+void SoundGeneratorClass::mixerTask(void * arg)
+{
+  SoundGeneratorClass * gen = (SoundGeneratorClass *) arg;
+
+  while (true) {
+    // wait for DMA to complete a buffer. More than one notification means the buffer has been played again (underrun)
+    #if FABGLIB_HAS_SOUND_STATS
+    uint32_t played = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    int64_t startTime = esp_timer_get_time();
+    #else
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    #endif
+
+    gen->mixBuffer((uint32_t *) gen->m_playedBuffer->buf);
+
+    #if FABGLIB_HAS_SOUND_STATS
+    uint32_t mixTime = esp_timer_get_time() - startTime;
+    gen->m_stats.buffersMixed += 1;
+    gen->m_stats.underruns    += played - 1;
+    gen->m_stats.mixTime      += mixTime;
+    gen->m_stats.maxMixTime    = tmax(gen->m_stats.maxMixTime, mixTime);
+    #endif
+  }
+}
+
+
+// invoked at the end of each DMA buffer: wakes the mixer task to fill it again while the other buffer is playing
+void IRAM_ATTR SoundGeneratorClass::I2SInterrupt(void * arg)
+{
+  SoundGeneratorClass * gen = (SoundGeneratorClass *) arg;
+
+  if (I2S0.int_st.out_eof) {
+    gen->m_playedBuffer = (lldesc_t volatile *) (uintptr_t) I2S0.out_eof_des_addr;
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+    vTaskNotifyGiveFromISR(gen->m_mixerTask, &higherPriorityTaskWoken);
+    if (higherPriorityTaskWoken)
+      portYIELD_FROM_ISR();
+  }
+
+  I2S0.int_clr.val = I2S0.int_st.val;
+}
+
+
+
+} // end of namespace
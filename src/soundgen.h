@@ -0,0 +1,319 @@
+/*
+  Created by Fabrizio Di Vittorio (fdivitto2013@gmail.com) - <http://www.fabgl.com>
+  Copyright (c) 2019 Fabrizio Di Vittorio.
+  All rights reserved.
+
+  This file is part of FabGL Library.
+
+  FabGL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  FabGL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with FabGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+
+#ifndef _SOUNDGEN_H_INCLUDED
+#define _SOUNDGEN_H_INCLUDED
+
+
+/**
+ * @file
+ *
+ * @brief This file contains fabgl::SoundGeneratorClass definition and the SoundGenerator instance.
+ */
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "rom/lldesc.h"
+#include "driver/gpio.h"
+#include "esp_intr_alloc.h"
+
+#include "fabglconf.h"
+
+
+
+
+
+namespace fabgl {
+
+
+
+/** @brief Represents the waveform of a sound generator voice. */
+enum Waveform {
+  SquareWaveform,    /**< Square wave, 50% duty cycle */
+  TriangleWaveform,  /**< Triangle wave */
+  SawtoothWaveform,  /**< Sawtooth wave */
+  NoiseWaveform,     /**< White noise, the frequency specifies how often a new random value is generated */
+  SampledWaveform,   /**< 8 bit signed samples provided by the application */
+};
+
+
+/**
+ * @brief Specifies the volume envelope of a voice (attack, decay, sustain, release).
+ *
+ * The volume goes from 0 to the voice volume in attackMS milliseconds, then goes down to sustainLevel
+ * in decayMS milliseconds. It remains at sustainLevel until the duration expires or the voice is stopped, then
+ * goes to 0 in releaseMS milliseconds.
+ */
+struct SoundEnvelope {
+  uint16_t attackMS;      /**< Attack time in milliseconds */
+  uint16_t decayMS;       /**< Decay time in milliseconds */
+  uint8_t  sustainLevel;  /**< Sustain level, from 0 (silence) to 255 (voice volume) */
+  uint16_t releaseMS;     /**< Release time in milliseconds */
+};
+
+
+#if FABGLIB_HAS_SOUND_STATS
+/**
+ * @brief Sound mixer counters.
+ *
+ * Use SoundGenerator.getStats() to read them and SoundGenerator.resetStats() to reset them.<br>
+ * The CPU share of the mixer is mixTime / (buffersMixed * FABGLIB_SOUND_BUFFER_SAMPLES / sample rate).
+ */
+struct SoundGeneratorStats {
+  uint32_t buffersMixed;  /**< Number of DMA buffers filled by the mixer task */
+  uint32_t underruns;     /**< Number of DMA buffers played again because the mixer task was late */
+  uint32_t maxVoices;     /**< Maximum number of voices mixed in the same buffer */
+  int64_t  mixTime;       /**< Total mixing time, in microseconds */
+  uint32_t maxMixTime;    /**< Maximum time required to fill a buffer, in microseconds */
+};
+#endif
+
+
+// voice envelope stage
+enum SoundVoiceStage {
+  SoundVoiceIdle,
+  SoundVoiceAttack,
+  SoundVoiceDecay,
+  SoundVoiceSustain,
+  SoundVoiceRelease,
+};
+
+
+// requests from application to the mixer task
+enum SoundVoiceRequest {
+  SoundVoiceNoRequest,
+  SoundVoiceReleaseRequest,
+  SoundVoiceStopRequest,
+};
+
+
+struct SoundVoice {
+  volatile SoundVoiceStage stage;
+  uint8_t            waveform;       // Waveform
+  uint8_t            volume;         // 0..127
+  bool               loop;           // SampledWaveform: restart at the end of samples
+  volatile uint8_t   request;        // SoundVoiceRequest, set by stopVoice() and stopAll(), handled by the mixer task
+  uint32_t           phase;          // 32 bit phase accumulator (SampledWaveform: 24.8 samples position)
+  uint32_t           phaseInc;
+  uint32_t           level;          // envelope level, 16.16 fixed point, 0..255
+  uint32_t           attackInc;
+  uint32_t           decayDec;
+  uint32_t           sustainLevel;
+  uint32_t           releaseDec;
+  int32_t            remaining;      // samples before release, -1 = until stopVoice()
+  int8_t const *     samples;
+  uint32_t           samplesEnd;     // samples length, 24.8 fixed point
+  uint16_t           noise;          // NoiseWaveform: LFSR state
+};
+
+
+
+/**
+ * @brief Multi-voice sound generator, mixes voices and streams them to the internal DAC using I2S0 DMA.
+ *
+ * Samples are streamed from two DMA descriptors connected as a ring. When a descriptor has been played the I2S EOF
+ * interrupt wakes the mixer task that fills it again while the other one is playing, so the CPU time required by audio is
+ * proportional to the sample rate and to the number of active voices, and never runs in the interrupt (VSync and line buffers
+ * interrupts are not delayed).<br>
+ * I2S1 is used by VGAController, so SoundGenerator uses I2S0, configured like SquareWaveGeneratorClass configures I2S1, in
+ * built-in DAC mode. Output is 8 bit PCM on GPIO25 (DAC1) or GPIO26 (DAC2).
+ *
+ * Example:
+ *
+ *     SoundGenerator.begin();
+ *     // a 440Hz triangle wave for half second
+ *     SoundGenerator.playSound(fabgl::TriangleWaveform, 440, 500);
+ *     // an explosion
+ *     SoundEnvelope env = { 0, 300, 0, 0 };
+ *     SoundGenerator.playSound(fabgl::NoiseWaveform, 4000, 300, 127, &env);
+ */
+class SoundGeneratorClass {
+
+public:
+
+  /**
+   * @brief Initialize the sound generator, allocate DMA buffers and start the mixer task.
+   *
+   * @param gpio Output GPIO. Can be GPIO_NUM_25 (DAC1) or GPIO_NUM_26 (DAC2).
+   * @param sampleRate Sample rate in Hertz.
+   *
+   * Example:
+   *
+   *     SoundGenerator.begin(GPIO_NUM_25, 16000);
+   */
+  void begin(gpio_num_t gpio = GPIO_NUM_25, int sampleRate = FABGLIB_SOUND_SAMPLE_RATE);
+
+  /**
+   * @brief Stop all voices, the mixer task and the DMA, and free buffers.
+   */
+  void end();
+
+  /**
+   * @brief Play a sound using a free voice.
+   *
+   * @param waveform Voice waveform (SampledWaveform is not allowed, use playSamples() instead).
+   * @param frequency Frequency in Hertz.
+   * @param durationMS Sound duration in milliseconds (release time excluded). -1 plays the sound until stopVoice() is called.
+   * @param volume Voice volume, from 0 to 127.
+   * @param envelope Optional volume envelope. If NULL the sound starts and ends immediately.
+   *
+   * @return The voice index, or -1 if there aren't free voices.
+   *
+   * Example:
+   *
+   *     // beep
+   *     SoundGenerator.playSound(fabgl::SquareWaveform, 1000, 100);
+   */
+  int playSound(Waveform waveform, int frequency, int durationMS, int volume = 127, SoundEnvelope const * envelope = NULL);
+
+  /**
+   * @brief Play 8 bit signed samples using a free voice.
+   *
+   * Samples are not copied, so the buffer must remain valid while playing.
+   *
+   * @param samples Signed 8 bit samples.
+   * @param length Number of samples.
+   * @param sampleRate Sample rate of samples, in Hertz.
+   * @param volume Voice volume, from 0 to 127.
+   * @param loop If true samples are repeated until stopVoice() is called.
+   * @param envelope Optional volume envelope.
+   *
+   * @return The voice index, or -1 if there aren't free voices.
+   */
+  int playSamples(int8_t const * samples, int length, int sampleRate, int volume = 127, bool loop = false, SoundEnvelope const * envelope = NULL);
+
+  /**
+   * @brief Change the frequency of a playing voice.
+   *
+   * @param voice Voice index, as returned by playSound() or playSamples().
+   * @param frequency New frequency in Hertz. For voices started with playSamples() this is the new samples rate.
+   */
+  void setFrequency(int voice, int frequency);
+
+  /**
+   * @brief Change the volume of a playing voice.
+   *
+   * @param voice Voice index, as returned by playSound() or playSamples().
+   * @param volume New volume, from 0 to 127.
+   */
+  void setVolume(int voice, int volume);
+
+  /**
+   * @brief Stop a voice, starting its release stage.
+   *
+   * @param voice Voice index, as returned by playSound() or playSamples().
+   */
+  void stopVoice(int voice);
+
+  /**
+   * @brief Immediately silence all voices.
+   */
+  void stopAll();
+
+  /**
+   * @brief Determine whether a voice is still playing (release stage included).
+   *
+   * @param voice Voice index, as returned by playSound() or playSamples().
+   *
+   * @return True if the voice is playing.
+   */
+  bool isPlaying(int voice) { return m_voices[voice].stage != SoundVoiceIdle; }
+
+  /**
+   * @brief Set the master volume.
+   *
+   * @param volume Master volume, from 0 to 127 (default).
+   */
+  void setMasterVolume(int volume) { m_masterVolume = volume; }
+
+  /**
+   * @brief Get the sample rate specified in begin().
+   *
+   * @return Sample rate in Hertz.
+   */
+  int getSampleRate() { return m_sampleRate; }
+
+#if FABGLIB_HAS_SOUND_STATS
+  /**
+   * @brief Get mixer counters.
+   *
+   * @return Reference to mixer counters.
+   *
+   * Example:
+   *
+   *     SoundGeneratorStats const & stats = SoundGenerator.getStats();
+   *     Serial.printf("buffers = %d, underruns = %d, max mix time = %d us\n", stats.buffersMixed, stats.underruns, stats.maxMixTime);
+   */
+  SoundGeneratorStats const & getStats() { return m_stats; }
+
+  /**
+   * @brief Reset mixer counters.
+   */
+  void resetStats() { memset(&m_stats, 0, sizeof(SoundGeneratorStats)); }
+#endif
+
+private:
+
+  void setupClock(int sampleRate);
+  void startVoice(int voice, SoundEnvelope const * envelope);
+  int findFreeVoice();
+  void mixBuffer(uint32_t * buffer);
+
+  static void mixerTask(void * arg);
+  static void I2SInterrupt(void * arg);
+
+  SoundVoice           m_voices[FABGLIB_SOUND_VOICES];
+  int                  m_sampleRate;
+  volatile int         m_masterVolume;
+  bool                 m_started;
+  lldesc_t volatile *  m_DMABuffers;
+  uint32_t *           m_DMAData[2];
+  lldesc_t volatile *  m_playedBuffer;   // last descriptor completed by DMA, set by I2SInterrupt()
+  TaskHandle_t         m_mixerTask;
+  intr_handle_t        m_I2SInterruptHandle;
+
+  #if FABGLIB_HAS_SOUND_STATS
+  SoundGeneratorStats  m_stats;
+  #endif
+};
+
+
+
+
+
+} // end of namespace
+
+
+
+
+extern fabgl::SoundGeneratorClass SoundGenerator;
+
+
+#endif
+
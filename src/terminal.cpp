@@ -26,7 +26,12 @@
 #include "freertos/task.h"
 #include "freertos/timers.h"
 
+#include "esp_timer.h"
+#include "soc/soc_memory_layout.h"
+#include "lwip/sockets.h"
+
 #include "fabutils.h"
+#include "fabtrace.h"
 #include "terminal.h"
 
 
@@ -62,8 +67,19 @@ const char OSC_8BIT[] = "\x9D";
 #define ISCTRLCHAR(c) ((c) <= ASCII_US || (c) == ASCII_DEL)
 
 
+#define INPUTRING_MASK (FABGLIB_TERMINAL_INPUT_QUEUE_SIZE - 1)
+
+
+// maximum number of bytes read at once from serial port
+#define SERIALPORT_READ_CHUNK 128
+
+
+// maximum number of printable characters mapped by printChars() before setChars() call
+#define PRINTABLE_RUN_MAX 64
+
+
 // Map "DEC Special Graphics Character Set" to CP437
-static const uint8_t DECGRAPH_TO_CP437[255] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,
+static const uint8_t DECGRAPH_TO_CP437[256] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,
                                                26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49,
                                                50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 65, 66, 67, 68, 69, 70, 71, 72, 73,
                                                74, 75, 76, 77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 88, 89, 90, 91, 92, 93, 94,
@@ -80,6 +96,76 @@ const char * CTRLCHAR_TO_STR[] = {"NUL", "SOH", "STX", "ETX", "EOT", "ENQ", "ACK
                                   "XOFF", "DC4", "NAK", "SYN", "ETB", "CAN", "EM", "SUB", "ESC", "FS", "GS", "RS", "US", "SPC"};
 
 
+// how ANSIKeyDef.code is sent
+enum ANSIKeyEncoding {
+  ANSIKey_None,       // not a special key
+  ANSIKey_CSI,        // CSI + code
+  ANSIKey_SS3,        // SS3 + code
+  ANSIKey_CursorKey,  // SS3 (cursor keys mode) or CSI, + code (see sendCursorKeyCode())
+  ANSIKey_KeypadKey,  // SS3 + applicationCode (application keypad mode) or CSI + code (see sendKeypadCursorKeyCode())
+};
+
+
+struct ANSIKeyDef {
+  uint8_t      encoding;         // ANSIKeyEncoding
+  char         applicationCode;
+  char const * code;
+};
+
+
+// escape sequences of cursor, editing and function keys, indexed by virtualkey (see buildANSIKeysTable())
+static ANSIKeyDef ANSIKeysTable[VK_LAST];
+
+
+static void buildANSIKeysTable()
+{
+  static const struct { VirtualKey vk; ANSIKeyDef def; } KEYS[] = {
+    // cursor keys
+    { VK_UP,          { ANSIKey_CursorKey,  0, "A" } },
+    { VK_DOWN,        { ANSIKey_CursorKey,  0, "B" } },
+    { VK_RIGHT,       { ANSIKey_CursorKey,  0, "C" } },
+    { VK_LEFT,        { ANSIKey_CursorKey,  0, "D" } },
+    // cursor keys - on numeric keypad
+    { VK_KP_UP,       { ANSIKey_KeypadKey, 'x', "A" } },
+    { VK_KP_DOWN,     { ANSIKey_KeypadKey, 'r', "B" } },
+    { VK_KP_RIGHT,    { ANSIKey_KeypadKey, 'v', "C" } },
+    { VK_KP_LEFT,     { ANSIKey_KeypadKey, 't', "D" } },
+    // PageUp, PageDown, Insert, Home, Delete, End
+    { VK_PAGEUP,      { ANSIKey_CSI,        0, "5~" } },
+    { VK_PAGEDOWN,    { ANSIKey_CSI,        0, "6~" } },
+    { VK_INSERT,      { ANSIKey_CSI,        0, "2~" } },
+    { VK_HOME,        { ANSIKey_CSI,        0, "1~" } },
+    { VK_DELETE,      { ANSIKey_CSI,        0, "3~" } },
+    { VK_END,         { ANSIKey_CSI,        0, "4~" } },
+    // PageUp, PageDown, Insert, Home, Delete, End - on numeric keypad
+    { VK_KP_PAGEUP,   { ANSIKey_KeypadKey, 'y', "5~" } },
+    { VK_KP_PAGEDOWN, { ANSIKey_KeypadKey, 's', "6~" } },
+    { VK_KP_INSERT,   { ANSIKey_KeypadKey, 'p', "2~" } },
+    { VK_KP_HOME,     { ANSIKey_KeypadKey, 'w', "1~" } },
+    { VK_KP_DELETE,   { ANSIKey_KeypadKey, 'n', "3~" } },
+    { VK_KP_END,      { ANSIKey_KeypadKey, 'q', "4~" } },
+    // function keys
+    { VK_F1,          { ANSIKey_SS3,        0, "P" } },
+    { VK_F2,          { ANSIKey_SS3,        0, "Q" } },
+    { VK_F3,          { ANSIKey_SS3,        0, "R" } },
+    { VK_F4,          { ANSIKey_SS3,        0, "S" } },
+    { VK_F5,          { ANSIKey_CSI,        0, "15~" } },
+    { VK_F6,          { ANSIKey_CSI,        0, "17~" } },
+    { VK_F7,          { ANSIKey_CSI,        0, "18~" } },
+    { VK_F8,          { ANSIKey_CSI,        0, "19~" } },
+    { VK_F9,          { ANSIKey_CSI,        0, "20~" } },
+    { VK_F10,         { ANSIKey_CSI,        0, "21~" } },
+    { VK_F11,         { ANSIKey_CSI,        0, "23~" } },
+    { VK_F12,         { ANSIKey_CSI,        0, "24~" } },
+  };
+  if (ANSIKeysTable[VK_UP].encoding != ANSIKey_None)
+    return; // already built
+  for (auto const & key : KEYS)
+    ANSIKeysTable[key.vk] = key.def;
+}
+
+
+
 
 void TerminalClass::begin()
 {
@@ -87,8 +173,25 @@ void TerminalClass::begin()
 
   m_glyphsBuffer = (GlyphsBuffer){0, 0, NULL, 0, 0, NULL};
 
+  m_lazyRendering = false;
+  m_dirtyCells    = NULL;
+  m_dirtyPending  = false;
+  m_lazyFence     = 0;
+
+  m_scrollbackData       = NULL;
+  m_scrollbackIndex      = NULL;
+  m_scrollbackLinesCount = 0;
+  m_scrollbackOffset     = 0;
+  m_scrollbackView.map   = NULL;
+  m_scrollbackFence      = 0;
+
   m_emuState.tabStop = NULL;
   m_font.data = NULL;
+  m_rowsInfo = NULL;
+  m_alternateRowsInfo = NULL;
+  m_fontCache = NULL;
+
+  buildANSIKeysTable();
 
   set132ColumnMode(false);
 
@@ -113,8 +216,12 @@ void TerminalClass::begin()
   m_blinkTimer = xTimerCreate("", pdMS_TO_TICKS(FABGLIB_DEFAULT_BLINK_PERIOD_MS), pdTRUE, this, blinkTimerFunc);
   xTimerStart(m_blinkTimer, portMAX_DELAY);
 
-  // queue and task to consume input characters
-  m_inputQueue = xQueueCreate(FABGLIB_TERMINAL_INPUT_QUEUE_SIZE, sizeof(uint8_t));
+  // ring and task to consume input characters
+  m_inputRing = (uint8_t*) malloc(FABGLIB_TERMINAL_INPUT_QUEUE_SIZE);
+  m_inputRingHead = m_inputRingTail = 0;
+  m_inputWriteMutex = xSemaphoreCreateMutex();
+  m_inputConsumerWaiting = false;
+  m_inputWaitingProducer = NULL;
   xTaskCreate(&charsConsumerTask, "", FABGLIB_CHARS_CONSUMER_TASK_STACK_SIZE, this, FABGLIB_CHARS_CONSUMER_TASK_PRIORITY, &m_charsConsumerTaskHandle);
 
   m_defaultBackgroundColor = Color::Black;
@@ -125,6 +232,16 @@ void TerminalClass::begin()
 
   m_outputQueue = NULL;
 
+  m_transport = NULL;
+  m_outputBatch = NULL;
+  m_outputBatchCount = 0;
+  m_outputBatchMutex = xSemaphoreCreateMutex();
+
+  m_sentBytes = 0;
+  m_statsReceivedBytes = 0;
+  m_statsSentBytes = 0;
+  m_statsTime = esp_timer_get_time();
+
   reset();
 }
 
@@ -147,6 +264,21 @@ void TerminalClass::connectSerialPort(HardwareSerial & serialPort, bool autoXONX
 }
 
 
+void TerminalClass::connectTransport(TerminalTransport * transport)
+{
+  flushTransport();
+
+  xSemaphoreTake(m_outputBatchMutex, portMAX_DELAY);
+  m_transport = transport;
+  if (transport && !m_outputBatch)
+    m_outputBatch = (uint8_t*) malloc(FABGLIB_TERMINAL_OUTPUT_BATCH_SIZE);
+  xSemaphoreGive(m_outputBatchMutex);
+
+  if (transport && !m_keyboardReaderTaskHandle && Keyboard.isKeyboardAvailable())
+    xTaskCreate(&keyboardReaderTask, "", FABGLIB_KEYBOARD_READER_TASK_STACK_SIZE, this, FABGLIB_KEYBOARD_READER_TASK_PRIORITY, &m_keyboardReaderTaskHandle);
+}
+
+
 void TerminalClass::connectLocally()
 {
   m_outputQueue = xQueueCreate(FABGLIB_TERMINAL_OUTPUT_QUEUE_SIZE, sizeof(uint8_t));
@@ -188,11 +320,12 @@ void TerminalClass::log(char c)
 void TerminalClass::freeFont()
 {
   #if FABGLIB_CACHE_FONT_IN_RAM
-  if (m_font.data) {
-    free((void*) m_font.data);
-    m_font.data = NULL;
+  if (m_fontCache) {
+    heap_caps_free(m_fontCache);
+    m_fontCache = NULL;
   }
   #endif
+  m_font.data = NULL;
 }
 
 
@@ -215,6 +348,36 @@ void TerminalClass::freeGlyphsMap()
     free((void*) m_alternateMap);
     m_alternateMap = NULL;
   }
+  free(m_rowsInfo);
+  m_rowsInfo = NULL;
+  free(m_alternateRowsInfo);
+  m_alternateRowsInfo = NULL;
+  if (m_dirtyCells) {
+    free(m_dirtyCells);
+    m_dirtyCells = NULL;
+  }
+  m_dirtyPending = false;
+  if (m_scrollbackView.map) {
+    // view size depends on columns and rows
+    VGAController.waitPrimitivesFence(m_scrollbackFence);
+    free((void*) m_scrollbackView.map);
+    m_scrollbackView.map = NULL;
+  }
+  m_scrollbackOffset = 0;
+}
+
+
+void TerminalClass::freeScrollback()
+{
+  if (m_scrollbackData) {
+    free(m_scrollbackData);
+    m_scrollbackData = NULL;
+  }
+  if (m_scrollbackIndex) {
+    free(m_scrollbackIndex);
+    m_scrollbackIndex = NULL;
+  }
+  m_scrollbackLinesCount = 0;
 }
 
 
@@ -228,13 +391,18 @@ void TerminalClass::end()
   clearSavedCursorStates();
 
   vTaskDelete(m_charsConsumerTaskHandle);
-  vQueueDelete(m_inputQueue);
+  free(m_inputRing);
+  vSemaphoreDelete(m_inputWriteMutex);
 
   vQueueDelete(m_outputQueue);
 
+  vSemaphoreDelete(m_outputBatchMutex);
+  free(m_outputBatch);
+
   freeFont();
   freeTabStops();
   freeGlyphsMap();
+  freeScrollback();
 }
 
 
@@ -247,6 +415,8 @@ void TerminalClass::reset()
   xSemaphoreTake(m_blinkTimerMutex, portMAX_DELAY);
   m_resetRequested = false;
 
+  m_parser.reset();
+
   m_emuState.originMode            = false;
   m_emuState.wraparound            = true;
   m_emuState.insertMode            = false;
@@ -319,11 +489,15 @@ void TerminalClass::loadFont(FontInfo const * font)
 
   m_font = *font;
 #if FABGLIB_CACHE_FONT_IN_RAM
-  int size = m_font.height * 256 * ((m_font.width + 7) / 8);
-  m_font.data = (uint8_t const*) malloc(size);
-  memcpy((void*)m_font.data, font->data, size);
-#else
-  m_font.data = font->data;
+  // fonts already in internal RAM (see FABGLIB_FONTS_IN_DRAM) are used in place
+  if (!esp_ptr_internal(font->data)) {
+    int size = m_font.height * 256 * ((m_font.width + 7) / 8);
+    m_fontCache = (uint8_t*) heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (m_fontCache) {
+      memcpy(m_fontCache, font->data, size);
+      m_font.data = m_fontCache;
+    }
+  }
 #endif
 
   m_columns = tmin(Canvas.getWidth() / m_font.width, 132);
@@ -340,6 +514,10 @@ void TerminalClass::loadFont(FontInfo const * font)
   m_glyphsBuffer.columns      = m_columns;
   m_glyphsBuffer.rows         = m_rows;
   m_glyphsBuffer.map          = (uint32_t*) heap_caps_malloc(sizeof(uint32_t) * m_columns * m_rows, MALLOC_CAP_32BIT);
+  m_dirtyCells = (uint32_t*) calloc((m_columns * m_rows + 31) / 32, sizeof(uint32_t));
+  m_rowsInfo = (TerminalRowInfo*) malloc(sizeof(TerminalRowInfo) * m_rows);
+  for (int i = 0; i < m_rows; ++i)
+    m_rowsInfo[i] = (TerminalRowInfo){0, 0xFF, 0};
   m_alternateMap = NULL;
   m_alternateScreenBuffer = false;
 }
@@ -351,7 +529,7 @@ void TerminalClass::flush(bool waitVSync)
   log("flush()\n");
   #endif
 
-  while (uxQueueMessagesWaiting(m_inputQueue) > 0)
+  while (inputRingCount() > 0)
     ;
   Canvas.waitCompletion(waitVSync);
 }
@@ -407,6 +585,7 @@ void TerminalClass::reverseVideo(bool value)
     m_paintOptions.swapFGBG = value;
     Canvas.setPaintOptions(m_paintOptions);
 
+    renderDirtyCells();
     Canvas.swapRectangle(0, 0, Canvas.getWidth() - 1, Canvas.getHeight() - 1);
   }
 }
@@ -425,17 +604,37 @@ void TerminalClass::int_clear()
   #endif
 
   Canvas.clear();
-  clearMap(m_glyphsBuffer.map);
+  clearMap(m_glyphsBuffer.map, m_rowsInfo);
 }
 
 
-void TerminalClass::clearMap(uint32_t * map)
+void TerminalClass::clearMap(uint32_t * map, TerminalRowInfo * rowsInfo)
 {
   uint32_t itemValue = GLYPHMAP_ITEM_MAKE(ASCII_SPC, m_emuState.backgroundColor, m_emuState.foregroundColor, m_glyphOptions);
   uint32_t * mapItemPtr = map;
-  for (int row = 0; row < m_rows; ++row)
+  for (int row = 0; row < m_rows; ++row) {
     for (int col = 0; col < m_columns; ++col, ++mapItemPtr)
       *mapItemPtr = itemValue;
+    clearRowInfo(rowsInfo + row);
+  }
+}
+
+
+// line attributes of a row filled with m_glyphOptions
+void TerminalClass::clearRowInfo(TerminalRowInfo * rowInfo)
+{
+  rowInfo->doubleWidth = m_glyphOptions.doubleWidth;
+  rowInfo->blinkX1     = m_glyphOptions.userOpt1 ? 0 : 0xFF;
+  rowInfo->blinkX2     = m_glyphOptions.userOpt1 ? m_columns - 1 : 0;
+}
+
+
+// includes cells X1...X2 (0 based) of "row" (0 based) into blinking cells range
+void TerminalClass::setRowBlinking(int row, int X1, int X2)
+{
+  TerminalRowInfo * rowInfo = m_rowsInfo + row;
+  rowInfo->blinkX1 = tmin<int>(rowInfo->blinkX1, X1);
+  rowInfo->blinkX2 = tmax<int>(rowInfo->blinkX2, X2);
 }
 
 
@@ -506,7 +705,7 @@ bool TerminalClass::int_enableCursor(bool value)
   if (m_emuState.cursorEnabled != value) {
     m_emuState.cursorEnabled = value;
     if (m_emuState.cursorEnabled) {
-      if (uxQueueMessagesWaiting(m_inputQueue) == 0)
+      if (inputRingCount() == 0)
         blinkCursor();  // just to show the cursor immediately
     } else {
       if (m_cursorState)
@@ -530,7 +729,8 @@ void TerminalClass::blinkTimerFunc(TimerHandle_t xTimer)
 {
   TerminalClass * term = (TerminalClass*) pvTimerGetTimerID(xTimer);
 
-  if (xSemaphoreTake(term->m_blinkTimerMutex, 0) == pdTRUE) {
+  // nothing to blink while the scrollback view is shown
+  if (term->m_scrollbackOffset == 0 && xSemaphoreTake(term->m_blinkTimerMutex, 0) == pdTRUE) {
 
     // cursor blink
     if (term->m_emuState.cursorEnabled && term->m_emuState.cursorBlinkingEnabled)
@@ -548,6 +748,9 @@ void TerminalClass::blinkTimerFunc(TimerHandle_t xTimer)
 
 void TerminalClass::blinkCursor()
 {
+  // cursor is painted over the screen content
+  renderDirtyCells();
+
   m_cursorState = !m_cursorState;
   int X = (m_emuState.cursorX - 1) * m_font.width;
   int Y = (m_emuState.cursorY - 1) * m_font.height;
@@ -568,6 +771,49 @@ void TerminalClass::blinkCursor()
 }
 
 
+void IRAM_ATTR TerminalClass::renderScanline(void * arg, uint8_t * dest, int scanLine)
+{
+  TerminalClass * term = (TerminalClass*) arg;
+
+  if (term->m_glyphsBuffer.map == NULL) {
+    memset(dest, VGAController.createRawPixel(RGB(0, 0, 0)), VGAController.getViewPortWidth());
+    return;
+  }
+
+  if (term->m_scrollbackOffset > 0) {
+    VGAController.renderGlyphsBufferScanline(&term->m_scrollbackView, dest, scanLine);
+    return;
+  }
+
+  VGAController.renderGlyphsBufferScanline(&term->m_glyphsBuffer, dest, scanLine);
+
+  // cursor (when visible, see blinkCursor()) inverts pixel colors
+  if (term->m_emuState.cursorEnabled && term->m_cursorState) {
+    const int cellY = scanLine - (term->m_emuState.cursorY - 1) * term->m_font.height;
+    if (cellY >= 0 && cellY < term->m_font.height) {
+      int X1 = (term->m_emuState.cursorX - 1) * term->m_font.width;
+      int X2 = X1 + term->m_font.width - 1;
+      int Y1 = 0;
+      switch (term->m_emuState.cursorStyle) {
+        case 3 ... 4:
+          // underline cursor
+          Y1 = term->m_font.height - 2;
+          break;
+        case 5 ... 6:
+          // bar cursor
+          X2 = X1 + 1;
+          break;
+      }
+      if (cellY >= Y1) {
+        X2 = tmin(X2, VGAController.getViewPortWidth() - 1);
+        for (int x = X1; x <= X2; ++x)
+          dest[(x & ~3) + ((x + 2) & 3)] ^= 0x3F;  // pixels order in 32 bit words is 2, 3, 0, 1. Sync bits are unchanged.
+      }
+    }
+  }
+}
+
+
 void TerminalClass::blinkText()
 {
   m_blinkingTextVisible = !m_blinkingTextVisible;
@@ -576,14 +822,22 @@ void TerminalClass::blinkText()
   int cols = m_columns;
   beginRefresh();
   for (int y = 0; y < rows; ++y) {
-    uint32_t * itemPtr = m_glyphsBuffer.map + y * cols;
-    for (int x = 0; x < cols; ++x, ++itemPtr) {
+    // visit only the range of blinking cells, shrinking it to the cells actually blinking
+    TerminalRowInfo * rowInfo = m_rowsInfo + y;
+    int X1 = rowInfo->blinkX1, X2 = rowInfo->blinkX2;
+    if (X1 > X2)
+      continue;
+    rowInfo->blinkX1 = 0xFF;
+    rowInfo->blinkX2 = 0;
+    uint32_t * itemPtr = m_glyphsBuffer.map + X1 + y * cols;
+    for (int x = X1; x <= X2; ++x, ++itemPtr) {
       // character to blink?
       GlyphOptions glyphOptions = glyphMapItem_getOptions(itemPtr);
       if (glyphOptions.userOpt1) {
         glyphOptions.blank = !m_blinkingTextVisible;
         glyphMapItem_setOptions(itemPtr, glyphOptions);
         refresh(x + 1, y + 1);
+        setRowBlinking(y, x, x);
         keepEnabled = true;
       }
     }
@@ -600,7 +854,7 @@ void TerminalClass::nextTabStop()
   int actualColumns = m_columns;
 
   // if double width for current line then consider half columns
-  if (getGlyphOptionsAt(1, m_emuState.cursorY).doubleWidth)
+  if (m_rowsInfo[m_emuState.cursorY - 1].doubleWidth)
     actualColumns /= 2;
 
   int x = m_emuState.cursorX;
@@ -642,21 +896,24 @@ void TerminalClass::scrollDown()
   #endif
 
   // scroll down using canvas
-  if (m_emuState.smoothScroll) {
-    for (int i = 0; i < m_font.height; ++i)
-      Canvas.scroll(0, 1);
-  } else
+  renderDirtyCells();
+  if (m_emuState.smoothScroll)
+    Canvas.smoothScroll(m_font.height);
+  else
     Canvas.scroll(0, m_font.height);
 
   // move down scren buffer
-  for (int y = m_emuState.scrollingRegionDown - 1; y > m_emuState.scrollingRegionTop - 1; --y)
+  for (int y = m_emuState.scrollingRegionDown - 1; y > m_emuState.scrollingRegionTop - 1; --y) {
     memcpy(m_glyphsBuffer.map + y * m_columns, m_glyphsBuffer.map + (y - 1) * m_columns, m_columns * sizeof(uint32_t));
+    m_rowsInfo[y] = m_rowsInfo[y - 1];
+  }
 
   // insert a blank line in the screen buffer
   uint32_t itemValue = GLYPHMAP_ITEM_MAKE(ASCII_SPC, m_emuState.backgroundColor, m_emuState.foregroundColor, m_glyphOptions);
   uint32_t * itemPtr = m_glyphsBuffer.map + (m_emuState.scrollingRegionTop - 1) * m_columns;
   for (int x = 0; x < m_columns; ++x, ++itemPtr)
     *itemPtr = itemValue;
+  clearRowInfo(m_rowsInfo + m_emuState.scrollingRegionTop - 1);
 
 }
 
@@ -680,21 +937,28 @@ void TerminalClass::scrollUp()
   #endif
 
   // scroll up using canvas
-  if (m_emuState.smoothScroll) {
-    for (int i = 0; i < m_font.height; ++i)
-      Canvas.scroll(0, -1);
-  } else
+  renderDirtyCells();
+  if (m_emuState.smoothScroll)
+    Canvas.smoothScroll(-m_font.height);
+  else
     Canvas.scroll(0, -m_font.height);
 
+  // store the line that goes out of the screen
+  if (m_scrollbackData && m_emuState.scrollingRegionTop == 1 && !m_alternateScreenBuffer)
+    scrollbackPush(m_glyphsBuffer.map);
+
   // move up screen buffer
-  for (int y = m_emuState.scrollingRegionTop - 1; y < m_emuState.scrollingRegionDown - 1; ++y)
+  for (int y = m_emuState.scrollingRegionTop - 1; y < m_emuState.scrollingRegionDown - 1; ++y) {
     memcpy(m_glyphsBuffer.map + y * m_columns, m_glyphsBuffer.map + (y + 1) * m_columns, m_columns * sizeof(uint32_t));
+    m_rowsInfo[y] = m_rowsInfo[y + 1];
+  }
 
   // insert a blank line in the screen buffer
   uint32_t itemValue = GLYPHMAP_ITEM_MAKE(ASCII_SPC, m_emuState.backgroundColor, m_emuState.foregroundColor, m_glyphOptions);
   uint32_t * itemPtr = m_glyphsBuffer.map + (m_emuState.scrollingRegionDown - 1) * m_columns;
   for (int x = 0; x < m_columns; ++x, ++itemPtr)
     *itemPtr = itemValue;
+  clearRowInfo(m_rowsInfo + m_emuState.scrollingRegionDown - 1);
 }
 
 
@@ -741,6 +1005,7 @@ void TerminalClass::insertAt(int column, int row, int count)
 
   // move characters on the right using canvas
   int charWidth = getCharWidthAt(row);
+  renderDirtyCells();
   Canvas.setScrollingRegion((column - 1) * charWidth, (row - 1) * m_font.height, charWidth * getColumnsAt(row) - 1, row * m_font.height - 1);
   Canvas.scroll(count * charWidth, 0);
   updateCanvasScrollingRegion();  // restore original scrolling region
@@ -752,10 +1017,17 @@ void TerminalClass::insertAt(int column, int row, int count)
 
   // fill blank characters
   GlyphOptions glyphOptions = m_glyphOptions;
-  glyphOptions.doubleWidth = glyphMapItem_getOptions(rowPtr).doubleWidth;
+  glyphOptions.doubleWidth = m_rowsInfo[row - 1].doubleWidth;
   uint32_t itemValue = GLYPHMAP_ITEM_MAKE(ASCII_SPC, m_emuState.backgroundColor, m_emuState.foregroundColor, glyphOptions);
   for (int i = 0; i < count; ++i)
     rowPtr[column + i - 1] = itemValue;
+
+  // blinking cells moved right
+  TerminalRowInfo * rowInfo = m_rowsInfo + row - 1;
+  if (rowInfo->blinkX1 <= rowInfo->blinkX2)
+    setRowBlinking(row - 1, rowInfo->blinkX1, tmin<int>(rowInfo->blinkX2 + count, m_columns - 1));
+  if (m_glyphOptions.userOpt1)
+    setRowBlinking(row - 1, column - 1, column + count - 2);
 }
 
 
@@ -772,6 +1044,7 @@ void TerminalClass::deleteAt(int column, int row, int count)
   int charWidth = getCharWidthAt(row);
 //logFmt("charWidth=%d\n", charWidth);
 //logFmt("Canvas.setScrollingRegion(%d, %d, %d, %d)\n", (column - 1) * charWidth, (row - 1) * m_font.height, charWidth * getColumnsAt(row) - 1, row * m_font.height - 1);
+  renderDirtyCells();
   Canvas.setScrollingRegion((column - 1) * charWidth, (row - 1) * m_font.height, charWidth * getColumnsAt(row) - 1, row * m_font.height - 1);
 //logFmt("Canvas.scroll(%d, 0)\n\n", -count * charWidth);
   Canvas.scroll(-count * charWidth, 0);
@@ -784,10 +1057,17 @@ void TerminalClass::deleteAt(int column, int row, int count)
 
   // fill blank characters
   GlyphOptions glyphOptions = m_glyphOptions;
-  glyphOptions.doubleWidth = glyphMapItem_getOptions(rowPtr).doubleWidth;
+  glyphOptions.doubleWidth = m_rowsInfo[row - 1].doubleWidth;
   uint32_t itemValue = GLYPHMAP_ITEM_MAKE(ASCII_SPC, m_emuState.backgroundColor, m_emuState.foregroundColor, glyphOptions);
   for (int i = m_columns - count + 1 ; i <= m_columns; ++i)
     rowPtr[i - 1] = itemValue;
+
+  // blinking cells moved left
+  TerminalRowInfo * rowInfo = m_rowsInfo + row - 1;
+  if (rowInfo->blinkX1 <= rowInfo->blinkX2 && rowInfo->blinkX1 >= column - 1)
+    rowInfo->blinkX1 = tmax<int>(rowInfo->blinkX1 - count, column - 1);
+  if (m_glyphOptions.userOpt1)
+    setRowBlinking(row - 1, m_columns - count, m_columns - 1);
 }
 
 
@@ -813,12 +1093,23 @@ void TerminalClass::erase(int X1, int Y1, int X2, int Y2, char c, bool maintainD
   GlyphOptions glyphOptions = {.value = 0};
   glyphOptions.fillBackground = 1;
 
+  // line attributes are erased only for whole rows
+  bool wholeRows = !maintainDoubleWidth && X1 == 0 && X2 == m_columns - 1;
+
   for (int y = Y1; y <= Y2; ++y) {
+    TerminalRowInfo * rowInfo = m_rowsInfo + y;
+    if (wholeRows) {
+      rowInfo->doubleWidth = 0;
+      if (!selective) {
+        rowInfo->blinkX1 = 0xFF;
+        rowInfo->blinkX2 = 0;
+      }
+    }
+    glyphOptions.doubleWidth = rowInfo->doubleWidth;
     uint32_t * itemPtr = m_glyphsBuffer.map + X1 + y * m_columns;
     for (int x = X1; x <= X2; ++x, ++itemPtr) {
       if (selective && glyphMapItem_getOptions(itemPtr).userOpt2)  // bypass if protected item
         continue;
-      glyphOptions.doubleWidth = maintainDoubleWidth ? glyphMapItem_getOptions(itemPtr).doubleWidth : 0;
       *itemPtr = GLYPHMAP_ITEM_MAKE(c, m_emuState.backgroundColor, m_emuState.foregroundColor, glyphOptions);
     }
   }
@@ -902,11 +1193,13 @@ void TerminalClass::useAlternateScreenBuffer(bool value)
     if (!m_alternateMap) {
       // first usage, need to setup the alternate screen
       m_alternateMap = (uint32_t*) heap_caps_malloc(sizeof(uint32_t) * m_columns * m_rows, MALLOC_CAP_32BIT);
-      clearMap(m_alternateMap);
+      m_alternateRowsInfo = (TerminalRowInfo*) malloc(sizeof(TerminalRowInfo) * m_rows);
+      clearMap(m_alternateMap, m_alternateRowsInfo);
       m_alternateCursorX = 1;
       m_alternateCursorY = 1;
     }
     tswap(m_alternateMap, m_glyphsBuffer.map);
+    tswap(m_alternateRowsInfo, m_rowsInfo);
     tswap(m_emuState.cursorX, m_alternateCursorX);
     tswap(m_emuState.cursorY, m_alternateCursorY);
     m_emuState.cursorPastLastCol = false;
@@ -992,31 +1285,116 @@ void TerminalClass::pollSerialPort()
     if (!avail)
       break;
 
-    write( m_serialPort->read() );
+    // move received data in blocks
+    uint8_t buffer[SERIALPORT_READ_CHUNK];
+    int count = m_serialPort->readBytes(buffer, tmin(avail, SERIALPORT_READ_CHUNK));
+    write(buffer, count);
+  }
+}
+
+
+// receives directly into the input ring, as long as the transport has data and the ring has room
+int TerminalClass::pollTransport()
+{
+  flushTransport();
+
+  int received = 0;
+  while (m_transport) {
+    uint8_t * buffer;
+    int size  = beginWrite(&buffer);
+    int count = size > 0 ? m_transport->receive(buffer, size) : 0;
+    endWrite(tmax(count, 0));
+    if (count < 0)
+      return received > 0 ? received : -1;
+    received += count;
+    if (count < size || size == 0)
+      break;
+  }
+  return received;
+}
+
+
+void TerminalClass::flushTransport()
+{
+  xSemaphoreTake(m_outputBatchMutex, portMAX_DELAY);
+  if (m_transport && m_outputBatchCount > 0)
+    m_transport->send(m_outputBatch, m_outputBatchCount);
+  m_outputBatchCount = 0;
+  xSemaphoreGive(m_outputBatchMutex);
+}
+
+
+// append to m_outputBatch, sent when full or by flushTransport()
+void TerminalClass::transportSend(char const * data, int size)
+{
+  xSemaphoreTake(m_outputBatchMutex, portMAX_DELAY);
+  if (m_transport) {
+    while (size > 0) {
+      int count = tmin(size, FABGLIB_TERMINAL_OUTPUT_BATCH_SIZE - m_outputBatchCount);
+      memcpy(m_outputBatch + m_outputBatchCount, data, count);
+      m_outputBatchCount += count;
+      data += count;
+      size -= count;
+      if (m_outputBatchCount == FABGLIB_TERMINAL_OUTPUT_BATCH_SIZE) {
+        m_transport->send(m_outputBatch, m_outputBatchCount);
+        m_outputBatchCount = 0;
+      }
+    }
   }
+  xSemaphoreGive(m_outputBatchMutex);
+}
+
+
+void TerminalClass::getTransferStats(TerminalTransferStats * stats)
+{
+  int64_t  now      = esp_timer_get_time();
+  uint32_t received = m_inputRingHead;
+  uint32_t sent     = m_sentBytes;
+  int64_t  elapsed  = tmax<int64_t>(now - m_statsTime, 1);
+
+  stats->receivedBytes          = received;
+  stats->sentBytes              = sent;
+  stats->receivedBytesPerSecond = (int) ((received - m_statsReceivedBytes) * 1000000LL / elapsed);
+  stats->sentBytesPerSecond     = (int) ((sent - m_statsSentBytes) * 1000000LL / elapsed);
+
+  m_statsReceivedBytes = received;
+  m_statsSentBytes     = sent;
+  m_statsTime          = now;
 }
 
 
-// send a character to m_serialPort or m_outputQueue
+// send a character to m_serialPort, m_transport or m_outputQueue
 void TerminalClass::send(char c)
 {
   #if FABGLIB_TERMINAL_DEBUG_REPORT_OUT_CODES
   logFmt("=> %02X  %s%c\n", (int)c, (c <= ASCII_SPC ? CTRLCHAR_TO_STR[(int)c] : ""), (c > ASCII_SPC ? c : ASCII_SPC));
   #endif
 
+  m_sentBytes += 1;
+
+  if (m_transport)
+    transportSend(&c, 1);
+
   if (m_serialPort) {
     while (m_serialPort->availableForWrite() == 0)
       delay(1);
     m_serialPort->write(c);
   }
 
-  localWrite(c);  // write to m_outputQueue
+  if (!m_transport)
+    localWrite(c);  // write to m_outputQueue
 }
 
 
-// send a string to m_serialPort or m_outputQueue
+// send a string to m_serialPort, m_transport or m_outputQueue
 void TerminalClass::send(char const * str)
 {
+  int len = strlen(str);
+  m_sentBytes += len;
+
+  if (m_transport)
+    transportSend(str, len);
+
   if (m_serialPort) {
     while (*str) {
       while (m_serialPort->availableForWrite() == 0)
@@ -1031,7 +1409,8 @@ void TerminalClass::send(char const * str)
     }
   }
 
-  localWrite(str);  // write to m_outputQueue
+  if (!m_transport)
+    localWrite(str);  // write to m_outputQueue
 }
 
 
@@ -1055,27 +1434,394 @@ void TerminalClass::sendSS3()
 
 int TerminalClass::availableForWrite()
 {
-  return uxQueueSpacesAvailable(m_inputQueue);
+  return FABGLIB_TERMINAL_INPUT_QUEUE_SIZE - inputRingCount();
 }
 
 
 size_t TerminalClass::write(uint8_t c)
 {
-  xQueueSendToBack(m_inputQueue, &c, portMAX_DELAY);
+  return write(&c, 1);
+}
+
+
+// blocks while the input ring is full
+int TerminalClass::write(const uint8_t * buffer, int size)
+{
+  #if FABGLIB_TERMINAL_DEBUG_REPORT_IN_CODES
+  for (int i = 0; i < size; ++i)
+    logFmt("<= %02X  %s%c\n", (int)buffer[i], (buffer[i] <= ASCII_SPC ? CTRLCHAR_TO_STR[(int)buffer[i]] : ""), (buffer[i] > ASCII_SPC ? buffer[i] : ASCII_SPC));
+  #endif
+
+  xSemaphoreTake(m_inputWriteMutex, portMAX_DELAY);
+
+  int remaining = size;
+  while (remaining > 0) {
+
+    int space = FABGLIB_TERMINAL_INPUT_QUEUE_SIZE - inputRingCount();
+    if (space == 0) {
+      // wait for the consumer to make some room (re-check after setting the flag, the consumer may have read meanwhile)
+      m_inputWaitingProducer = xTaskGetCurrentTaskHandle();
+      if (inputRingCount() == FABGLIB_TERMINAL_INPUT_QUEUE_SIZE)
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      m_inputWaitingProducer = NULL;
+      continue;
+    }
+
+    // copy up to the end of the ring, then from the beginning
+    int count = tmin(space, remaining);
+    int pos   = m_inputRingHead & INPUTRING_MASK;
+    int part  = tmin(count, FABGLIB_TERMINAL_INPUT_QUEUE_SIZE - pos);
+    memcpy(m_inputRing + pos, buffer, part);
+    memcpy(m_inputRing, buffer + part, count - part);
+    m_inputRingHead += count;
+    buffer    += count;
+    remaining -= count;
+
+    inputRingNotifyConsumer();
+  }
+
+  xSemaphoreGive(m_inputWriteMutex);
+
+  return size;
+}
+
+
+int TerminalClass::beginWrite(uint8_t * * buffer)
+{
+  xSemaphoreTake(m_inputWriteMutex, portMAX_DELAY);
+  int pos = m_inputRingHead & INPUTRING_MASK;
+  *buffer = m_inputRing + pos;
+  return tmin(FABGLIB_TERMINAL_INPUT_QUEUE_SIZE - inputRingCount(), FABGLIB_TERMINAL_INPUT_QUEUE_SIZE - pos);
+}
 
+
+void TerminalClass::endWrite(int count)
+{
   #if FABGLIB_TERMINAL_DEBUG_REPORT_IN_CODES
-  logFmt("<= %02X  %s%c\n", (int)c, (c <= ASCII_SPC ? CTRLCHAR_TO_STR[(int)c] : ""), (c > ASCII_SPC ? c : ASCII_SPC));
+  uint8_t const * buffer = m_inputRing + (m_inputRingHead & INPUTRING_MASK);
+  for (int i = 0; i < count; ++i)
+    logFmt("<= %02X  %s%c\n", (int)buffer[i], (buffer[i] <= ASCII_SPC ? CTRLCHAR_TO_STR[(int)buffer[i]] : ""), (buffer[i] > ASCII_SPC ? buffer[i] : ASCII_SPC));
   #endif
 
-  return 1;
+  if (count > 0) {
+    m_inputRingHead += count;
+    inputRingNotifyConsumer();
+  }
+
+  xSemaphoreGive(m_inputWriteMutex);
 }
 
 
-int TerminalClass::write(const uint8_t * buffer, int size)
+// called by the consumer when the input ring is empty
+void TerminalClass::inputRingWaitData()
 {
-  for (int i = 0; i < size; ++i)
-    write(*(buffer++));
-  return size;
+  while (inputRingCount() == 0) {
+    // re-check after setting the flag, a producer may have written meanwhile
+    m_inputConsumerWaiting = true;
+    if (inputRingCount() == 0)
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    m_inputConsumerWaiting = false;
+  }
+}
+
+
+// called by producers after writing to the input ring
+void TerminalClass::inputRingNotifyConsumer()
+{
+  if (m_inputConsumerWaiting) {
+    m_inputConsumerWaiting = false;
+    xTaskNotifyGive(m_charsConsumerTaskHandle);
+  }
+}
+
+
+void TerminalClass::inputRingNotifyProducer()
+{
+  TaskHandle_t producer = m_inputWaitingProducer;
+  if (producer) {
+    m_inputWaitingProducer = NULL;
+    xTaskNotifyGive(producer);
+  }
+}
+
+
+void TerminalClass::enableLazyRendering(bool value)
+{
+  xSemaphoreTake(m_blinkTimerMutex, portMAX_DELAY);
+  m_lazyRendering = value;
+  if (!value)
+    renderDirtyCells();
+  xSemaphoreGive(m_blinkTimerMutex);
+}
+
+
+// render "count" cells of row Y (0 based) starting from X (0 based), or mark them dirty when lazy rendering is enabled
+void TerminalClass::renderCells(int X, int Y, int count)
+{
+  if (m_lazyRendering)
+    setCellsDirty(X, Y, count);
+  else
+    Canvas.renderGlyphsBuffer(X, Y, &m_glyphsBuffer, count);
+}
+
+
+void TerminalClass::setCellsDirty(int X, int Y, int count)
+{
+  if (m_dirtyCells == NULL)
+    return;
+  for (int i = X + Y * m_columns, last = i + count; i < last; ++i)
+    m_dirtyCells[i >> 5] |= 1 << (i & 31);
+  m_dirtyPending = true;
+}
+
+
+// render dirty cells, one primitive for each contiguous span of a row
+void TerminalClass::renderDirtyCells()
+{
+  if (!m_dirtyPending)
+    return;
+  m_dirtyPending = false;
+  for (int y = 0; y < m_rows; ++y) {
+    int spanX = -1;
+    for (int x = 0; x <= m_columns; ++x) {
+      int i = x + y * m_columns;
+      bool dirty = x < m_columns && (m_dirtyCells[i >> 5] & (1 << (i & 31)));
+      if (dirty) {
+        m_dirtyCells[i >> 5] &= ~(1 << (i & 31));
+        if (spanX < 0)
+          spanX = x;
+      } else if (spanX >= 0) {
+        Canvas.renderGlyphsBuffer(spanX, y, &m_glyphsBuffer, x - spanX);
+        spanX = -1;
+      }
+    }
+  }
+  m_lazyFence = VGAController.getPrimitivesFence();
+}
+
+
+static void * scrollbackAlloc(size_t size, bool usePSRAM)
+{
+  void * ret = usePSRAM ? heap_caps_malloc(size, MALLOC_CAP_SPIRAM) : NULL;
+  return ret ? ret : malloc(size);
+}
+
+
+bool TerminalClass::setScrollbackLines(int lines, bool usePSRAM)
+{
+  xSemaphoreTake(m_blinkTimerMutex, portMAX_DELAY);
+
+  int_setScrollbackOffset(0);
+  freeScrollback();
+
+  bool ret = true;
+  if (lines > 0) {
+    // data ring size is a power of two, so positions can wrap using a mask
+    m_scrollbackDataSize = 1024;
+    while (m_scrollbackDataSize < (uint32_t) lines * FABGLIB_TERMINAL_SCROLLBACK_BYTES_PER_LINE)
+      m_scrollbackDataSize <<= 1;
+    m_scrollbackData      = (uint8_t*) scrollbackAlloc(m_scrollbackDataSize, usePSRAM);
+    m_scrollbackIndex     = (uint32_t*) scrollbackAlloc(lines * sizeof(uint32_t), usePSRAM);
+    m_scrollbackIndexSize = lines;
+    m_scrollbackDataHead  = 0;
+    m_scrollbackLinesHead = 0;
+    if (m_scrollbackData == NULL || m_scrollbackIndex == NULL) {
+      freeScrollback();
+      ret = false;
+    }
+  }
+
+  xSemaphoreGive(m_blinkTimerMutex);
+
+  return ret;
+}
+
+
+// store a row of the glyphs map into the scrollback buffer as:
+//   uint8_t charsCount, uint8_t runsCount, charsCount * uint8_t (characters), runsCount * (uint8_t length, uint8_t colors, uint16_t options)
+// Characters after charsCount are blanks. Oldest lines are discarded to make room.
+void TerminalClass::scrollbackPush(uint32_t const * row)
+{
+  int charsCount = m_columns;
+  while (charsCount > 0 && glyphMapItem_getIndex(row + charsCount - 1) == ASCII_SPC)
+    --charsCount;
+
+  int runsCount = 0;
+  for (int x = 0; x < m_columns; ++x)
+    if (x == 0 || (row[x] >> GLYPHMAP_BGCOLOR_BIT) != (row[x - 1] >> GLYPHMAP_BGCOLOR_BIT))
+      ++runsCount;
+
+  // discard oldest lines
+  const uint32_t size = 2 + charsCount + 4 * runsCount;
+  while (m_scrollbackLinesCount > 0 &&
+         (m_scrollbackLinesCount == m_scrollbackIndexSize ||
+          m_scrollbackDataHead + size - m_scrollbackIndex[(m_scrollbackLinesHead - m_scrollbackLinesCount) % m_scrollbackIndexSize] > m_scrollbackDataSize))
+    --m_scrollbackLinesCount;
+
+  m_scrollbackIndex[m_scrollbackLinesHead % m_scrollbackIndexSize] = m_scrollbackDataHead;
+  ++m_scrollbackLinesHead;
+  ++m_scrollbackLinesCount;
+
+  const uint32_t mask = m_scrollbackDataSize - 1;
+  uint32_t pos = m_scrollbackDataHead;
+  m_scrollbackData[pos++ & mask] = charsCount;
+  m_scrollbackData[pos++ & mask] = runsCount;
+  for (int x = 0; x < charsCount; ++x)
+    m_scrollbackData[pos++ & mask] = glyphMapItem_getIndex(row + x);
+  for (int x = 0; x < m_columns; ) {
+    uint32_t attr = row[x] >> GLYPHMAP_BGCOLOR_BIT;
+    int length = 1;
+    while (x + length < m_columns && (row[x + length] >> GLYPHMAP_BGCOLOR_BIT) == attr)
+      ++length;
+    m_scrollbackData[pos++ & mask] = length;
+    m_scrollbackData[pos++ & mask] = attr;
+    m_scrollbackData[pos++ & mask] = attr >> 8;
+    m_scrollbackData[pos++ & mask] = attr >> 16;
+    x += length;
+  }
+  m_scrollbackDataHead = pos;
+}
+
+
+// decode a scrollback line into a glyphs map row. age: 1 = last stored line, getScrollbackLines() = oldest line.
+// The line is truncated or filled with blanks when the number of columns has been changed.
+void TerminalClass::scrollbackGet(int age, uint32_t * row)
+{
+  const uint32_t mask = m_scrollbackDataSize - 1;
+  uint32_t pos = m_scrollbackIndex[(m_scrollbackLinesHead - age) % m_scrollbackIndexSize];
+  const int charsCount = m_scrollbackData[pos++ & mask];
+  int runsCount = m_scrollbackData[pos++ & mask];
+  uint32_t runsPos = pos + charsCount;
+  uint32_t attr = 0;
+  for (int x = 0, runRemaining = 0; x < m_columns; ++x, --runRemaining) {
+    if (runRemaining == 0 && runsCount > 0) {
+      runRemaining = m_scrollbackData[runsPos++ & mask];
+      attr  = m_scrollbackData[runsPos++ & mask];
+      attr |= m_scrollbackData[runsPos++ & mask] << 8;
+      attr |= m_scrollbackData[runsPos++ & mask] << 16;
+      --runsCount;
+    }
+    row[x] = (attr << GLYPHMAP_BGCOLOR_BIT) | (x < charsCount ? m_scrollbackData[(pos + x) & mask] : ASCII_SPC);
+  }
+}
+
+
+void TerminalClass::setScrollbackOffset(int lines)
+{
+  xSemaphoreTake(m_blinkTimerMutex, portMAX_DELAY);
+  int_setScrollbackOffset(lines);
+  xSemaphoreGive(m_blinkTimerMutex);
+}
+
+
+void TerminalClass::int_setScrollbackOffset(int lines)
+{
+  lines = iclamp(lines, 0, m_scrollbackLinesCount);
+  if (lines == m_scrollbackOffset || m_glyphsBuffer.map == NULL)
+    return;
+
+  if (m_scrollbackOffset == 0) {
+    // leaving the live screen: the view will cover the cursor
+    if (m_scrollbackView.map == NULL) {
+      m_scrollbackView     = m_glyphsBuffer;
+      m_scrollbackView.map = (uint32_t*) heap_caps_malloc(sizeof(uint32_t) * m_columns * m_rows, MALLOC_CAP_32BIT);
+      if (m_scrollbackView.map == NULL)
+        return;
+    }
+    renderDirtyCells();
+    m_cursorState = false;
+  }
+
+  m_scrollbackOffset = lines;
+
+  if (lines > 0)
+    renderScrollbackView();
+  else
+    Canvas.renderGlyphsBuffer(0, 0, &m_glyphsBuffer, m_columns, m_rows);
+}
+
+
+// compose the view (scrollback lines followed by top rows of the live screen) and render it as a single rectangle
+void TerminalClass::renderScrollbackView()
+{
+  // view map could be still used by the previous rendering
+  VGAController.waitPrimitivesFence(m_scrollbackFence);
+  for (int y = 0; y < m_rows; ++y) {
+    uint32_t * row = m_scrollbackView.map + y * m_columns;
+    int age = m_scrollbackOffset - y;
+    if (age > 0)
+      scrollbackGet(age, row);
+    else
+      memcpy(row, m_glyphsBuffer.map + (-age) * m_columns, m_columns * sizeof(uint32_t));
+  }
+  Canvas.renderGlyphsBuffer(0, 0, &m_scrollbackView, m_columns, m_rows);
+  m_scrollbackFence = VGAController.getPrimitivesFence();
+}
+
+
+// set specified characters starting at current cursor position, moving cursor as setChar() does.
+// Glyphs map is updated for the whole run, then each contiguous span of a row is rendered by a single primitive.
+void TerminalClass::setChars(char const * chars, int count)
+{
+  if (m_emuState.insertMode) {
+    // insertion moves other characters
+    for (int i = 0; i < count; ++i)
+      setChar(chars[i]);
+    return;
+  }
+
+  int spanX     = 0;  // first column of current span (0 = first column)
+  int spanY     = 0;
+  int spanCount = 0;
+
+  for (int i = 0; i < count; ++i) {
+
+    if (m_emuState.cursorPastLastCol && m_emuState.wraparound) {
+      // the span must be painted before scrolling
+      if (spanCount > 0) {
+        renderCells(spanX, spanY, spanCount);
+        spanCount = 0;
+      }
+      setCursorPos(1, m_emuState.cursorY); // this sets m_emuState.cursorPastLastCol = false
+      if (moveDown())
+        scrollUp();
+    }
+
+    int cellX = m_emuState.cursorX - 1;
+    int cellY = m_emuState.cursorY - 1;
+
+    // doubleWidth must be maintained
+    uint32_t * mapItemPtr = m_glyphsBuffer.map + cellX + cellY * m_columns;
+    GlyphOptions glyphOptions = m_glyphOptions;
+    glyphOptions.doubleWidth = m_rowsInfo[cellY].doubleWidth;
+    *mapItemPtr = GLYPHMAP_ITEM_MAKE(chars[i], m_emuState.backgroundColor, m_emuState.foregroundColor, glyphOptions);
+    if (glyphOptions.userOpt1)
+      setRowBlinking(cellY, cellX, cellX);
+
+    if (spanCount > 0 && (cellY != spanY || cellX != spanX + spanCount)) {
+      // not contiguous (ie last column overwritten when wraparound is disabled)
+      renderCells(spanX, spanY, spanCount);
+      spanCount = 0;
+    }
+    if (spanCount == 0) {
+      spanX = cellX;
+      spanY = cellY;
+    }
+    ++spanCount;
+
+    if (m_emuState.cursorX == m_columns) {
+      m_emuState.cursorPastLastCol = true;
+    } else {
+      setCursorPos(m_emuState.cursorX + 1, m_emuState.cursorY);
+    }
+  }
+
+  if (spanCount > 0)
+    renderCells(spanX, spanY, spanCount);
+
+  // blinking text?
+  if (m_glyphOptions.userOpt1)
+    m_prevBlinkingTextEnabled = true; // consumeInputQueue() will set the value
 }
 
 
@@ -1097,8 +1843,10 @@ void TerminalClass::setChar(char c)
 
   // doubleWidth must be maintained
   uint32_t * mapItemPtr = m_glyphsBuffer.map + (m_emuState.cursorX - 1) + (m_emuState.cursorY - 1) * m_columns;
-  glyphOptions.doubleWidth = glyphMapItem_getOptions(mapItemPtr).doubleWidth;
+  glyphOptions.doubleWidth = m_rowsInfo[m_emuState.cursorY - 1].doubleWidth;
   *mapItemPtr = GLYPHMAP_ITEM_MAKE(c, m_emuState.backgroundColor, m_emuState.foregroundColor, glyphOptions);
+  if (glyphOptions.userOpt1)
+    setRowBlinking(m_emuState.cursorY - 1, m_emuState.cursorX - 1, m_emuState.cursorX - 1);
 
   if (glyphOptions.value != m_glyphOptions.value)
     Canvas.setGlyphOptions(glyphOptions);
@@ -1149,18 +1897,27 @@ void TerminalClass::refresh(int X1, int Y1, int X2, int Y2)
   logFmt("refresh(%d, %d, %d, %d)\n", X1, Y1, X2, Y2);
   #endif
 
-  for (int y = Y1 - 1; y < Y2; ++y) {
-    for (int x = X1 - 1; x < X2; ++x)
-      Canvas.renderGlyphsBuffer(x, y, &m_glyphsBuffer);
-    Canvas.waitCompletion(false);
+  if (m_lazyRendering) {
+    for (int y = Y1 - 1; y < Y2; ++y)
+      setCellsDirty(X1 - 1, y, X2 - X1 + 1);
+    return;
+  }
+
+  // wait for the previous row while the current one is queued, so the queue cannot overflow and this task sleeps meanwhile
+  uint32_t prevRowFence = VGAController.getPrimitivesFence();
+  for (int y = Y1 - 1; y < Y2; ++y) {
+    Canvas.renderGlyphsBuffer(X1 - 1, y, &m_glyphsBuffer, X2 - X1 + 1);
+    uint32_t rowFence = VGAController.getPrimitivesFence();
+    VGAController.waitPrimitivesFence(prevRowFence);
+    prevRowFence = rowFence;
   }
 }
 
 
 // Warning: beginRefresh() disables vertical sync interrupts. This means that
-// the VGAController primitives queue is not processed, and adding primitives may
-// cause a deadlock. To avoid this a call to "Canvas.waitCompletion(false)"
-// should be performed very often.
+// the VGAController primitives queue is processed only by this task, when the queue
+// or the primitives arena is full. To avoid long pauses a call to
+// "Canvas.waitCompletion(false)" should be performed very often.
 void TerminalClass::beginRefresh()
 {
   VGAController.suspendBackgroundPrimitiveExecution();
@@ -1180,6 +1937,11 @@ void TerminalClass::setLineDoubleWidth(int row, int value)
   logFmt("setLineDoubleWidth(%d, %d)\n", row, value);
   #endif
 
+  // nothing to rewrite and render when line attribute doesn't change
+  if (m_rowsInfo[row - 1].doubleWidth == value)
+    return;
+  m_rowsInfo[row - 1].doubleWidth = value;
+
   uint32_t * mapItemPtr = m_glyphsBuffer.map + (row - 1) * m_columns;
   for (int i = 0; i < m_columns; ++i, ++mapItemPtr) {
     GlyphOptions glyphOptions = glyphMapItem_getOptions(mapItemPtr);
@@ -1193,13 +1955,13 @@ void TerminalClass::setLineDoubleWidth(int row, int value)
 
 int TerminalClass::getCharWidthAt(int row)
 {
-  return glyphMapItem_getOptions(m_glyphsBuffer.map + (row - 1) * m_columns).doubleWidth ? m_font.width * 2 : m_font.width;
+  return m_rowsInfo[row - 1].doubleWidth ? m_font.width * 2 : m_font.width;
 }
 
 
 int TerminalClass::getColumnsAt(int row)
 {
-  return glyphMapItem_getOptions(m_glyphsBuffer.map + (row - 1) * m_columns).doubleWidth ? m_columns / 2 : m_columns;
+  return m_rowsInfo[row - 1].doubleWidth ? m_columns / 2 : m_columns;
 }
 
 
@@ -1209,64 +1971,128 @@ GlyphOptions TerminalClass::getGlyphOptionsAt(int X, int Y)
 }
 
 
-// blocking operation
-char TerminalClass::getNextCode(bool processCtrlCodes)
-{
-  while (true) {
-    char c;
-    xQueueReceive(m_inputQueue, &c, portMAX_DELAY);
-
-    // inside an ESC sequence we may find control characters!
-    if (processCtrlCodes && ISCTRLCHAR(c))
-      execCtrlCode(c);
-    else
-      return c;
-  }
-}
-
-
 void TerminalClass::charsConsumerTask(void * pvParameters)
 {
   TerminalClass * term = (TerminalClass*) pvParameters;
 
-  while (true)
+  while (true) {
+    if (term->m_dirtyPending && term->inputRingCount() == 0) {
+      // nothing more to process, reconcile the screen before waiting
+      xSemaphoreTake(term->m_blinkTimerMutex, portMAX_DELAY);
+      term->renderDirtyCells();
+      xSemaphoreGive(term->m_blinkTimerMutex);
+    }
     term->consumeInputQueue();
+  }
 }
 
 
 void TerminalClass::consumeInputQueue()
 {
-  char c = getNextCode(false);  // blocking call. false: do not process ctrl chars
+  inputRingWaitData();  // blocking call
 
   xSemaphoreTake(m_blinkTimerMutex, portMAX_DELAY);
 
+  // received codes restore the live screen
+  if (m_scrollbackOffset > 0)
+    int_setScrollbackOffset(0);
+
   m_prevCursorEnabled = int_enableCursor(false);
   m_prevBlinkingTextEnabled = enableBlinkingText(false);
 
-  // ESC
-  // Start escape sequence
-  if (c == ASCII_ESC)
-    consumeESC();
-
-  else if (ISCTRLCHAR(c))
-    execCtrlCode(c);
-
-  else {
-    if (m_emuState.characterSet[m_emuState.characterSetIndex] == 0 || (!m_emuState.ANSIMode && m_emuState.VT52GraphicsMode))
-      c = DECGRAPH_TO_CP437[(uint8_t)c];
-    setChar(c);
+  // parse all received codes (up to a ring size), one contiguous slice of the ring at the time.
+  // Parsed bytes are released after their action has been executed, because printable characters are taken directly from the ring.
+  int processed = 0;
+  while (inputRingCount() > 0 && processed < FABGLIB_TERMINAL_INPUT_QUEUE_SIZE && !m_resetRequested) {
+    int pos      = m_inputRingTail & INPUTRING_MASK;
+    int size     = tmin((int) inputRingCount(), FABGLIB_TERMINAL_INPUT_QUEUE_SIZE - pos);
+    int consumed = m_parser.parse((char const *) m_inputRing + pos, size, m_emuState.ANSIMode);
+    FABGLIB_TRACE(TerminalAction, Begin, m_parser.getAction());
+    execParserAction();
+    FABGLIB_TRACE(TerminalAction, End, m_parser.getAction());
+    m_inputRingTail += consumed;
+    processed += consumed;
+    inputRingNotifyProducer();
   }
 
+  // lazy rendering: reconcile the screen when previous rendering has been executed (at most once per frame)
+  if (m_dirtyPending && VGAController.isPrimitivesFencePassed(m_lazyFence))
+    renderDirtyCells();
+
   enableBlinkingText(m_prevBlinkingTextEnabled);
   int_enableCursor(m_prevCursorEnabled);
 
   xSemaphoreGive(m_blinkTimerMutex);
 
+  // replies to queries are sent at once
+  if (m_outputBatchCount > 0)
+    flushTransport();
+
   if (m_resetRequested)
     reset();
 }
 
 
+void TerminalClass::execParserAction()
+{
+  switch (m_parser.getAction()) {
+
+    case VTAction::PrintChars:
+      printChars(m_parser.getPrintChars(), m_parser.getPrintCount());
+      break;
+
+    case VTAction::ExecuteCtrl:
+      execCtrlCode(m_parser.getCode());
+      break;
+
+    case VTAction::ESCDispatch:
+      execESC();
+      break;
+
+    case VTAction::CSIDispatch:
+      execCSI();
+      break;
+
+    case VTAction::DCSDispatch:
+      execDCS();
+      break;
+
+    case VTAction::DCSFail:
+      #if FABGLIB_TERMINAL_DEBUG_REPORT_UNSUPPORT
+      log("DCS failed, expected ST or content too long\n");
+      #endif
+      break;
+
+    case VTAction::VT52Dispatch:
+      execESCVT52();
+      break;
+
+    default:
+      break;
+  }
+}
+
+
+// display a run of printable characters, mapping them when a graphics character set is selected
+void TerminalClass::printChars(char const * chars, int count)
+{
+  const bool graphics = m_emuState.characterSet[m_emuState.characterSetIndex] == 0 || (!m_emuState.ANSIMode && m_emuState.VT52GraphicsMode);
+  if (!graphics) {
+    setChars(chars, count);
+    return;
+  }
+  char run[PRINTABLE_RUN_MAX];
+  while (count > 0) {
+    int runLength = tmin(count, PRINTABLE_RUN_MAX);
+    for (int i = 0; i < runLength; ++i)
+      run[i] = DECGRAPH_TO_CP437[(uint8_t)chars[i]];
+    setChars(run, runLength);
+    chars += runLength;
+    count -= runLength;
+  }
+}
+
+
 void TerminalClass::execCtrlCode(char c)
 {
   switch (c) {
@@ -1339,32 +2165,82 @@ void TerminalClass::execCtrlCode(char c)
 }
 
 
-// consume non-CSI and CSI (ESC is already consumed)
-void TerminalClass::consumeESC()
+// exec ESC sequences (but CSI and DCS)
+void TerminalClass::execESC()
 {
+  char c = m_parser.getCode();
+  char intermediate = m_parser.getIntermediate();
 
-  if (!m_emuState.ANSIMode) {
-    consumeESCVT52();
-    return;
-  }
+  #if FABGLIB_TERMINAL_DEBUG_REPORT_ESC
+  if (intermediate)
+    logFmt("ESC%c%c\n", intermediate, c);
+  else
+    logFmt("ESC%c\n", c);
+  #endif
 
-  char c = getNextCode(true);   // true: process ctrl chars
+  switch (intermediate) {
 
-  if (c == '[') {
-    // ESC [ : start of CSI sequence
-    consumeCSI();
-    return;
-  }
+    // ESC #
+    case '#':
+      switch (c) {
+        // ESC # 3 : DECDHL, DEC double-height line, top half
+        case '3':
+          setLineDoubleWidth(m_emuState.cursorY, 2);
+          break;
+        // ESC # 4 : DECDHL, DEC double-height line, bottom half
+        case '4':
+          setLineDoubleWidth(m_emuState.cursorY, 3);
+          break;
+        // ESC # 5 : DECSWL, DEC single-width line
+        case '5':
+          setLineDoubleWidth(m_emuState.cursorY, 0);
+          break;
+        // ESC # 6 : DECDWL, DEC double-width line
+        case '6':
+          setLineDoubleWidth(m_emuState.cursorY, 1);
+          break;
+        // ESC # 8 :DECALN, DEC screen alignment test - fill screen with E's.
+        case '8':
+          erase(1, 1, m_columns, m_rows, 'E', false, false);
+          break;
+      }
+      return;
 
-  if (c == 'P') {
-    // ESC P : start of DCS sequence
-    consumeDCS();
-    return;
-  }
+    // Sequence defining character set:
+    // ESC character_set_index character_set
+    // character_set_index: '(' = G0  ')' = G1   '*' = G2   '+' = G3
+    // character_set: '0' = VT100 graphics mapping    '1' = VT100 graphics mapping    'B' = USASCII
+    case '(':
+    case ')':
+    case '*':
+    case '+':
+      switch (c) {
+        case '0':
+        case '2':
+          m_emuState.characterSet[intermediate - '('] = 0; // DEC Special Character and Line Drawing
+          break;
+        default:  // 'B' and others
+          m_emuState.characterSet[intermediate - '('] = 1; // United States (USASCII)
+          break;
+      }
+      return;
 
-  #if FABGLIB_TERMINAL_DEBUG_REPORT_ESC
-  logFmt("ESC%c\n", c);
-  #endif
+    case ASCII_SPC:
+      switch (c) {
+
+        // ESC SPC F : S7C1T, Select 7-Bit C1 Control Characters
+        case 'F':
+          m_emuState.ctrlBits = 7;
+          break;
+
+        // ESC SPC G : S8C1T, Select 8-Bit C1 Control Characters
+        case 'G':
+          if (m_emuState.conformanceLevel >= 2 && m_emuState.ANSIMode)
+            m_emuState.ctrlBits = 8;
+          break;
+      }
+      return;
+  }
 
   switch (c) {
 
@@ -1414,52 +2290,6 @@ void TerminalClass::consumeESC()
       restoreCursorState();
       break;
 
-    // ESC #
-    case '#':
-      c = getNextCode(true);  // true: process ctrl chars
-      switch (c) {
-        // ESC # 3 : DECDHL, DEC double-height line, top half
-        case '3':
-          setLineDoubleWidth(m_emuState.cursorY, 2);
-          break;
-        // ESC # 4 : DECDHL, DEC double-height line, bottom half
-        case '4':
-          setLineDoubleWidth(m_emuState.cursorY, 3);
-          break;
-        // ESC # 5 : DECSWL, DEC single-width line
-        case '5':
-          setLineDoubleWidth(m_emuState.cursorY, 0);
-          break;
-        // ESC # 6 : DECDWL, DEC double-width line
-        case '6':
-          setLineDoubleWidth(m_emuState.cursorY, 1);
-          break;
-        // ESC # 8 :DECALN, DEC screen alignment test - fill screen with E's.
-        case '8':
-          erase(1, 1, m_columns, m_rows, 'E', false, false);
-          break;
-      }
-      break;
-
-    // Start sequence defining character set:
-    // ESC character_set_index character_set
-    // character_set_index: '(' = G0  ')' = G1   '*' = G2   '+' = G3
-    // character_set: '0' = VT100 graphics mapping    '1' = VT100 graphics mapping    'B' = USASCII
-    case '(':
-    case ')':
-    case '*':
-    case '+':
-      switch (getNextCode(true)) {
-        case '0':
-        case '2':
-          m_emuState.characterSet[c - '('] = 0; // DEC Special Character and Line Drawing
-          break;
-        default:  // 'B' and others
-          m_emuState.characterSet[c - '('] = 1; // United States (USASCII)
-          break;
-      }
-      break;
-
     // ESC = : DECKPAM (Keypad Application Mode)
     case '=':
       m_emuState.keypadMode = KeypadMode::Application;
@@ -1476,22 +2306,6 @@ void TerminalClass::consumeESC()
       #endif
       break;
 
-    case ASCII_SPC:
-      switch (getNextCode(true)) {
-
-        // ESC SPC F : S7C1T, Select 7-Bit C1 Control Characters
-        case 'F':
-          m_emuState.ctrlBits = 7;
-          break;
-
-        // ESC SPC G : S8C1T, Select 8-Bit C1 Control Characters
-        case 'G':
-          if (m_emuState.conformanceLevel >= 2 && m_emuState.ANSIMode)
-            m_emuState.ctrlBits = 8;
-          break;
-      }
-      break;
-
     // consume unknow char
     default:
       #if FABGLIB_TERMINAL_DEBUG_REPORT_UNSUPPORT
@@ -1502,84 +2316,42 @@ void TerminalClass::consumeESC()
 }
 
 
-// a parameter is a number. Parameters are separated by ';'. Example: "5;27;3"
-// first parameter has index 0
-// params array must have up to FABGLIB_MAX_CSI_PARAMS
-char TerminalClass::consumeParamsAndGetCode(int * params, int * paramsCount, bool * questionMarkFound)
+// exec CSI sequence
+void TerminalClass::execCSI()
 {
-  // get parameters until maximum size reached or a command character has been found
-  *paramsCount = 1; // one parameter is always assumed (even if not exists)
-  *questionMarkFound = false;
-  int * p = params;
-  *p = 0;
-  while (true) {
-    char c = getNextCode(true);  // true: process ctrl chars
-
-    #if FABGLIB_TERMINAL_DEBUG_REPORT_ESC
-    log(c);
-    #endif
-
-    if (c == '?') {
-      *questionMarkFound = true;
-      continue;
-    }
-
-    // break the loop if a command has been found
-    if (!isdigit(c) && c != ';') {
-
-      #if FABGLIB_TERMINAL_DEBUG_REPORT_ESC
-      log('\n');
-      #endif
-
-      // reset non specified parameters
-      while (p < params + FABGLIB_MAX_CSI_PARAMS)
-        *(++p) = 0;
-
-      return c;
-    }
-
-    if (p < params + FABGLIB_MAX_CSI_PARAMS) {
-      if (c == ';') {
-        ++p;
-        *p = 0;
-        ++(*paramsCount);
-      } else {
-        // this is a digit
-        *p = *p * 10 + (c - '0');
-      }
-    }
-  }
-}
+  int const * params     = m_parser.getParams();
+  int paramsCount        = m_parser.getParamsCount();
+  bool questionMarkFound = m_parser.getPrivateMarker();
+  char c                 = m_parser.getCode();
 
-
-// consume CSI sequence (ESC + '[' already consumed)
-void TerminalClass::consumeCSI()
-{
   #if FABGLIB_TERMINAL_DEBUG_REPORT_ESC
   log("ESC[");
+  if (questionMarkFound)
+    log('?');
+  for (int i = 0; i < paramsCount; ++i)
+    logFmt(i < paramsCount - 1 ? "%d;" : "%d", params[i]);
+  if (m_parser.getIntermediate())
+    log(m_parser.getIntermediate());
+  log(c);
+  log('\n');
   #endif
 
-  bool questionMarkFound;
-  int params[FABGLIB_MAX_CSI_PARAMS];
-  int paramsCount;
-  char c = consumeParamsAndGetCode(params, &paramsCount, &questionMarkFound);
-
-  // ESC [ ? ... h
-  // ESC [ ? ... l
-  if (questionMarkFound && (c == 'h' || c == 'l')) {
-    consumeDECPrivateModes(params, paramsCount, c);
+  // ESC [ SPC ...
+  if (m_parser.getIntermediate() == ASCII_SPC) {
+    execCSISPC(params, paramsCount, c);
     return;
   }
 
-  // ESC [ SPC ...
-  if (c == ASCII_SPC) {
-    consumeCSISPC(params, paramsCount);
+  // ESC [ " ...
+  if (m_parser.getIntermediate() == '"') {
+    execCSIQUOT(params, paramsCount, c);
     return;
   }
 
-  // ESC [ " ...
-  if (c == '"') {
-    consumeCSIQUOT(params, paramsCount);
+  // ESC [ ? ... h
+  // ESC [ ? ... l
+  if (questionMarkFound && (c == 'h' || c == 'l')) {
+    execDECPrivateModes(params, paramsCount, c);
     return;
   }
 
@@ -1839,11 +2611,9 @@ void TerminalClass::consumeCSI()
 }
 
 
-// consume CSI " sequences
-void TerminalClass::consumeCSIQUOT(int * params, int paramsCount)
+// exec CSI " sequences
+void TerminalClass::execCSIQUOT(int const * params, int paramsCount, char c)
 {
-  char c = getNextCode(true);  // true: process ctrl chars
-
   switch (c) {
 
     // ESC [ P1; P2 " p : DECSCL, Select Conformance Level
@@ -1865,11 +2635,9 @@ void TerminalClass::consumeCSIQUOT(int * params, int paramsCount)
 }
 
 
-// consume CSI SPC sequences
-void TerminalClass::consumeCSISPC(int * params, int paramsCount)
+// exec CSI SPC sequences
+void TerminalClass::execCSISPC(int const * params, int paramsCount, char c)
 {
-  char c = getNextCode(true);  // true: process ctrl chars
-
   switch (c) {
 
     // ESC [ Ps SPC q : DECSCUSR, Set Cursor Style
@@ -1891,11 +2659,11 @@ void TerminalClass::consumeCSISPC(int * params, int paramsCount)
 }
 
 
-// consume DEC Private Mode (DECSET/DECRST) sequences
+// exec DEC Private Mode (DECSET/DECRST) sequences
 // ESC [ ? # h     <- set
 // ESC [ ? # l     <- reset
 // "c" can be "h" or "l"
-void TerminalClass::consumeDECPrivateModes(int const * params, int paramsCount, char c)
+void TerminalClass::execDECPrivateModes(int const * params, int paramsCount, char c)
 {
   bool set = (c == 'h');
   switch (params[0]) {
@@ -2167,44 +2935,18 @@ void TerminalClass::execSGRParameters(int const * params, int paramsCount)
 }
 
 
-// "ESC P" (DCS) already consumed
-// consume from parameters to ST (that is ESC "\")
-void TerminalClass::consumeDCS()
+// exec DCS sequence, from parameters to ST (that is ESC "\")
+void TerminalClass::execDCS()
 {
+  int const * params   = m_parser.getParams();
+  int paramsCount      = m_parser.getParamsCount();
+  char const * content = m_parser.getContent();
+  int contentLength    = m_parser.getContentLength();
+
   #if FABGLIB_TERMINAL_DEBUG_REPORT_ESC
-  log("ESC P");
+  logFmt("ESC P %.*s ESC \\\n", contentLength, content);
   #endif
 
-  // get parameters
-  bool questionMarkFound;
-  int params[FABGLIB_MAX_CSI_PARAMS];
-  int paramsCount;
-  char c = consumeParamsAndGetCode(params, &paramsCount, &questionMarkFound);
-
-  // get DCS content up to ST
-  char content[FABGLIB_MAX_DCS_CONTENT];
-  int contentLength = 0;
-  content[contentLength++] = c;
-  while (true) {
-    char c = getNextCode(false);  // false: do notprocess ctrl chars, ESC needed here
-    if (c == ASCII_ESC) {
-      if (getNextCode(false) == '\\')
-        break;  // ST found
-      else {
-        #if FABGLIB_TERMINAL_DEBUG_REPORT_UNSUPPORT
-        log("DCS failed, expected ST\n");
-        #endif
-        return;  // fail
-      }
-    } else if (contentLength == FABGLIB_MAX_DCS_CONTENT) {
-      #if FABGLIB_TERMINAL_DEBUG_REPORT_UNSUPPORT
-      log("DCS failed, content too long\n");
-      #endif
-      return; // fail
-    }
-    content[contentLength++] = c;
-  }
-
   // $q : DECRQSS, Request Selection or Setting
   if (m_emuState.conformanceLevel >= 3 && contentLength > 2 && content[0] == '$' && content[1] == 'q') {
 
@@ -2232,9 +2974,9 @@ void TerminalClass::consumeDCS()
 }
 
 
-void TerminalClass::consumeESCVT52()
+void TerminalClass::execESCVT52()
 {
-  char c = getNextCode(false);
+  char c = m_parser.getCode();
 
   #if FABGLIB_TERMINAL_DEBUG_REPORT_ESC
   logFmt("ESC%c\n", c);
@@ -2293,12 +3035,8 @@ void TerminalClass::consumeESCVT52()
 
     // ESC Y row col : Direct Cursor Addressing
     case 'Y':
-    {
-      int row = getNextCode(false) - 31;
-      int col = getNextCode(false) - 31;
-      setCursorPos(col, row);
+      setCursorPos(m_parser.getParams()[1], m_parser.getParams()[0]);
       break;
-    }
 
     // ESC Z : Identify
     case 'Z':
@@ -2357,11 +3095,20 @@ void TerminalClass::keyboardReaderTask(void * pvParameters)
         continue; // don't repeat
       term->m_lastPressedKey = vk;
 
+      // Shift+PageUp and Shift+PageDown page the scrollback view
+      if (term->m_scrollbackData && (vk == VK_PAGEUP || vk == VK_PAGEDOWN) && (Keyboard.isVKDown(VK_LSHIFT) || Keyboard.isVKDown(VK_RSHIFT))) {
+        term->setScrollbackOffset(term->m_scrollbackOffset + (vk == VK_PAGEUP ? term->m_rows : -term->m_rows));
+        continue;
+      }
+
       if (term->m_emuState.ANSIMode)
         term->ANSIDecodeVirtualKey(vk);
       else
         term->VT52DecodeVirtualKey(vk);
 
+      if (term->m_outputBatchCount > 0)
+        term->flushTransport();
+
     } else {
       // !keyDown
       term->m_lastPressedKey = VK_NONE;
@@ -2395,101 +3142,27 @@ void TerminalClass::sendKeypadCursorKeyCode(char applicationCode, const char * n
 
 void TerminalClass::ANSIDecodeVirtualKey(VirtualKey vk)
 {
-  switch (vk) {
-
-    // cursor keys
-
-    case VK_UP:
-      sendCursorKeyCode('A');
-      break;
-
-    case VK_DOWN:
-      sendCursorKeyCode('B');
-      break;
-
-    case VK_RIGHT:
-      sendCursorKeyCode('C');
-      break;
-
-    case VK_LEFT:
-      sendCursorKeyCode('D');
-      break;
-
-    // cursor keys - on numeric keypad
-
-    case VK_KP_UP:
-      sendKeypadCursorKeyCode('x', "A");
-      break;
-
-    case VK_KP_DOWN:
-      sendKeypadCursorKeyCode('r', "B");
-      break;
-
-    case VK_KP_RIGHT:
-      sendKeypadCursorKeyCode('v', "C");
-      break;
-
-    case VK_KP_LEFT:
-      sendKeypadCursorKeyCode('t', "D");
-      break;
-
-    // PageUp, PageDown, Insert, Home, Delete, End
-
-    case VK_PAGEUP:
-      sendCSI();
-      send("5~");
-      break;
-
-    case VK_PAGEDOWN:
-      sendCSI();
-      send("6~");
-      break;
-
-    case VK_INSERT:
-      sendCSI();
-      send("2~");
-      break;
-
-    case VK_HOME:
+  ANSIKeyDef const & key = ANSIKeysTable[vk];
+  switch (key.encoding) {
+    case ANSIKey_CSI:
       sendCSI();
-      send("1~");
-      break;
-
-    case VK_DELETE:
-      sendCSI();
-      send("3~");
-      break;
-
-    case VK_END:
-      sendCSI();
-      send("4~");
-      break;
-
-    // PageUp, PageDown, Insert, Home, Delete, End - on numeric keypad
-
-    case VK_KP_PAGEUP:
-      sendKeypadCursorKeyCode('y', "5~");
-      break;
-
-    case VK_KP_PAGEDOWN:
-      sendKeypadCursorKeyCode('s', "6~");
-      break;
-
-    case VK_KP_INSERT:
-      sendKeypadCursorKeyCode('p', "2~");
-      break;
-
-    case VK_KP_HOME:
-      sendKeypadCursorKeyCode('w', "1~");
-      break;
-
-    case VK_KP_DELETE:
-      sendKeypadCursorKeyCode('n', "3~");
+      send(key.code);
+      return;
+    case ANSIKey_SS3:
+      sendSS3();
+      send(key.code);
+      return;
+    case ANSIKey_CursorKey:
+      sendCursorKeyCode(key.code[0]);
+      return;
+    case ANSIKey_KeypadKey:
+      sendKeypadCursorKeyCode(key.applicationCode, key.code);
+      return;
+    default:
       break;
+  }
 
-    case VK_KP_END:
-      sendKeypadCursorKeyCode('q', "4~");
-      break;
+  switch (vk) {
 
     // Backspace
 
@@ -2497,68 +3170,6 @@ void TerminalClass::ANSIDecodeVirtualKey(VirtualKey vk)
       send(m_emuState.backarrowKeyMode ? ASCII_BS : ASCII_DEL);
       break;
 
-    // Function keys
-
-    case VK_F1:
-      sendSS3();
-      send('P');
-      break;
-
-    case VK_F2:
-      sendSS3();
-      send('Q');
-      break;
-
-    case VK_F3:
-      sendSS3();
-      send('R');
-      break;
-
-    case VK_F4:
-      sendSS3();
-      send('S');
-      break;
-
-    case VK_F5:
-      sendCSI();
-      send("15~");
-      break;
-
-    case VK_F6:
-      sendCSI();
-      send("17~");
-      break;
-
-    case VK_F7:
-      sendCSI();
-      send("18~");
-      break;
-
-    case VK_F8:
-      sendCSI();
-      send("19~");
-      break;
-
-    case VK_F9:
-      sendCSI();
-      send("20~");
-      break;
-
-    case VK_F10:
-      sendCSI();
-      send("21~");
-      break;
-
-    case VK_F11:
-      sendCSI();
-      send("23~");
-      break;
-
-    case VK_F12:
-      sendCSI();
-      send("24~");
-      break;
-
     // Printable keys
 
     default:
@@ -2684,4 +3295,51 @@ void TerminalClass::VT52DecodeVirtualKey(VirtualKey vk)
 }
 
 
+///////////////////////////////////////////////////////////////////////////////////
+// ClientTerminalTransport
+
+
+int ClientTerminalTransport::receive(uint8_t * buffer, int maxSize)
+{
+  int avail = m_client.available();
+  if (avail > 0)
+    return m_client.read(buffer, tmin(avail, maxSize));
+  return m_client.connected() ? 0 : -1;
+}
+
+
+void ClientTerminalTransport::send(uint8_t const * data, int size)
+{
+  m_client.write(data, size);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////
+// SocketTerminalTransport
+
+
+// copies from socket buffers (pbufs) directly to the destination
+int SocketTerminalTransport::receive(uint8_t * buffer, int maxSize)
+{
+  int count = ::recv(m_socket, buffer, maxSize, MSG_DONTWAIT);
+  if (count > 0)
+    return count;
+  if (count < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
+    return 0;
+  return -1;  // closed or failed
+}
+
+
+void SocketTerminalTransport::send(uint8_t const * data, int size)
+{
+  while (size > 0) {
+    int count = ::send(m_socket, data, size, 0);
+    if (count <= 0)
+      break;
+    data += count;
+    size -= count;
+  }
+}
+
+
 } // end of namespace
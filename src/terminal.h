@@ -42,8 +42,10 @@
 #include "fabglconf.h"
 #include "canvas.h"
 #include "keyboard.h"
+#include "vtparser.h"
 
 #include "Stream.h"
+#include "Client.h"
 
 
 
@@ -231,6 +233,15 @@ struct TerminalCursorState {
 };
 
 
+// line attributes of a row of the screen buffer.
+// blinkX1...blinkX2 includes all blinking cells of the row (may include cells no more blinking), blinkX1 > blinkX2 when no cell blinks
+struct TerminalRowInfo {
+  uint8_t                 doubleWidth;  // same of GlyphOptions.doubleWidth of all cells of the row
+  uint8_t                 blinkX1;
+  uint8_t                 blinkX2;
+};
+
+
 enum KeypadMode {
   Application,  // DECKPAM
   Numeric,      // DECKPNM
@@ -316,6 +327,105 @@ struct EmuState {
 
 
 
+/**
+ * @brief Base class of the terminal transports (see TerminalClass.connectTransport()).
+ *
+ * A transport moves codes between the terminal and a remote host in blocks: received data is stored directly into the terminal input queue,
+ * keys and replies to terminal queries are batched and sent at once.<br>
+ * Derived classes may filter the received data in place (for example to remove telnet commands).
+ */
+class TerminalTransport {
+
+public:
+
+  /**
+   * @brief Receive data without waiting.
+   *
+   * @param buffer Where to store received data (a free slice of the terminal input queue).
+   * @param maxSize Maximum number of bytes to store.
+   *
+   * @return Number of bytes stored into the buffer, 0 if no data is available, -1 if the connection has been closed.
+   */
+  virtual int receive(uint8_t * buffer, int maxSize) = 0;
+
+  /**
+   * @brief Send a block of data.
+   *
+   * @param data Data to send.
+   * @param size Number of bytes to send.
+   */
+  virtual void send(uint8_t const * data, int size) = 0;
+
+};
+
+
+/**
+ * @brief A terminal transport over an Arduino client (WiFiClient, EthernetClient, etc...).
+ *
+ * Example:
+ *
+ *     WiFiClient client;
+ *     ClientTerminalTransport transport(client);
+ *
+ *     void setup() {
+ *       ...
+ *       client.connect(host, port);
+ *       Terminal.connectTransport(&transport);
+ *     }
+ *
+ *     void loop() {
+ *       Terminal.pollTransport();
+ *     }
+ */
+class ClientTerminalTransport : public TerminalTransport {
+
+public:
+
+  ClientTerminalTransport(Client & client) : m_client(client) { }
+
+  int receive(uint8_t * buffer, int maxSize);
+  void send(uint8_t const * data, int size);
+
+private:
+
+  Client & m_client;
+
+};
+
+
+/**
+ * @brief A terminal transport over a lwIP socket.
+ *
+ * Data is received from the socket buffers directly into the terminal input queue.
+ */
+class SocketTerminalTransport : public TerminalTransport {
+
+public:
+
+  SocketTerminalTransport(int socket) : m_socket(socket) { }
+
+  int receive(uint8_t * buffer, int maxSize);
+  void send(uint8_t const * data, int size);
+
+private:
+
+  int m_socket;
+
+};
+
+
+/**
+ * @brief Number of bytes received and sent by the terminal (see TerminalClass.getTransferStats()).
+ */
+struct TerminalTransferStats {
+  uint32_t receivedBytes;          /**< Total number of bytes written to the terminal (from any source). */
+  uint32_t sentBytes;              /**< Total number of bytes sent by the terminal (keys and replies). */
+  int      receivedBytesPerSecond; /**< Received bytes per second since the previous getTransferStats() call. */
+  int      sentBytesPerSecond;     /**< Sent bytes per second since the previous getTransferStats() call. */
+};
+
+
+
 /**
  * @brief An ANSI-VT100 compatible display terminal.
  *
@@ -448,6 +558,80 @@ public:
    */
   void pollSerialPort();
 
+  /**
+   * @brief Connect a remote host using the specified transport.
+   *
+   * Typed keys and replies to terminal queries are batched (up to FABGLIB_TERMINAL_OUTPUT_BATCH_SIZE bytes) and sent to the transport
+   * in blocks. Call TerminalClass.pollTransport() to receive data from the transport.<br>
+   * While a transport is connected keys are not stored into the local keyboard queue (see TerminalClass.connectLocally()).
+   *
+   * @param transport The transport to use, NULL to disconnect.
+   *
+   * Example:
+   *
+   *       Terminal.begin();
+   *       Terminal.connectTransport(&transport);
+   */
+  void connectTransport(TerminalTransport * transport);
+
+  /**
+   * @brief Receive data from current transport.
+   *
+   * Received data is stored directly into the terminal input queue, without intermediate buffers. When the queue is full data is left to the
+   * transport (the remote host is slowed down by the network flow control).<br>
+   * This method needs to be called in the application main loop. Pending keys and replies are also sent.
+   *
+   * @return Number of received bytes, or -1 if the connection has been closed.
+   *
+   * Example:
+   *
+   *       void loop()
+   *       {
+   *         if (Terminal.pollTransport() < 0)
+   *           Terminal.connectTransport(NULL);
+   *       }
+   */
+  int pollTransport();
+
+  /**
+   * @brief Send pending keys and replies to current transport.
+   */
+  void flushTransport();
+
+  /**
+   * @brief Get direct access to the free space of the input queue.
+   *
+   * Allows data producers (network buffers, DMA...) to store codes directly into the input queue. Must be followed by a TerminalClass.endWrite()
+   * call, even when no data has been written. The queue is locked between the two calls.
+   *
+   * @param buffer Receives a pointer to the contiguous free space.
+   *
+   * @return Size of the contiguous free space (may be 0 when the queue is full).
+   *
+   * Example:
+   *
+   *       uint8_t * buffer;
+   *       int size = Terminal.beginWrite(&buffer);
+   *       Terminal.endWrite(pbuf_copy_partial(p, buffer, size, offset));
+   */
+  int beginWrite(uint8_t * * buffer);
+
+  /**
+   * @brief Complete a write started by TerminalClass.beginWrite().
+   *
+   * @param count Number of bytes written to the buffer returned by TerminalClass.beginWrite().
+   */
+  void endWrite(int count);
+
+  /**
+   * @brief Get the number of bytes received and sent by the terminal.
+   *
+   * Rates are calculated since the previous call.
+   *
+   * @param stats Receives the counters.
+   */
+  void getTransferStats(TerminalTransferStats * stats);
+
   /**
    * @brief Permits using of terminal locally.
    *
@@ -583,6 +767,67 @@ public:
    */
   void enableCursor(bool value);
 
+  /**
+   * @brief Enable or disable lazy rendering.
+   *
+   * When lazy rendering is enabled printed characters and refreshed areas just mark cells of the glyphs map as changed. Changed cells are
+   * rendered when the terminal has nothing more to process, before scrolling or painting the cursor, and when the previous rendering
+   * has been executed (at most once per frame). Multiple overwrites of the same cells (progress bars, full screen applications) cost a single render.
+   *
+   * @param value If true rendering is lazy, if false characters are rendered immediately.
+   *
+   * Example:
+   *
+   *     Terminal.enableLazyRendering(true);
+   */
+  void enableLazyRendering(bool value);
+
+  /**
+   * @brief Set size of the scrollback buffer.
+   *
+   * Lines scrolled out from the top of the screen are stored in the scrollback buffer, in compact form (8 bit characters plus attributes runs,
+   * see FABGLIB_TERMINAL_SCROLLBACK_BYTES_PER_LINE). Lines scrolled inside a scrolling region, or while the alternate screen is active, are not stored.
+   * Shift+PageUp and Shift+PageDown page the scrollback view when the keyboard is connected locally. Received codes restore the live screen.
+   * Any previously stored line is discarded.
+   *
+   * @param lines Maximum number of lines to store. 0 disables the scrollback buffer.
+   * @param usePSRAM If true the scrollback buffer is allocated in PSRAM (when available).
+   *
+   * @return True on success, false if there is not enough memory.
+   *
+   * Example:
+   *
+   *     // keep last 5000 lines in PSRAM
+   *     Terminal.setScrollbackLines(5000);
+   */
+  bool setScrollbackLines(int lines, bool usePSRAM = true);
+
+  /**
+   * @brief Return the number of lines currently stored in the scrollback buffer.
+   *
+   * @return Number of stored lines.
+   */
+  int getScrollbackLines() { return m_scrollbackLinesCount; }
+
+  /**
+   * @brief Scroll the view back into the scrollback buffer.
+   *
+   * @param lines Number of lines the view is scrolled back (0 = live screen). Clamped to getScrollbackLines().
+   *
+   * Example:
+   *
+   *     // page up
+   *     Terminal.setScrollbackOffset(Terminal.getScrollbackOffset() + Terminal.getRows());
+   */
+  void setScrollbackOffset(int lines);
+
+  /**
+   * @brief Return the number of lines the view is scrolled back.
+   *
+   * @return Number of lines the view is scrolled back (0 = live screen).
+   */
+  int getScrollbackOffset() { return m_scrollbackOffset; }
+
   /**
    * @brief Return number of codes that the display input queue can still accept.
    *
@@ -650,6 +895,18 @@ public:
    */
   int write(const uint8_t * buffer, int size);
 
+  /**
+   * @brief Send specified number of codes to the display.
+   *
+   * Same of write(const uint8_t * buffer, int size). Used by Print methods (print(), printf(), etc...).
+   *
+   * @param buffer Pointer to codes buffer.
+   * @param size Number of codes in the buffer.
+   *
+   * @return The number of codes written.
+   */
+  size_t write(const uint8_t * buffer, size_t size) { return write(buffer, (int) size); }
+
   /**
    * @brief Send a single code to the display.
    *
@@ -663,16 +920,37 @@ public:
 
   using Print::write;
 
+  /**
+   * @brief Scanline callback which renders the terminal screen.
+   *
+   * Allows running the terminal in scanline mode, without viewport memory (see VGAControllerClass.setScanlineCallback()).
+   * Cursor is rendered inverting colors. Terminal font should be cached in RAM (see FABGLIB_CACHE_FONT_IN_RAM).
+   *
+   * @param arg Pointer to the TerminalClass object.
+   * @param dest Line buffer to fill.
+   * @param scanLine Viewport line to render.
+   *
+   * Example:
+   *
+   *     VGAController.setScanlineCallback(TerminalClass::renderScanline, &Terminal);
+   *     VGAController.setResolution(SVGA_800x600_60Hz);
+   *     Terminal.begin();
+   */
+  static void renderScanline(void * arg, uint8_t * dest, int scanLine);
+
 
 private:
 
   void reset();
   void int_clear();
-  void clearMap(uint32_t * map);
+  void clearMap(uint32_t * map, TerminalRowInfo * rowsInfo);
+  void clearRowInfo(TerminalRowInfo * rowInfo);
+  void setRowBlinking(int row, int X1, int X2);
 
   void freeFont();
   void freeTabStops();
   void freeGlyphsMap();
+  void freeScrollback();
 
   void set132ColumnMode(bool value);
 
@@ -705,15 +983,16 @@ private:
   void erase(int X1, int Y1, int X2, int Y2, char c, bool maintainDoubleWidth, bool selective);
 
   void consumeInputQueue();
-  void consumeESC();
-  void consumeCSI();
-  void consumeCSIQUOT(int * params, int paramsCount);
-  void consumeCSISPC(int * params, int paramsCount);
-  char consumeParamsAndGetCode(int * params, int * paramsCount, bool * questionMarkFound);
-  void consumeDECPrivateModes(int const * params, int paramsCount, char c);
-  void consumeDCS();
+  void execParserAction();
+  void printChars(char const * chars, int count);
+  void execESC();
+  void execCSI();
+  void execCSIQUOT(int const * params, int paramsCount, char c);
+  void execCSISPC(int const * params, int paramsCount, char c);
+  void execDECPrivateModes(int const * params, int paramsCount, char c);
+  void execDCS();
   void execSGRParameters(int const * params, int paramsCount);
-  void consumeESCVT52();
+  void execESCVT52();
 
   void execCtrlCode(char c);
 
@@ -726,9 +1005,21 @@ private:
   void blinkCursor();
   bool int_enableCursor(bool value);
 
-  char getNextCode(bool processCtrlCodes);
+  int inputRingCount() { return m_inputRingHead - m_inputRingTail; }
+  void inputRingWaitData();
+  void inputRingNotifyConsumer();
+  void inputRingNotifyProducer();
 
   void setChar(char c);
+  void setChars(char const * chars, int count);
+  void renderCells(int X, int Y, int count);
+  void setCellsDirty(int X, int Y, int count);
+  void renderDirtyCells();
+
+  void scrollbackPush(uint32_t const * row);
+  void scrollbackGet(int age, uint32_t * row);
+  void int_setScrollbackOffset(int lines);
+  void renderScrollbackView();
   GlyphOptions getGlyphOptionsAt(int X, int Y);
 
   void insertAt(int column, int row, int count);
@@ -750,6 +1041,7 @@ private:
 
   void send(char c);
   void send(char const * str);
+  void transportSend(char const * data, int size);
   void sendCSI();
   void sendDCS();
   void sendSS3();
@@ -765,9 +1057,31 @@ private:
   // you may also call this the "text screen buffer"
   GlyphsBuffer       m_glyphsBuffer;
 
+  // lazy rendering (see enableLazyRendering())
+  bool               m_lazyRendering;
+  uint32_t *         m_dirtyCells;     // one bit per m_glyphsBuffer.map item
+  volatile bool      m_dirtyPending;   // true when some bit of m_dirtyCells is set
+  uint32_t           m_lazyFence;      // fence of last renderDirtyCells()
+
+  // scrollback buffer (see setScrollbackLines())
+  uint8_t *          m_scrollbackData;         // ring of compacted lines, m_scrollbackDataSize bytes (power of two)
+  uint32_t           m_scrollbackDataSize;
+  uint32_t           m_scrollbackDataHead;     // total number of written bytes
+  uint32_t *         m_scrollbackIndex;        // ring of lines start positions (m_scrollbackDataHead values), m_scrollbackIndexSize items
+  int                m_scrollbackIndexSize;
+  uint32_t           m_scrollbackLinesHead;    // total number of stored lines
+  int                m_scrollbackLinesCount;   // number of lines currently available
+  volatile int       m_scrollbackOffset;       // number of lines the view is scrolled back (0 = live screen)
+  GlyphsBuffer       m_scrollbackView;         // screen shown while m_scrollbackOffset > 0
+  uint32_t           m_scrollbackFence;        // fence of last renderScrollbackView()
+
   // used to implement alternate screen buffer
   uint32_t *         m_alternateMap;
 
+  // line attributes of m_glyphsBuffer.map and m_alternateMap rows
+  TerminalRowInfo *  m_rowsInfo;
+  TerminalRowInfo *  m_alternateRowsInfo;
+
   // true when m_alternateMap and m_glyphBuffer.map has been swapped
   bool               m_alternateScreenBuffer;
 
@@ -777,6 +1091,9 @@ private:
 
   FontInfo           m_font;
 
+  // RAM copy of font data (FABGLIB_CACHE_FONT_IN_RAM), NULL when font data is already in internal RAM
+  uint8_t *          m_fontCache;
+
   PaintOptions       m_paintOptions;
   GlyphOptions       m_glyphOptions;
 
@@ -813,8 +1130,30 @@ private:
   // keys from keyboard are processed and sent to serial port
   HardwareSerial *   m_serialPort;
 
-  // contains characters to be processed (from write() calls)
-  QueueHandle_t      m_inputQueue;
+  // optional transport (see connectTransport())
+  // codes to send are batched into m_outputBatch, protected by m_outputBatchMutex
+  TerminalTransport *   m_transport;
+  uint8_t *             m_outputBatch;
+  int                   m_outputBatchCount;
+  SemaphoreHandle_t     m_outputBatchMutex;
+
+  // transfer counters (see getTransferStats())
+  volatile uint32_t     m_sentBytes;
+  uint32_t              m_statsReceivedBytes;
+  uint32_t              m_statsSentBytes;
+  int64_t               m_statsTime;
+
+  // contains characters to be processed (from write() calls), FABGLIB_TERMINAL_INPUT_QUEUE_SIZE bytes.
+  // Producers are serialized by m_inputWriteMutex, the consumer (charsConsumerTask) is lock free.
+  uint8_t *             m_inputRing;
+  volatile uint32_t     m_inputRingHead;       // total number of written bytes
+  volatile uint32_t     m_inputRingTail;       // total number of read bytes
+  SemaphoreHandle_t     m_inputWriteMutex;
+  volatile bool         m_inputConsumerWaiting;
+  volatile TaskHandle_t m_inputWaitingProducer;
+
+  // escape sequences parser of m_inputRing content
+  VTParser           m_parser;
 
   // contains characters received and decoded from keyboard (or as replyed to ANSI-VT queries)
   QueueHandle_t      m_outputQueue;
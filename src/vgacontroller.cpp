@@ -36,8 +36,10 @@
 #include "driver/periph_ctrl.h"
 #include "rom/lldesc.h"
 #include "soc/rtc.h"
+#include "esp_intr_alloc.h"
 
 #include "fabutils.h"
+#include "fabtrace.h"
 #include "vgacontroller.h"
 #include "swgenerator.h"
 #include "cursors.h"
@@ -89,8 +91,62 @@ RGB COLOR2RGB[16] = {
 // dword : 0           1           2          ...etc...
 #define PIXELINROW(row, X) (row[((X) & 0xFFFC) + ((2 + (X)) & 3)])
 
-// requires variables: m_viewPort
-#define PIXEL(X, Y) PIXELINROW(m_viewPort[(Y)], X)
+
+// protects primitives fence counter
+static portMUX_TYPE s_fenceMux = portMUX_INITIALIZER_UNLOCKED;
+
+
+// render task notification bits
+#define RENDERTASK_VSYNC 1   // vertical sync occurred
+#define RENDERTASK_WAKE  2   // background execution suspended or resumed
+
+
+#if FABGLIB_HAS_ALPHA_BLENDING
+// BLEND_LUT[(src << 6) | dst] is the RGB222 color made of one third of "src" and two thirds of "dst" (rounded, for each channel).
+// Two thirds of "src" is BLEND_LUT[(dst << 6) | src].
+static uint8_t BLEND_LUT[64 * 64];
+
+
+static void buildBlendLUT()
+{
+  for (int src = 0; src < 64; ++src)
+    for (int dst = 0; dst < 64; ++dst) {
+      uint8_t color = 0;
+      for (int shift = 0; shift < 6; shift += 2)
+        color |= ((((src >> shift) & 3) + 2 * ((dst >> shift) & 3) + 1) / 3) << shift;
+      BLEND_LUT[(src << 6) | dst] = color;
+    }
+}
+#endif
+
+
+// RGB222 color resulting from bitmap pixel "src" (AABBGGRR, alpha not 0) painted over RGB222 color "dst"
+static inline uint8_t IRAM_ATTR blendPixel(uint8_t src, uint8_t dst)
+{
+  #if FABGLIB_HAS_ALPHA_BLENDING
+  switch (src >> 6) {
+    case 1:
+      return BLEND_LUT[((src & 0x3F) << 6) | dst];
+    case 2:
+      return BLEND_LUT[(dst << 6) | (src & 0x3F)];
+  }
+  #endif
+  return src & 0x3F;
+}
+
+
+// paints bitmap pixel "src" (AABBGGRR) at "x" of a line of raw pixels
+static inline void IRAM_ATTR drawRawPixel(uint8_t * dstrow, int x, uint8_t src)
+{
+  if (src >= 0xC0)
+    PIXELINROW(dstrow, x) = src;  // alpha bits match SYNC_MASK
+  else if (src >> 6)
+    PIXELINROW(dstrow, x) = SYNC_MASK | blendPixel(src, PIXELINROW(dstrow, x) & 0x3F);
+}
+
+
+// default palette of PixelFormat::Palette4
+static const Color PALETTE4_DEFAULT[4] = { Black, BrightCyan, BrightMagenta, BrightWhite };
 
 
 
@@ -112,18 +168,75 @@ void VGAControllerClass::init(gpio_num_t VSyncGPIO)
 {
   m_execQueue = xQueueCreate(FABGLIB_EXEC_QUEUE_SIZE, sizeof(Primitive));
 
+  #if FABGLIB_HAS_ALPHA_BLENDING
+  buildBlendLUT();
+  #endif
+
+  m_batch             = NULL;
+  m_pathEdges         = NULL;
+  m_glyphRowCachePen  = -1;
+  m_pathActiveEdges   = NULL;
+  m_batchOwner        = NULL;
+  m_batchLevel        = 0;
+  m_batchWritePos     = 0;
+  m_batchPublishedPos = 0;
+  m_batchReadPos      = 0;
+  m_arena             = NULL;
+  m_arenaMutex        = xSemaphoreCreateMutex();
+  m_arenaWritePos     = 0;
+  m_arenaReadPos      = 0;
+
   m_DMABuffersHead = NULL;
   m_DMABuffers = NULL;
   m_DMABuffersVisible = NULL;
   m_DMABuffersCount = 0;
+  m_videoMemoryBlocks = 0;
+  if (FABGLIB_VIDEO_MEMORY_SIZE > 0)
+    reserveVideoMemory(FABGLIB_VIDEO_MEMORY_SIZE, 4);
+  m_viewPortRing = NULL;
+  m_viewPortRingOffset = 0;
+  m_paletteExpand = NULL;
+  m_lineBuffers = NULL;
+  m_lineDMABuffers = 0;
+  m_I2SInterruptHandle = NULL;
+  m_scanlineCallback = NULL;
+  m_scanlineCallbackArg = NULL;
+  setPixelFormat(PixelFormat::RGB222);
+  applyPixelFormat();
   m_VSyncInterruptSuspended = 1; // >0 suspended
+  m_suspendingTask = NULL;
   m_backgroundPrimitiveExecutionEnabled = true;
+  m_renderTask = NULL;
+  m_renderTaskBusy = false;
+  m_renderTaskIdleWaitTask = NULL;
+  m_primitivesSubmitted = 0;
+  m_primitivesCompleted = 0;
+  m_fenceWaitTask = NULL;
+  m_VSyncCount = 0;
+  m_VSyncWaitTask = NULL;
   m_VSyncGPIO = VSyncGPIO;
   m_sprites = NULL;
   m_spritesCount = 0;
-  m_spritesHidden = true;
+  resetSpritesStats();
+  #if FABGLIB_HAS_FRAME_STATS
+  resetFrameStats();
+  #endif
   m_doubleBuffered = false;
   m_mouseCursor.visible = false;
+  m_mouseCursorOverlay = false;
+  m_overlayCursor = NULL;
+  m_overlayDirty = false;
+  m_overlayDamaged = false;
+  m_overlayLines = NULL;
+  m_overlayX = m_overlayY = 0;
+  m_overlayBitmap = NULL;
+  m_overlayRingRow = 0;
+  m_overlayRows = 0;
+  m_backgroundLayer = NULL;
+  m_layerRects[0] = m_layerRects[1] = NULL;
+  m_layerRectsCount[0] = m_layerRectsCount[1] = 0;
+  m_layerRectsSize = 0;
+  m_backBufferIndex = 0;
 
   SquareWaveGenerator.begin();
 }
@@ -185,6 +298,17 @@ void VGAControllerClass::setSprites(Sprite * sprites, int count, int spriteSize)
   m_sprites      = sprites;
   m_spriteSize   = spriteSize;
   m_spritesCount = count;
+  if (m_backgroundLayer && m_layerRectsSize < count + 1) {
+    // grow painted areas lists keeping areas of previous sprites, they are restored at next refresh
+    Rect * rects0 = (Rect*) realloc((void*) m_layerRects[0], sizeof(Rect) * (count + 1));
+    if (rects0)
+      m_layerRects[0] = rects0;
+    Rect * rects1 = (Rect*) realloc((void*) m_layerRects[1], sizeof(Rect) * (count + 1));
+    if (rects1)
+      m_layerRects[1] = rects1;
+    if (rects0 && rects1)
+      m_layerRectsSize = count + 1;
+  }
 }
 
 
@@ -275,72 +399,167 @@ static bool convertModelineToTimings(char const * modeline, Timings * timings)
 }
 
 
-void VGAControllerClass::setResolution(char const * modeline, int viewPortWidth, int viewPortHeight, bool doubleBuffered)
+bool VGAControllerClass::setResolution(char const * modeline, int viewPortWidth, int viewPortHeight, bool doubleBuffered)
 {
   Timings timings;
-  if (convertModelineToTimings(modeline, &timings))
-    setResolution(timings, viewPortWidth, viewPortHeight, doubleBuffered);
+  return convertModelineToTimings(modeline, &timings) && setResolution(timings, viewPortWidth, viewPortHeight, doubleBuffered);
 }
 
 
 // this method may adjust m_viewPortHeight to the actual number of allocated rows.
-// to reduce memory allocation overhead try to allocate the minimum number of blocks.
-void VGAControllerClass::allocateViewPort()
+// Video memory for the whole mode (viewport lines plus "buffersSize" bytes for the other buffers) is reserved at once, so it is made of
+// few large blocks. Then lines are carved first, leaving "buffersSize" bytes to the other buffers. Lines of palette formats don't need
+// DMA capable memory, anyway they share the same blocks.
+// Returns false if there is not enough memory.
+bool VGAControllerClass::allocateViewPort(int buffersSize)
 {
-  int linesCount[FABGLIB_VIEWPORT_MEMORY_POOL_COUNT]; // where store number of lines for each pool
-  int poolsCount = 0; // number of allocated pools
-  int remainingLines = m_viewPortHeight;
-  m_viewPortHeight = 0; // m_viewPortHeight needs to be recalculated
-
-  if (m_doubleBuffered)
-    remainingLines *= 2;
+  m_viewPortRingOffset = 0;
 
-  // allocate pools
-  while (remainingLines > 0 && poolsCount < FABGLIB_VIEWPORT_MEMORY_POOL_COUNT) {
-    int largestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_DMA);
-    linesCount[poolsCount] = tmin(remainingLines, largestBlock / m_viewPortWidth);
-    if (linesCount[poolsCount] == 0)  // no more memory available for lines
-      break;
-    m_viewPortMemoryPool[poolsCount] = (uint8_t*) heap_caps_malloc(linesCount[poolsCount] * m_viewPortWidth, MALLOC_CAP_DMA);
-    remainingLines -= linesCount[poolsCount];
-    m_viewPortHeight += linesCount[poolsCount];
-    ++poolsCount;
+  // scanline mode: there isn't any viewport memory
+  if (m_scanlineCallback) {
+    m_viewPortHeight -= m_viewPortHeight % FABGLIB_LINE_BUFFERS_COUNT;
+    m_viewPort = m_viewPortVisible = NULL;
+    return reserveVideoMemory(buffersSize, 4) && m_viewPortHeight > 0;
   }
-  m_viewPortMemoryPool[poolsCount] = NULL;
+
+  const int rowSize  = getViewPortRowSize();
+  const int lineSize = (rowSize + 3) & ~3;  // as carved by allocVideoMemory()
+  const int buffers  = m_doubleBuffered ? 2 : 1;
+
+  reserveVideoMemory(m_viewPortHeight * buffers * lineSize + buffersSize, lineSize);
+  m_viewPortHeight = tmin<int>(m_viewPortHeight, tmax(0, availableVideoMemory(lineSize) - buffersSize) / lineSize / buffers);
+  if (m_pixelShift)
+    m_viewPortHeight -= m_viewPortHeight % FABGLIB_LINE_BUFFERS_COUNT;
+  if (m_viewPortHeight == 0)
+    return false;
 
   // fill m_viewPort[] with line pointers
-  if (m_doubleBuffered) {
-    m_viewPortHeight /= 2;
+  if (m_doubleBuffered)
     m_viewPortVisible = (volatile uint8_t * *) heap_caps_malloc(sizeof(uint8_t*) * m_viewPortHeight, MALLOC_CAP_32BIT);
+  bool hardwareVScroll = FABGLIB_HARDWARE_VSCROLL && !m_doubleBuffered;
+  m_viewPort = (volatile uint8_t * *) heap_caps_malloc(sizeof(uint8_t*) * m_viewPortHeight * (hardwareVScroll ? 2 : 1), MALLOC_CAP_32BIT);
+  if (m_viewPort == NULL || (m_doubleBuffered && m_viewPortVisible == NULL))
+    return false;
+  for (int i = 0; i < m_viewPortHeight; ++i) {
+    m_viewPort[i] = (uint8_t*) allocVideoMemory(rowSize);
+    if (m_doubleBuffered)
+      m_viewPortVisible[i] = (uint8_t*) allocVideoMemory(rowSize);
+    if (m_viewPort[i] == NULL || (m_doubleBuffered && m_viewPortVisible[i] == NULL))
+      return false;
   }
-  m_viewPort = (volatile uint8_t * *) heap_caps_malloc(sizeof(uint8_t*) * m_viewPortHeight, MALLOC_CAP_32BIT);
-  for (int p = 0, l = 0; p < poolsCount; ++p) {
-    uint8_t * pool = m_viewPortMemoryPool[p];
-    for (int i = 0; i < linesCount[p]; ++i) {
-      if (l + i < m_viewPortHeight)
-        m_viewPort[l + i] = pool;
-      else
-        m_viewPortVisible[l + i - m_viewPortHeight] = pool; // set only when double buffered is enabled
-      pool += m_viewPortWidth;
-    }
-    l += linesCount[p];
+
+  // second copy of lines pointers for the viewport ring
+  if (hardwareVScroll) {
+    memcpy(m_viewPort + m_viewPortHeight, m_viewPort, sizeof(uint8_t*) * m_viewPortHeight);
+    m_viewPortRing = m_viewPort;
   }
+
+  return true;
+}
+
+
+// Video memory needed by current mode besides viewport lines: blank lines, DMA descriptors, line buffers and mouse cursor overlay lines
+int VGAControllerClass::calcBuffersVideoMemory()
+{
+  const int lineSize = (m_viewPortWidth + 3) & ~3;
+  int size = 2 * ((m_HLineSize + 3) & ~3);
+  size += (m_doubleBuffered ? 2 : 1) * ((calcRequiredDMABuffersCount(m_viewPortHeight) * sizeof(lldesc_t) + 3) & ~3);
+  if (usesLineBuffers())
+    size += FABGLIB_LINE_BUFFERS_COUNT * lineSize;
+  if (m_mouseCursorOverlay && m_pixelShift == 0)
+    size += FABGLIB_MOUSE_CURSOR_OVERLAY_HEIGHT * lineSize;
+  return size;
 }
 
 
 void VGAControllerClass::freeViewPort()
 {
-  for (uint8_t * * poolPtr = m_viewPortMemoryPool; *poolPtr; ++poolPtr) {
-    heap_caps_free((void*) *poolPtr);
-    *poolPtr = NULL;
-  }
-  heap_caps_free(m_viewPort);
+  // DMA descriptors may be reused by the next resolution, restore sequential links
+  resetViewPortRing();
+
+  // lines memory is returned to video memory by releaseVideoMemory()
+  heap_caps_free(m_viewPortRing ? m_viewPortRing : m_viewPort);
   if (m_doubleBuffered)
     heap_caps_free(m_viewPortVisible);
+  m_viewPortRing    = NULL;
+  m_viewPort        = NULL;
+  m_viewPortVisible = NULL;
+
+  freeBackgroundLayer();
+}
+
+
+// Makes sure video memory contains at least "size" bytes in pieces of "unit" bytes (a multiple of 4), adding blocks as large as
+// possible. Returns false if there isn't enough DMA capable memory.
+bool VGAControllerClass::reserveVideoMemory(int size, int unit)
+{
+  int available = availableVideoMemory(unit);
+  while (available < size && m_videoMemoryBlocks < FABGLIB_VIEWPORT_MEMORY_POOL_COUNT) {
+    const int units = tmin<int>(heap_caps_get_largest_free_block(MALLOC_CAP_DMA) / unit, (size - available + unit - 1) / unit);
+    uint8_t * data = units > 0 ? (uint8_t*) heap_caps_malloc(units * unit, MALLOC_CAP_DMA) : NULL;
+    if (data == NULL)
+      break;
+    VideoMemoryBlock & block = m_videoMemory[m_videoMemoryBlocks++];
+    block.data = data;
+    block.size = units * unit;
+    block.used = 0;
+    available += block.size;
+  }
+  return available >= size;
+}
+
+
+// Free video memory usable as pieces of "unit" bytes (a multiple of 4)
+int VGAControllerClass::availableVideoMemory(int unit)
+{
+  int available = 0;
+  for (int i = 0; i < m_videoMemoryBlocks; ++i)
+    available += (m_videoMemory[i].size - m_videoMemory[i].used) / unit * unit;
+  return available;
+}
+
+
+// Carves "size" bytes (32 bit aligned) from video memory, growing it if necessary. Returns NULL if there isn't enough memory.
+void * VGAControllerClass::allocVideoMemory(int size)
+{
+  size = (size + 3) & ~3;
+  do {
+    for (int i = 0; i < m_videoMemoryBlocks; ++i) {
+      VideoMemoryBlock & block = m_videoMemory[i];
+      if (block.size - block.used >= size) {
+        void * ptr = block.data + block.used;
+        block.used += size;
+        return ptr;
+      }
+    }
+  } while (reserveVideoMemory(availableVideoMemory(size) + size, size));
+  return NULL;
+}
+
+
+// All video memory becomes available again. Blocks are retained for the next resolution.
+void VGAControllerClass::releaseVideoMemory()
+{
+  for (int i = 0; i < m_videoMemoryBlocks; ++i)
+    m_videoMemory[i].used = 0;
+}
+
+
+// Frees the blocks current resolution doesn't use
+void VGAControllerClass::freeUnusedVideoMemory()
+{
+  int count = 0;
+  for (int i = 0; i < m_videoMemoryBlocks; ++i) {
+    if (m_videoMemory[i].used == 0)
+      heap_caps_free(m_videoMemory[i].data);
+    else
+      m_videoMemory[count++] = m_videoMemory[i];
+  }
+  m_videoMemoryBlocks = count;
 }
 
 
-void VGAControllerClass::setResolution(Timings const& timings, int viewPortWidth, int viewPortHeight, bool doubleBuffered)
+bool VGAControllerClass::setResolution(Timings const& timings, int viewPortWidth, int viewPortHeight, bool doubleBuffered)
 {
   if (m_DMABuffers) {
     suspendBackgroundPrimitiveExecution();
@@ -348,14 +567,14 @@ void VGAControllerClass::setResolution(Timings const& timings, int viewPortWidth
     freeBuffers();
   }
 
+  // row sizes and line buffers depend on the pixel format
+  applyPixelFormat();
+
   m_timings = timings;
-  m_doubleBuffered = doubleBuffered;
+  m_doubleBuffered = doubleBuffered && m_scanlineCallback == NULL;
 
   m_HLineSize = m_timings.HFrontPorch + m_timings.HSyncPulse + m_timings.HBackPorch + m_timings.HVisibleArea;
 
-  m_HBlankLine_withVSync = (uint8_t*) heap_caps_malloc(m_HLineSize, MALLOC_CAP_DMA);
-  m_HBlankLine           = (uint8_t*) heap_caps_malloc(m_HLineSize, MALLOC_CAP_DMA);
-
   m_viewPortWidth  = ~3 & (viewPortWidth <= 0 || viewPortWidth >= m_timings.HVisibleArea ? m_timings.HVisibleArea : viewPortWidth); // view port width must be 32 bit aligned
   m_viewPortHeight = viewPortHeight <= 0 || viewPortHeight >= m_timings.VVisibleArea ? m_timings.VVisibleArea : viewPortHeight;
 
@@ -369,22 +588,68 @@ void VGAControllerClass::setResolution(Timings const& timings, int viewPortWidth
 
   m_linesCount = m_timings.VVisibleArea + m_timings.VFrontPorch + m_timings.VSyncPulse + m_timings.VBackPorch;
 
-  // allocate DMA descriptors
-  setDMABuffersCount(calcRequiredDMABuffersCount(m_viewPortHeight));
+  // mouse cursor overlay: RGB222 needs a line for each cursor row, palette formats paint it into line buffers
+  m_mouseCursorOverlay = FABGLIB_MOUSE_CURSOR_OVERLAY && !m_doubleBuffered && m_scanlineCallback == NULL;
+
+  // allocate the viewport, then the other buffers from the remaining video memory
+  const int videoMemoryBlocks = m_videoMemoryBlocks;
+  bool allocated = allocateViewPort(calcBuffersVideoMemory());
+  if (allocated) {
+    m_HBlankLine_withVSync = (uint8_t*) allocVideoMemory(m_HLineSize);
+    m_HBlankLine           = (uint8_t*) allocVideoMemory(m_HLineSize);
+    allocated = m_HBlankLine_withVSync && m_HBlankLine && setDMABuffersCount(calcRequiredDMABuffersCount(m_viewPortHeight));
+  }
+
+  // line buffers and palette conversion tables
+  if (allocated && usesLineBuffers()) {
+    m_lineBuffers = (uint8_t*) allocVideoMemory(FABGLIB_LINE_BUFFERS_COUNT * ((m_viewPortWidth + 3) & ~3));
+    allocated = m_lineBuffers != NULL;
+  }
+  if (allocated && m_pixelShift) {
+    m_paletteExpand = (uint32_t*) heap_caps_malloc(sizeof(uint32_t) * 256, MALLOC_CAP_32BIT);
+    allocated = m_paletteExpand != NULL;
+  }
+
+  if (!allocated) {
+    // not enough memory: video output remains stopped, with an empty viewport. Blocks added for this mode are given back, so they don't
+    // take the slots of FABGLIB_VIEWPORT_MEMORY_POOL_COUNT.
+    freeBuffers();
+    while (m_videoMemoryBlocks > videoMemoryBlocks)
+      heap_caps_free(m_videoMemory[--m_videoMemoryBlocks].data);
+    m_viewPortWidth = m_viewPortHeight = 0;
+    m_paintState.clippingRect = m_paintState.absClippingRect = Rect(0, 0, -1, -1);
+    return false;
+  }
 
-  // allocate the viewport
-  allocateViewPort();
+  updatePaletteTables();
 
-  // this may free space if m_viewPortHeight has been reduced
-  setDMABuffersCount(calcRequiredDMABuffersCount(m_viewPortHeight));
+  if (m_mouseCursorOverlay && m_pixelShift == 0) {
+    m_overlayLines = (uint8_t*) allocVideoMemory(FABGLIB_MOUSE_CURSOR_OVERLAY_HEIGHT * ((m_viewPortWidth + 3) & ~3));
+    m_mouseCursorOverlay = m_overlayLines != NULL;
+  }
+  if (m_mouseCursorOverlay) {
+    // cursor is no more a sprite
+    m_mouseCursor.savedBackgroundWidth = m_mouseCursor.savedBackgroundHeight = 0;
+    m_overlayDirty = true;
+  }
 
   // fill buffers
   fillVertBuffers(0);
   fillHorizBuffers(0);
 
   // fill view port
-  for (int i = 0; i < m_viewPortHeight; ++i)
-    fill(m_viewPort[i], 0, m_viewPortWidth, 0, 0, 0, false, false);
+  for (int i = 0; m_viewPort && i < m_viewPortHeight; ++i) {
+    if (m_pixelShift)
+      memset((uint8_t*) m_viewPort[i], 0, getViewPortRowSize());
+    else
+      fill(m_viewPort[i], 0, m_viewPortWidth, 0, 0, 0, false, false);
+  }
+
+  // line buffers of the first lines, next ones are prepared by I2SInterrupt()
+  if (usesLineBuffers()) {
+    for (int i = 0; i < FABGLIB_LINE_BUFFERS_COUNT; ++i)
+      prepareLineBuffer(i);
+  }
 
   m_DMABuffersHead->qe.stqe_next = (lldesc_t*) &m_DMABuffersVisible[0];
 
@@ -403,20 +668,44 @@ void VGAControllerClass::setResolution(Timings const& timings, int viewPortWidth
   m_maxVSyncISRTime = ceil(1000000.0 / m_timings.frequency * m_timings.scanCount * m_HLineSize * (m_timings.VSyncPulse + m_timings.VBackPorch + m_viewPortRow));
 
   SquareWaveGenerator.play(m_timings.frequency, m_DMABuffers);
+
+  // line buffers: an interrupt is generated at the end of each viewport line (see setDMABufferView())
+  if (usesLineBuffers()) {
+    if (m_I2SInterruptHandle == NULL)
+      esp_intr_alloc(ETS_I2S1_INTR_SOURCE, ESP_INTR_FLAG_LEVEL3 | ESP_INTR_FLAG_IRAM, I2SInterrupt, this, &m_I2SInterruptHandle);
+    I2S1.int_clr.val     = 0xFFFFFFFF;
+    I2S1.int_ena.out_eof = 1;
+  }
+
   resumeBackgroundPrimitiveExecution();
+
+  return true;
 }
 
 
+// also frees buffers of a mode partially allocated by setResolution()
 void VGAControllerClass::freeBuffers()
 {
-  if (m_DMABuffersCount > 0) {
-    heap_caps_free((void*)m_HBlankLine_withVSync);
-    heap_caps_free((void*)m_HBlankLine);
+  if (m_I2SInterruptHandle) {
+    I2S1.int_ena.out_eof = 0;
+    esp_intr_free(m_I2SInterruptHandle);
+    m_I2SInterruptHandle = NULL;
+  }
+  heap_caps_free(m_paletteExpand);
+  m_paletteExpand = NULL;
+  m_lineBuffers = NULL;
+  m_HBlankLine = m_HBlankLine_withVSync = NULL;
+  m_overlayLines = NULL;
+  m_overlayBitmap = NULL;
+  m_overlayRows = 0;
+  m_mouseCursorOverlay = false;
 
-    freeViewPort();
+  freeViewPort();
 
-    setDMABuffersCount(0);
-  }
+  setDMABuffersCount(0);
+
+  // blank lines, descriptors, line buffers and viewport lines
+  releaseVideoMemory();
 }
 
 
@@ -450,6 +739,13 @@ int VGAControllerClass::calcRequiredDMABuffersCount(int viewPortHeight)
 
 void VGAControllerClass::fillVertBuffers(int offsetY)
 {
+  // viewport lines are reassigned in order to the DMA descriptors
+  resetViewPortRing();
+
+  int viewPortBuffersPerLine, viewPos;
+  getViewPortLineDMABuffers(&viewPortBuffersPerLine, &viewPos);
+  m_lineDMABuffers = viewPortBuffersPerLine * m_timings.scanCount;
+
   int16_t porchSum = m_timings.VFrontPorch + m_timings.VBackPorch;
   m_timings.VFrontPorch = tmax(1, (int16_t)m_timings.VFrontPorch - offsetY);
   m_timings.VBackPorch  = tmax(1, porchSum - m_timings.VFrontPorch);
@@ -603,13 +899,11 @@ void VGAControllerClass::shrinkScreen(int shrinkX, int shrinkY)
 }
 
 
-// Can be used to change buffers count, maintainig already set pointers.
+// Descriptors are carved from video memory. A smaller count reuses current descriptors, relinking them.
 bool VGAControllerClass::setDMABuffersCount(int buffersCount)
 {
   if (buffersCount == 0) {
-    heap_caps_free( (void*) m_DMABuffers );
-    if (m_doubleBuffered)
-      heap_caps_free( (void*) m_DMABuffersVisible );
+    // memory is returned to video memory by releaseVideoMemory()
     m_DMABuffers = NULL;
     m_DMABuffersVisible = NULL;
     m_DMABuffersCount = 0;
@@ -621,20 +915,24 @@ bool VGAControllerClass::setDMABuffersCount(int buffersCount)
     // buffers head
     if (m_DMABuffersHead == NULL) {
       m_DMABuffersHead = (lldesc_t*) heap_caps_malloc(sizeof(lldesc_t), MALLOC_CAP_DMA);
+      if (m_DMABuffersHead == NULL)
+        return false;
       m_DMABuffersHead->eof    = m_DMABuffersHead->sosf = m_DMABuffersHead->offset = 0;
       m_DMABuffersHead->owner  = 1;
       m_DMABuffersHead->size   = 0;
       m_DMABuffersHead->length = 0;
-      m_DMABuffersHead->buf    = m_HBlankLine;  // dummy valid address. Setting NULL crashes DMA!
       m_DMABuffersHead->qe.stqe_next = NULL;  // this will be set before the first frame
     }
+    m_DMABuffersHead->buf = m_HBlankLine;  // dummy valid address. Setting NULL crashes DMA! Blank lines are carved again by each mode
 
-    // (re)allocate and initialize DMA descs
-    m_DMABuffers = (lldesc_t*) heap_caps_realloc((void*)m_DMABuffers, buffersCount * sizeof(lldesc_t), MALLOC_CAP_DMA);
-    if (m_doubleBuffered)
-      m_DMABuffersVisible = (lldesc_t*) heap_caps_realloc((void*)m_DMABuffersVisible, buffersCount * sizeof(lldesc_t), MALLOC_CAP_DMA);
-    else
-      m_DMABuffersVisible = m_DMABuffers;
+    // allocate and initialize DMA descs
+    if (buffersCount > m_DMABuffersCount) {
+      m_DMABuffers = (lldesc_t*) allocVideoMemory(buffersCount * sizeof(lldesc_t));
+      if (m_doubleBuffered)
+        m_DMABuffersVisible = (lldesc_t*) allocVideoMemory(buffersCount * sizeof(lldesc_t));
+      else
+        m_DMABuffersVisible = m_DMABuffers;
+    }
     if (!m_DMABuffers || !m_DMABuffersVisible)
       return false;
 
@@ -681,12 +979,15 @@ void VGAControllerClass::setDMABufferView(int index, int row, int scan, volatile
   uint8_t * bufferPtr;
   if (scan > 0 && m_timings.multiScanBlack == 1 && m_timings.HStartingBlock == FrontPorch)
     bufferPtr = (uint8_t *) (m_HBlankLine + m_HLineSize - m_timings.HVisibleArea);  // this works only when HSYNC, FrontPorch and BackPorch are at the beginning of m_HBlankLine
+  else if (usesLineBuffers())
+    bufferPtr = (uint8_t *) (m_lineBuffers + (row % FABGLIB_LINE_BUFFERS_COUNT) * ((m_viewPortWidth + 3) & (~3)));
   else
     bufferPtr = (uint8_t *) viewPort[row];
   lldesc_t volatile * DMABuffers = onVisibleDMA ? m_DMABuffersVisible : m_DMABuffers;
   DMABuffers[index].size   = (m_viewPortWidth + 3) & (~3);
   DMABuffers[index].length = m_viewPortWidth;
   DMABuffers[index].buf    = bufferPtr;
+  DMABuffers[index].eof    = usesLineBuffers() && scan == m_timings.scanCount - 1;  // generates I2SInterrupt() at the end of the line
 }
 
 
@@ -717,6 +1018,351 @@ uint8_t IRAM_ATTR VGAControllerClass::preparePixel(RGB rgb, bool HSync, bool VSy
 }
 
 
+// value to store in the viewport to paint the specified color: the raw pixel or the nearest palette index
+uint8_t IRAM_ATTR VGAControllerClass::preparePattern(RGB rgb)
+{
+  return m_pixelShift ? m_paletteIndex[(rgb.B << BLUE_BIT) | (rgb.G << GREEN_BIT) | (rgb.R << RED_BIT)] : preparePixel(rgb);
+}
+
+
+inline void IRAM_ATTR VGAControllerClass::setRowPixel(uint8_t volatile * row, int x, uint8_t value)
+{
+  if (m_pixelShift == 0)
+    PIXELINROW(row, x) = value;
+  else {
+    const int bits  = 8 >> m_pixelShift;
+    const int shift = (~x & ((1 << m_pixelShift) - 1)) * bits;
+    uint8_t volatile * b = row + (x >> m_pixelShift);
+    *b = (*b & ~(((1 << bits) - 1) << shift)) | (value << shift);
+  }
+}
+
+
+inline uint8_t IRAM_ATTR VGAControllerClass::getRowPixel(uint8_t volatile * row, int x)
+{
+  if (m_pixelShift == 0)
+    return PIXELINROW(row, x);
+  const int bits  = 8 >> m_pixelShift;
+  const int shift = (~x & ((1 << m_pixelShift) - 1)) * bits;
+  return (row[x >> m_pixelShift] >> shift) & ((1 << bits) - 1);
+}
+
+
+// paints bitmap pixel "src" (AABBGGRR) at "x" of a viewport row of palette indexes, translucent pixels are blended with current palette color
+inline void IRAM_ATTR VGAControllerClass::drawPalettePixel(uint8_t volatile * row, int x, uint8_t src)
+{
+  if (src >= 0xC0)
+    setRowPixel(row, x, m_paletteIndex[src & 0x3F]);
+  else if (src >> 6)
+    setRowPixel(row, x, m_paletteIndex[blendPixel(src, m_palette[getRowPixel(row, x)] & 0x3F)]);
+}
+
+
+// byte containing "pattern" in all its pixels
+static inline uint8_t IRAM_ATTR replicatePattern(uint8_t pattern, int pixelShift)
+{
+  return pixelShift == 0 ? pattern : (pixelShift == 1 ? pattern * 0x11 : pattern * 0x55);
+}
+
+
+// the running viewport keeps its format until setResolution() calls applyPixelFormat()
+void VGAControllerClass::setPixelFormat(PixelFormat value)
+{
+  m_pendingPixelFormat = value;
+  m_pixelFormatPending = true;
+}
+
+
+// Applies the format set by setPixelFormat(), restoring its default palette. Viewport must be freed.
+void VGAControllerClass::applyPixelFormat()
+{
+  if (!m_pixelFormatPending)
+    return;
+  m_pixelFormatPending = false;
+  m_pixelFormat = m_pendingPixelFormat;
+  m_pixelShift  = (m_pixelFormat == PixelFormat::Palette16 ? 1 : (m_pixelFormat == PixelFormat::Palette4 ? 2 : 0));
+  for (int i = 0; i < 16; ++i)
+    m_paletteColors[i] = m_pixelFormat == PixelFormat::Palette4 ? RGB(PALETTE4_DEFAULT[i & 3]) : COLOR2RGB[i];
+}
+
+
+void VGAControllerClass::setPaletteItem(int index, RGB const & color)
+{
+  m_paletteColors[index & 15] = color;
+  updatePaletteTables();
+}
+
+
+void VGAControllerClass::setScanlineCallback(ScanlineCallback callback, void * arg)
+{
+  m_scanlineCallback    = callback;
+  m_scanlineCallbackArg = arg;
+}
+
+
+void IRAM_ATTR VGAControllerClass::renderGlyphsBufferScanline(GlyphsBuffer const * glyphsBuffer, uint8_t * dest, int scanLine)
+{
+  const int glyphsWidth    = glyphsBuffer->glyphsWidth;
+  const int glyphsHeight   = glyphsBuffer->glyphsHeight;
+  const int glyphWidthByte = (glyphsWidth + 7) / 8;
+  const int row            = scanLine / glyphsHeight;
+  const int glyphY         = scanLine - row * glyphsHeight;
+  const uint8_t black      = preparePixel(RGB(0, 0, 0));
+
+  int x = 0;
+
+  if (row < glyphsBuffer->rows) {
+    uint32_t const * mapItem = glyphsBuffer->map + row * glyphsBuffer->columns;
+    for (int col = 0; col < glyphsBuffer->columns; ++col, ++mapItem) {
+
+      GlyphOptions options = glyphMapItem_getOptions(mapItem);
+      const int step = options.doubleWidth ? 2 : 1;
+      if (x + glyphsWidth * step > m_viewPortWidth)
+        break;
+
+      RGB penColor   = COLOR2RGB[(int) glyphMapItem_getFGColor(mapItem)];
+      RGB brushColor = COLOR2RGB[(int) glyphMapItem_getBGColor(mapItem)];
+      if (options.invert)
+        tswap(penColor, brushColor);
+      if (options.reduceLuminosity) {
+        if (penColor.R > 2) penColor.R -= 2;
+        if (penColor.G > 2) penColor.G -= 2;
+        if (penColor.B > 2) penColor.B -= 2;
+      }
+      const uint8_t penPattern   = preparePixel(penColor);
+      const uint8_t brushPattern = preparePixel(brushColor);
+
+      if (options.blank || (options.underline && glyphY == glyphsHeight - FABGLIB_UNDERLINE_POSITION - 1)) {
+        const uint8_t pattern = options.blank ? brushPattern : penPattern;
+        for (int i = 0; i < glyphsWidth * step; ++i, ++x)
+          PIXELINROW(dest, x) = pattern;
+        continue;
+      }
+
+      // double height takes top or bottom half of the glyph
+      int srcY = glyphY;
+      if (options.doubleWidth > 1)
+        srcY = (options.doubleWidth == 2 ? 0 : (glyphsHeight >> 1)) + (glyphY >> 1);
+      uint8_t const * srcrow = glyphsBuffer->glyphsData + (glyphMapItem_getIndex(mapItem) * glyphsHeight + srcY) * glyphWidthByte;
+
+      bool prevSet = false;
+      for (int gx = 0; gx < glyphsWidth; ++gx) {
+        bool set = (srcrow[gx >> 3] << (gx & 7)) & 0x80;
+        const uint8_t pattern = set || (options.bold && prevSet) ? penPattern : brushPattern;
+        prevSet = set;
+        PIXELINROW(dest, x) = pattern;
+        ++x;
+        if (step == 2) {
+          PIXELINROW(dest, x) = pattern;
+          ++x;
+        }
+      }
+    }
+  }
+
+  for (; x < m_viewPortWidth; ++x)
+    PIXELINROW(dest, x) = black;
+}
+
+
+// first byte (runs count) of row "y" of a RLE encoded bitmap
+static inline uint8_t const * IRAM_ATTR RLEBitmapRow(Bitmap const * bitmap, int y)
+{
+  uint8_t const * data = bitmap->data;
+  return data + (data[y * 2] | (data[y * 2 + 1] << 8));
+}
+
+
+// paints row "y" of a bitmap placed at horizontal position X into a line of raw pixels, clipped to 0...width-1
+static void IRAM_ATTR paintBitmapRow(uint8_t * dest, Bitmap const * bitmap, int y, int X, int width)
+{
+  const int x1 = tmax<int>(0, X);
+  const int x2 = tmin<int>(width, X + bitmap->width);
+  if (bitmap->encoding == RLEBitmap) {
+    uint8_t const * run = RLEBitmapRow(bitmap, y);
+    for (int runs = *run++, x = X; runs > 0 && x < x2; --runs) {
+      x += *run++;
+      const int count = *run++;
+      for (int i = tmax(x, x1); i < tmin(x + count, x2); ++i)
+        drawRawPixel(dest, i, run[i - x]);
+      run += count;
+      x += count;
+    }
+    return;
+  }
+  uint8_t const * src = bitmap->data + y * bitmap->width - X;
+  for (int x = x1; x < x2; ++x)
+    drawRawPixel(dest, x, src[x]);
+}
+
+
+void IRAM_ATTR VGAControllerClass::renderSpritesScanline(uint8_t * dest, int scanLine)
+{
+  // last "sprite" is the mouse cursor
+  for (int i = 0; i <= m_spritesCount; ++i) {
+    Sprite * sprite = getSprite(i);
+    if (!sprite->visible || sprite->framesCount == 0)
+      continue;
+    Bitmap const * bitmap = sprite->getFrame();
+    const int y = scanLine - sprite->y;
+    if (y >= 0 && y < bitmap->height)
+      paintBitmapRow(dest, bitmap, y, sprite->x, m_viewPortWidth);
+  }
+}
+
+
+void VGAControllerClass::updatePaletteTables()
+{
+  if (m_pixelShift == 0)
+    return;
+
+  const int colors = 1 << (8 >> m_pixelShift);
+
+  for (int i = 0; i < colors; ++i)
+    m_palette[i] = preparePixel(m_paletteColors[i]);
+
+  // nearest palette item of each RGB222 color
+  for (int c = 0; c < 64; ++c) {
+    int bestDist = INT_MAX;
+    for (int i = 0; i < colors; ++i) {
+      int dR = ((c >> RED_BIT) & 3)   - m_paletteColors[i].R;
+      int dG = ((c >> GREEN_BIT) & 3) - m_paletteColors[i].G;
+      int dB = ((c >> BLUE_BIT) & 3)  - m_paletteColors[i].B;
+      int dist = dR * dR + dG * dG + dB * dB;
+      if (dist < bestDist) {
+        bestDist = dist;
+        m_paletteIndex[c] = i;
+      }
+    }
+  }
+
+  // raw pixels of each byte of indexes, in PIXELINROW order:
+  //   Palette16 : low 16 bits contain pixels 0, 1 (a half word, see expandPaletteRow())
+  //   Palette4  : a whole word with pixels 2, 3, 0, 1
+  if (m_paletteExpand) {
+    for (int b = 0; b < 256; ++b) {
+      if (m_pixelShift == 1)
+        m_paletteExpand[b] = m_palette[b >> 4] | (m_palette[b & 0xF] << 8);
+      else
+        m_paletteExpand[b] = m_palette[(b >> 2) & 3] | (m_palette[b & 3] << 8) | (m_palette[b >> 6] << 16) | (m_palette[(b >> 4) & 3] << 24);
+    }
+  }
+}
+
+
+// converts a viewport row of palette indexes to a line of raw pixels
+void IRAM_ATTR VGAControllerClass::expandPaletteRow(uint8_t volatile * dest, uint8_t volatile * src)
+{
+  uint32_t * dst = (uint32_t *) dest;
+  uint32_t const * expand = m_paletteExpand;
+  const int words = m_viewPortWidth >> 2;
+  if (m_pixelShift == 1) {
+    for (int i = 0; i < words; ++i, src += 2)
+      dst[i] = expand[src[1]] | (expand[src[0]] << 16);
+  } else {
+    for (int i = 0; i < words; ++i)
+      dst[i] = expand[src[i]];
+  }
+}
+
+
+// prepares the line buffer of the specified viewport line
+void IRAM_ATTR VGAControllerClass::prepareLineBuffer(int line)
+{
+  uint8_t * dest = (uint8_t *) (m_lineBuffers + (line % FABGLIB_LINE_BUFFERS_COUNT) * ((m_viewPortWidth + 3) & ~3));
+  if (m_scanlineCallback)
+    m_scanlineCallback(m_scanlineCallbackArg, dest, line);
+  else {
+    expandPaletteRow(dest, (m_doubleBuffered ? m_viewPortVisible : m_viewPort)[line]);
+    // mouse cursor overlay
+    Bitmap const * bitmap = m_overlayBitmap;
+    if (m_mouseCursorOverlay && bitmap && line >= m_overlayY && line < m_overlayY + bitmap->height)
+      paintBitmapRow(dest, bitmap, line - m_overlayY, m_overlayX, m_viewPortWidth);
+  }
+}
+
+
+// Mouse cursor overlay, invoked at VSync, when the viewport is not displayed. Takes a snapshot of cursor position and bitmap, then
+// (RGB222 only) links back the previous rows to the viewport and composites the new ones.
+void IRAM_ATTR VGAControllerClass::updateMouseCursorOverlay()
+{
+  if (!m_mouseCursorOverlay || !m_overlayDirty)
+    return;
+  m_overlayDirty = false;
+
+  Bitmap const * bitmap = m_overlayCursor;
+  m_overlayX      = m_mouseCursor.x;
+  m_overlayY      = m_mouseCursor.y;
+  m_overlayBitmap = bitmap;
+
+  // palette formats: cursor is painted by prepareLineBuffer()
+  if (m_pixelShift)
+    return;
+
+  const int lineSize = (m_viewPortWidth + 3) & ~3;
+
+  for (int i = 0; i < m_overlayRows; ++i)
+    patchMouseCursorOverlayRow(m_overlayRingRow + i, m_overlayLines + i * lineSize, false);
+  m_overlayRows = 0;
+
+  if (bitmap == NULL)
+    return;
+
+  const int y1 = tmax<int>(0, m_overlayY);
+  const int y2 = tmin<int>(m_viewPortHeight, m_overlayY + tmin<int>(bitmap->height, FABGLIB_MOUSE_CURSOR_OVERLAY_HEIGHT));
+  m_overlayRingRow = m_viewPortRingOffset + y1;
+  for (int y = y1; y < y2; ++y) {
+    uint8_t * line = m_overlayLines + (y - y1) * lineSize;
+    memcpy(line, (uint8_t*) m_viewPort[y], m_viewPortWidth);
+    paintBitmapRow(line, bitmap, y - m_overlayY, m_overlayX, m_viewPortWidth);
+    patchMouseCursorOverlayRow(m_overlayRingRow + y - y1, line, true);
+  }
+  m_overlayRows = tmax(0, y2 - y1);
+}
+
+
+// Links DMA descriptors of viewport ring row "ringRow" (all scans) to "line" (patch = true) or back to its viewport row (patch = false).
+// Descriptors relinked meanwhile by scrolling are left untouched.
+void IRAM_ATTR VGAControllerClass::patchMouseCursorOverlayRow(int ringRow, uint8_t * line, bool patch)
+{
+  int buffersPerLine, viewPos;
+  getViewPortLineDMABuffers(&buffersPerLine, &viewPos);
+  ringRow %= m_viewPortHeight;
+  uint8_t * row = (uint8_t *) (m_viewPortRing ? m_viewPortRing[ringRow] : m_viewPort[ringRow]);
+  for (int scan = 0; scan < m_timings.scanCount; ++scan) {
+    lldesc_t volatile * desc = &m_DMABuffers[m_viewPortRow * m_timings.scanCount + (ringRow * m_timings.scanCount + scan) * buffersPerLine + viewPos];
+    if (desc->buf == (patch ? row : line))
+      desc->buf = patch ? line : row;
+  }
+}
+
+
+// line buffers: invoked at the end of each viewport line "y", prepares the line buffer for line "y + FABGLIB_LINE_BUFFERS_COUNT"
+void IRAM_ATTR VGAControllerClass::I2SInterrupt(void * arg)
+{
+  VGAControllerClass * ctrl = (VGAControllerClass *) arg;
+
+  if (I2S1.int_st.out_eof) {
+    // descriptor may belong to the visible or to the drawing DMA buffers (double buffering)
+    lldesc_t volatile * desc = (lldesc_t volatile *) (uintptr_t) I2S1.out_eof_des_addr;
+    lldesc_t volatile * DMABuffers = ctrl->m_DMABuffersVisible;
+    if (desc < DMABuffers || desc >= DMABuffers + ctrl->m_DMABuffersCount)
+      DMABuffers = ctrl->m_DMABuffers;
+
+    const int height = ctrl->m_viewPortHeight;
+    int line = (desc - DMABuffers - ctrl->m_viewPortRow * ctrl->m_timings.scanCount) / ctrl->m_lineDMABuffers;
+    if (line >= 0 && line < height) {
+      int nextLine = line + FABGLIB_LINE_BUFFERS_COUNT;
+      if (nextLine >= height)
+        nextLine -= height;
+      ctrl->prepareLineBuffer(nextLine);
+    }
+  }
+
+  I2S1.int_clr.val = I2S1.int_st.val;
+}
+
+
 // buffer: buffer to fill (buffer size must be 32 bit aligned)
 // startPos: initial position (in pixels)
 // length: number of pixels to fill
@@ -749,14 +1395,26 @@ void VGAControllerClass::enableBackgroundPrimitiveExecution(bool value)
 
 
 // Suspend vertical sync interrupt
-// Warning: After call to suspendBackgroundPrimitiveExecution() adding primitives may cause a deadlock.
-// To avoid this a call to "processPrimitives()" should be performed very often.
+// Primitives added meanwhile by the suspending task are executed by itself when the queue is full or a fence is waited (see mustExecQueue()).
+// Anyway a call to "processPrimitives()" should be performed very often.
 // Can be nested
 void VGAControllerClass::suspendBackgroundPrimitiveExecution()
 {
   ++m_VSyncInterruptSuspended;
-  if (m_VSyncInterruptSuspended == 1)
+  if (m_VSyncInterruptSuspended == 1) {
     detachInterrupt(digitalPinToInterrupt(m_VSyncGPIO));
+    m_suspendingTask = xTaskGetCurrentTaskHandle();
+  }
+  if (m_renderTask && m_renderTask != xTaskGetCurrentTaskHandle()) {
+    // wake up render task if waiting for vertical sync, then sleep until it completes current primitive (see renderTaskSetIdle())
+    xTaskNotify(m_renderTask, RENDERTASK_WAKE, eSetBits);
+    while (m_renderTaskBusy) {
+      m_renderTaskIdleWaitTask = xTaskGetCurrentTaskHandle();
+      if (m_renderTaskBusy)
+        ulTaskNotifyTake(pdTRUE, 1);
+    }
+    m_renderTaskIdleWaitTask = NULL;
+  }
 }
 
 
@@ -765,67 +1423,622 @@ void VGAControllerClass::suspendBackgroundPrimitiveExecution()
 void VGAControllerClass::resumeBackgroundPrimitiveExecution()
 {
   m_VSyncInterruptSuspended = tmax(0, m_VSyncInterruptSuspended - 1);
-  if (m_VSyncInterruptSuspended == 0)
+  if (m_VSyncInterruptSuspended == 0) {
+    m_suspendingTask = NULL;
     attachInterrupt(digitalPinToInterrupt(m_VSyncGPIO), VSyncInterrupt, m_timings.VSyncLogic == '-' ? FALLING : RISING);
+    if (m_renderTask)
+      xTaskNotify(m_renderTask, RENDERTASK_WAKE, eSetBits);
+  }
 }
 
 
-void VGAControllerClass::addPrimitive(Primitive const & primitive)
+void VGAControllerClass::enableRenderTask(bool value)
 {
-  if ((m_backgroundPrimitiveExecutionEnabled && m_doubleBuffered == false) || primitive.cmd == PrimitiveCmd::SwapBuffers)
-    xQueueSendToBack(m_execQueue, &primitive, portMAX_DELAY);
-  else {
-    execPrimitive(primitive);
-    showSprites();
+  if (value == (m_renderTask != NULL))
+    return;
+  // task is created or deleted while it is not executing primitives
+  suspendBackgroundPrimitiveExecution();
+  if (value) {
+    xTaskCreatePinnedToCore(&renderTask, "", FABGLIB_RENDER_TASK_STACK_SIZE, this, FABGLIB_RENDER_TASK_PRIORITY, &m_renderTask, FABGLIB_RENDER_TASK_CORE);
+  } else {
+    vTaskDelete(m_renderTask);
+    m_renderTask = NULL;
   }
+  resumeBackgroundPrimitiveExecution();
 }
 
 
-void VGAControllerClass::primitivesExecutionWait()
+void IRAM_ATTR VGAControllerClass::renderTask(void * arg)
 {
-  while (uxQueueMessagesWaiting(m_execQueue) > 0)
-    ;
-}
+  VGAControllerClass * ctrl = (VGAControllerClass*) arg;
 
+  while (true) {
+    Primitive prim;
+    xQueuePeek(ctrl->m_execQueue, &prim, portMAX_DELAY);
 
-// Use for fast queue processing. Warning, may generate flickering because don't care of vertical sync
-// Do not call inside ISR
-void IRAM_ATTR VGAControllerClass::processPrimitives()
-{
-  suspendBackgroundPrimitiveExecution();
-  Primitive prim;
-  while (xQueueReceive(m_execQueue, &prim, 0) == pdTRUE)
-    execPrimitive(prim);
-  showSprites();
-  resumeBackgroundPrimitiveExecution();
-}
+    ctrl->m_renderTaskBusy = true;
 
+    if (ctrl->m_VSyncInterruptSuspended > 0) {
+      // wait for resumeBackgroundPrimitiveExecution()
+      ctrl->renderTaskSetIdle();
+      xTaskNotifyWait(0, 0xFFFFFFFF, NULL, portMAX_DELAY);
+      continue;
+    }
 
-void IRAM_ATTR VGAControllerClass::VSyncInterrupt()
-{
-  int64_t startTime = esp_timer_get_time();
-  bool isFirst = true;
-  do {
-    Primitive prim;
-    if (xQueueReceiveFromISR(VGAController.m_execQueue, &prim, NULL) == pdFALSE)
-      break;
+    #if FABGLIB_HAS_FRAME_STATS
+    int64_t startTime = esp_timer_get_time();
+    uint32_t executedBefore = ctrl->m_frameStats.primitivesExecuted;
+    ctrl->m_frameStats.lastSpritesTime = 0;
+    #endif
+
+    while (ctrl->m_VSyncInterruptSuspended == 0 && xQueueReceive(ctrl->m_execQueue, &prim, 0) == pdTRUE) {
+      ctrl->renderTaskExecPrimitive(prim);
+      ++ctrl->m_primitivesCompleted;
+    }
+    ctrl->showSprites();
+
+    #if FABGLIB_HAS_FRAME_STATS
+    ctrl->updateFrameStats(startTime, executedBefore, false);
+    #endif
+
+    ctrl->renderTaskSetIdle();
+
+    ctrl->notifyPrimitivesFenceWaiter();
+  }
+}
+
+
+void IRAM_ATTR VGAControllerClass::renderTaskExecPrimitive(Primitive const & prim)
+{
+  switch (prim.cmd) {
+
+    case PrimitiveCmd::SwapBuffers:
+      renderTaskWaitVSync();
+      execPrimitive(prim);
+      break;
+
+    case PrimitiveCmd::SmoothVScroll:
+    {
+      Primitive step;
+      step.cmd    = prim.cmd;
+      step.ivalue = prim.ivalue;
+      while (execSmoothVScrollStep(&step))
+        renderTaskWaitVSync();
+      break;
+    }
+
+    case PrimitiveCmd::ExecuteBatch:
+      // execute batched primitives one by one, because of SwapBuffers
+      for (int i = 0; i < prim.ivalue; ++i, ++m_batchReadPos)
+        renderTaskExecPrimitive(m_batch[m_batchReadPos & (FABGLIB_PRIMITIVES_BATCH_SIZE - 1)]);
+      break;
+
+    default:
+      execPrimitive(prim);
+      break;
+
+  }
+}
+
+
+// Clears m_renderTaskBusy and wakes up the task waiting for it in suspendBackgroundPrimitiveExecution()
+void IRAM_ATTR VGAControllerClass::renderTaskSetIdle()
+{
+  m_renderTaskBusy = false;
+  TaskHandle_t task = m_renderTaskIdleWaitTask;
+  if (task) {
+    m_renderTaskIdleWaitTask = NULL;
+    xTaskNotifyGive(task);
+  }
+}
+
+
+// Wait for next vertical sync. Returns immediately if suspendBackgroundPrimitiveExecution() is called meanwhile.
+void IRAM_ATTR VGAControllerClass::renderTaskWaitVSync()
+{
+  // discard a vertical sync already occurred
+  xTaskNotifyWait(0, 0xFFFFFFFF, NULL, 0);
+  uint32_t value = 0;
+  while (m_VSyncInterruptSuspended == 0 && (value & RENDERTASK_VSYNC) == 0)
+    xTaskNotifyWait(0, 0xFFFFFFFF, &value, portMAX_DELAY);
+}
+
+
+// Raw bitmaps up to this size (in bytes) are copied into the primitives arena. Larger ones are usually persistent images.
+#define ARENA_BITMAP_MAX_SIZE (FABGLIB_PRIMITIVES_ARENA_SIZE / 8)
+
+
+// arena blocks start with a 32 bit header containing the block size (header included)
+#define ARENA_BLOCK_HEADER_SIZE 4
+
+
+// Returns true if primitive parameters must be copied into the primitives arena when queued
+static bool usesArena(Primitive const & primitive)
+{
+  switch (primitive.cmd) {
+    case PrimitiveCmd::DrawText:
+    case PrimitiveCmd::DrawPath:
+    case PrimitiveCmd::FillPath:
+    #if FABGLIB_HAS_READWRITE_RAW_DATA
+    case PrimitiveCmd::ReadRawData:
+    case PrimitiveCmd::WriteRawData:
+    #endif
+      return true;
+    case PrimitiveCmd::DrawBitmap:
+    {
+      Bitmap const * bitmap = primitive.bitmapDrawingInfo.bitmap;
+      return bitmap->encoding == RawBitmap && bitmap->width * bitmap->height <= ARENA_BITMAP_MAX_SIZE;
+    }
+    default:
+      return false;
+  }
+}
+
+
+// Return the fence of queued primitive, or 0 if the primitive has been batched or executed immediately
+uint32_t VGAControllerClass::addPrimitive(Primitive const & primitive)
+{
+  // scanline mode: nothing to draw into
+  if (m_scanlineCallback && m_viewPort == NULL)
+    return 0;
+
+  if (primitive.cmd == PrimitiveCmd::FillPath && m_pathEdges == NULL) {
+    // accessed by VSync interrupt, so it must be in internal memory
+    m_pathEdges       = (PathEdge*) heap_caps_malloc(sizeof(PathEdge) * FABGLIB_MAX_PATH_EDGES, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    m_pathActiveEdges = (int16_t*) heap_caps_malloc(sizeof(int16_t) * FABGLIB_MAX_PATH_EDGES, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  }
+
+  if ((m_backgroundPrimitiveExecutionEnabled && m_doubleBuffered == false) || primitive.cmd == PrimitiveCmd::SwapBuffers) {
+    if (usesArena(primitive)) {
+      return sendArenaPrimitive(primitive);
+    } else if (m_batchLevel > 0 && m_batchOwner == xTaskGetCurrentTaskHandle()) {
+      if (m_batchWritePos - m_batchReadPos >= FABGLIB_PRIMITIVES_BATCH_SIZE) {
+        // batch ring is full, publish it and sleep until it has been executed
+        flushPrimitivesBatch();
+        waitPrimitivesFence(m_primitivesSubmitted);
+      }
+      m_batch[m_batchWritePos & (FABGLIB_PRIMITIVES_BATCH_SIZE - 1)] = primitive;
+      ++m_batchWritePos;
+    } else {
+      uint32_t fence = sendPrimitive(primitive);
+      #if FABGLIB_HAS_FRAME_STATS
+      updateQueueHighWater();
+      #endif
+      return fence;
+    }
+  } else {
+    execPrimitive(primitive);
+    showSprites();
+  }
+  return 0;
+}
+
+
+// Counter is incremented before sending and read after, so the returned fence cannot be passed before the primitive has been executed, even
+// when other tasks are sending primitives at the same time (at worst it includes some of their primitives)
+uint32_t VGAControllerClass::sendPrimitive(Primitive const & primitive)
+{
+  portENTER_CRITICAL(&s_fenceMux);
+  ++m_primitivesSubmitted;
+  portEXIT_CRITICAL(&s_fenceMux);
+  if (mustExecQueue() && uxQueueSpacesAvailable(m_execQueue) == 0) {
+    // queue is full and nobody else can execute it
+    execQueuedPrimitives();
+  }
+  xQueueSendToBack(m_execQueue, &primitive, portMAX_DELAY);
+  return m_primitivesSubmitted;
+}
+
+
+// Copies primitive parameters into the arena and sends the primitive. These primitives are not batched (pending batch is published
+// before), and are sent while holding m_arenaMutex, so the executor consumes arena blocks in the same order they have been allocated.
+// When the arena is full the mutex is released and the task sleeps until queued primitives have been executed (or executes them if it has
+// suspended background execution). Parameters that don't fit an empty arena (larger than half arena) are not copied: the primitive is sent as is and executed before returning.
+uint32_t VGAControllerClass::sendArenaPrimitive(Primitive const & primitive)
+{
+  flushPrimitivesBatch();
+
+  bool copied;
+  uint32_t fence;
+  while (true) {
+    xSemaphoreTake(m_arenaMutex, portMAX_DELAY);
+
+    if (m_arena == NULL) {
+      // accessed by render task, so it must be in internal memory
+      m_arena = (uint8_t*) heap_caps_malloc(FABGLIB_PRIMITIVES_ARENA_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_32BIT);
+    }
+
+    Primitive p;
+    p = primitive;
+    copied = m_arena && copyToArena(p);
+    if (copied || m_arena == NULL || m_arenaReadPos == m_arenaWritePos) {
+      fence = sendPrimitive(p);
+      xSemaphoreGive(m_arenaMutex);
+      break;
+    }
+
+    // arena is full, wait for the executor to release blocks
+    fence = m_primitivesSubmitted;
+    xSemaphoreGive(m_arenaMutex);
+    waitPrimitivesFence(fence);
+  }
+
+  #if FABGLIB_HAS_FRAME_STATS
+  updateQueueHighWater();
+  #endif
+
+  if (!copied) {
+    // parameters still refer caller memory
+    waitPrimitivesFence(fence);
+  }
+  return fence;
+}
+
+
+// Replaces primitive parameters pointer with a copy into the arena. Returns false if the arena is too small.
+// Must be called holding m_arenaMutex.
+bool VGAControllerClass::copyToArena(Primitive & primitive)
+{
+  switch (primitive.cmd) {
+
+    case PrimitiveCmd::DrawText:
+    {
+      int length = strlen(primitive.text->text) + 1;
+      DrawTextInfo * text = (DrawTextInfo*) allocArena(sizeof(DrawTextInfo) + length);
+      if (text == NULL)
+        return false;
+      char * chars = (char*) (text + 1);
+      memcpy(chars, primitive.text->text, length);
+      *text = DrawTextInfo(primitive.text->X, primitive.text->Y, primitive.text->font, chars);
+      primitive.text = text;
+      return true;
+    }
+
+    case PrimitiveCmd::DrawPath:
+    case PrimitiveCmd::FillPath:
+    {
+      Path const * src = primitive.path;
+      int pointsSize = src->pointsCount * sizeof(Point);
+      int sizesSize  = src->pathsSizes ? src->pathsCount * sizeof(int16_t) : 0;
+      Path * path = (Path*) allocArena(sizeof(Path) + pointsSize + sizesSize);
+      if (path == NULL)
+        return false;
+      Point * points = (Point*) (path + 1);
+      memcpy(points, src->points, pointsSize);
+      int16_t * pathsSizes = NULL;
+      if (sizesSize) {
+        pathsSizes = (int16_t*) ((uint8_t*) points + pointsSize);
+        memcpy(pathsSizes, src->pathsSizes, sizesSize);
+      }
+      path->points      = points;
+      path->pointsCount = src->pointsCount;
+      path->pathsCount  = src->pathsCount;
+      path->pathsSizes  = pathsSizes;
+      primitive.path = path;
+      return true;
+    }
+
+    #if FABGLIB_HAS_READWRITE_RAW_DATA
+    case PrimitiveCmd::ReadRawData:
+    case PrimitiveCmd::WriteRawData:
+    {
+      // only the region is copied, data remains in caller memory
+      RawData * rawData = (RawData*) allocArena(sizeof(RawData));
+      if (rawData == NULL)
+        return false;
+      memcpy(rawData, primitive.rawData, sizeof(RawData));
+      primitive.rawData = rawData;
+      return true;
+    }
+    #endif
+
+    case PrimitiveCmd::DrawBitmap:
+    {
+      Bitmap const * src = primitive.bitmapDrawingInfo.bitmap;
+      int dataSize = src->width * src->height;
+      Bitmap * bitmap = (Bitmap*) allocArena(sizeof(Bitmap) + dataSize);
+      if (bitmap == NULL)
+        return false;
+      uint8_t * data = (uint8_t*) (bitmap + 1);
+      memcpy(data, src->data, dataSize);
+      // never destroyed: cached spans and collision mask are not copied
+      bitmap->width              = src->width;
+      bitmap->height             = src->height;
+      bitmap->data               = data;
+      bitmap->dataAllocated      = false;
+      bitmap->encoding           = RawBitmap;
+      bitmap->opaqueSpans        = NULL;
+      bitmap->opaqueSpansDirty   = false;
+      bitmap->collisionMask      = NULL;
+      bitmap->collisionMaskWords = 0;
+      primitive.bitmapDrawingInfo.bitmap = bitmap;
+      return true;
+    }
+
+    default:
+      return false;
+  }
+}
+
+
+// Returns "size" contiguous bytes (32 bit aligned) of the arena, or NULL if there isn't enough free space or size is larger than half arena.
+// Never waits. One word is always left free, so m_arenaWritePos == m_arenaReadPos means empty arena.
+// Must be called holding m_arenaMutex.
+void * VGAControllerClass::allocArena(int size)
+{
+  size = ((size + 3) & ~3) + ARENA_BLOCK_HEADER_SIZE;
+  if (size > FABGLIB_PRIMITIVES_ARENA_SIZE / 2)
+    return NULL;
+  const int readPos  = m_arenaReadPos;
+  const int writePos = m_arenaWritePos;
+  int pos = -1;
+  if (writePos >= readPos) {
+    if (FABGLIB_PRIMITIVES_ARENA_SIZE - writePos - (readPos == 0 ? 4 : 0) >= size)
+      pos = writePos;   // at the end
+    else if (readPos - 4 >= size)
+      pos = 0;          // at the start, skipping the end
+  } else if (readPos - writePos - 4 >= size)
+    pos = writePos;
+  if (pos < 0)
+    return NULL;
+  m_arenaWritePos = (pos + size) % FABGLIB_PRIMITIVES_ARENA_SIZE;
+  *(uint32_t*) (m_arena + pos) = size;
+  return m_arena + pos + ARENA_BLOCK_HEADER_SIZE;
+}
+
+
+// Invoked by the executor when "ptr" is no more used. Does nothing if "ptr" doesn't belong to the arena.
+void IRAM_ATTR VGAControllerClass::releaseArena(void const * ptr)
+{
+  uint8_t const * block = (uint8_t const *) ptr - ARENA_BLOCK_HEADER_SIZE;
+  if (m_arena && block >= m_arena && block < m_arena + FABGLIB_PRIMITIVES_ARENA_SIZE)
+    m_arenaReadPos = (block - m_arena + *(uint32_t const *) block) % FABGLIB_PRIMITIVES_ARENA_SIZE;
+}
+
+
+uint32_t VGAControllerClass::getPrimitivesFence()
+{
+  flushPrimitivesBatch();
+  return m_primitivesSubmitted;
+}
+
+
+void VGAControllerClass::waitPrimitivesFence(uint32_t fence)
+{
+  flushPrimitivesBatch();
+  while (!isPrimitivesFencePassed(fence)) {
+    if (mustExecQueue()) {
+      // calling task has suspended background execution, nobody else executes primitives
+      execQueuedPrimitives();
+      continue;
+    }
+    // executor notifies waiting task after each execution round. A short timeout handles multiple waiting tasks.
+    m_fenceWaitTask = xTaskGetCurrentTaskHandle();
+    if (!isPrimitivesFencePassed(fence))
+      ulTaskNotifyTake(pdTRUE, 1);
+  }
+}
+
+
+void VGAControllerClass::waitVSync()
+{
+  uint32_t count = m_VSyncCount;
+  while (m_VSyncCount == count) {
+    // other notifications (ie primitives fences) may wake up the task, so check the counter
+    m_VSyncWaitTask = xTaskGetCurrentTaskHandle();
+    if (m_VSyncCount == count)
+      ulTaskNotifyTake(pdTRUE, 1);
+    if (m_VSyncInterruptSuspended)
+      break;
+  }
+  m_VSyncWaitTask = NULL;
+}
+
+
+void IRAM_ATTR VGAControllerClass::notifyPrimitivesFenceWaiter()
+{
+  TaskHandle_t task = m_fenceWaitTask;
+  if (task) {
+    m_fenceWaitTask = NULL;
+    xTaskNotifyGive(task);
+  }
+}
+
+
+void VGAControllerClass::primitivesExecutionWait()
+{
+  waitPrimitivesFence(getPrimitivesFence());
+}
+
+
+// another task cannot begin a batch while a batch is in progress: its primitives are just queued
+void VGAControllerClass::beginPrimitivesBatch()
+{
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  if (m_batchLevel > 0 && m_batchOwner != task)
+    return;
+  if (m_batch == NULL) {
+    // accessed by VSync interrupt, so it must be in internal memory
+    m_batch = (Primitive*) heap_caps_malloc(sizeof(Primitive) * FABGLIB_PRIMITIVES_BATCH_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (m_batch == NULL)
+      return;
+  }
+  m_batchOwner = task;
+  ++m_batchLevel;
+}
+
+
+void VGAControllerClass::endPrimitivesBatch()
+{
+  if (m_batchLevel > 0 && m_batchOwner == xTaskGetCurrentTaskHandle() && --m_batchLevel == 0)
+    flushPrimitivesBatch();
+}
+
+
+// Send a single ExecuteBatch primitive for all batched primitives not already sent
+// Only the task owning the batch publishes it
+void VGAControllerClass::flushPrimitivesBatch()
+{
+  if (m_batchOwner != xTaskGetCurrentTaskHandle())
+    return;
+  int count = m_batchWritePos - m_batchPublishedPos;
+  if (count > 0) {
+    Primitive p;
+    p.cmd    = PrimitiveCmd::ExecuteBatch;
+    p.ivalue = count;
+    sendPrimitive(p);
+    m_batchPublishedPos = m_batchWritePos;
+    #if FABGLIB_HAS_FRAME_STATS
+    updateQueueHighWater();
+    #endif
+  }
+}
+
+
+// Use for fast queue processing. Warning, may generate flickering because don't care of vertical sync
+// Do not call inside ISR
+void IRAM_ATTR VGAControllerClass::processPrimitives()
+{
+  flushPrimitivesBatch();
+  execQueuedPrimitives();
+}
+
+
+// Executes queued primitives in calling task. Unlike processPrimitives() the batch ring is not published.
+void IRAM_ATTR VGAControllerClass::execQueuedPrimitives()
+{
+  suspendBackgroundPrimitiveExecution();
+  Primitive prim;
+  while (xQueueReceive(m_execQueue, &prim, 0) == pdTRUE) {
+    execPrimitive(prim);
+    ++m_primitivesCompleted;
+  }
+  showSprites();
+  resumeBackgroundPrimitiveExecution();
+  notifyPrimitivesFenceWaiter();
+}
+
+
+void IRAM_ATTR VGAControllerClass::VSyncInterrupt()
+{
+  FABGLIB_TRACE(VSync, Begin, 0);
+
+  VGAController.updateMouseCursorOverlay();
+
+  // wake up task waiting in waitVSync()
+  ++VGAController.m_VSyncCount;
+  TaskHandle_t VSyncWaitTask = VGAController.m_VSyncWaitTask;
+  if (VSyncWaitTask) {
+    VGAController.m_VSyncWaitTask = NULL;
+    vTaskNotifyGiveFromISR(VSyncWaitTask, NULL);
+  }
+
+  if (VGAController.m_renderTask) {
+    // primitives are executed by the render task, just signal vertical sync
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR(VGAController.m_renderTask, RENDERTASK_VSYNC, eSetBits, &woken);
+    FABGLIB_TRACE(VSync, End, 0);
+    if (woken)
+      portYIELD_FROM_ISR();
+    return;
+  }
+
+  int64_t startTime = esp_timer_get_time();
+  #if FABGLIB_HAS_FRAME_STATS
+  FrameStats & stats = VGAController.m_frameStats;
+  uint32_t executedBefore = stats.primitivesExecuted;
+  stats.lastSpritesTime = 0;
+  #endif
+  bool isFirst    = true;
+  bool hasScrolled = false; // true when a SmoothVScroll step has been executed in this frame
+  do {
+    Primitive prim;
+    if (xQueueReceiveFromISR(VGAController.m_execQueue, &prim, NULL) == pdFALSE)
+      break;
+
+    if (prim.cmd == PrimitiveCmd::ExecuteBatch) {
+      // execute batched primitives directly from the batch ring
+      int count = prim.ivalue;
+      while (count > 0) {
+        Primitive const & bprim = VGAController.m_batch[VGAController.m_batchReadPos & (FABGLIB_PRIMITIVES_BATCH_SIZE - 1)];
+        if (bprim.cmd == PrimitiveCmd::SwapBuffers && !isFirst) {
+          #if FABGLIB_HAS_FRAME_STATS
+          ++stats.swapBuffersDeferred;
+          #endif
+          break;
+        }
+        if (bprim.cmd == PrimitiveCmd::SmoothVScroll) {
+          // one step per frame, the batch ring item keeps the remaining offset
+          if (hasScrolled || VGAController.execSmoothVScrollStep(&VGAController.m_batch[VGAController.m_batchReadPos & (FABGLIB_PRIMITIVES_BATCH_SIZE - 1)]))
+            break;
+          hasScrolled = true;
+        } else
+          VGAController.execPrimitive(bprim);
+        ++VGAController.m_batchReadPos;
+        --count;
+        isFirst = false;
+        if (startTime + VGAController.m_maxVSyncISRTime <= esp_timer_get_time())
+          break;
+      }
+      if (count > 0) {
+        // remaining primitives will be executed at next VSync
+        prim.ivalue = count;
+        xQueueSendToFrontFromISR(VGAController.m_execQueue, &prim, NULL);
+        break;
+      }
+      ++VGAController.m_primitivesCompleted;
+      continue;
+    }
 
     if (prim.cmd == PrimitiveCmd::SwapBuffers && !isFirst) {
       // SwapBuffers must be the first primitive executed at VSync. If not reinsert it and interrupt execution to wait for next VSync.
       xQueueSendToFrontFromISR(VGAController.m_execQueue, &prim, NULL);
+      #if FABGLIB_HAS_FRAME_STATS
+      ++stats.swapBuffersDeferred;
+      #endif
       break;
     }
 
+    if (prim.cmd == PrimitiveCmd::SmoothVScroll) {
+      // one step per frame. Reinsert it until scrolling ends, so following primitives wait for it.
+      if (hasScrolled || VGAController.execSmoothVScrollStep(&prim)) {
+        xQueueSendToFrontFromISR(VGAController.m_execQueue, &prim, NULL);
+        break;
+      }
+      hasScrolled = true;
+      ++VGAController.m_primitivesCompleted;
+      isFirst = false;
+      continue;
+    }
+
     VGAController.execPrimitive(prim);
+    ++VGAController.m_primitivesCompleted;
 
     isFirst = false;
   } while (startTime + VGAController.m_maxVSyncISRTime > esp_timer_get_time());
   VGAController.showSprites();
+
+  // wake up task waiting in waitPrimitivesFence()
+  TaskHandle_t fenceWaitTask = VGAController.m_fenceWaitTask;
+  if (fenceWaitTask) {
+    VGAController.m_fenceWaitTask = NULL;
+    vTaskNotifyGiveFromISR(fenceWaitTask, NULL);
+  }
+
+  #if FABGLIB_HAS_FRAME_STATS
+  VGAController.updateFrameStats(startTime, executedBefore, true);
+  #endif
+
+  FABGLIB_TRACE(VSync, End, 0);
 }
 
 
 void IRAM_ATTR VGAControllerClass::execPrimitive(Primitive const & prim)
 {
+  FABGLIB_TRACE(Primitive, Begin, prim.cmd);
+  #if FABGLIB_HAS_FRAME_STATS
+  int64_t startTime = esp_timer_get_time();
+  #endif
   switch (prim.cmd) {
     case PrimitiveCmd::SetPenColor:
       m_paintState.penColor = prim.color;
@@ -851,6 +2064,9 @@ void IRAM_ATTR VGAControllerClass::execPrimitive(Primitive const & prim)
     case PrimitiveCmd::DrawEllipse:
       execDrawEllipse(prim.size);
       break;
+    case PrimitiveCmd::FillRoundRect:
+      execFillRoundRect(prim.roundRect);
+      break;
     case PrimitiveCmd::Clear:
       execClear();
       break;
@@ -861,7 +2077,11 @@ void IRAM_ATTR VGAControllerClass::execPrimitive(Primitive const & prim)
       execHScroll(prim.ivalue);
       break;
     case PrimitiveCmd::DrawGlyph:
-      execDrawGlyph(prim.glyph, m_paintState.glyphOptions, m_paintState.penColor, m_paintState.brushColor);
+      execDrawGlyph(Glyph(prim.glyph.X, prim.glyph.Y, prim.glyphWidth, prim.glyphHeight, prim.glyph.data), m_paintState.glyphOptions, m_paintState.penColor, m_paintState.brushColor);
+      break;
+    case PrimitiveCmd::DrawText:
+      execDrawText(*prim.text);
+      releaseArena(prim.text);
       break;
     case PrimitiveCmd::SetGlyphOptions:
       m_paintState.glyphOptions = prim.glyphOptions;
@@ -885,10 +2105,18 @@ void IRAM_ATTR VGAControllerClass::execPrimitive(Primitive const & prim)
       break;
 #if FABGLIB_HAS_READWRITE_RAW_DATA
     case PrimitiveCmd::ReadRawData:
-      execReadRawData(prim.rawData);
+      execReadRawData(*prim.rawData);
+      releaseArena(prim.rawData);
+      break;
+    case PrimitiveCmd::ReadRLERows:
+      execReadRLERows(prim.rleRows);
+      break;
+    case PrimitiveCmd::WriteRLERows:
+      execWriteRLERows(prim.rleRows);
       break;
     case PrimitiveCmd::WriteRawData:
-      execWriteRawData(prim.rawData);
+      execWriteRawData(*prim.rawData);
+      releaseArena(prim.rawData);
       break;
 #endif
     case PrimitiveCmd::RenderGlyphsBuffer:
@@ -896,19 +2124,28 @@ void IRAM_ATTR VGAControllerClass::execPrimitive(Primitive const & prim)
       break;
     case PrimitiveCmd::DrawBitmap:
       execDrawBitmap(prim.bitmapDrawingInfo);
+      releaseArena(prim.bitmapDrawingInfo.bitmap);
       break;
     case PrimitiveCmd::RefreshSprites:
-      hideSprites();
-      showSprites();
+      if (m_backgroundLayer)
+        composeSprites();
+      else
+        showSprites();
       break;
     case PrimitiveCmd::SwapBuffers:
       execSwapBuffers();
       break;
+    case PrimitiveCmd::SmoothVScroll:
+      // executed outside vertical sync interrupt: scroll at once
+      execVScroll(prim.ivalue);
+      break;
     case PrimitiveCmd::DrawPath:
-      execDrawPath(prim.path);
+      execDrawPath(*prim.path);
+      releaseArena(prim.path);
       break;
     case PrimitiveCmd::FillPath:
-      execFillPath(prim.path);
+      execFillPath(*prim.path);
+      releaseArena(prim.path);
       break;
     case PrimitiveCmd::SetOrigin:
       m_paintState.origin = prim.position;
@@ -918,10 +2155,70 @@ void IRAM_ATTR VGAControllerClass::execPrimitive(Primitive const & prim)
       m_paintState.clippingRect = prim.rect;
       updateAbsoluteClippingRect();
       break;
+    case PrimitiveCmd::ExecuteBatch:
+      for (int i = 0; i < prim.ivalue; ++i, ++m_batchReadPos)
+        execPrimitive(m_batch[m_batchReadPos & (FABGLIB_PRIMITIVES_BATCH_SIZE - 1)]);
+      break;
   }
+  #if FABGLIB_HAS_FRAME_STATS
+  // batched primitives are already accounted individually
+  if (prim.cmd != PrimitiveCmd::ExecuteBatch)
+    updatePrimitiveStats(prim.cmd, startTime);
+  #endif
+  FABGLIB_TRACE(Primitive, End, prim.cmd);
+}
+
+
+#if FABGLIB_HAS_FRAME_STATS
+
+void IRAM_ATTR VGAControllerClass::updatePrimitiveStats(PrimitiveCmd cmd, int64_t startTime)
+{
+  uint32_t time = esp_timer_get_time() - startTime;
+  PrimitiveStats & pstats = m_frameStats.primitives[cmd];
+  ++pstats.count;
+  pstats.totalTime += time;
+  pstats.maxTime = tmax(pstats.maxTime, time);
+  // bucket 0: <1us, bucket N: [2^(N-1), 2^N) us, last bucket: everything else
+  int bucket = time == 0 ? 0 : tmin<int>(FRAMESTATS_HISTOGRAM_SIZE - 1, 32 - __builtin_clz(time));
+  ++pstats.histogram[bucket];
+  ++m_frameStats.primitivesExecuted;
+}
+
+
+void VGAControllerClass::updateQueueHighWater()
+{
+  uint32_t count = uxQueueMessagesWaiting(m_execQueue);
+  if (count > m_frameStats.queueHighWater)
+    m_frameStats.queueHighWater = count;
 }
 
 
+// Ends a frame: VSync interrupt execution (hasBudget = true) or round of the render task
+void IRAM_ATTR VGAControllerClass::updateFrameStats(int64_t startTime, uint32_t executedBefore, bool hasBudget)
+{
+  FrameStats & stats = m_frameStats;
+  int64_t endTime = esp_timer_get_time();
+  ++stats.frames;
+  stats.lastFramePrimitives = stats.primitivesExecuted - executedBefore;
+  stats.maxFramePrimitives  = tmax(stats.maxFramePrimitives, stats.lastFramePrimitives);
+  stats.lastFramePending    = uxQueueMessagesWaitingFromISR(m_execQueue);
+  stats.maxFramePending     = tmax(stats.maxFramePending, stats.lastFramePending);
+  if (hasBudget && stats.lastFramePending > 0 && startTime + m_maxVSyncISRTime <= endTime)
+    ++stats.budgetExceeded;
+  stats.lastFrameTime       = endTime - startTime;
+  stats.maxFrameTime        = tmax(stats.maxFrameTime, stats.lastFrameTime);
+  stats.maxSpritesTime      = tmax(stats.maxSpritesTime, stats.lastSpritesTime);
+}
+
+
+void VGAControllerClass::resetFrameStats()
+{
+  memset(&m_frameStats, 0, sizeof(FrameStats));
+}
+
+#endif
+
+
 void VGAControllerClass::updateAbsoluteClippingRect()
 {
   int X1 = iclamp(m_paintState.origin.X + m_paintState.clippingRect.X1, 0, m_viewPortWidth - 1);
@@ -934,30 +2231,31 @@ void VGAControllerClass::updateAbsoluteClippingRect()
 
 void IRAM_ATTR VGAControllerClass::execSetPixel(Point const & position)
 {
-  hideSprites();
-  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePixel(m_paintState.brushColor) : preparePixel(m_paintState.penColor);
-
   const int x = position.X + m_paintState.origin.X;
   const int y = position.Y + m_paintState.origin.Y;
 
+  hideSprites(x, y, x, y);
+  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePattern(m_paintState.brushColor) : preparePattern(m_paintState.penColor);
+
   const int clipX1 = m_paintState.absClippingRect.X1;
   const int clipY1 = m_paintState.absClippingRect.Y1;
   const int clipX2 = m_paintState.absClippingRect.X2;
   const int clipY2 = m_paintState.absClippingRect.Y2;
 
   if (x >= clipX1 && x <= clipX2 && y >= clipY1 && y <= clipY2)
-    PIXEL(x, y) = pattern;
+    setRowPixel(m_viewPort[y], x, pattern);
 }
 
 
 void IRAM_ATTR VGAControllerClass::execLineTo(Point const & position)
 {
-  hideSprites();
-  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePixel(m_paintState.brushColor) : preparePixel(m_paintState.penColor);
-
   int origX = m_paintState.origin.X;
   int origY = m_paintState.origin.Y;
 
+  hideSprites(tmin<int>(m_paintState.position.X, position.X + origX), tmin<int>(m_paintState.position.Y, position.Y + origY),
+              tmax<int>(m_paintState.position.X, position.X + origX), tmax<int>(m_paintState.position.Y, position.Y + origY));
+  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePattern(m_paintState.brushColor) : preparePattern(m_paintState.penColor);
+
   drawLine(m_paintState.position.X, m_paintState.position.Y, position.X + origX, position.Y + origY, pattern);
 
   m_paintState.position = Point(position.X + origX, position.Y + origY);
@@ -970,17 +2268,9 @@ void IRAM_ATTR VGAControllerClass::drawLine(int X1, int Y1, int X2, int Y2, uint
 {
   if (Y1 == Y2) {
     // horizontal line
-    if (Y1 < m_paintState.absClippingRect.Y1 || Y1 > m_paintState.absClippingRect.Y2)
-      return;
     if (X1 > X2)
       tswap(X1, X2);
-    if (X1 > m_paintState.absClippingRect.X2 || X2 < m_paintState.absClippingRect.X1)
-      return;
-    X1 = iclamp(X1, m_paintState.absClippingRect.X1, m_paintState.absClippingRect.X2);
-    X2 = iclamp(X2, m_paintState.absClippingRect.X1, m_paintState.absClippingRect.X2);
-    uint8_t volatile * row = m_viewPort[Y1];
-    for (int x = X1; x <= X2; ++x)
-      PIXELINROW(row, x) = pattern;
+    fillClippedRow(Y1, X1, X2, pattern);
   } else if (X1 == X2) {
     // vertical line
     if (X1 < m_paintState.absClippingRect.X1 || X1 > m_paintState.absClippingRect.X2)
@@ -992,7 +2282,7 @@ void IRAM_ATTR VGAControllerClass::drawLine(int X1, int Y1, int X2, int Y2, uint
     Y1 = iclamp(Y1, m_paintState.absClippingRect.Y1, m_paintState.absClippingRect.Y2);
     Y2 = iclamp(Y2, m_paintState.absClippingRect.Y1, m_paintState.absClippingRect.Y2);
     for (int y = Y1; y <= Y2; ++y)
-      PIXEL(X1, y) = pattern;
+      setRowPixel(m_viewPort[y], X1, pattern);
   } else {
     // other cases (Bresenham's algorithm)
     if (!clipLine(X1, Y1, X2, Y2, m_paintState.absClippingRect))
@@ -1003,7 +2293,7 @@ void IRAM_ATTR VGAControllerClass::drawLine(int X1, int Y1, int X2, int Y2, uint
     const int sy = Y1 < Y2 ? 1 : -1;
     int err = (dx > dy ? dx : -dy) / 2;
     while (true) {
-      PIXEL(X1, Y1) = pattern;
+      setRowPixel(m_viewPort[Y1], X1, pattern);
       if (X1 == X2 && Y1 == Y2)
         break;
       int e2 = err;
@@ -1024,6 +2314,21 @@ void IRAM_ATTR VGAControllerClass::drawLine(int X1, int Y1, int X2, int Y2, uint
 void IRAM_ATTR VGAControllerClass::fillRow(int y, int x1, int x2, uint8_t pattern)
 {
   uint8_t * row = (uint8_t*) m_viewPort[y];
+  if (m_pixelShift) {
+    // palette formats: fill single pixels up to a byte boundary, then whole bytes
+    const int pixelsPerByte = 1 << m_pixelShift;
+    int x = x1;
+    for (; x <= x2 && (x & (pixelsPerByte - 1)) != 0; ++x)
+      setRowPixel(row, x, pattern);
+    int bytes = (x2 + 1 - x) >> m_pixelShift;
+    if (bytes > 0) {
+      memset(row + (x >> m_pixelShift), replicatePattern(pattern, m_pixelShift), bytes);
+      x += bytes << m_pixelShift;
+    }
+    for (; x <= x2; ++x)
+      setRowPixel(row, x, pattern);
+    return;
+  }
   // fill first bytes before full 32 bits word
   int x = x1;
   for (; x <= x2 && (x & 3) != 0; ++x) {
@@ -1042,12 +2347,30 @@ void IRAM_ATTR VGAControllerClass::fillRow(int y, int x1, int x2, uint8_t patter
 }
 
 
+// fills the span x1...x2 (x1 <= x2) of row y, clipped on current absolute clipping rectangle
+void IRAM_ATTR VGAControllerClass::fillClippedRow(int y, int x1, int x2, uint8_t pattern)
+{
+  Rect const & clip = m_paintState.absClippingRect;
+  if (y < clip.Y1 || y > clip.Y2 || x1 > clip.X2 || x2 < clip.X1)
+    return;
+  fillRow(y, tmax<int>(x1, clip.X1), tmin<int>(x2, clip.X2), pattern);
+}
+
+
 // swaps all pixels inside the range x1...x2 of yA and yB
 // parameters not checked
 void IRAM_ATTR VGAControllerClass::swapRows(int yA, int yB, int x1, int x2)
 {
   uint8_t * rowA = (uint8_t*) m_viewPort[yA];
   uint8_t * rowB = (uint8_t*) m_viewPort[yB];
+  if (m_pixelShift) {
+    for (int x = x1; x <= x2; ++x) {
+      uint8_t a = getRowPixel(rowA, x);
+      setRowPixel(rowA, x, getRowPixel(rowB, x));
+      setRowPixel(rowB, x, a);
+    }
+    return;
+  }
   // swap first bytes before full 32 bits word
   int x = x1;
   for (; x <= x2 && (x & 3) != 0; ++x)
@@ -1083,187 +2406,262 @@ void IRAM_ATTR VGAControllerClass::execFillRect(Rect const & rect)
   x2 = iclamp(x2, clipX1, clipX2);
   y2 = iclamp(y2, clipY1, clipY2);
 
-  hideSprites();
-  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePixel(m_paintState.penColor) : preparePixel(m_paintState.brushColor);
+  hideSprites(x1, y1, x2, y2);
+  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePattern(m_paintState.penColor) : preparePattern(m_paintState.brushColor);
 
   for (int y = y1; y <= y2; ++y)
     fillRow(y, x1, x2, pattern);
 }
 
 
+// Rows of a quarter of ellipse of radii rx and ry (midpoint algorithm), from the center row (dy = 0) to the farthest one (dy = ry).
+// "x" is the half width of current row. Boundary is the ellipse of radii rx + 1/2 and ry + 1/2, so the pixel at (x, dy) is inside
+// when (2x)^2 * (2ry + 1)^2 + (2dy)^2 * (2rx + 1)^2 <= (2rx + 1)^2 * (2ry + 1)^2. The error term is updated incrementally.
+struct EllipseQuarter {
+  int     a2;   // (2rx + 1)^2
+  int     b2;   // (2ry + 1)^2
+  int     dy;
+  int     x;
+  int64_t err;  // (2x)^2 * b2 + (2dy)^2 * a2 - a2 * b2
+
+  EllipseQuarter(int rx, int ry) : a2((2 * rx + 1) * (2 * rx + 1)), b2((2 * ry + 1) * (2 * ry + 1)), dy(0), x(rx), err(-(int64_t)(4 * rx + 1) * b2) { }
+
+  // moves to next row
+  void next() {
+    err += (int64_t)(8 * dy + 4) * a2;
+    ++dy;
+    while (err > 0 && x > 0) {
+      err -= (int64_t)(8 * x - 4) * b2;
+      --x;
+    }
+  }
+};
+
+
+// each row of the four symmetric quadrants is a single span, clipped and filled with fillRow()
 void IRAM_ATTR VGAControllerClass::execFillEllipse(Size const & size)
 {
-  hideSprites();
-  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePixel(m_paintState.penColor) : preparePixel(m_paintState.brushColor);
+  const int centerX = m_paintState.position.X;
+  const int centerY = m_paintState.position.Y;
+  const int rx = size.width / 2;
+  const int ry = size.height / 2;
 
-  const int clipX1 = m_paintState.absClippingRect.X1;
-  const int clipY1 = m_paintState.absClippingRect.Y1;
-  const int clipX2 = m_paintState.absClippingRect.X2;
-  const int clipY2 = m_paintState.absClippingRect.Y2;
+  Rect const & clip = m_paintState.absClippingRect;
+  if (centerX - rx > clip.X2 || centerX + rx < clip.X1 || centerY - ry > clip.Y2 || centerY + ry < clip.Y1)
+    return;
+
+  hideSprites(centerX - rx - 1, centerY - ry - 1, centerX + rx + 1, centerY + ry + 1);
+  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePattern(m_paintState.penColor) : preparePattern(m_paintState.brushColor);
+
+  for (EllipseQuarter q(rx, ry); q.dy <= ry; q.next()) {
+    fillClippedRow(centerY - q.dy, centerX - q.x, centerX + q.x, pattern);
+    if (q.dy > 0)
+      fillClippedRow(centerY + q.dy, centerX - q.x, centerX + q.x, pattern);
+  }
+}
 
-  const int halfWidth  = size.width / 2;
-  const int halfHeight = size.height / 2;
-  const int hh = halfHeight * halfHeight;
-  const int ww = halfWidth * halfWidth;
-  const int hhww = hh * ww;
 
-  int x0 = halfWidth;
-  int dx = 0;
+// outline pixels of each row go from the half width of the next row (plus one) to the half width of the row itself, so each quadrant
+// row is a single span and the outline has no holes
+void IRAM_ATTR VGAControllerClass::execDrawEllipse(Size const & size)
+{
+  const int centerX = m_paintState.position.X;
+  const int centerY = m_paintState.position.Y;
+  const int rx = size.width / 2;
+  const int ry = size.height / 2;
+
+  Rect const & clip = m_paintState.absClippingRect;
+  if (centerX - rx > clip.X2 || centerX + rx < clip.X1 || centerY - ry > clip.Y2 || centerY + ry < clip.Y1)
+    return;
 
-  int centerX = m_paintState.position.X;
-  int centerY = m_paintState.position.Y;
+  hideSprites(centerX - rx - 1, centerY - ry - 1, centerX + rx + 1, centerY + ry + 1);
+  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePattern(m_paintState.brushColor) : preparePattern(m_paintState.penColor);
 
-  if (centerY >= clipY1 && centerY <= clipY2) {
-    int col1 = centerX - halfWidth;
-    int col2 = centerX + halfWidth;
-    if (col1 <= clipX2 && col2 >= clipX1) {
-      col1 = iclamp(col1, clipX1, clipX2);
-      col2 = iclamp(col2, clipX1, clipX2);
-      uint8_t volatile * row = m_viewPort[centerY];
-      for (int x = col1; x <= col2; ++x)
-        PIXELINROW(row, x) = pattern;
+  EllipseQuarter q(rx, ry);
+  for (int dy = 0; dy <= ry; ++dy) {
+    const int outer = q.x;
+    int inner = 0;  // farthest row is entirely outline
+    if (dy < ry) {
+      q.next();
+      inner = tmin(q.x + 1, outer);
+    }
+    fillClippedRow(centerY - dy, centerX - outer, centerX - inner, pattern);
+    fillClippedRow(centerY - dy, centerX + inner, centerX + outer, pattern);
+    if (dy > 0) {
+      fillClippedRow(centerY + dy, centerX - outer, centerX - inner, pattern);
+      fillClippedRow(centerY + dy, centerX + inner, centerX + outer, pattern);
     }
   }
+}
 
-  for (int y = 1; y <= halfHeight; ++y)
-  {
-    int x1 = x0 - (dx - 1);
-    for ( ; x1 > 0; x1--)
-      if (x1 * x1 * hh + y * y * ww <= hhww)
-        break;
-    dx = x0 - x1;
-    x0 = x1;
 
-    int col1 = centerX - x0;
-    int col2 = centerX + x0;
+// corners are quarters of circle generated like ellipse rows, rows between corners are filled entirely
+void IRAM_ATTR VGAControllerClass::execFillRoundRect(RoundRectInfo const & info)
+{
+  const int x1 = m_paintState.position.X;
+  const int y1 = m_paintState.position.Y;
+  const int x2 = x1 + info.width - 1;
+  const int y2 = y1 + info.height - 1;
+
+  Rect const & clip = m_paintState.absClippingRect;
+  if (info.width <= 0 || info.height <= 0 || x1 > clip.X2 || x2 < clip.X1 || y1 > clip.Y2 || y2 < clip.Y1)
+    return;
+
+  hideSprites(x1, y1, x2, y2);
+  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePattern(m_paintState.penColor) : preparePattern(m_paintState.brushColor);
 
-    if (col1 <= clipX2 && col2 >= clipX1) {
+  const int radius = iclamp(info.radius, 0, tmin(info.width - 1, info.height - 1) / 2);
 
-      col1 = iclamp(col1, clipX1, clipX2);
-      col2 = iclamp(col2, clipX1, clipX2);
+  // corners
+  for (EllipseQuarter q(radius, radius); q.dy <= radius; q.next()) {
+    const int left  = x1 + radius - q.x;
+    const int right = x2 - radius + q.x;
+    fillClippedRow(y1 + radius - q.dy, left, right, pattern);
+    fillClippedRow(y2 - radius + q.dy, left, right, pattern);
+  }
 
-      int y1 = centerY - y;
-      if (y1 >= clipY1 && y1 <= clipY2)
-        fillRow(y1, col1, col2, pattern);
+  // between corners
+  const int top    = tmax<int>(y1 + radius + 1, clip.Y1);
+  const int bottom = tmin<int>(y2 - radius - 1, clip.Y2);
+  for (int y = top; y <= bottom; ++y)
+    fillClippedRow(y, x1, x2, pattern);
+}
 
-      int y2 = centerY + y;
-      if (y2 >= clipY1 && y2 <= clipY2)
-        fillRow(y2, col1, col2, pattern);
 
-    }
+void IRAM_ATTR VGAControllerClass::execClear()
+{
+  hideSprites(0, 0, m_viewPortWidth - 1, m_viewPortHeight - 1);
+  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePattern(m_paintState.penColor) : preparePattern(m_paintState.brushColor);
+  const uint8_t fillByte = replicatePattern(pattern, m_pixelShift);
+  for (int y = 0; y < m_viewPortHeight; ++y)
+    memset((uint8_t*) m_viewPort[y], fillByte, getViewPortRowSize());
+}
+
+
+// scroll < 0 -> scroll UP
+// scroll > 0 -> scroll DOWN
+// Speciying horizontal scrolling region slow-down scrolling!
+// number of DMA buffers used by each viewport line (for each scan) and index of the one pointing to viewport data
+void IRAM_ATTR VGAControllerClass::getViewPortLineDMABuffers(int * buffersPerLine, int * viewPos)
+{
+  *buffersPerLine = 0;
+  *viewPos = 1;
+  switch (m_timings.HStartingBlock) {
+    case ScreenBlock::FrontPorch:
+      // FRONTPORCH -> SYNC -> BACKPORCH -> VISIBLEAREA
+      *buffersPerLine = (m_viewPortCol + m_viewPortWidth) < m_timings.HVisibleArea ? 3 : 2;
+      break;
+    case ScreenBlock::Sync:
+      // SYNC -> BACKPORCH -> VISIBLEAREA -> FRONTPORCH
+      *buffersPerLine = 3;
+      break;
+    case ScreenBlock::BackPorch:
+      // BACKPORCH -> VISIBLEAREA -> FRONTPORCH -> SYNC
+      *buffersPerLine = 3;
+      break;
+    case ScreenBlock::VisibleArea:
+      // VISIBLEAREA -> FRONTPORCH -> SYNC -> BACKPORCH
+      *buffersPerLine = m_viewPortCol > 0 ? 3 : 2;
+      *viewPos = m_viewPortCol > 0 ? 1 : 0;
+      break;
   }
 }
 
 
-void IRAM_ATTR VGAControllerClass::execDrawEllipse(Size const & size)
+// DMA descriptors of viewport lines are linked as a ring, opened before the line "offset", which becomes the first displayed line.
+// Just three links are changed, lines data is not touched.
+void IRAM_ATTR VGAControllerClass::setViewPortRingOffset(int offset)
 {
-  hideSprites();
-  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePixel(m_paintState.brushColor) : preparePixel(m_paintState.penColor);
+  // palette formats: DMA descriptors point to line buffers, moving lines pointers is enough
+  if (m_pixelShift) {
+    m_viewPortRingOffset = offset;
+    m_viewPort = m_viewPortRing + offset;
+    return;
+  }
 
-  const int clipX1 = m_paintState.absClippingRect.X1;
-  const int clipY1 = m_paintState.absClippingRect.Y1;
-  const int clipX2 = m_paintState.absClippingRect.X2;
-  const int clipY2 = m_paintState.absClippingRect.Y2;
+  int buffersPerLine, viewPos;
+  getViewPortLineDMABuffers(&buffersPerLine, &viewPos);
+  const int lineSize = m_timings.scanCount * buffersPerLine;
+  const int height   = m_viewPortHeight;
+  const int firstIdx = m_viewPortRow * m_timings.scanCount;
 
-  int x0 = m_paintState.position.X - size.width / 2;
-  int y0 = m_paintState.position.Y - size.height / 2;
-  int x1 = m_paintState.position.X + size.width / 2;
-  int y1 = m_paintState.position.Y + size.height / 2;
-
-  int a = abs (x1 - x0), b = abs (y1 - y0), b1 = b & 1;
-  int dx = 4 * (1 - a) * b * b, dy = 4 * (b1 + 1) * a * a;
-  int err = dx + dy + b1 * a * a, e2;
-
-  if (x0 > x1) {
-    x0 = x1;
-    x1 += a;
-  }
-  if (y0 > y1)
-    y0 = y1;
-  y0 += (b + 1) / 2;
-  y1 = y0-b1;
-  a *= 8 * a;
-  b1 = 8 * b * b;
-  do {
-    if (y0 >= clipY1 && y0 <= clipY2) {
-      if (x1 >= clipX1 && x1 <= clipX2) {
-        // bottom-right semicircle
-        PIXEL(x1, y0) = pattern;
-      }
-      if (x0 >= clipX1 && x0 <= clipX2) {
-        // bottom-left semicircle
-        PIXEL(x0, y0) = pattern;
-      }
-    }
-    if (y1 >= clipY1 && y1 <= clipY2) {
-      if (x0 >= clipX1 && x0 <= clipX2) {
-        // top-left semicircle
-        PIXEL(x0, y1) = pattern;
-      }
-      if (x1 >= clipX1 && x1 <= clipX2) {
-        // top-right semicircle
-        PIXEL(x1, y1) = pattern;
-      }
-    }
-    e2 = 2 * err;
-    if (e2 >= dx) {
-      ++x0;
-      --x1;
-      err += dx += b1;
-    }
-    if (e2 <= dy) {
-      ++y0;
-      --y1;
-      err += dy += a;
-    }
-  } while (x0 <= x1);
+  lldesc_t volatile * lines = m_DMABuffers + firstIdx;
+  lldesc_t volatile * prev  = firstIdx > 0 ? &m_DMABuffers[firstIdx - 1] : m_DMABuffersHead;
+  lldesc_t volatile * next  = &m_DMABuffers[firstIdx + height * lineSize];
 
-  while (y0 - y1 < b) {
-    int x = x0 - 1;
-    int y = y0;
-    if (x >= clipX1 && x <= clipX2 && y >= clipY1 && y <= clipY2)
-      PIXEL(x, y) = pattern;
+  // close the ring where it was opened
+  int last = (m_viewPortRingOffset + height - 1) % height;
+  lines[last * lineSize + lineSize - 1].qe.stqe_next = (lldesc_t*) &lines[m_viewPortRingOffset * lineSize];
 
-    x = x1 + 1;
-    y = y0++;
-    if (x >= clipX1 && x <= clipX2 && y >= clipY1 && y <= clipY2)
-      PIXEL(x, y) = pattern;
+  // open the ring before the new first line
+  last = (offset + height - 1) % height;
+  lines[last * lineSize + lineSize - 1].qe.stqe_next = (lldesc_t*) next;
+  prev->qe.stqe_next = (lldesc_t*) &lines[offset * lineSize];
+
+  m_viewPortRingOffset = offset;
+  m_viewPort = m_viewPortRing + offset;
+}
 
-    x = x0 - 1;
-    y = y1;
-    if (x >= clipX1 && x <= clipX2 && y >= clipY1 && y <= clipY2)
-      PIXEL(x, y) = pattern;
 
-    x = x1 + 1;
-    y = y1--;
-    if (x >= clipX1 && x <= clipX2 && y >= clipY1 && y <= clipY2)
-      PIXEL(x, y) = pattern;
+// moves the current lines pointers at the beginning of the ring and links the DMA descriptors in sequence
+// DMA descriptors buffers must be reassigned (ie calling fillVertBuffers())
+void VGAControllerClass::resetViewPortRing()
+{
+  if (m_viewPortRing && m_viewPortRingOffset != 0) {
+    memmove(m_viewPortRing, m_viewPortRing + m_viewPortRingOffset, sizeof(uint8_t*) * m_viewPortHeight);
+    memcpy(m_viewPortRing + m_viewPortHeight, m_viewPortRing, sizeof(uint8_t*) * m_viewPortHeight);
+    setViewPortRingOffset(0);
   }
 }
 
 
-void IRAM_ATTR VGAControllerClass::execClear()
+// execute one step (up to FABGLIB_SMOOTH_SCROLL_LINES_PER_FRAME lines) of a SmoothVScroll primitive
+// prim->ivalue is updated with the remaining offset. Returns true when more steps are required.
+bool IRAM_ATTR VGAControllerClass::execSmoothVScrollStep(Primitive * prim)
 {
-  hideSprites();
-  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePixel(m_paintState.penColor) : preparePixel(m_paintState.brushColor);
-  for (int y = 0; y < m_viewPortHeight; ++y)
-    memset((uint8_t*) m_viewPort[y], pattern, m_viewPortWidth);
+  int step = tmin(abs(prim->ivalue), FABGLIB_SMOOTH_SCROLL_LINES_PER_FRAME);
+  if (prim->ivalue < 0)
+    step = -step;
+  Primitive p;
+  p.cmd    = PrimitiveCmd::VScroll;
+  p.ivalue = step;
+  execPrimitive(p);
+  prim->ivalue -= step;
+  return prim->ivalue != 0;
 }
 
 
 // scroll < 0 -> scroll UP
 // scroll > 0 -> scroll DOWN
 // Speciying horizontal scrolling region slow-down scrolling!
+// When the scrolling region is the whole viewport and hardware scroll is enabled only DMA descriptors links are changed.
 void IRAM_ATTR VGAControllerClass::execVScroll(int scroll)
 {
-  hideSprites();
-  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePixel(m_paintState.penColor) : preparePixel(m_paintState.brushColor);
+  hideSprites(m_paintState.scrollingRegion.X1, m_paintState.scrollingRegion.Y1, m_paintState.scrollingRegion.X2, m_paintState.scrollingRegion.Y2);
+  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePattern(m_paintState.penColor) : preparePattern(m_paintState.brushColor);
   int Y1 = m_paintState.scrollingRegion.Y1;
   int Y2 = m_paintState.scrollingRegion.Y2;
   int X1 = m_paintState.scrollingRegion.X1;
   int X2 = m_paintState.scrollingRegion.X2;
   int height = Y2 - Y1 + 1;
 
+  if (m_viewPortRing && X1 == 0 && X2 == m_viewPortWidth - 1 && Y1 == 0 && Y2 == m_viewPortHeight - 1 && scroll != 0 && abs(scroll) < height) {
+
+    // hardware scroll: rotate the viewport ring
+    setViewPortRingOffset((m_viewPortRingOffset - scroll + height) % height);
+
+    // fill exposed area with brush color
+    if (scroll < 0) {
+      for (int i = height + scroll; i < height; ++i)
+        fillRow(i, X1, X2, pattern);
+    } else {
+      for (int i = 0; i < scroll; ++i)
+        fillRow(i, X1, X2, pattern);
+    }
+
+    return;
+  }
+
   if (scroll < 0) {
 
     // scroll UP
@@ -1307,32 +2705,27 @@ void IRAM_ATTR VGAControllerClass::execVScroll(int scroll)
 
   if (scroll != 0) {
 
-    // reassign DMA pointers
-
-    int viewPortBuffersPerLine = 0;
-    int linePos = 1;
-    switch (m_timings.HStartingBlock) {
-      case ScreenBlock::FrontPorch:
-        // FRONTPORCH -> SYNC -> BACKPORCH -> VISIBLEAREA
-        viewPortBuffersPerLine = (m_viewPortCol + m_viewPortWidth) < m_timings.HVisibleArea ? 3 : 2;
-        break;
-      case ScreenBlock::Sync:
-        // SYNC -> BACKPORCH -> VISIBLEAREA -> FRONTPORCH
-        viewPortBuffersPerLine = 3;
-        break;
-      case ScreenBlock::BackPorch:
-        // BACKPORCH -> VISIBLEAREA -> FRONTPORCH -> SYNC
-        viewPortBuffersPerLine = 3;
-        break;
-      case ScreenBlock::VisibleArea:
-        // VISIBLEAREA -> FRONTPORCH -> SYNC -> BACKPORCH
-        viewPortBuffersPerLine = m_viewPortCol > 0 ? 3 : 2;
-        linePos = m_viewPortCol > 0 ? 1 : 0;
-        break;
+    // update the second copy of lines pointers of the viewport ring
+    if (m_viewPortRing) {
+      for (int i = Y1; i <= Y2; ++i) {
+        int idx = m_viewPortRingOffset + i;
+        m_viewPortRing[idx < m_viewPortHeight ? idx + m_viewPortHeight : idx - m_viewPortHeight] = m_viewPort[i];
+      }
     }
-    for (int i = Y1, idx = Y1 * m_timings.scanCount; i <= Y2; ++i)
+
+    // reassign DMA pointers (palette formats DMA descriptors point to line buffers)
+
+    if (m_pixelShift)
+      return;
+
+    int viewPortBuffersPerLine, linePos;
+    getViewPortLineDMABuffers(&viewPortBuffersPerLine, &linePos);
+    for (int i = Y1; i <= Y2; ++i) {
+      // viewport line "i" is displayed by DMA descriptors of ring line "i + m_viewPortRingOffset"
+      int idx = ((i + m_viewPortRingOffset) % m_viewPortHeight) * m_timings.scanCount;
       for (int scan = 0; scan < m_timings.scanCount; ++scan, ++idx)
         setDMABufferView(m_viewPortRow * m_timings.scanCount + idx * viewPortBuffersPerLine + linePos, i, scan, m_viewPort, false);
+    }
   }
 }
 
@@ -1343,8 +2736,8 @@ void IRAM_ATTR VGAControllerClass::execVScroll(int scroll)
 // Horizontal scrolling region start and size (X2-X1+1) must be aligned to 32 bits, otherwise the unoptimized (very slow) version is used.
 void IRAM_ATTR VGAControllerClass::execHScroll(int scroll)
 {
-  hideSprites();
-  uint8_t pattern8   = m_paintState.paintOptions.swapFGBG ? preparePixel(m_paintState.penColor) : preparePixel(m_paintState.brushColor);
+  hideSprites(m_paintState.scrollingRegion.X1, m_paintState.scrollingRegion.Y1, m_paintState.scrollingRegion.X2, m_paintState.scrollingRegion.Y2);
+  uint8_t pattern8   = m_paintState.paintOptions.swapFGBG ? preparePattern(m_paintState.penColor) : preparePattern(m_paintState.brushColor);
   uint16_t pattern16 = pattern8 << 8 | pattern8;
   uint32_t pattern32 = pattern16 << 16 | pattern16;
 
@@ -1355,7 +2748,7 @@ void IRAM_ATTR VGAControllerClass::execHScroll(int scroll)
 
   int width   = X2 - X1 + 1;
   int width32 = width >> 2;
-  bool HScrolllingRegionAligned = ((X1 & 3) == 0 && (width & 3) == 0);
+  bool HScrolllingRegionAligned = (m_pixelShift == 0 && (X1 & 3) == 0 && (width & 3) == 0);
 
   if (scroll < 0) {
     // scroll left
@@ -1411,10 +2804,10 @@ void IRAM_ATTR VGAControllerClass::execHScroll(int scroll)
         // unaligned horizontal scrolling region, fallback to slow version
         uint8_t * row = (uint8_t*) m_viewPort[y];
         for (int x = X1; x <= X2 + scroll; ++x)
-          PIXELINROW(row, x) = PIXELINROW(row, x - scroll);
+          setRowPixel(row, x, getRowPixel(row, x - scroll));
         // fill right area with brush color
         for (int x = X2 + 1 + scroll; x <= X2; ++x)
-          PIXELINROW(row, x) = pattern8;
+          setRowPixel(row, x, pattern8);
       }
     }
   } else if (scroll > 0) {
@@ -1471,10 +2864,10 @@ void IRAM_ATTR VGAControllerClass::execHScroll(int scroll)
         // unaligned horizontal scrolling region, fallback to slow version
         uint8_t * row = (uint8_t*) m_viewPort[y];
         for (int x = X2 - scroll; x >= X1; --x)
-          PIXELINROW(row, x + scroll) = PIXELINROW(row, x);
+          setRowPixel(row, x + scroll, getRowPixel(row, x));
         // fill left area with brush color
         for (int x = X1; x < X1 + scroll; ++x)
-          PIXELINROW(row, x) = pattern8;
+          setRowPixel(row, x, pattern8);
       }
     }
 
@@ -1482,36 +2875,142 @@ void IRAM_ATTR VGAControllerClass::execHScroll(int scroll)
 }
 
 
+// Items are rendered row by row. In RGB222, items having simple options and width multiple of 4, fully inside clipping rectangle, are
+// written directly as 32 bit words (four pixels) using m_glyphRowCache, others are painted by execDrawGlyph().
 void IRAM_ATTR VGAControllerClass::execRenderGlyphsBuffer(GlyphsBufferRenderInfo const & glyphsBufferRenderInfo)
 {
-  hideSprites();
-  int itemX = glyphsBufferRenderInfo.itemX;
-  int itemY = glyphsBufferRenderInfo.itemY;
+  GlyphsBuffer const * glyphsBuffer = glyphsBufferRenderInfo.glyphsBuffer;
+
+  const int glyphsWidth  = glyphsBuffer->glyphsWidth;
+  const int glyphsHeight = glyphsBuffer->glyphsHeight;
+  const int glyphSize    = glyphsHeight * ((glyphsWidth + 7) / 8);
+
+  const int firstX = glyphsBufferRenderInfo.itemX;
+  const int lastX  = tmin<int>(firstX + glyphsBufferRenderInfo.count, glyphsBuffer->columns) - 1;
+  const int firstY = glyphsBufferRenderInfo.itemY;
+  const int lastY  = tmin<int>(firstY + glyphsBufferRenderInfo.rowsCount, glyphsBuffer->rows) - 1;
+  if (firstX > lastX || firstY > lastY)
+    return;
+
+  const int origX = m_paintState.origin.X;
+  const int origY = m_paintState.origin.Y;
+
+  // double width items may use up to twice the width
+  hideSprites(origX + firstX * glyphsWidth, origY + firstY * glyphsHeight, origX + (lastX + 1) * glyphsWidth * 2 - 1, origY + (lastY + 1) * glyphsHeight - 1);
+
+  const bool canFast = m_pixelShift == 0 && (glyphsWidth & 3) == 0 && glyphsWidth <= 32;
+  Rect const & clip = m_paintState.absClippingRect;
+
+  for (int itemY = firstY; itemY <= lastY; ++itemY) {
+    uint32_t const * mapItem = glyphsBuffer->map + firstX + itemY * glyphsBuffer->columns;
+    for (int itemX = firstX; itemX <= lastX; ++itemX, ++mapItem) {
+
+      GlyphOptions glyphOptions = glyphMapItem_getOptions(mapItem);
+      RGB fgColor = COLOR2RGB[(int) glyphMapItem_getFGColor(mapItem)];
+      RGB bgColor = COLOR2RGB[(int) glyphMapItem_getBGColor(mapItem)];
+
+      Glyph glyph;
+      glyph.X      = (int16_t) (itemX * glyphsWidth * (glyphOptions.doubleWidth ? 2 : 1));
+      glyph.Y      = (int16_t) (itemY * glyphsHeight);
+      glyph.width  = glyphsWidth;
+      glyph.height = glyphsHeight;
+      glyph.data   = glyphsBuffer->glyphsData + glyphMapItem_getIndex(mapItem) * glyphSize;
+
+      const int destX = glyph.X + origX;
+      const int destY = glyph.Y + origY;
+
+      if (canFast && glyphOptions.fillBackground && !glyphOptions.bold && !glyphOptions.italic && !glyphOptions.blank && !glyphOptions.underline && !glyphOptions.doubleWidth &&
+          (destX & 3) == 0 && destX >= clip.X1 && destY >= clip.Y1 && destX + glyphsWidth - 1 <= clip.X2 && destY + glyphsHeight - 1 <= clip.Y2) {
+
+        if (glyphOptions.invert ^ m_paintState.paintOptions.swapFGBG)
+          tswap(fgColor, bgColor);
+
+        // a very simple and ugly reduce luminosity (faint) implementation!
+        if (glyphOptions.reduceLuminosity) {
+          if (fgColor.R > 2) fgColor.R -= 2;
+          if (fgColor.G > 2) fgColor.G -= 2;
+          if (fgColor.B > 2) fgColor.B -= 2;
+        }
+
+        drawGlyphsBufferItem(destX, destY, glyphsWidth, glyphsHeight, glyph.data, preparePattern(fgColor), preparePattern(bgColor));
+
+      } else
+        execDrawGlyph(glyph, glyphOptions, fgColor, bgColor);
+    }
+  }
+}
+
+
+// Rows of one byte wide glyphs (WIDTH = 4 or 8), written as one or two 32 bit words. destX must be a multiple of 4.
+template <int WIDTH>
+static inline void IRAM_ATTR drawGlyphsBufferItemRows(uint8_t volatile * * rows, int destX, int glyphsHeight, uint8_t const * glyphData, uint32_t const * rowCache)
+{
+  for (int y = 0; y < glyphsHeight; ++y) {
+    uint32_t * dest = (uint32_t*) (rows[y] + destX);
+    const uint8_t bits = glyphData[y];
+    dest[0] = rowCache[bits >> 4];
+    if (WIDTH == 8)
+      dest[1] = rowCache[bits & 0x0F];
+  }
+}
 
-  int glyphsWidth  = glyphsBufferRenderInfo.glyphsBuffer->glyphsWidth;
-  int glyphsHeight = glyphsBufferRenderInfo.glyphsBuffer->glyphsHeight;
 
-  uint32_t const * mapItem = glyphsBufferRenderInfo.glyphsBuffer->map + itemX + itemY * glyphsBufferRenderInfo.glyphsBuffer->columns;
+// prepares m_glyphRowCache for the specified pen and brush patterns
+void IRAM_ATTR VGAControllerClass::prepareGlyphRowCache(uint8_t penPattern, uint8_t brushPattern)
+{
+  if (penPattern != m_glyphRowCachePen || brushPattern != m_glyphRowCacheBrush) {
+    // word bytes order is pixel 2, 3, 0, 1 (see PIXELINROW)
+    static const uint8_t PIXELSHIFT[4] = { 16, 24, 0, 8 };
+    for (int bits = 0; bits < 16; ++bits) {
+      uint32_t word = 0;
+      for (int p = 0; p < 4; ++p)
+        word |= (uint32_t) ((bits & (8 >> p)) ? penPattern : brushPattern) << PIXELSHIFT[p];
+      m_glyphRowCache[bits] = word;
+    }
+    m_glyphRowCachePen   = penPattern;
+    m_glyphRowCacheBrush = brushPattern;
+  }
+}
 
-  GlyphOptions glyphOptions = glyphMapItem_getOptions(mapItem);
-  RGB fgColor = COLOR2RGB[(int) glyphMapItem_getFGColor(mapItem)];
-  RGB bgColor = COLOR2RGB[(int) glyphMapItem_getBGColor(mapItem)];
 
-  Glyph glyph;
-  glyph.X      = (int16_t) (itemX * glyphsWidth * (glyphOptions.doubleWidth ? 2 : 1));
-  glyph.Y      = (int16_t) (itemY * glyphsHeight);
-  glyph.width  = glyphsWidth;
-  glyph.height = glyphsHeight;
-  glyph.data   = glyphsBufferRenderInfo.glyphsBuffer->glyphsData + glyphMapItem_getIndex(mapItem) * glyphsHeight * ((glyphsWidth + 7) / 8);;
+// destX must be a multiple of 4, glyphsWidth a multiple of 4 (max 32). No clipping is performed.
+void IRAM_ATTR VGAControllerClass::drawGlyphsBufferItem(int destX, int destY, int glyphsWidth, int glyphsHeight, uint8_t const * glyphData, uint8_t penPattern, uint8_t brushPattern)
+{
+  prepareGlyphRowCache(penPattern, brushPattern);
 
-  execDrawGlyph(glyph, glyphOptions, fgColor, bgColor);
+  switch (glyphsWidth) {
+    // embedded fonts widths
+    case 4:
+      drawGlyphsBufferItemRows<4>(m_viewPort + destY, destX, glyphsHeight, glyphData, m_glyphRowCache);
+      break;
+    case 8:
+      drawGlyphsBufferItemRows<8>(m_viewPort + destY, destX, glyphsHeight, glyphData, m_glyphRowCache);
+      break;
+    default:
+    {
+      const int widthBytes = (glyphsWidth + 7) / 8;
+      const int words      = glyphsWidth / 4;
+      for (int y = 0; y < glyphsHeight; ++y, glyphData += widthBytes) {
+        uint32_t * dest = (uint32_t*) (m_viewPort[destY + y] + destX);
+        for (int w = 0; w < words; ++w) {
+          uint8_t bits = glyphData[w >> 1];
+          dest[w] = m_glyphRowCache[(w & 1) ? (bits & 0x0F) : (bits >> 4)];
+        }
+      }
+      break;
+    }
+  }
 }
 
 
 void IRAM_ATTR VGAControllerClass::execDrawGlyph(Glyph const & glyph, GlyphOptions glyphOptions, RGB penColor, RGB brushColor)
 {
-  hideSprites();
-  if (glyphOptions.fillBackground && !glyphOptions.bold && !glyphOptions.italic && !glyphOptions.blank && !glyphOptions.underline && !glyphOptions.doubleWidth && glyph.width <= 32)
+  const int glyphX = glyph.X + m_paintState.origin.X;
+  const int glyphY = glyph.Y + m_paintState.origin.Y;
+  // italic adds up to two pixels to the right
+  hideSprites(glyphX, glyphY, glyphX + glyph.width * (glyphOptions.doubleWidth ? 2 : 1) + (glyphOptions.italic ? 2 : 0) - 1, glyphY + glyph.height - 1);
+
+  if (m_pixelShift == 0 && glyphOptions.fillBackground && !glyphOptions.bold && !glyphOptions.italic && !glyphOptions.blank && !glyphOptions.underline && !glyphOptions.doubleWidth && glyph.width <= 32)
     execDrawGlyph_light(glyph, glyphOptions, penColor, brushColor);
   else
     execDrawGlyph_full(glyph, glyphOptions, penColor, brushColor);
@@ -1610,8 +3109,8 @@ void IRAM_ATTR VGAControllerClass::execDrawGlyph_full(Glyph const & glyph, Glyph
     if (penColor.B > 2) penColor.B -= 2;
   }
 
-  uint8_t penPattern   = preparePixel(penColor);
-  uint8_t brushPattern = preparePixel(brushColor);
+  uint8_t penPattern   = preparePattern(penColor);
+  uint8_t brushPattern = preparePattern(brushColor);
 
   for (int y = Y1; y < Y1 + YCount; ++y, ++destY) {
 
@@ -1624,12 +3123,12 @@ void IRAM_ATTR VGAControllerClass::execDrawGlyph_full(Glyph const & glyph, Glyph
     if (underline && y == glyphHeight - FABGLIB_UNDERLINE_POSITION - 1) {
 
       for (int x = X1, adestX = destX + skewAdder; x < X1 + XCount && adestX <= clipX2; ++x, ++adestX) {
-        PIXELINROW(dstrow, adestX) = blank ? brushPattern : penPattern;
+        setRowPixel(dstrow, adestX, blank ? brushPattern : penPattern);
         if (doubleWidth) {
           ++adestX;
           if (adestX > clipX2)
             break;
-          PIXELINROW(dstrow, adestX) = blank ? brushPattern : penPattern;
+          setRowPixel(dstrow, adestX, blank ? brushPattern : penPattern);
         }
       }
 
@@ -1637,13 +3136,13 @@ void IRAM_ATTR VGAControllerClass::execDrawGlyph_full(Glyph const & glyph, Glyph
 
       for (int x = X1, adestX = destX + skewAdder; x < X1 + XCount && adestX <= clipX2; ++x, ++adestX) {
         if ((srcrow[x >> 3] << (x & 7)) & 0x80 && !blank) {
-          PIXELINROW(dstrow, adestX) = penPattern;
+          setRowPixel(dstrow, adestX, penPattern);
           prevSet = true;
         } else if (bold && prevSet) {
-          PIXELINROW(dstrow, adestX) = penPattern;
+          setRowPixel(dstrow, adestX, penPattern);
           prevSet = false;
         } else if (fillBackground) {
-          PIXELINROW(dstrow, adestX) = brushPattern;
+          setRowPixel(dstrow, adestX, brushPattern);
           prevSet = false;
         } else {
           prevSet = false;
@@ -1653,9 +3152,9 @@ void IRAM_ATTR VGAControllerClass::execDrawGlyph_full(Glyph const & glyph, Glyph
           if (adestX > clipX2)
             break;
           if (fillBackground)
-            PIXELINROW(dstrow, adestX) = prevSet ? penPattern : brushPattern;
+            setRowPixel(dstrow, adestX, prevSet ? penPattern : brushPattern);
           else if (prevSet)
-            PIXELINROW(dstrow, adestX) = penPattern;
+            setRowPixel(dstrow, adestX, penPattern);
         }
       }
 
@@ -1668,6 +3167,27 @@ void IRAM_ATTR VGAControllerClass::execDrawGlyph_full(Glyph const & glyph, Glyph
 }
 
 
+// Unrolled rows of one byte wide glyphs (WIDTH = 4 or 8, the embedded fonts widths), without horizontal clipping
+template <int WIDTH>
+static inline void IRAM_ATTR drawGlyphRows(uint8_t volatile * * rows, int destX, int rowsCount, uint8_t const * glyphData, uint8_t penPattern, uint8_t brushPattern)
+{
+  for (int y = 0; y < rowsCount; ++y) {
+    uint8_t * dstrow = (uint8_t*) rows[y];
+    const uint8_t src = glyphData[y];
+    PIXELINROW(dstrow, destX)     = src & 0x80 ? penPattern : brushPattern;
+    PIXELINROW(dstrow, destX + 1) = src & 0x40 ? penPattern : brushPattern;
+    PIXELINROW(dstrow, destX + 2) = src & 0x20 ? penPattern : brushPattern;
+    PIXELINROW(dstrow, destX + 3) = src & 0x10 ? penPattern : brushPattern;
+    if (WIDTH == 8) {
+      PIXELINROW(dstrow, destX + 4) = src & 0x08 ? penPattern : brushPattern;
+      PIXELINROW(dstrow, destX + 5) = src & 0x04 ? penPattern : brushPattern;
+      PIXELINROW(dstrow, destX + 6) = src & 0x02 ? penPattern : brushPattern;
+      PIXELINROW(dstrow, destX + 7) = src & 0x01 ? penPattern : brushPattern;
+    }
+  }
+}
+
+
 // assume:
 //   glyph.width <= 32
 //   glyphOptions.fillBackground = 1
@@ -1738,8 +3258,19 @@ void IRAM_ATTR VGAControllerClass::execDrawGlyph_light(Glyph const & glyph, Glyp
     if (penColor.B > 2) penColor.B -= 2;
   }
 
-  uint8_t penPattern   = preparePixel(penColor);
-  uint8_t brushPattern = preparePixel(brushColor);
+  uint8_t penPattern   = preparePattern(penColor);
+  uint8_t brushPattern = preparePattern(brushColor);
+
+  // embedded fonts widths, not horizontally clipped
+  if (X1 == 0 && XCount == glyphWidth) {
+    if (glyphWidth == 8) {
+      drawGlyphRows<8>(m_viewPort + destY, destX, YCount, glyphData + Y1, penPattern, brushPattern);
+      return;
+    } else if (glyphWidth == 4) {
+      drawGlyphRows<4>(m_viewPort + destY, destX, YCount, glyphData + Y1, penPattern, brushPattern);
+      return;
+    }
+  }
 
   for (int y = Y1; y < Y1 + YCount; ++y, ++destY) {
     uint8_t * dstrow = (uint8_t*) m_viewPort[destY];
@@ -1753,11 +3284,117 @@ void IRAM_ATTR VGAControllerClass::execDrawGlyph_light(Glyph const & glyph, Glyp
 }
 
 
+// Draws a string of glyphs on the same row.
+// With simple options (see execDrawGlyph_light()) the glyphs fully inside horizontal clipping are rendered in a single pass, row
+// by row, expanding font bits directly to pixels (four pixels at the time when aligned). Other glyphs are painted one by one.
+void IRAM_ATTR VGAControllerClass::execDrawText(DrawTextInfo const & textInfo)
+{
+  uint8_t const * text = (uint8_t const *) textInfo.text;
+  const int count = strlen(textInfo.text);
+  if (count == 0)
+    return;
+
+  FontInfo const * font      = textInfo.font;
+  const int glyphWidth       = font->width;
+  const int glyphHeight      = font->height;
+  const int glyphWidthByte   = (glyphWidth + 7) / 8;
+  const int glyphSize        = glyphHeight * glyphWidthByte;
+  GlyphOptions glyphOptions  = m_paintState.glyphOptions;
+  const int advance          = glyphWidth * (glyphOptions.doubleWidth ? 2 : 1);
+
+  const int destX = textInfo.X + m_paintState.origin.X;
+  int destY       = textInfo.Y + m_paintState.origin.Y;
+
+  // italic adds up to two pixels to the right
+  hideSprites(destX, destY, destX + count * advance + (glyphOptions.italic ? 2 : 0) - 1, destY + glyphHeight - 1);
+
+  Glyph glyph(textInfo.X, textInfo.Y, glyphWidth, glyphHeight, NULL);
+
+  if (m_pixelShift != 0 || !glyphOptions.fillBackground || glyphOptions.bold || glyphOptions.italic || glyphOptions.blank || glyphOptions.underline || glyphOptions.doubleWidth || glyphWidth > 32) {
+    for (int i = 0; i < count; ++i, glyph.X += advance) {
+      glyph.data = font->data + text[i] * glyphSize;
+      execDrawGlyph_full(glyph, glyphOptions, m_paintState.penColor, m_paintState.brushColor);
+    }
+    return;
+  }
+
+  const int clipX1 = m_paintState.absClippingRect.X1;
+  const int clipY1 = m_paintState.absClippingRect.Y1;
+  const int clipX2 = m_paintState.absClippingRect.X2;
+  const int clipY2 = m_paintState.absClippingRect.Y2;
+
+  if (destX > clipX2 || destY > clipY2 || destX + count * glyphWidth <= clipX1)
+    return;
+
+  // glyphs from "first" to "last" are fully inside horizontal clipping, the others are clipped by execDrawGlyph_light()
+  const int first = destX < clipX1 ? (clipX1 - destX + glyphWidth - 1) / glyphWidth : 0;
+  const int last  = tmin(count, (clipX2 + 1 - destX) / glyphWidth) - 1;
+  const int partial[2] = { first - 1, last + 1 };
+  for (int i = 0; i < 2; ++i) {
+    if (partial[i] >= 0 && partial[i] < count && (i == 0 || partial[1] != partial[0])) {
+      glyph.X    = textInfo.X + partial[i] * glyphWidth;
+      glyph.data = font->data + text[partial[i]] * glyphSize;
+      execDrawGlyph_light(glyph, glyphOptions, m_paintState.penColor, m_paintState.brushColor);
+    }
+  }
+  if (first > last)
+    return;
+
+  // glyph rows from Y1 to YEnd - 1
+  int Y1   = 0;
+  int YEnd = glyphHeight;
+  if (destY < clipY1) {
+    Y1 = clipY1 - destY;
+    destY = clipY1;
+  }
+  if (Y1 >= glyphHeight)
+    return;
+  if (destY + YEnd - Y1 > clipY2 + 1)
+    YEnd = clipY2 + 1 - destY + Y1;
+
+  RGB penColor   = m_paintState.penColor;
+  RGB brushColor = m_paintState.brushColor;
+
+  if (glyphOptions.invert ^ m_paintState.paintOptions.swapFGBG)
+    tswap(penColor, brushColor);
+
+  // a very simple and ugly reduce luminosity (faint) implementation!
+  if (glyphOptions.reduceLuminosity) {
+    if (penColor.R > 2) penColor.R -= 2;
+    if (penColor.G > 2) penColor.G -= 2;
+    if (penColor.B > 2) penColor.B -= 2;
+  }
+
+  const uint8_t penPattern   = preparePattern(penColor);
+  const uint8_t brushPattern = preparePattern(brushColor);
+
+  const int  firstX = destX + first * glyphWidth;
+  const bool words  = (glyphWidth & 3) == 0 && (firstX & 3) == 0;
+  if (words)
+    prepareGlyphRowCache(penPattern, brushPattern);
+
+  for (int y = Y1; y < YEnd; ++y, ++destY) {
+    uint8_t * dstrow = (uint8_t*) m_viewPort[destY];
+    uint8_t const * srcrow = font->data + y * glyphWidthByte;
+    int x = firstX;
+    for (int i = first; i <= last; ++i, x += glyphWidth) {
+      uint8_t const * src = srcrow + text[i] * glyphSize;
+      if (words) {
+        uint32_t * dest = (uint32_t*) (dstrow + x);
+        for (int w = 0; w < glyphWidth / 4; ++w)
+          dest[w] = m_glyphRowCache[(w & 1) ? (src[w >> 1] & 0x0F) : (src[w >> 1] >> 4)];
+      } else {
+        for (int px = 0; px < glyphWidth; ++px)
+          PIXELINROW(dstrow, x + px) = (src[px >> 3] << (px & 7)) & 0x80 ? penPattern : brushPattern;
+      }
+    }
+  }
+}
+
+
 #if FABGLIB_HAS_INVERTRECT
 void IRAM_ATTR VGAControllerClass::execInvertRect(Rect const & rect)
 {
-  hideSprites();
-
   int origX = m_paintState.origin.X;
   int origY = m_paintState.origin.Y;
 
@@ -1765,11 +3402,21 @@ void IRAM_ATTR VGAControllerClass::execInvertRect(Rect const & rect)
   int y1 = iclamp(rect.Y1 + origY, 0, m_viewPortHeight - 1);
   int x2 = iclamp(rect.X2 + origX, 0, m_viewPortWidth - 1);
   int y2 = iclamp(rect.Y2 + origY, 0, m_viewPortHeight - 1);
+
+  hideSprites(x1, y1, x2, y2);
+
+  // palette formats invert palette indexes
+  const uint8_t paletteMask = (1 << (8 >> m_pixelShift)) - 1;
+
   for (int y = y1; y <= y2; ++y) {
     uint8_t * row = (uint8_t*) m_viewPort[y];
     for (int x = x1; x <= x2; ++x) {
-      uint8_t * px = (uint8_t*) &PIXELINROW(row, x);
-      *px = (1 << HSYNC_BIT) | (1 << VSYNC_BIT) | ~(*px);
+      if (m_pixelShift)
+        setRowPixel(row, x, getRowPixel(row, x) ^ paletteMask);
+      else {
+        uint8_t * px = (uint8_t*) &PIXELINROW(row, x);
+        *px = (1 << HSYNC_BIT) | (1 << VSYNC_BIT) | ~(*px);
+      }
     }
   }
 }
@@ -1778,10 +3425,8 @@ void IRAM_ATTR VGAControllerClass::execInvertRect(Rect const & rect)
 
 void IRAM_ATTR VGAControllerClass::execSwapFGBG(Rect const & rect)
 {
-  hideSprites();
-
-  uint8_t penPattern   = preparePixel(m_paintState.penColor);
-  uint8_t brushPattern = preparePixel(m_paintState.brushColor);
+  uint8_t penPattern   = preparePattern(m_paintState.penColor);
+  uint8_t brushPattern = preparePattern(m_paintState.brushColor);
 
   int origX = m_paintState.origin.X;
   int origY = m_paintState.origin.Y;
@@ -1790,30 +3435,80 @@ void IRAM_ATTR VGAControllerClass::execSwapFGBG(Rect const & rect)
   int y1 = iclamp(rect.Y1 + origY, 0, m_viewPortHeight - 1);
   int x2 = iclamp(rect.X2 + origX, 0, m_viewPortWidth - 1);
   int y2 = iclamp(rect.Y2 + origY, 0, m_viewPortHeight - 1);
+
+  hideSprites(x1, y1, x2, y2);
+
   for (int y = y1; y <= y2; ++y) {
     uint8_t * row = (uint8_t*) m_viewPort[y];
     for (int x = x1; x <= x2; ++x) {
-      uint8_t * px = (uint8_t*) &PIXELINROW(row, x);
-      if (*px == penPattern)
-        *px = brushPattern;
-      else if (*px == brushPattern)
-        *px = penPattern;
+      uint8_t px = getRowPixel(row, x);
+      if (px == penPattern)
+        setRowPixel(row, x, brushPattern);
+      else if (px == brushPattern)
+        setRowPixel(row, x, penPattern);
     }
   }
 }
 
 
-// Slow operation!
-// supports overlapping of source and dest rectangles
-void IRAM_ATTR VGAControllerClass::execCopyRect(Rect const & source)
+// Calculates the visible part of a rectangle at destX, destY. Returns false if nothing is visible.
+// On return X1, Y1 is the first visible point (relative to the rectangle) and XCount, YCount the visible size.
+// destX and destY are moved to the first visible point
+static inline bool IRAM_ATTR clipRect(int & destX, int & destY, int width, int height, int clipX1, int clipY1, int clipX2, int clipY2, int & X1, int & Y1, int & XCount, int & YCount)
 {
-  hideSprites();
+  X1 = tmax(0, clipX1 - destX);
+  Y1 = tmax(0, clipY1 - destY);
+  XCount = tmin(width, clipX2 + 1 - destX) - X1;
+  YCount = tmin(height, clipY2 + 1 - destY) - Y1;
+  destX += X1;
+  destY += Y1;
+  return XCount > 0 && YCount > 0;
+}
 
-  const int clipX1 = m_paintState.absClippingRect.X1;
-  const int clipY1 = m_paintState.absClippingRect.Y1;
-  const int clipX2 = m_paintState.absClippingRect.X2;
-  const int clipY2 = m_paintState.absClippingRect.Y2;
 
+// Copies pixels x1...x2 (inclusive) from srcRow to dstRow, where both rows use the PIXELINROW layout and are word aligned
+// relative to each other. Whole words are moved at once, only pixels of partial words at the ends are moved one by one.
+// Moves from right to left when "rightToLeft" is true (source and destination may overlap).
+static void IRAM_ATTR copyRowPixels(uint8_t * dstRow, uint8_t const * srcRow, int x1, int x2, bool rightToLeft)
+{
+  int wordsX1 = (x1 + 3) & ~3;        // first pixel of the first whole word
+  int wordsX2 = (x2 + 1) & ~3;        // first pixel after the last whole word
+  if (wordsX1 >= wordsX2) {
+    // no whole words
+    if (rightToLeft) {
+      for (int x = x2; x >= x1; --x)
+        PIXELINROW(dstRow, x) = PIXELINROW(srcRow, x);
+    } else {
+      for (int x = x1; x <= x2; ++x)
+        PIXELINROW(dstRow, x) = PIXELINROW(srcRow, x);
+    }
+    return;
+  }
+  uint32_t * dst = (uint32_t*) (dstRow + wordsX1);
+  uint32_t const * src = (uint32_t const*) (srcRow + wordsX1);
+  int words = (wordsX2 - wordsX1) >> 2;
+  if (rightToLeft) {
+    for (int x = x2; x >= wordsX2; --x)
+      PIXELINROW(dstRow, x) = PIXELINROW(srcRow, x);
+    for (int i = words - 1; i >= 0; --i)
+      dst[i] = src[i];
+    for (int x = wordsX1 - 1; x >= x1; --x)
+      PIXELINROW(dstRow, x) = PIXELINROW(srcRow, x);
+  } else {
+    for (int x = x1; x < wordsX1; ++x)
+      PIXELINROW(dstRow, x) = PIXELINROW(srcRow, x);
+    for (int i = 0; i < words; ++i)
+      dst[i] = src[i];
+    for (int x = wordsX2; x <= x2; ++x)
+      PIXELINROW(dstRow, x) = PIXELINROW(srcRow, x);
+  }
+}
+
+
+// supports overlapping of source and dest rectangles
+// When source and destination have the same horizontal alignment (on 4 pixels) whole 32 bit words are copied
+void IRAM_ATTR VGAControllerClass::execCopyRect(Rect const & source)
+{
   int origX = m_paintState.origin.X;
   int origY = m_paintState.origin.Y;
 
@@ -1826,70 +3521,256 @@ void IRAM_ATTR VGAControllerClass::execCopyRect(Rect const & source)
   int deltaX = destX - srcX;
   int deltaY = destY - srcY;
 
-  int incX = deltaX < 0 ? 1 : -1;
-  int incY = deltaY < 0 ? 1 : -1;
+  // sprites must be removed from both source and destination
+  hideSprites(srcX, srcY, srcX + width - 1, srcY + height - 1);
+  hideSprites(destX, destY, destX + width - 1, destY + height - 1);
+
+  // clip destination to the clipping rectangle and source to the viewport
+  int X1, Y1, XCount, YCount;
+  if (!clipRect(destX, destY, width, height, tmax<int>(m_paintState.absClippingRect.X1, deltaX), tmax<int>(m_paintState.absClippingRect.Y1, deltaY),
+                tmin<int>(m_paintState.absClippingRect.X2, m_viewPortWidth - 1 + deltaX), tmin<int>(m_paintState.absClippingRect.Y2, m_viewPortHeight - 1 + deltaY),
+                X1, Y1, XCount, YCount))
+    return;
+
+  const int x1 = destX;
+  const int x2 = destX + XCount - 1;
+  const bool rightToLeft = deltaX > 0;
+
+  // copy from bottom to top when moving down
+  int incY = deltaY > 0 ? -1 : 1;
+  int y = deltaY > 0 ? destY + YCount - 1 : destY;
+
+  for (int i = 0; i < YCount; ++i, y += incY) {
+    uint8_t const * srcRow = (uint8_t const*) m_viewPort[y - deltaY];
+    uint8_t * dstRow = (uint8_t*) m_viewPort[y];
+    if (m_pixelShift == 0 && (deltaX & 3) == 0) {
+      // same alignment, make source row addressable with destination coordinates
+      copyRowPixels(dstRow, srcRow - deltaX, x1, x2, rightToLeft);
+    } else if (rightToLeft) {
+      for (int x = x2; x >= x1; --x)
+        setRowPixel(dstRow, x, getRowPixel((uint8_t*) srcRow, x - deltaX));
+    } else {
+      for (int x = x1; x <= x2; ++x)
+        setRowPixel(dstRow, x, getRowPixel((uint8_t*) srcRow, x - deltaX));
+    }
+  }
+}
+
+
+#if FABGLIB_HAS_READWRITE_RAW_DATA
+// pixels outside of the viewport are not read (related data is left untouched)
+void IRAM_ATTR VGAControllerClass::execReadRawData(RawData const & rawData)
+{
+  int x1 = tmax<int>(rawData.X, 0);
+  int y1 = tmax<int>(rawData.Y, 0);
+  int x2 = tmin<int>(rawData.X + rawData.width - 1, m_viewPortWidth - 1);
+  int y2 = tmin<int>(rawData.Y + rawData.height - 1, m_viewPortHeight - 1);
+  hideSprites(x1, y1, x2, y2);
+
+  for (int y = y1; y <= y2; ++y) {
+    uint8_t * row  = (uint8_t*) m_viewPort[y];
+    uint8_t * dest = rawData.data + (y - rawData.Y) * rawData.width - rawData.X;
+    for (int x = x1; x <= x2; ++x)
+      dest[x] = getRowPixel(row, x);
+  }
+}
+
+
+// pixels outside of the viewport are discarded
+void IRAM_ATTR VGAControllerClass::execWriteRawData(RawData const & rawData)
+{
+  int x1 = tmax<int>(rawData.X, 0);
+  int y1 = tmax<int>(rawData.Y, 0);
+  int x2 = tmin<int>(rawData.X + rawData.width - 1, m_viewPortWidth - 1);
+  int y2 = tmin<int>(rawData.Y + rawData.height - 1, m_viewPortHeight - 1);
+  hideSprites(x1, y1, x2, y2);
+
+  for (int y = y1; y <= y2; ++y) {
+    uint8_t * row = (uint8_t*) m_viewPort[y];
+    uint8_t const * src = rawData.data + (y - rawData.Y) * rawData.width - rawData.X;
+    for (int x = x1; x <= x2; ++x)
+      setRowPixel(row, x, src[x]);
+  }
+}
+
 
-  int startX = deltaX < 0 ? destX : destX + width - 1;
-  int startY = deltaY < 0 ? destY : destY + height - 1;
+// worst case size of a run-length encoded row (see RLERows)
+#define RLEROW_MAX_SIZE(width) ((width) + (width) / 128 + 2)
 
-  for (int y = startY, i = 0; i < height; y += incY, ++i) {
-    if (y >= clipY1 && y <= clipY2) {
-      uint8_t * srcRow = (uint8_t*) m_viewPort[y - deltaY];
-      uint8_t * dstRow = (uint8_t*) m_viewPort[y];
-      for (int x = startX, j = 0; j < width; x += incX, ++j) {
-        if (x >= clipX1 && x <= clipX2)
-          PIXELINROW(dstRow, x) = PIXELINROW(srcRow, x - deltaX);
+
+// Encodes rows of the visible viewport (sprites included), sets rows->size. rows->data must have room for RLEROW_MAX_SIZE() bytes per row.
+// A run is stored when at least three pixels are equal, otherwise pixels are stored as they are.
+void IRAM_ATTR VGAControllerClass::execReadRLERows(RLERows * rows)
+{
+  const int width = m_viewPortWidth;
+  volatile uint8_t * * viewPort = m_doubleBuffered ? m_viewPortVisible : m_viewPort;
+  uint8_t * out = rows->data;
+  for (int y = rows->Y; y < rows->Y + rows->height; ++y) {
+    uint8_t * row = (uint8_t*) viewPort[y];
+    for (int x = 0; x < width; ) {
+      uint8_t value = getRowPixel(row, x);
+      int run = 1;
+      while (x + run < width && run < 128 && getRowPixel(row, x + run) == value)
+        ++run;
+      if (run >= 3) {
+        *out++ = 127 + run;
+        *out++ = value;
+        x += run;
+      } else {
+        // pixels up to the start of next run
+        uint8_t * header = out++;
+        int count = 0;
+        for (; x < width && count < 128; ++x, ++count) {
+          value = getRowPixel(row, x);
+          if (count > 0 && x + 2 < width && getRowPixel(row, x + 1) == value && getRowPixel(row, x + 2) == value)
+            break;
+          *out++ = value;
+        }
+        *header = count - 1;
       }
     }
   }
+  rows->size = out - rows->data;
 }
 
 
-#if FABGLIB_HAS_READWRITE_RAW_DATA
-// no bounds checks is done!
-void IRAM_ATTR VGAControllerClass::execReadRawData(RawData const & rawData)
+// decodes run-length encoded rows, pixels outside of the viewport and truncated packets are discarded
+void IRAM_ATTR VGAControllerClass::execWriteRLERows(RLERows const * rows)
 {
-  hideSprites();
-  int x1 = rawData.X;
-  int y1 = rawData.Y;
-  int x2 = rawData.X + rawData.width - 1;
-  int y2 = rawData.Y + rawData.height - 1;
-  uint8_t * dest = rawData.data;
-
-  for (int y = y1; y <= y2; ++y) {
-    uint8_t * row = (uint8_t*) m_viewPort[y];
-    for (int x = x1; x <= x2; ++x, ++dest)
-      *dest = PIXELINROW(row, x);
+  const int width = m_viewPortWidth;
+  const int Y2    = tmin<int>(rows->Y + rows->height, m_viewPortHeight) - 1;
+  hideSprites(0, rows->Y, width - 1, Y2);
+  uint8_t const * in  = rows->data;
+  uint8_t const * end = rows->data + rows->size;
+  for (int y = rows->Y; y <= Y2 && in < end; ++y) {
+    uint8_t * row = y >= 0 ? (uint8_t*) m_viewPort[y] : NULL;
+    for (int x = 0; x < width && in < end; ) {
+      int header = *in++;
+      if (header >= 128) {
+        // run
+        if (in == end)
+          break;
+        uint8_t value = *in++;
+        int count = tmin(header - 127, width - x);
+        for (int i = 0; row && i < count; ++i)
+          setRowPixel(row, x + i, value);
+        x += header - 127;
+      } else {
+        // pixels
+        int count = tmin<int>(tmin(header + 1, width - x), end - in);
+        for (int i = 0; row && i < count; ++i)
+          setRowPixel(row, x + i, in[i]);
+        in += header + 1;
+        x  += header + 1;
+      }
+    }
   }
 }
 
 
-// no bounds checks is done!
-void IRAM_ATTR VGAControllerClass::execWriteRawData(RawData const & rawData)
+bool VGAControllerClass::captureScreen(CaptureCallback callback, void * context)
 {
-  hideSprites();
-  int x1 = rawData.X;
-  int y1 = rawData.Y;
-  int x2 = rawData.X + rawData.width - 1;
-  int y2 = rawData.Y + rawData.height - 1;
-  uint8_t * src = rawData.data;
-
-  for (int y = y1; y <= y2; ++y) {
-    uint8_t * row = (uint8_t*) m_viewPort[y];
-    for (int x = x1; x <= x2; ++x, ++src)
-      PIXELINROW(row, x) = *src;
+  // no viewport memory in scanline mode
+  if (m_viewPort == NULL)
+    return false;
+
+  const int rowsPerChunk = FABGLIB_CAPTURE_ROWS_PER_CHUNK;
+  const int chunksCount  = (m_viewPortHeight + rowsPerChunk - 1) / rowsPerChunk;
+  const int chunkSize    = rowsPerChunk * RLEROW_MAX_SIZE(m_viewPortWidth);
+
+  // two chunks: one is encoded by the primitives executor while the other is handed to the callback
+  RLERows  chunks[2];
+  uint32_t fences[2] = { 0, 0 };
+  uint32_t lastFence = 0;
+  chunks[0].data = (uint8_t*) malloc(chunkSize);
+  chunks[1].data = (uint8_t*) malloc(chunkSize);
+
+  bool result = chunks[0].data && chunks[1].data;
+  for (int i = 0; i <= chunksCount && result; ++i) {
+    if (i < chunksCount) {
+      RLERows & chunk = chunks[i & 1];
+      chunk.Y      = i * rowsPerChunk;
+      chunk.height = tmin(rowsPerChunk, m_viewPortHeight - chunk.Y);
+      chunk.size   = 0;
+      Primitive p;
+      p.cmd     = PrimitiveCmd::ReadRLERows;
+      p.rleRows = &chunk;
+      addPrimitive(p);
+      fences[i & 1] = lastFence = getPrimitivesFence();
+    }
+    if (i > 0) {
+      RLERows const & chunk = chunks[(i - 1) & 1];
+      waitPrimitivesFence(fences[(i - 1) & 1]);
+      result = callback(context, chunk.Y, chunk.height, chunk.data, chunk.size);
+    }
   }
+
+  // interrupted: last queued chunk may be still pending
+  if (lastFence)
+    waitPrimitivesFence(lastFence);
+
+  free(chunks[0].data);
+  free(chunks[1].data);
+  return result;
+}
+
+
+void VGAControllerClass::restoreScreenChunk(int Y, int height, uint8_t const * data, int size)
+{
+  RLERows rows;
+  rows.Y      = Y;
+  rows.height = height;
+  rows.size   = size;
+  rows.data   = (uint8_t*) data;
+  Primitive p;
+  p.cmd     = PrimitiveCmd::WriteRLERows;
+  p.rleRows = &rows;
+  addPrimitive(p);
+  waitPrimitivesFence(getPrimitivesFence());
 }
 #endif
 
 
 void IRAM_ATTR VGAControllerClass::execDrawBitmap(BitmapDrawingInfo const & bitmapDrawingInfo)
 {
-  hideSprites();
-  drawBitmap(bitmapDrawingInfo.X + m_paintState.origin.X, bitmapDrawingInfo.Y + m_paintState.origin.Y, bitmapDrawingInfo.bitmap, NULL, false);
+  const int destX = bitmapDrawingInfo.X + m_paintState.origin.X;
+  const int destY = bitmapDrawingInfo.Y + m_paintState.origin.Y;
+  hideSprites(destX, destY, destX + bitmapDrawingInfo.bitmap->width - 1, destY + bitmapDrawingInfo.bitmap->height - 1);
+  drawBitmap(destX, destY, bitmapDrawingInfo.bitmap, NULL, false);
+}
+
+
+// Draws source pixels X1...X1+count-1 of bitmap row "src" at destX of "dstrow", skipping transparent pixels and blending translucent ones.
+// Four opaque pixels on a word boundary are written with a single store.
+static inline void IRAM_ATTR drawBitmapRowSpan(uint8_t * dstrow, int destX, uint8_t const * src, int count)
+{
+  int x = destX, xend = destX + count;
+  for (; x < xend && (x & 3) != 0; ++x, ++src)
+    drawRawPixel(dstrow, x, *src);
+  uint32_t * dst = (uint32_t*) (dstrow + x);
+  for (; x + 4 <= xend; x += 4, src += 4, ++dst) {
+    if ((src[0] & src[1] & src[2] & src[3]) >= 0xC0) {
+      // memory word has pixels 2, 3, 0, 1
+      *dst = src[2] | (src[3] << 8) | (src[0] << 16) | (src[1] << 24);
+    } else {
+      for (int i = 0; i < 4; ++i)
+        drawRawPixel(dstrow, x + i, src[i]);
+    }
+  }
+  for (; x < xend; ++x, ++src)
+    drawRawPixel(dstrow, x, *src);
 }
 
 
+// Size of a row of the saved background of a sprite "width" pixels wide.
+// Each row contains whole words of the viewport (in PIXELINROW layout), so up to 3 pixels may be added at each side.
+int Sprite::savedBackgroundRowSize(int width)
+{
+  return (width + 9) & ~3;
+}
+
+
+// when saveBackground is not NULL the area covered by the bitmap (always clipped to the viewport) is copied to saveBackground (see restoreBackground())
 void IRAM_ATTR VGAControllerClass::drawBitmap(int destX, int destY, Bitmap const * bitmap, uint8_t * saveBackground, bool ignoreClippingRect)
 {
   const int clipX1 = ignoreClippingRect ? 0 : m_paintState.absClippingRect.X1;
@@ -1897,152 +3778,413 @@ void IRAM_ATTR VGAControllerClass::drawBitmap(int destX, int destY, Bitmap const
   const int clipX2 = ignoreClippingRect ? m_viewPortWidth - 1 : m_paintState.absClippingRect.X2;
   const int clipY2 = ignoreClippingRect ? m_viewPortHeight - 1 : m_paintState.absClippingRect.Y2;
 
-  if (destX > clipX2 || destY > clipY2)
-    return;
-
-  int width  = bitmap->width;
-  int height = bitmap->height;
+  const int width = bitmap->width;
 
-  int X1 = 0;
-  int XCount = width;
+  int X1, Y1, XCount, YCount;
+  if (!clipRect(destX, destY, width, bitmap->height, clipX1, clipY1, clipX2, clipY2, X1, Y1, XCount, YCount))
+    return;
 
-  if (destX < clipX1) {
-    X1 = clipX1 - destX;
-    destX = clipX1;
+  if (m_pixelShift) {
+    // palette formats: pixels are mapped to the nearest palette color, background is saved as one palette index per byte
+    const int rowSize = Sprite::savedBackgroundRowSize(width);
+    for (int y = 0; y < YCount; ++y) {
+      uint8_t volatile * dstrow = m_viewPort[destY + y];
+      uint8_t * saverow = saveBackground ? saveBackground + (Y1 + y) * rowSize : NULL;
+      if (bitmap->encoding == RLEBitmap) {
+        if (saverow)
+          for (int x = 0; x < XCount; ++x)
+            saverow[x] = getRowPixel(dstrow, destX + x);
+        uint8_t const * run = RLEBitmapRow(bitmap, Y1 + y);
+        for (int runs = *run++, x = 0; runs > 0 && x < X1 + XCount; --runs) {
+          x += *run++;
+          const int count = *run++;
+          for (int i = tmax<int>(x, X1); i < tmin<int>(x + count, X1 + XCount); ++i)
+            drawPalettePixel(dstrow, destX + i - X1, run[i - x]);
+          run += count;
+          x += count;
+        }
+        continue;
+      }
+      uint8_t const * src = bitmap->data + (Y1 + y) * width + X1;
+      for (int x = 0; x < XCount; ++x, ++src) {
+        if (saverow)
+          saverow[x] = getRowPixel(dstrow, destX + x);
+        drawPalettePixel(dstrow, destX + x, *src);
+      }
+    }
+    return;
   }
 
-  if (destX + XCount > clipX2 + 1)
-    XCount = clipX2 + 1 - destX;
-
-  int Y1 = 0;
-  int YCount = height;
-
-  if (destY < clipY1) {
-    Y1 = clipY1 - destY;
-    destY = clipY1;
+  if (saveBackground) {
+    // save whole words, rows are saved at the same word offset they have in the viewport
+    const int rowSize = Sprite::savedBackgroundRowSize(width);
+    const int firstWord = destX & ~3;
+    const int bytes = (((destX + XCount + 3) & ~3) - firstWord);
+    for (int y = 0; y < YCount; ++y)
+      memcpy(saveBackground + (Y1 + y) * rowSize, (uint8_t*) m_viewPort[destY + y] + firstWord, bytes);
   }
 
-  if (destY + YCount > clipY2 + 1)
-    YCount = clipY2 + 1 - destY;
+  uint8_t const * data = bitmap->data;
+  uint16_t const * spans = bitmap->opaqueSpansDirty ? NULL : bitmap->opaqueSpans;
+  const int X2 = X1 + XCount;
+
+  for (int y = Y1, adestY = destY; y < Y1 + YCount; ++y, ++adestY) {
+    uint8_t * dstrow = (uint8_t*) m_viewPort[adestY];
+    uint8_t const * srcrow = data + y * width;
+    if (bitmap->encoding == RLEBitmap) {
+      // draw runs, transparent pixels are not stored
+      uint8_t const * run = RLEBitmapRow(bitmap, y);
+      for (int runs = *run++, x = 0; runs > 0 && x < X2; --runs) {
+        x += *run++;
+        const int count = *run++;
+        int runX1 = tmax<int>(x, X1);
+        int runX2 = tmin<int>(x + count, X2);
+        if (runX1 < runX2)
+          drawBitmapRowSpan(dstrow, destX + runX1 - X1, run + runX1 - x, runX2 - runX1);
+        run += count;
+        x += count;
+      }
+    } else if (spans) {
+      // draw only opaque spans
+      uint16_t const * span    = spans + bitmap->height + 1 + 2 * spans[y];
+      uint16_t const * spanEnd = spans + bitmap->height + 1 + 2 * spans[y + 1];
+      for (; span < spanEnd; span += 2) {
+        int spanX1 = tmax<int>(span[0], X1);
+        int spanX2 = tmin<int>(span[0] + span[1], X2);
+        if (spanX1 < spanX2)
+          drawBitmapRowSpan(dstrow, destX + spanX1 - X1, srcrow + spanX1, spanX2 - spanX1);
+      }
+    } else
+      drawBitmapRowSpan(dstrow, destX, srcrow + X1, XCount);
+  }
+}
 
-  if (saveBackground) {
 
-    // save background and draw the bitmap
-    uint8_t const * data = bitmap->data;
-    for (int y = Y1, adestY = destY; y < YCount; ++y, ++adestY) {
-      uint8_t * dstrow = (uint8_t*) m_viewPort[adestY];
-      uint8_t * savePx = saveBackground + y * width + X1;
-      uint8_t const * src = data + y * width + X1;
-      for (int x = X1, adestX = destX; x < XCount; ++x, ++adestX, ++savePx, ++src) {
-        int alpha = *src >> 6;  // TODO?, alpha blending
-        if (alpha) {
-          uint8_t * dstPx = &PIXELINROW(dstrow, adestX);
-          *savePx = *dstPx;
-          *dstPx = SYNC_MASK | *src;
-        } else {
-          *savePx = 0;
-        }
-      }
-    }
+// restores a background saved by drawBitmap(), width and height are the bitmap size
+void IRAM_ATTR VGAControllerClass::restoreBackground(int destX, int destY, int width, int height, uint8_t const * savedBackground)
+{
+  int X1, Y1, XCount, YCount;
+  if (!clipRect(destX, destY, width, height, 0, 0, m_viewPortWidth - 1, m_viewPortHeight - 1, X1, Y1, XCount, YCount))
+    return;
 
-  } else {
+  const int rowSize = Sprite::savedBackgroundRowSize(width);
+  const int firstWord = destX & ~3;
 
-    // draw just the bitmap
-    if (bitmap) {
-      uint8_t const * data = bitmap->data;
-      for (int y = Y1, adestY = destY; y < YCount; ++y, ++adestY) {
-        uint8_t * dstrow = (uint8_t*) m_viewPort[adestY];
-        uint8_t const * src = data + y * width + X1;
-        for (int x = X1, adestX = destX; x < XCount; ++x, ++adestX, ++src) {
-          int alpha = *src >> 6;  // TODO?, alpha blending
-          if (alpha)
-            PIXELINROW(dstrow, adestX) = SYNC_MASK | *src;
-        }
-      }
+  if (m_pixelShift) {
+    for (int y = 0; y < YCount; ++y) {
+      uint8_t const * srcrow = savedBackground + (Y1 + y) * rowSize;
+      for (int x = 0; x < XCount; ++x)
+        setRowPixel(m_viewPort[destY + y], destX + x, srcrow[x]);
     }
+    return;
+  }
 
+  for (int y = 0; y < YCount; ++y) {
+    // make saved row addressable with viewport coordinates
+    uint8_t const * srcrow = savedBackground + (Y1 + y) * rowSize - firstWord;
+    copyRowPixels((uint8_t*) m_viewPort[destY + y], srcrow, destX, destX + XCount - 1, false);
   }
 }
 
 
 void VGAControllerClass::refreshSprites()
 {
+  // frames may have been invalidated since they have been added
+  for (int i = 0; i < m_spritesCount; ++i) {
+    Bitmap const * frame = getSprite(i)->getFrame();
+    if (frame)
+      frame->updateOpaqueSpans();
+  }
   Primitive p;
   p.cmd = PrimitiveCmd::RefreshSprites;
   addPrimitive(p);
 }
 
 
+void VGAControllerClass::resetSpritesStats()
+{
+  m_spritesStats.restored = 0;
+  m_spritesStats.skipped  = 0;
+  m_spritesStats.painted  = 0;
+}
+
+
+// rectangle where the sprite has been painted, valid only when savedBackgroundWidth > 0
+static inline Rect IRAM_ATTR spriteSavedRect(Sprite const * sprite)
+{
+  return Rect(sprite->savedX, sprite->savedY, sprite->savedX + sprite->savedBackgroundWidth - 1, sprite->savedY + sprite->savedBackgroundHeight - 1);
+}
+
+
+// rectangle where the sprite will be painted by showSprites(). Returns false if the sprite will not be painted
+static inline bool IRAM_ATTR spriteNextRect(Sprite * sprite, Rect * rect)
+{
+  Bitmap const * bitmap = sprite->getFrame();
+  if (sprite->visible && sprite->allowDraw && bitmap) {
+    int16_t spriteX = sprite->x;
+    int16_t spriteY = sprite->y;
+    *rect = Rect(spriteX, spriteY, spriteX + bitmap->width - 1, spriteY + bitmap->height - 1);
+    return true;
+  }
+  return false;
+}
+
+
+// Restores only sprites that have been changed (moved, animated, shown or hidden)
 void IRAM_ATTR VGAControllerClass::hideSprites()
 {
-  if (!m_spritesHidden) {
-    m_spritesHidden = true;
-
-    // normal sprites
-    if (m_sprites && !m_doubleBuffered) {
-      // restore saved backgrounds
-      uint8_t * spritePtr = (uint8_t*)m_sprites + (m_spritesCount - 1) * m_spriteSize;
-      for (int i = 0; i < m_spritesCount; ++i, spritePtr -= m_spriteSize) {
-        Sprite * sprite = (Sprite*) spritePtr;
-        if (sprite->allowDraw && sprite->savedBackgroundWidth > 0) {
-          Bitmap bitmap(sprite->savedBackgroundWidth, sprite->savedBackgroundHeight, sprite->savedBackground);
-          drawBitmap(sprite->savedX, sprite->savedY, &bitmap, NULL, true);
-          sprite->savedBackgroundWidth = sprite->savedBackgroundHeight = 0;
-        }
+  hideSprites(0, 0, -1, -1);
+}
+
+
+// Restores sprites that have been changed or that intersect X1, Y1, X2, Y2 (absolute coordinates, X1 > X2 means no rectangle).
+// Sprites painted over a restored sprite are restored as well. Restored sprites are painted again by showSprites().
+// When double buffered normal sprites are painted again after any drawing, because they are not saved into the background.
+void IRAM_ATTR VGAControllerClass::hideSprites(int X1, int Y1, int X2, int Y2)
+{
+  // with background layer sprites are composited by RefreshSprites primitive
+  if (m_backgroundLayer)
+    return;
+
+  FABGLIB_TRACE(HideSprites, Begin, 0);
+  #if FABGLIB_HAS_FRAME_STATS
+  int64_t startTime = esp_timer_get_time();
+  #endif
+  const Rect damage(X1, Y1, X2, Y2);
+  const bool hasDamage = X1 <= X2 && Y1 <= Y2;
+
+  // mouse cursor overlay: rows under the cursor will be composited again (after drawing, see showSprites())
+  Bitmap const * overlayBitmap = m_overlayBitmap;
+  if (m_mouseCursorOverlay && hasDamage && overlayBitmap &&
+      intersect(damage, Rect(m_overlayX, m_overlayY, m_overlayX + overlayBitmap->width - 1, m_overlayY + overlayBitmap->height - 1)))
+    m_overlayDamaged = true;
+
+  // mouse cursor is the last sprite, unless composited by the overlay
+  const int count = m_spritesCount + (m_mouseCursorOverlay ? 0 : 1);
+
+  // mark sprites to restore, from bottom to top, in a single pass. "closure" bounds the rectangles restored or painted so far:
+  // sprites outside of it are not overwritten, the others are checked against each sprite below.
+  Rect closure;
+  bool hasClosure = false;
+  bool restore    = false;
+  for (int i = 0; i < count; ++i) {
+    Sprite * sprite = getSprite(i);
+    if (!sprite->allowDraw)
+      continue;
+
+    Rect nextRect;
+    const bool willPaint = spriteNextRect(sprite, &nextRect);
+
+    if (sprite->savedBackgroundWidth == 0) {
+      // not on screen, will be painted over upper sprites
+      if (willPaint) {
+        closure    = hasClosure ? rectUnion(closure, nextRect) : nextRect;
+        hasClosure = true;
       }
+      continue;
     }
 
-    // mouse cursor sprite
-    if (m_mouseCursor.savedBackgroundWidth > 0) {
-      Bitmap bitmap(m_mouseCursor.savedBackgroundWidth, m_mouseCursor.savedBackgroundHeight, m_mouseCursor.savedBackground);
-      drawBitmap(m_mouseCursor.savedX, m_mouseCursor.savedY, &bitmap, NULL, true);
-      m_mouseCursor.savedBackgroundWidth = m_mouseCursor.savedBackgroundHeight = 0;
+    Rect savedRect = spriteSavedRect(sprite);
+    bool mark = (m_doubleBuffered && hasDamage && i < m_spritesCount) ||
+                !willPaint || sprite->isStatic || sprite->savedFrame != sprite->getFrame() ||
+                nextRect.X1 != savedRect.X1 || nextRect.Y1 != savedRect.Y1 || (hasDamage && intersect(savedRect, damage));
+
+    // restoring or painting a sprite below this one overwrites it
+    if (!mark && hasClosure && intersect(savedRect, closure)) {
+      for (int j = 0; !mark && j < i; ++j) {
+        Sprite * below = getSprite(j);
+        Rect belowRect;
+        if (below->damaged)
+          mark = intersect(savedRect, spriteSavedRect(below)) || (spriteNextRect(below, &belowRect) && intersect(savedRect, belowRect));
+        else if (below->savedBackgroundWidth == 0 && spriteNextRect(below, &belowRect))
+          mark = intersect(savedRect, belowRect);
+      }
     }
 
+    if (mark) {
+      sprite->damaged = true;
+      restore = true;
+      closure    = hasClosure ? rectUnion(closure, savedRect) : savedRect;
+      hasClosure = true;
+      if (willPaint)
+        closure = rectUnion(closure, nextRect);
+    } else
+      ++m_spritesStats.skipped;
+  }
+
+  // restore saved backgrounds, from top to bottom
+  if (restore) {
+    for (int i = count - 1; i >= 0; --i) {
+      Sprite * sprite = getSprite(i);
+      if (sprite->damaged) {
+        // backgrounds of normal sprites are not saved when double buffered, they are just painted again
+        if (!m_doubleBuffered || i == m_spritesCount)
+          restoreBackground(sprite->savedX, sprite->savedY, sprite->savedBackgroundWidth, sprite->savedBackgroundHeight, sprite->savedBackground);
+        sprite->savedBackgroundWidth = sprite->savedBackgroundHeight = 0;
+        sprite->damaged = false;
+        ++m_spritesStats.restored;
+      }
+    }
   }
+  #if FABGLIB_HAS_FRAME_STATS
+  m_frameStats.lastSpritesTime += esp_timer_get_time() - startTime;
+  #endif
+  FABGLIB_TRACE(HideSprites, End, 0);
 }
 
 
 void IRAM_ATTR VGAControllerClass::showSprites()
 {
-  if (m_spritesHidden) {
-    m_spritesHidden = false;
-
-    // normal sprites
-    // save backgrounds and draw sprites
-    uint8_t * spritePtr = (uint8_t*)m_sprites;
-    for (int i = 0; i < m_spritesCount; ++i, spritePtr += m_spriteSize) {
-      Sprite * sprite = (Sprite*) spritePtr;
-      if (sprite->visible && sprite->allowDraw && sprite->getFrame()) {
-        // save sprite X and Y so other threads can change them without interferring
-        int16_t spriteX = sprite->x;
-        int16_t spriteY = sprite->y;
-        Bitmap const * bitmap = sprite->getFrame();
-        drawBitmap(spriteX, spriteY, bitmap, sprite->savedBackground, true);
-        sprite->savedX = spriteX;
-        sprite->savedY = spriteY;
-        sprite->savedBackgroundWidth  = bitmap->width;
-        sprite->savedBackgroundHeight = bitmap->height;
-        if (sprite->isStatic)
-          sprite->allowDraw = false;
-      }
-    }
+  // with background layer sprites are composited by RefreshSprites primitive
+  if (m_backgroundLayer)
+    return;
+
+  // sprites may have been changed after last hideSprites()
+  hideSprites();
+
+  FABGLIB_TRACE(ShowSprites, Begin, 0);
+  #if FABGLIB_HAS_FRAME_STATS
+  int64_t startTime = esp_timer_get_time();
+  #endif
+
+  if (m_overlayDamaged) {
+    m_overlayDamaged = false;
+    m_overlayDirty   = true;
+  }
 
-    // mouse cursor sprite
-    // save backgrounds and draw mouse cursor
-    if (m_mouseCursor.visible && m_mouseCursor.getFrame()) {
+  // save backgrounds and paint sprites not already on screen
+  const int count = m_spritesCount + (m_mouseCursorOverlay ? 0 : 1);
+  for (int i = 0; i < count; ++i) {
+    Sprite * sprite = getSprite(i);
+    if (sprite->savedBackgroundWidth == 0 && sprite->visible && sprite->allowDraw && sprite->getFrame()) {
       // save sprite X and Y so other threads can change them without interferring
-      int16_t spriteX = m_mouseCursor.x;
-      int16_t spriteY = m_mouseCursor.y;
-      Bitmap const * bitmap = m_mouseCursor.getFrame();
-      drawBitmap(spriteX, spriteY, bitmap, m_mouseCursor.savedBackground, true);
-      m_mouseCursor.savedX = spriteX;
-      m_mouseCursor.savedY = spriteY;
-      m_mouseCursor.savedBackgroundWidth  = bitmap->width;
-      m_mouseCursor.savedBackgroundHeight = bitmap->height;
+      int16_t spriteX = sprite->x;
+      int16_t spriteY = sprite->y;
+      Bitmap const * bitmap = sprite->getFrame();
+      drawBitmap(spriteX, spriteY, bitmap, sprite->savedBackground, true);
+      sprite->savedX = spriteX;
+      sprite->savedY = spriteY;
+      sprite->savedFrame = bitmap;
+      sprite->savedBackgroundWidth  = bitmap->width;
+      sprite->savedBackgroundHeight = bitmap->height;
+      if (sprite->isStatic)
+        sprite->allowDraw = false;
+      ++m_spritesStats.painted;
+    }
+  }
+  #if FABGLIB_HAS_FRAME_STATS
+  m_frameStats.lastSpritesTime += esp_timer_get_time() - startTime;
+  #endif
+  FABGLIB_TRACE(ShowSprites, End, 0);
+}
+
+
+bool VGAControllerClass::setBackgroundLayer()
+{
+  if (!m_doubleBuffered || m_viewPort == NULL)
+    return false;
+
+  // wait for the scene to be completely drawn
+  processPrimitives();
+  primitivesExecutionWait();
+
+  const int rowSize = getViewPortRowSize();
+  if (m_backgroundLayer == NULL) {
+    m_backgroundLayer = (uint8_t*) heap_caps_malloc(rowSize * m_viewPortHeight, MALLOC_CAP_8BIT);
+    m_layerRects[0]   = (Rect*) malloc(sizeof(Rect) * (m_spritesCount + 1));
+    m_layerRects[1]   = (Rect*) malloc(sizeof(Rect) * (m_spritesCount + 1));
+    if (m_backgroundLayer == NULL || m_layerRects[0] == NULL || m_layerRects[1] == NULL) {
+      freeBackgroundLayer();
+      return false;
     }
+    m_layerRectsSize = m_spritesCount + 1;
+  }
+
+  suspendBackgroundPrimitiveExecution();
+  for (int y = 0; y < m_viewPortHeight; ++y) {
+    memcpy(m_backgroundLayer + y * rowSize, (uint8_t*) m_viewPort[y], rowSize);
+    memcpy((uint8_t*) m_viewPortVisible[y], (uint8_t*) m_viewPort[y], rowSize);
+  }
+  m_layerRectsCount[0] = m_layerRectsCount[1] = 0;
+  resumeBackgroundPrimitiveExecution();
+
+  return true;
+}
+
+
+void VGAControllerClass::removeBackgroundLayer()
+{
+  processPrimitives();
+  primitivesExecutionWait();
+  suspendBackgroundPrimitiveExecution();
+  freeBackgroundLayer();
+  resumeBackgroundPrimitiveExecution();
+}
+
+
+void VGAControllerClass::freeBackgroundLayer()
+{
+  heap_caps_free(m_backgroundLayer);
+  free(m_layerRects[0]);
+  free(m_layerRects[1]);
+  m_backgroundLayer = NULL;
+  m_layerRects[0] = m_layerRects[1] = NULL;
+  m_layerRectsCount[0] = m_layerRectsCount[1] = 0;
+  m_layerRectsSize = 0;
+}
+
+
+// copies a rectangle (absolute coordinates, already clipped to the viewport) from background layer to the back buffer
+void IRAM_ATTR VGAControllerClass::restoreLayerRect(Rect const & rect)
+{
+  const int rowSize = getViewPortRowSize();
+  for (int y = rect.Y1; y <= rect.Y2; ++y) {
+    uint8_t const * srcrow = m_backgroundLayer + y * rowSize;
+    if (m_pixelShift) {
+      for (int x = rect.X1; x <= rect.X2; ++x)
+        setRowPixel(m_viewPort[y], x, getRowPixel((uint8_t volatile *) srcrow, x));
+    } else
+      copyRowPixels((uint8_t*) m_viewPort[y], srcrow, rect.X1, rect.X2, false);
+  }
+}
+
 
+// Sprites compositor: restores from background layer the areas where sprites have been painted in the back buffer (two frames ago),
+// then paints all visible sprites. Together these cover the union of previous and current sprites rectangles.
+void IRAM_ATTR VGAControllerClass::composeSprites()
+{
+  #if FABGLIB_HAS_FRAME_STATS
+  int64_t startTime = esp_timer_get_time();
+  #endif
+
+  Rect * rects = m_layerRects[m_backBufferIndex];
+  int16_t & rectsCount = m_layerRectsCount[m_backBufferIndex];
+
+  for (int i = 0; i < rectsCount; ++i)
+    restoreLayerRect(rects[i]);
+  m_spritesStats.restored += rectsCount;
+  rectsCount = 0;
+
+  const Rect viewPortRect(0, 0, m_viewPortWidth - 1, m_viewPortHeight - 1);
+  const int count = m_spritesCount + 1;
+  for (int i = 0; i < count && rectsCount < m_layerRectsSize; ++i) {
+    Sprite * sprite = getSprite(i);
+    Bitmap const * bitmap = sprite->getFrame();
+    if (sprite->visible && bitmap) {
+      int16_t spriteX = sprite->x;
+      int16_t spriteY = sprite->y;
+      Rect rect = intersection(Rect(spriteX, spriteY, spriteX + bitmap->width - 1, spriteY + bitmap->height - 1), viewPortRect);
+      if (rect.X1 <= rect.X2 && rect.Y1 <= rect.Y2) {
+        drawBitmap(spriteX, spriteY, bitmap, NULL, true);
+        rects[rectsCount++] = rect;
+        ++m_spritesStats.painted;
+      }
+    }
   }
+
+  #if FABGLIB_HAS_FRAME_STATS
+  m_frameStats.lastSpritesTime += esp_timer_get_time() - startTime;
+  #endif
 }
 
 
@@ -2050,94 +4192,166 @@ void IRAM_ATTR VGAControllerClass::execSwapBuffers()
 {
   tswap(m_DMABuffers, m_DMABuffersVisible);
   tswap(m_viewPort, m_viewPortVisible);
+  m_backBufferIndex ^= 1;
   m_DMABuffersHead->qe.stqe_next = (lldesc_t*) &m_DMABuffersVisible[0];
 }
 
 
+// bounding rectangle of a path (absolute coordinates)
+static Rect IRAM_ATTR pathBounds(Path const & path, Point const & origin)
+{
+  Rect bounds(INT16_MAX, INT16_MAX, INT16_MIN, INT16_MIN);
+  for (int i = 0; i < path.pointsCount; ++i) {
+    bounds.X1 = tmin(bounds.X1, path.points[i].X);
+    bounds.Y1 = tmin(bounds.Y1, path.points[i].Y);
+    bounds.X2 = tmax(bounds.X2, path.points[i].X);
+    bounds.Y2 = tmax(bounds.Y2, path.points[i].Y);
+  }
+  return translate(bounds, origin);
+}
+
+
 void IRAM_ATTR VGAControllerClass::execDrawPath(Path const & path)
 {
-  hideSprites();
+  Rect bounds = pathBounds(path, m_paintState.origin);
+  hideSprites(bounds.X1, bounds.Y1, bounds.X2, bounds.Y2);
 
-  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePixel(m_paintState.brushColor) : preparePixel(m_paintState.penColor);
+  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePattern(m_paintState.brushColor) : preparePattern(m_paintState.penColor);
 
   int origX = m_paintState.origin.X;
   int origY = m_paintState.origin.Y;
 
-  int i = 0;
-  for (; i < path.pointsCount - 1; ++i)
-    drawLine(path.points[i].X + origX, path.points[i].Y + origY, path.points[i + 1].X + origX, path.points[i + 1].Y + origY, pattern);
-  drawLine(path.points[i].X + origX, path.points[i].Y + origY, path.points[0].X + origX, path.points[0].Y + origY, pattern);
+  Point const * points = path.points;
+  const int pathsCount = path.pathsSizes ? path.pathsCount : 1;
+  for (int p = 0; p < pathsCount; ++p) {
+    const int pointsCount = path.pathsSizes ? path.pathsSizes[p] : path.pointsCount;
+    if (pointsCount > 0) {
+      int i = 0;
+      for (; i < pointsCount - 1; ++i)
+        drawLine(points[i].X + origX, points[i].Y + origY, points[i + 1].X + origX, points[i + 1].Y + origY, pattern);
+      drawLine(points[i].X + origX, points[i].Y + origY, points[0].X + origX, points[0].Y + origY, pattern);
+    }
+    points += pointsCount;
+  }
 }
 
 
 void IRAM_ATTR VGAControllerClass::execFillPath(Path const & path)
 {
-  hideSprites();
+  if (m_pathEdges == NULL || m_pathActiveEdges == NULL)
+    return;
 
-  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePixel(m_paintState.penColor) : preparePixel(m_paintState.brushColor);
+  Rect bounds = pathBounds(path, m_paintState.origin);
+  hideSprites(bounds.X1, bounds.Y1, bounds.X2, bounds.Y2);
 
-  const int clipX1 = m_paintState.absClippingRect.X1;
-  const int clipY1 = m_paintState.absClippingRect.Y1;
-  const int clipX2 = m_paintState.absClippingRect.X2;
-  const int clipY2 = m_paintState.absClippingRect.Y2;
+  uint8_t pattern = m_paintState.paintOptions.swapFGBG ? preparePattern(m_paintState.penColor) : preparePattern(m_paintState.brushColor);
+
+  const int minY = tmax<int>(m_paintState.absClippingRect.Y1, bounds.Y1);
+  const int maxY = tmin<int>(m_paintState.absClippingRect.Y2, bounds.Y2);
+
+  Point const * points = path.points;
+  const int pathsCount = path.pathsSizes ? path.pathsCount : 1;
+  for (int p = 0; p < pathsCount; ++p) {
+    const int pointsCount = path.pathsSizes ? path.pathsSizes[p] : path.pointsCount;
+    if (minY <= maxY)
+      fillPolygon(points, pointsCount, minY, maxY, pattern);
+    points += pointsCount;
+  }
+}
+
+
+// Active edge table scanline fill (even-odd rule), clipped to minY..maxY and to horizontal clipping rectangle.
+// An edge crosses scanline Y when Y1 < Y <= Y2 (Y1 < Y2), at X rounded up. Spans are filled from left X to right X - 1.
+void IRAM_ATTR VGAControllerClass::fillPolygon(Point const * points, int pointsCount, int minY, int maxY, uint8_t pattern)
+{
+  if (pointsCount < 3 || pointsCount > FABGLIB_MAX_PATH_EDGES)
+    return;
+
+  const int minX = m_paintState.absClippingRect.X1;
+  const int maxX = m_paintState.absClippingRect.X2 + 1;
 
   const int origX = m_paintState.origin.X;
   const int origY = m_paintState.origin.Y;
 
-  int minX = clipX1;
-  int maxX = clipX2 + 1;
+  PathEdge * edges = m_pathEdges;
+  int16_t * active = m_pathActiveEdges;
+
+  // build edges table, sorted by first scanline
+  int edgesCount = 0;
+  for (int i = 0, j = pointsCount - 1; i < pointsCount; j = i++) {
+    int x1 = points[j].X + origX, y1 = points[j].Y + origY;
+    int x2 = points[i].X + origX, y2 = points[i].Y + origY;
+    if (y1 == y2)
+      continue;
+    if (y1 > y2) {
+      tswap(x1, x2);
+      tswap(y1, y2);
+    }
+    int YStart = tmax(y1 + 1, minY);
+    int YEnd   = tmin(y2, maxY);
+    if (YStart > YEnd)
+      continue;
+    const int dx  = x2 - x1;
+    const int dy  = y2 - y1;
+    const int num = (YStart - y1) * dx;
+    const int q   = num / dy + (num % dy > 0);  // ceil
+    PathEdge edge;
+    edge.X       = x1 + q;
+    edge.Rem     = q * dy - num;
+    edge.XStep   = dx / dy - (dx % dy < 0);     // floor
+    edge.RemStep = dx - edge.XStep * dy;
+    edge.DY      = dy;
+    edge.YStart  = YStart;
+    edge.YEnd    = YEnd;
+    int k = edgesCount++;
+    for (; k > 0 && edges[k - 1].YStart > YStart; --k)
+      edges[k] = edges[k - 1];
+    edges[k] = edge;
+  }
+  if (edgesCount == 0)
+    return;
 
-  int minY = INT_MAX;
-  int maxY = 0;
-  for (int i = 0; i < path.pointsCount; ++i) {
-    int py = path.points[i].Y + origY;
-    if (py < minY)
-      minY = py;
-    if (py > maxY)
-      maxY = py;
-  }
-  minY = tmax(clipY1, minY);
-  maxY = tmin(clipY2, maxY);
-
-  int16_t nodeX[path.pointsCount];
-
-  for (int pixelY = minY; pixelY <= maxY; ++pixelY) {
-
-    int nodes = 0;
-    int j = path.pointsCount - 1;
-    for (int i = 0; i < path.pointsCount; ++i) {
-      int piy = path.points[i].Y + origY;
-      int pjy = path.points[j].Y + origY;
-      if ((piy < pixelY && pjy >= pixelY) || (pjy < pixelY && piy >= pixelY)) {
-        int pjx = path.points[j].X + origX;
-        int pix = path.points[i].X + origX;
-        int a = (pixelY - piy) * (pjx - pix);
-        int b = (pjy - piy);
-        nodeX[nodes++] = pix + a / b + (((a < 0) ^ (b > 0)) && (a % b));
+  int nextEdge    = 0;
+  int activeCount = 0;
+  for (int y = edges[0].YStart; y <= maxY && (nextEdge < edgesCount || activeCount > 0); ++y) {
+
+    // remove edges ended at previous scanline, advance the others
+    int count = 0;
+    for (int i = 0; i < activeCount; ++i) {
+      PathEdge * edge = &edges[active[i]];
+      if (edge->YEnd >= y) {
+        edge->X   += edge->XStep;
+        edge->Rem -= edge->RemStep;
+        if (edge->Rem < 0) {
+          edge->Rem += edge->DY;
+          ++edge->X;
+        }
+        active[count++] = active[i];
       }
-      j = i;
     }
-
-    int i = 0;
-    while (i < nodes - 1) {
-      if (nodeX[i] > nodeX[i + 1]) {
-        tswap(nodeX[i], nodeX[i + 1]);
-        if (i)
-          --i;
-      } else
-        ++i;
+    activeCount = count;
+
+    // add edges starting at this scanline
+    for (; nextEdge < edgesCount && edges[nextEdge].YStart == y; ++nextEdge)
+      active[activeCount++] = nextEdge;
+
+    // sort by X (insertion sort, order changes little from one scanline to the next)
+    for (int i = 1; i < activeCount; ++i) {
+      int16_t e = active[i];
+      int16_t x = edges[e].X;
+      int k = i;
+      for (; k > 0 && edges[active[k - 1]].X > x; --k)
+        active[k] = active[k - 1];
+      active[k] = e;
     }
 
-    for (int i = 0; i < nodes; i += 2) {
-      if (nodeX[i] >= maxX)
+    for (int i = 0; i + 1 < activeCount; i += 2) {
+      int X1 = edges[active[i]].X;
+      int X2 = edges[active[i + 1]].X;
+      if (X1 >= maxX)
         break;
-      if (nodeX[i + 1] > minX) {
-        if (nodeX[i] < minX)
-          nodeX[i] = minX;
-        if (nodeX[i + 1] > maxX)
-          nodeX[i + 1] = maxX;
-        fillRow(pixelY, nodeX[i], nodeX[i + 1] - 1, pattern);
-      }
+      if (X2 > minX)
+        fillRow(y, tmax(X1, minX), tmin(X2, maxX) - 1, pattern);
     }
   }
 }
@@ -2149,10 +4363,14 @@ void VGAControllerClass::setMouseCursor(Cursor const * cursor)
   if (cursor == NULL || &cursor->bitmap != m_mouseCursor.getFrame()) {
     m_mouseCursor.visible = false;
     m_mouseCursor.clearBitmaps();
+    m_overlayCursor = NULL;
 
-    refreshSprites();
-    processPrimitives();
-    primitivesExecutionWait();
+    // overlay doesn't use sprite bitmaps
+    if (!m_mouseCursorOverlay) {
+      refreshSprites();
+      processPrimitives();
+      primitivesExecutionWait();
+    }
 
     if (cursor) {
       m_mouseCursor.move(+m_mouseHotspotX, +m_mouseHotspotY, false);
@@ -2161,8 +4379,13 @@ void VGAControllerClass::setMouseCursor(Cursor const * cursor)
       m_mouseCursor.addBitmap(&cursor->bitmap);
       m_mouseCursor.visible = true;
       m_mouseCursor.move(-m_mouseHotspotX, -m_mouseHotspotY, false);
+      m_overlayCursor = &cursor->bitmap;
     }
-    refreshSprites();
+
+    if (m_mouseCursorOverlay)
+      m_overlayDirty = true;
+    else
+      refreshSprites();
   }
 }
 
@@ -2176,7 +4399,11 @@ void VGAControllerClass::setMouseCursor(CursorName cursorName)
 void VGAControllerClass::setMouseCursorPos(int X, int Y)
 {
   m_mouseCursor.moveTo(X - m_mouseHotspotX, Y - m_mouseHotspotY);
-  refreshSprites();
+  // the overlay composites the cursor at next VSync, without any primitive
+  if (m_mouseCursorOverlay)
+    m_overlayDirty = true;
+  else
+    refreshSprites();
 }
 
 
@@ -2195,10 +4422,12 @@ Sprite::Sprite()
   savedBackgroundWidth    = 0;
   savedBackgroundHeight   = 0;
   savedBackground         = NULL; // allocated or reallocated when bitmaps are added
+  savedFrame              = NULL;
   collisionDetectorObject = NULL;
   visible                 = true;
   isStatic                = false;
   allowDraw               = true;
+  damaged                 = false;
 }
 
 
@@ -2215,7 +4444,7 @@ void Sprite::allocRequiredBackgroundBuffer()
   if (!VGAController.isDoubleBuffered()) {
     int reqBackBufferSize = 0;
     for (int i = 0; i < framesCount; ++i)
-      reqBackBufferSize = tmax(reqBackBufferSize, frames[i]->width * frames[i]->height);
+      reqBackBufferSize = tmax(reqBackBufferSize, savedBackgroundRowSize(frames[i]->width) * frames[i]->height);
     savedBackground = (uint8_t*) realloc(savedBackground, reqBackBufferSize);
   }
 }
@@ -2234,6 +4463,7 @@ Sprite * Sprite::addBitmap(Bitmap const * bitmap)
   ++framesCount;
   frames = (Bitmap const **) realloc(frames, sizeof(Bitmap*) * framesCount);
   frames[framesCount - 1] = bitmap;
+  bitmap->updateOpaqueSpans();
   allocRequiredBackgroundBuffer();
   return this;
 }
@@ -2242,8 +4472,24 @@ Sprite * Sprite::addBitmap(Bitmap const * bitmap)
 Sprite * Sprite::addBitmap(Bitmap const * bitmap[], int count)
 {
   frames = (Bitmap const **) realloc(frames, sizeof(Bitmap*) * (framesCount + count));
-  for (int i = 0; i < count; ++i)
+  for (int i = 0; i < count; ++i) {
     frames[framesCount + i] = bitmap[i];
+    bitmap[i]->updateOpaqueSpans();
+  }
+  framesCount += count;
+  allocRequiredBackgroundBuffer();
+  return this;
+}
+
+
+// adds "count" bitmaps stored consecutively (ie an atlas generated by tools/img2bitmap with -f option)
+Sprite * Sprite::addBitmaps(Bitmap const * bitmaps, int count)
+{
+  frames = (Bitmap const **) realloc(frames, sizeof(Bitmap*) * (framesCount + count));
+  for (int i = 0; i < count; ++i) {
+    frames[framesCount + i] = &bitmaps[i];
+    bitmaps[i].updateOpaqueSpans();
+  }
   framesCount += count;
   allocRequiredBackgroundBuffer();
   return this;
@@ -2287,7 +4533,7 @@ Sprite * Sprite::moveTo(int x, int y)
 
 
 Bitmap::Bitmap(int width_, int height_, void const * data_, bool copy)
-  : width(width_), height(height_), data((uint8_t const*)data_), dataAllocated(false)
+  : width(width_), height(height_), data((uint8_t const*)data_), dataAllocated(false), encoding(RawBitmap), opaqueSpans(NULL), opaqueSpansDirty(true), collisionMask(NULL), collisionMaskWords(0)
 {
   if (copy) {
     dataAllocated = true;
@@ -2300,7 +4546,7 @@ Bitmap::Bitmap(int width_, int height_, void const * data_, bool copy)
 //    1 : 1 bit per pixel, 0 = transparent, 1 = foregroundColor
 //    8 : 8 bits per pixel: AABBGGRR
 Bitmap::Bitmap(int width_, int height_, void const * data_, int bitsPerPixel, RGB foregroundColor, bool copy)
-  : width(width_), height(height_)
+  : width(width_), height(height_), encoding(RawBitmap), opaqueSpans(NULL), opaqueSpansDirty(true), collisionMask(NULL), collisionMaskWords(0)
 {
   width  = width_;
   height = height_;
@@ -2342,10 +4588,163 @@ Bitmap::Bitmap(int width_, int height_, void const * data_, int bitsPerPixel, RG
 }
 
 
+// RLE encoded data is used in place, it doesn't need opaque spans table
+Bitmap::Bitmap(int width_, int height_, void const * data_, BitmapEncoding encoding_)
+  : width(width_), height(height_), data((uint8_t const*)data_), dataAllocated(false), encoding(encoding_), opaqueSpans(NULL), opaqueSpansDirty(encoding_ == RawBitmap), collisionMask(NULL), collisionMaskWords(0)
+{
+}
+
+
+Bitmap::Bitmap(Bitmap && bitmap)
+  : dataAllocated(false), opaqueSpans(NULL), collisionMask(NULL)
+{
+  *this = (Bitmap &&) bitmap;
+}
+
+
 Bitmap::~Bitmap()
 {
   if (dataAllocated)
     free((void*) data);
+  free(opaqueSpans);
+  free(collisionMask);
+}
+
+
+// takes ownership of buffers of "bitmap", that is left empty
+Bitmap & Bitmap::operator=(Bitmap && bitmap)
+{
+  if (this != &bitmap) {
+    if (dataAllocated)
+      free((void*) data);
+    free(opaqueSpans);
+    free(collisionMask);
+    width              = bitmap.width;
+    height             = bitmap.height;
+    data               = bitmap.data;
+    dataAllocated      = bitmap.dataAllocated;
+    encoding           = bitmap.encoding;
+    opaqueSpans        = bitmap.opaqueSpans;
+    opaqueSpansDirty   = bitmap.opaqueSpansDirty;
+    collisionMask      = bitmap.collisionMask;
+    collisionMaskWords = bitmap.collisionMaskWords;
+    collisionMaskRect  = bitmap.collisionMaskRect;
+    bitmap.width = bitmap.height = 0;
+    bitmap.data               = NULL;
+    bitmap.dataAllocated      = false;
+    bitmap.opaqueSpans        = NULL;
+    bitmap.collisionMask      = NULL;
+    bitmap.collisionMaskWords = 0;
+  }
+  return *this;
+}
+
+
+void Bitmap::invalidate() const
+{
+  // pixels may be changed, mask and spans will be rebuilt on next use
+  free(collisionMask);
+  collisionMask = NULL;
+  opaqueSpansDirty = (encoding == RawBitmap);
+  if (opaqueSpans) {
+    // bitmap has been drawn, queued primitives (ie sprites refresh) may still read spans
+    VGAController.primitivesExecutionWait();
+    free(opaqueSpans);
+    opaqueSpans = NULL;
+  }
+}
+
+
+void Bitmap::buildOpaqueSpans()
+{
+  invalidate();
+}
+
+
+// not called by the primitives executor: building the table allocates memory
+// a dirty table is always NULL (see invalidate()), the new one is published when complete
+void Bitmap::updateOpaqueSpans() const
+{
+  if (!opaqueSpansDirty)
+    return;
+  opaqueSpansDirty = false;
+
+  // count spans
+  int spansCount = 0;
+  for (int y = 0; y < height; ++y) {
+    uint8_t const * row = data + y * width;
+    for (int x = 0; x < width; ++x)
+      if ((row[x] >> 6) && (x == 0 || (row[x - 1] >> 6) == 0))
+        ++spansCount;
+  }
+
+  // when there is not enough memory the bitmap is painted checking every pixel
+  uint16_t * table = (uint16_t*) malloc(sizeof(uint16_t) * (height + 1 + 2 * spansCount));
+  if (table == NULL)
+    return;
+
+  uint16_t * span = table + height + 1;
+  int index = 0;
+  for (int y = 0; y < height; ++y) {
+    table[y] = index;
+    uint8_t const * row = data + y * width;
+    for (int x = 0; x < width; ) {
+      if (row[x] >> 6) {
+        int start = x;
+        while (x < width && (row[x] >> 6))
+          ++x;
+        *span++ = start;
+        *span++ = x - start;
+        ++index;
+      } else
+        ++x;
+    }
+  }
+  table[height] = index;
+
+  opaqueSpans = table;
+}
+
+
+uint32_t const * Bitmap::getCollisionMask() const
+{
+  if (collisionMask == NULL) {
+    // one more word per row, so a row can be read 32 bits at a time from any position
+    int words = (width + 31) / 32 + 1;
+    uint32_t * mask = (uint32_t*) calloc(words * height, sizeof(uint32_t));
+    if (mask == NULL)
+      return NULL;
+    // empty bitmaps have X1 > X2
+    Rect rect(width, height, -1, -1);
+    for (int y = 0; y < height; ++y) {
+      uint32_t * maskRow = mask + y * words;
+      if (encoding == RLEBitmap) {
+        uint8_t const * run = RLEBitmapRow(this, y);
+        for (int runs = *run++, x = 0; runs > 0; --runs) {
+          x += *run++;
+          const int count = *run++;
+          for (int i = x; i < x + count; ++i)
+            if (run[i - x] >> 6) {
+              maskRow[i >> 5] |= 0x80000000 >> (i & 31);
+              rect = Rect(tmin<int>(rect.X1, i), tmin<int>(rect.Y1, y), tmax<int>(rect.X2, i), tmax<int>(rect.Y2, y));
+            }
+          run += count;
+          x += count;
+        }
+        continue;
+      }
+      uint8_t const * row = data + y * width;
+      for (int x = 0; x < width; ++x)
+        if (row[x] >> 6) {
+          maskRow[x >> 5] |= 0x80000000 >> (x & 31);
+          rect = Rect(tmin<int>(rect.X1, x), tmin<int>(rect.Y1, y), tmax<int>(rect.X2, x), tmax<int>(rect.Y2, y));
+        }
+    }
+    collisionMask      = mask;
+    collisionMaskWords = words;
+    collisionMaskRect  = rect;
+  }
+  return collisionMask;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -37,9 +37,11 @@
 
 #include "rom/lldesc.h"
 #include "driver/gpio.h"
+#include "esp_intr_alloc.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 
 #include "fabglconf.h"
 #include "fabutils.h"
@@ -62,6 +64,25 @@ enum ScreenBlock {
 };
 
 
+/** @brief Specifies how pixels are stored in the viewport (see VGAControllerClass.setPixelFormat()) */
+enum PixelFormat {
+  RGB222,     /**< One byte per pixel, each pixel directly contains its color (default) */
+  Palette16,  /**< 4 bits per pixel, each pixel is an index of a 16 colors palette */
+  Palette4,   /**< 2 bits per pixel, each pixel is an index of a 4 colors palette */
+};
+
+
+/**
+ * @brief Callback that generates a line of raw pixels in scanline mode (see VGAControllerClass.setScanlineCallback()).
+ *
+ * @param arg Argument specified in VGAControllerClass.setScanlineCallback().
+ * @param dest Line buffer to fill with getViewPortWidth() raw pixels (see VGAControllerClass.createRawPixel()), in the same order of the viewport memory
+ *             (pixels 2, 3, 0, 1 in each 32 bit word).
+ * @param scanLine Viewport line to generate (0 = first line of the viewport).
+ */
+typedef void (*ScanlineCallback)(void * arg, uint8_t * dest, int scanLine);
+
+
 /** @brief Specifies the VGA timings. This is a modeline decoded. */
 struct Timings {
   char          label[22];       /**< Resolution text description */
@@ -87,7 +108,7 @@ struct Timings {
   Notes:
     - all positions can have negative and outofbound coordinates. Shapes are always clipped correctly.
 */
-enum PrimitiveCmd {
+enum PrimitiveCmd : uint8_t {
   // Set current pen color
   // params: color
   SetPenColor,
@@ -120,6 +141,10 @@ enum PrimitiveCmd {
   // params: size
   DrawEllipse,
 
+  // Fill a rectangle with rounded corners, current position is the top-left corner, using current brush color
+  // params: roundRect
+  FillRoundRect,
+
   // Fill viewport with brush color
   // params: none
   Clear,
@@ -133,9 +158,13 @@ enum PrimitiveCmd {
   HScroll,
 
   // Draw a glyph (BW image)
-  // params: glyph
+  // params: glyph, glyphWidth, glyphHeight
   DrawGlyph,
 
+  // Draw a string of glyphs of the same font, on the same row
+  // params: text (arena)
+  DrawText,
+
   // Set paint options
   // params: glyphOptions
   SetGlyphOptions,
@@ -164,20 +193,28 @@ enum PrimitiveCmd {
 
 #if FABGLIB_HAS_READWRITE_RAW_DATA
   // Read raw viewport data
-  // params: rawData
+  // params: rawData (arena)
   ReadRawData,
 
   // Write raw viewport data
-  // params: rawData
+  // params: rawData (arena)
   WriteRawData,
+
+  // Encode rows of the visible viewport with run-length encoding (see VGAControllerClass.captureScreen())
+  // params: rleRows
+  ReadRLERows,
+
+  // Decode run-length encoded rows to the viewport (see VGAControllerClass.restoreScreenChunk())
+  // params: rleRows
+  WriteRLERows,
 #endif
 
-  // Render glyphs buffer
+  // Render a rectangle (or a span of the same row) of glyphs buffer items
   // params: glyphsBufferRenderInfo
   RenderGlyphsBuffer,
 
   // Draw a bitmap
-  // params: bitmapDrawingInfo
+  // params: bitmapDrawingInfo (small raw bitmaps in arena)
   DrawBitmap,
 
   // Refresh sprites
@@ -187,12 +224,12 @@ enum PrimitiveCmd {
   // Swap buffers (m_doubleBuffered must be True)
   SwapBuffers,
 
-  // Fill a path, using current brush color
-  // params: path
+  // Fill a path (or a list of paths), using current brush color
+  // params: path (arena)
   FillPath,
 
-  // Draw a path, using current pen color
-  // params: path
+  // Draw a path (or a list of paths), using current pen color
+  // params: path (arena)
   DrawPath,
 
   // Set axis origin
@@ -202,9 +239,21 @@ enum PrimitiveCmd {
   // Set clipping rectangle
   // params: rect
   SetClippingRect,
+
+  // Scroll vertically by FABGLIB_SMOOTH_SCROLL_LINES_PER_FRAME lines at each vertical sync, following primitives wait for the end of scrolling
+  // params: ivalue (remaining scroll offset)
+  SmoothVScroll,
+
+  // Execute primitives stored in the batch ring (see VGAControllerClass.beginPrimitivesBatch())
+  // params: ivalue (number of primitives)
+  ExecuteBatch,
 };
 
 
+// number of primitive commands (ExecuteBatch must remain the last one)
+static const int PrimitiveCmdCount = PrimitiveCmd::ExecuteBatch + 1;
+
+
 
 /**
  * @brief This enum defines named colors.
@@ -262,6 +311,60 @@ inline bool operator!=(RGB const& lhs, RGB const& rhs)
 
 
 
+#ifndef FONTINFO
+#define FONTINFO
+
+#define FONTINFOFLAGS_ITALIC    1
+#define FONTINFOFLAGS_UNDERLINE 2
+#define FONTINFODLAFS_STRIKEOUT 4
+
+struct FontInfo {
+  uint8_t  pointSize;
+  uint8_t  width;
+  uint8_t  height;
+  uint8_t  ascent;
+  uint8_t  inleading;
+  uint8_t  exleading;
+  uint8_t  flags;
+  uint16_t weight;
+  uint16_t charset;
+  uint8_t const * data;
+};
+
+#endif
+
+
+// text drawn by DrawText primitive
+struct DrawTextInfo {
+  int16_t          X;
+  int16_t          Y;
+  FontInfo const * font;
+  char const *     text;  // null terminated
+
+  DrawTextInfo(int X_, int Y_, FontInfo const * font_, char const * text_) : X(X_), Y(Y_), font(font_), text(text_) { }
+};
+
+
+// FillRoundRect parameters
+struct RoundRectInfo {
+  int16_t width;
+  int16_t height;
+  int16_t radius;   // corners radius, limited to half of width and height
+
+  RoundRectInfo(int width_, int height_, int radius_) : width(width_), height(height_), radius(radius_) { }
+};
+
+
+// DrawGlyph parameters. Glyph size is in Primitive.glyphWidth and Primitive.glyphHeight, to keep primitives small
+struct GlyphDrawingInfo {
+  int16_t         X;
+  int16_t         Y;
+  uint8_t const * data;
+
+  GlyphDrawingInfo(int X_, int Y_, uint8_t const * data_) : X(X_), Y(Y_), data(data_) { }
+};
+
+
 /**
  * @brief Represents a glyph position, size and binary data.
  *
@@ -294,6 +397,34 @@ struct RawData {
 };
 
 
+/**
+ * @brief Represents whole rows of raw screen buffer, encoded with run-length encoding.
+ *
+ * Each row is encoded separately, as a sequence of packets. A packet starts with a header byte H: when H >= 128 it is followed by a single pixel
+ * repeated H - 127 times, otherwise it is followed by H + 1 pixels. Pixels have the same values of raw data (see CanvasClass.readRawData()).
+ */
+struct RLERows {
+  int16_t   Y;       /**< First row */
+  int16_t   height;  /**< Number of rows */
+  int       size;    /**< Size of encoded data in bytes */
+  uint8_t * data;    /**< Encoded data */
+};
+
+
+/**
+ * @brief Callback receiving the chunks of a screen capture (see VGAControllerClass.captureScreen()).
+ *
+ * @param context Value specified calling VGAControllerClass.captureScreen().
+ * @param Y First row of the chunk.
+ * @param height Number of rows of the chunk.
+ * @param data Run-length encoded rows (see RLERows).
+ * @param size Size of encoded data in bytes.
+ *
+ * @return False to interrupt the capture.
+ */
+typedef bool (*CaptureCallback)(void * context, int Y, int height, uint8_t const * data, int size);
+
+
 
 /**
  * @brief Specifies various glyph painting options.
@@ -362,11 +493,21 @@ struct GlyphsBuffer {
 
 
 struct GlyphsBufferRenderInfo {
-  int16_t              itemX;  // starts from 0
-  int16_t              itemY;  // starts from 0
+  uint8_t              itemX;      // starts from 0
+  uint8_t              itemY;      // starts from 0
+  uint8_t              count;      // number of items to render on each row, starting from itemX
+  uint8_t              rowsCount;  // number of rows to render, starting from itemY
   GlyphsBuffer const * glyphsBuffer;
 
-  GlyphsBufferRenderInfo(int itemX_, int itemY_, GlyphsBuffer const * glyphsBuffer_) : itemX(itemX_), itemY(itemY_), glyphsBuffer(glyphsBuffer_) { }
+  GlyphsBufferRenderInfo(int itemX_, int itemY_, GlyphsBuffer const * glyphsBuffer_, int count_ = 1, int rowsCount_ = 1)
+    : itemX(itemX_), itemY(itemY_), count(count_), rowsCount(rowsCount_), glyphsBuffer(glyphsBuffer_) { }
+};
+
+
+/** @brief Specifies how pixels of a Bitmap are stored */
+enum BitmapEncoding {
+  RawBitmap,  /**< One byte per pixel (AABBGGRR) */
+  RLEBitmap,  /**< Runs of opaque pixels, transparent pixels are not stored (see Bitmap) */
 };
 
 
@@ -378,19 +519,76 @@ struct GlyphsBufferRenderInfo {
  * 7 6 5 4 3 2 1 0
  * A A B B G G R R
  *
- * AA = 0 fully transparent, AA = 3 fully opaque.
+ * AA = 0 fully transparent, AA = 3 fully opaque. AA = 1 and AA = 2 blend one third and two thirds of the pixel color with the background
+ * (when FABGLIB_HAS_ALPHA_BLENDING is enabled, otherwise they are opaque).
  * Each color channel can have values from 0 to 3 (maxmum intensity).
+ *
+ * A table of the non transparent spans of each row is built when the bitmap is first drawn (or added to a sprite), so transparent pixels
+ * are skipped when the bitmap is painted. Until then the bitmap is painted checking every pixel, so data can be filled after construction.
+ * After modifying data of a bitmap already drawn, invalidate() must be called (spans table and collision mask are cached).
+ *
+ * RLE encoded bitmaps (BitmapEncoding::RLEBitmap, generated by tools/img2bitmap with -r option) store only opaque pixels:
+ * data starts with "height" 16 bit little endian offsets (from data start) of each row. Each row is made of a runs count byte followed
+ * by the runs. Each run contains the number of transparent pixels to skip (byte), the number of opaque pixels (byte) and the opaque pixels (one byte each, AABBGGRR).
  */
 struct Bitmap {
   int16_t         width;          /**< Bitmap horizontal size */
   int16_t         height;         /**< Bitmap vertical size */
   uint8_t const * data;           /**< Bitmap binary data */
   bool            dataAllocated;  /**< If true data is released when bitmap is destroyed */
+  BitmapEncoding  encoding;       /**< How pixels are stored in data */
+
+  // spans of non transparent pixels (NULL = not available), built by updateOpaqueSpans() when opaqueSpansDirty is true. First height + 1 items
+  // are, for each row, the index of its first span (last item is the total spans count). Then follow the spans, as pairs of starting X and pixels count.
+  mutable uint16_t * opaqueSpans;
+  mutable bool       opaqueSpansDirty;
+
+  // packed 1 bit per pixel opacity mask, built on first use by getCollisionMask() (NULL = not built yet). Each row has collisionMaskWords
+  // 32 bit words (last one always zero), most significant bit is the leftmost pixel. collisionMaskRect bounds all opaque pixels.
+  mutable uint32_t * collisionMask;
+  mutable int16_t    collisionMaskWords;
+  mutable Rect       collisionMaskRect;
 
-  Bitmap() : width(0), height(0), data(NULL), dataAllocated(false) { }
+  Bitmap() : width(0), height(0), data(NULL), dataAllocated(false), encoding(RawBitmap), opaqueSpans(NULL), opaqueSpansDirty(true), collisionMask(NULL), collisionMaskWords(0) { }
   Bitmap(int width_, int height_, void const * data_, bool copy = false);
   Bitmap(int width_, int height_, void const * data_, int bitsPerPixel, RGB foregroundColor, bool copy = false);
+  Bitmap(int width_, int height_, void const * data_, BitmapEncoding encoding_);
+  Bitmap(Bitmap && bitmap);
   ~Bitmap();
+
+  // owned buffers (data, spans and mask) cannot be shared, a bitmap can only be moved
+  Bitmap(Bitmap const &) = delete;
+  Bitmap & operator=(Bitmap const &) = delete;
+  Bitmap & operator=(Bitmap && bitmap);
+
+  /**
+   * @brief Same of invalidate(), kept for compatibility.
+   */
+  void buildOpaqueSpans();
+
+  /**
+   * @brief Build the table of non transparent spans, if it is dirty.
+   *
+   * Called by CanvasClass.drawBitmap(), Sprite.addBitmap() and VGAControllerClass.refreshSprites(), the application doesn't need to call it.
+   */
+  void updateOpaqueSpans() const;
+
+  /**
+   * @brief Release the cached spans table and collision mask, so they are rebuilt from data on next use.
+   *
+   * Call it after some pixels have been changed. RLE encoded bitmaps don't need spans.
+   * When the bitmap has already been drawn it waits for queued primitives to be executed.
+   */
+  void invalidate() const;
+
+  /**
+   * @brief Get the packed 1 bit per pixel opacity mask, used by collision detector.
+   *
+   * The mask is built on first call and released by invalidate().
+   *
+   * @return Pointer to the mask rows (see collisionMaskWords and collisionMaskRect) or NULL when there is not enough memory.
+   */
+  uint32_t const * getCollisionMask() const;
 };
 
 
@@ -461,6 +659,7 @@ struct Sprite {
   int16_t            savedBackgroundWidth;
   int16_t            savedBackgroundHeight;
   uint8_t *          savedBackground;
+  Bitmap const *     savedFrame;  // frame painted at savedX, savedY
   QuadTreeObject *   collisionDetectorObject;
   struct {
     uint8_t visible:  1;
@@ -469,6 +668,8 @@ struct Sprite {
     uint8_t isStatic:  1;
     // This is always '1' for dynamic sprites and always '0' for static sprites.
     uint8_t allowDraw: 1;
+    // Used internally by VGAControllerClass.hideSprites() to mark sprites to restore.
+    uint8_t damaged:   1;
   };
 
   Sprite();
@@ -479,18 +680,43 @@ struct Sprite {
   Sprite * setFrame(int frame) { currentFrame = frame; return this; }
   Sprite * addBitmap(Bitmap const * bitmap);
   Sprite * addBitmap(Bitmap const * bitmap[], int count);
+  Sprite * addBitmaps(Bitmap const * bitmaps, int count);
   void clearBitmaps();
   int getWidth()  { return frames[currentFrame]->width; }
   int getHeight() { return frames[currentFrame]->height; }
   void allocRequiredBackgroundBuffer();
+  static int savedBackgroundRowSize(int width);
   Sprite * move(int offsetX, int offsetY, bool wrapAround = true);
   Sprite * moveTo(int x, int y);
 };
 
 
+// a list of polygons (paths) stored consecutively in "points". When pathsSizes is NULL "points" contains a single polygon.
 struct Path {
-  Point const * points;
-  int           pointsCount;
+  Point const *   points;
+  int16_t         pointsCount;  // total number of points
+  int16_t         pathsCount;   // number of items in pathsSizes
+  int16_t const * pathsSizes;   // number of points of each polygon (NULL = single polygon of pointsCount points)
+};
+
+
+// polygon edge prepared by fillPolygon(). X is stepped exactly: X = X1 + ceil((Y - Y1) * DX / DY), with Rem = X * DY - (Y - Y1) * DX - X1 * DY
+struct PathEdge {
+  int16_t X;        // X coordinate at current scanline
+  int16_t XStep;    // floor(DX / DY)
+  int16_t Rem;      // 0 <= Rem < DY
+  int16_t RemStep;  // DX - XStep * DY
+  int16_t DY;
+  int16_t YStart;   // first scanline
+  int16_t YEnd;     // last scanline
+};
+
+
+// block of DMA capable memory owned by the video memory manager, carved sequentially (see VGAControllerClass::allocVideoMemory())
+struct VideoMemoryBlock {
+  uint8_t * data;
+  int       size;
+  int       used;
 };
 
 
@@ -502,27 +728,94 @@ struct PaintOptions {
 };
 
 
+// Parameters are at most 8 bytes (12 bytes primitive). Variable length parameters are referenced by pointer: when the primitive is
+// queued they are copied into the primitives arena (see FABGLIB_PRIMITIVES_ARENA_SIZE), so callers don't need to keep them alive.
 struct Primitive {
   PrimitiveCmd cmd;
+  uint8_t      glyphWidth;   // DrawGlyph
+  uint8_t      glyphHeight;  // DrawGlyph
   union {
     int16_t                ivalue;
     RGB                    color;
     Point                  position;
     Size                   size;
-    Glyph                  glyph;
+    RoundRectInfo          roundRect;
+    GlyphDrawingInfo       glyph;
+    DrawTextInfo const *   text;
     Rect                   rect;
     GlyphOptions           glyphOptions;
-    RawData                rawData;
+    RawData const *        rawData;
+    RLERows *              rleRows;
     PaintOptions           paintOptions;
     GlyphsBufferRenderInfo glyphsBufferRenderInfo;
     BitmapDrawingInfo      bitmapDrawingInfo;
-    Path                   path;
+    Path const *           path;
   };
 
   Primitive() { }
 };
 
 
+/**
+ * @brief Sprites refresh counters.
+ *
+ * Counters are incremented by VGA controller whenever sprites are restored or painted. Use VGAControllerClass.getSpritesStats()
+ * to read them and VGAControllerClass.resetSpritesStats() to reset them.
+ */
+struct SpritesStats {
+  uint32_t restored;  /**< Number of sprite backgrounds restored because sprite has been changed or overlapped by a drawing */
+  uint32_t skipped;   /**< Number of sprites left untouched on screen because not changed nor overlapped by a drawing */
+  uint32_t painted;   /**< Number of sprites painted */
+};
+
+
+#if FABGLIB_HAS_FRAME_STATS
+
+/** Number of buckets of PrimitiveStats.histogram. */
+#define FRAMESTATS_HISTOGRAM_SIZE 8
+
+/**
+ * @brief Execution time counters of a single primitive command.
+ *
+ * Times are in microseconds. Bucket 0 of histogram counts executions taking less than 1us, bucket N (1..6) executions taking from 2^(N-1)
+ * to 2^N-1 us. Last bucket counts executions taking 64us or more.
+ */
+struct PrimitiveStats {
+  uint32_t count;                                 /**< Number of executions */
+  uint32_t totalTime;                             /**< Sum of all execution times */
+  uint32_t maxTime;                               /**< Longest execution time */
+  uint32_t histogram[FRAMESTATS_HISTOGRAM_SIZE];  /**< Execution times distribution */
+};
+
+
+/**
+ * @brief Frame time and VSync budget counters.
+ *
+ * Counters are updated by VGA controller when primitives are executed. Use VGAControllerClass.getFrameStats() to read them
+ * and VGAControllerClass.resetFrameStats() to reset them. Times are in microseconds.
+ * "Frame" counters refer to a single VSync interrupt execution, that can use at most VGAControllerClass.getMaxVSyncISRTime(), or to a single
+ * execution round of the render task (see VGAControllerClass.enableRenderTask()), that has no time budget.
+ */
+struct FrameStats {
+  uint32_t       frames;               /**< Number of VSync interrupts executed */
+  uint32_t       primitivesExecuted;   /**< Total number of executed primitives (batched primitives are counted individually) */
+  uint32_t       lastFramePrimitives;  /**< Number of primitives executed by last VSync interrupt */
+  uint32_t       maxFramePrimitives;   /**< Maximum number of primitives executed by a single VSync interrupt */
+  uint32_t       lastFramePending;     /**< Number of exec queue items left after last VSync interrupt */
+  uint32_t       maxFramePending;      /**< Maximum number of exec queue items left after a VSync interrupt */
+  uint32_t       budgetExceeded;       /**< Number of VSync interrupts ended by time budget expiration, with primitives still in queue */
+  uint32_t       swapBuffersDeferred;  /**< Number of times a SwapBuffers has been postponed to next VSync because not first of its frame */
+  uint32_t       lastFrameTime;        /**< Duration of last VSync interrupt */
+  uint32_t       maxFrameTime;         /**< Maximum duration of a VSync interrupt */
+  uint32_t       lastSpritesTime;      /**< Time spent hiding and showing sprites since last VSync interrupt began */
+  uint32_t       maxSpritesTime;       /**< Maximum of lastSpritesTime */
+  uint32_t       queueHighWater;       /**< Maximum number of items found in exec queue (see FABGLIB_EXEC_QUEUE_SIZE) */
+  PrimitiveStats primitives[PrimitiveCmdCount]; /**< Execution times per primitive command, indexed by PrimitiveCmd */
+};
+
+#endif
+
+
 struct PaintState {
   RGB          penColor;
   RGB          brushColor;
@@ -635,10 +928,117 @@ public:
    *     // Set 640x382@60Hz but limit the viewport to 640x350
    *     VGAController.setResolution(VGA_640x382_60Hz, 640, 350);
    *
+   * @return False if the modeline is not valid or there is not enough memory even for a reduced viewport. Video output is then stopped and
+   * setResolution() must be called again (for example with a smaller mode) before drawing.
    */
-  void setResolution(char const * modeline, int viewPortWidth = -1, int viewPortHeight = -1, bool doubleBuffered = false);
+  bool setResolution(char const * modeline, int viewPortWidth = -1, int viewPortHeight = -1, bool doubleBuffered = false);
+
+  bool setResolution(Timings const& timings, int viewPortWidth = -1, int viewPortHeight = -1, bool doubleBuffered = false);
 
-  void setResolution(Timings const& timings, int viewPortWidth = -1, int viewPortHeight = -1, bool doubleBuffered = false);
+  /**
+   * @brief Give back to the heap video memory blocks not used by current resolution.
+   *
+   * Video memory is retained across setResolution() calls (see FABGLIB_VIDEO_MEMORY_SIZE), so a mode switch doesn't depend on heap fragmentation.
+   * Call this method after switching to a smaller mode, when the memory is needed elsewhere. Before the first setResolution() it releases
+   * the whole reserve.
+   */
+  void freeUnusedVideoMemory();
+
+  /**
+   * @brief Set how pixels are stored in the viewport.
+   *
+   * Palette formats store each pixel as an index of a palette (see setPaletteItem()), reducing viewport memory to a half (PixelFormat::Palette16) or
+   * a quarter (PixelFormat::Palette4). Viewport lines are converted to colors on the fly, while they are sent, into FABGLIB_LINE_BUFFERS_COUNT DMA line buffers.<br>
+   * Drawing colors and bitmap pixels are mapped to the nearest palette color. Raw data (see CanvasClass.readRawData()) contains palette indexes.<br>
+   * The new format is applied by the next call to setResolution(), that also restores its default palette. Until then the current viewport
+   * keeps its format and palette.
+   *
+   * @param value Pixel format. Default is PixelFormat::RGB222.
+   *
+   * Example:
+   *
+   *     // 640x480 with 16 colors requires just 150K of viewport memory
+   *     VGAController.setPixelFormat(PixelFormat::Palette16);
+   *     VGAController.setResolution(VGA_640x480_60Hz);
+   */
+  void setPixelFormat(PixelFormat value);
+
+  /**
+   * @brief Return current pixel format.
+   *
+   * @return Pixel format of the viewport, the one set by setPixelFormat() before last setResolution().
+   */
+  PixelFormat getPixelFormat() { return m_pixelFormat; }
+
+  /**
+   * @brief Set a palette item.
+   *
+   * Palette is used only when a palette pixel format is selected (see setPixelFormat()). The change is immediately visible on all pixels
+   * having the specified index. Items refer to the current pixel format, setResolution() restores the default palette of a new format.<br>
+   * Default palette of PixelFormat::Palette16 contains colors of fabgl::Color, in the same order. Default palette of PixelFormat::Palette4 contains
+   * Black, BrightCyan, BrightMagenta and BrightWhite.
+   *
+   * @param index Palette item index (0..15 for PixelFormat::Palette16, 0..3 for PixelFormat::Palette4).
+   * @param color Color of the palette item.
+   */
+  void setPaletteItem(int index, RGB const & color);
+
+  /**
+   * @brief Enable or disable scanline mode.
+   *
+   * In scanline mode there isn't any viewport memory: each line is generated just before it is sent, calling the specified callback from an
+   * interrupt. Only FABGLIB_LINE_BUFFERS_COUNT line buffers are allocated, so very high resolutions require few KBytes of RAM.<br>
+   * The callback runs inside an high priority interrupt, about one line time before the line is sent: it must be fast, be placed in IRAM (IRAM_ATTR),
+   * access only data in RAM and cannot call FreeRTOS functions. Use renderGlyphsBufferScanline() and renderSpritesScanline() to render
+   * glyphs maps (like the terminal screen) and sprites.<br>
+   * Canvas drawings are ignored in scanline mode and double buffering is not available.<br>
+   * Scanline mode is applied (or removed, setting callback to NULL) by the next call to setResolution().
+   *
+   * @param callback Function which generates lines. NULL disables scanline mode.
+   * @param arg Argument passed to the callback.
+   *
+   * Example:
+   *
+   *     // 800x600 terminal, using a font cached in RAM (see FABGLIB_CACHE_FONT_IN_RAM)
+   *     VGAController.setScanlineCallback(TerminalClass::renderScanline, &Terminal);
+   *     VGAController.setResolution(SVGA_800x600_60Hz);
+   *     Terminal.begin();
+   */
+  void setScanlineCallback(ScanlineCallback callback, void * arg = NULL);
+
+  /**
+   * @brief Convert a color to raw pixel.
+   *
+   * Raw pixels contain also horizontal and vertical sync signals, set to their inactive values.
+   *
+   * @param rgb Color to convert.
+   *
+   * @return Raw pixel, to use for example in scanline callbacks (see setScanlineCallback()).
+   */
+  uint8_t createRawPixel(RGB rgb) { return preparePixel(rgb); }
+
+  /**
+   * @brief Render a line of a glyphs buffer.
+   *
+   * Can be called by a scanline callback (see setScanlineCallback()). Glyph options bold, invert, blank, underline, reduceLuminosity and doubleWidth
+   * are supported, while italic is ignored.
+   *
+   * @param glyphsBuffer Glyphs map to render, starting from left-top corner of the viewport.
+   * @param dest Line buffer, as received by the scanline callback. Pixels not covered by glyphs are set to black.
+   * @param scanLine Viewport line to render.
+   */
+  void renderGlyphsBufferScanline(GlyphsBuffer const * glyphsBuffer, uint8_t * dest, int scanLine);
+
+  /**
+   * @brief Paint visible sprites and mouse cursor over a line.
+   *
+   * Can be called by a scanline callback (see setScanlineCallback()) after the line background has been rendered.
+   * Sprites are painted in the same order as in framebuffer mode (see setSprites()).
+   *
+   * @param dest Line buffer, as received by the scanline callback.
+   * @param scanLine Viewport line to render.
+   */
+  void renderSpritesScanline(uint8_t * dest, int scanLine);
 
   Timings * getResolutionTimings() { return &m_timings; }
 
@@ -684,10 +1084,144 @@ public:
    */
   int getViewPortHeight() { return m_viewPortHeight; }
 
-  void addPrimitive(Primitive const & primitive);
+  /**
+   * @brief Add a primitive to the primitives queue, or execute it immediately when background execution is disabled.
+   *
+   * @param primitive Primitive to execute.
+   *
+   * @return Fence of the primitive to use with waitPrimitivesFence(). Returns 0 when the primitive has been executed immediately or stored in the batch ring
+   *         (see beginPrimitivesBatch()): in this case use getPrimitivesFence().
+   */
+  uint32_t addPrimitive(Primitive const & primitive);
 
+  /**
+   * @brief Wait for all queued primitives to be executed.
+   *
+   * Same of waitPrimitivesFence(getPrimitivesFence()).
+   */
   void primitivesExecutionWait();
 
+  /**
+   * @brief Return a fence that is passed when all primitives queued until now have been executed.
+   *
+   * Primitives in the batch ring of calling task are sent to the queue before.
+   *
+   * @return Fence to use with waitPrimitivesFence() and isPrimitivesFencePassed().
+   */
+  uint32_t getPrimitivesFence();
+
+  /**
+   * @brief Block calling task until specified fence has been passed.
+   *
+   * Calling task sleeps (it doesn't consume CPU) until primitives have been executed.<br>
+   * If calling task has suspended background execution (see suspendBackgroundPrimitiveExecution()) queued primitives are executed immediately.
+   *
+   * @param fence Fence returned by addPrimitive() or getPrimitivesFence().
+   *
+   * Example:
+   *
+   *     // paint some glyphs, do other jobs, then wait for the glyphs to be on screen
+   *     uint32_t fence = VGAController.getPrimitivesFence();
+   *     doSomething();
+   *     VGAController.waitPrimitivesFence(fence);
+   */
+  void waitPrimitivesFence(uint32_t fence);
+
+  /**
+   * @brief Block calling task until next vertical sync.
+   *
+   * Calling task sleeps (it doesn't consume CPU). Only one task at the time can wait for vertical sync.<br>
+   * Returns after a system tick when background primitive execution is suspended (vertical sync interrupt is disabled).
+   *
+   * Example:
+   *
+   *     // move a sprite by one pixel at each frame
+   *     while (true) {
+   *       VGAController.waitVSync();
+   *       sprite.move(1, 0);
+   *       VGAController.refreshSprites();
+   *     }
+   */
+  void waitVSync();
+
+  /**
+   * @brief Return the number of vertical syncs occurred while background primitive execution was enabled.
+   *
+   * @return Vertical syncs counter.
+   */
+  uint32_t getVSyncCount() { return m_VSyncCount; }
+
+  /**
+   * @brief Return true if all primitives up to the specified fence have been executed.
+   *
+   * @param fence Fence returned by addPrimitive() or getPrimitivesFence().
+   *
+   * @return True if the fence has been passed.
+   */
+  bool isPrimitivesFencePassed(uint32_t fence) { return (int32_t)(m_primitivesCompleted - fence) >= 0; }
+
+#if FABGLIB_HAS_READWRITE_RAW_DATA
+
+  /**
+   * @brief Capture the visible screen as a sequence of run-length encoded chunks.
+   *
+   * Chunks of FABGLIB_CAPTURE_ROWS_PER_CHUNK rows are encoded by the primitives executor (at vertical sync, along with other primitives), while the
+   * previous chunk is handed to the callback, so rendering continues during the capture. Only calling task waits.<br>
+   * Rows are captured at different times, so the image may contain changes occurred during the capture. Sprites are captured as shown.
+   *
+   * @param callback Function called for each chunk, in the calling task (it may send data over network or serial port).
+   * @param context Value passed to the callback.
+   *
+   * @return False if the capture has been interrupted by the callback or there is not enough memory.
+   *
+   * Example:
+   *
+   *     bool sendChunk(void * context, int Y, int height, uint8_t const * data, int size)
+   *     {
+   *       WiFiClient * client = (WiFiClient*) context;
+   *       client->write((uint8_t const *) &Y, 2);
+   *       client->write((uint8_t const *) &height, 2);
+   *       client->write((uint8_t const *) &size, 4);
+   *       return client->write(data, size) == size;
+   *     }
+   *
+   *     VGAController.captureScreen(sendChunk, &client);
+   */
+  bool captureScreen(CaptureCallback callback, void * context);
+
+  /**
+   * @brief Write a run-length encoded chunk (as produced by captureScreen()) to the screen.
+   *
+   * The chunk is decoded by the primitives executor, this method returns when it has been written. Rows and pixels outside of the viewport are discarded.
+   *
+   * @param Y First row of the chunk.
+   * @param height Number of rows of the chunk.
+   * @param data Run-length encoded rows (see RLERows).
+   * @param size Size of encoded data in bytes.
+   */
+  void restoreScreenChunk(int Y, int height, uint8_t const * data, int size);
+
+#endif
+
+  /**
+   * @brief Start collecting primitives into the batch ring.
+   *
+   * Primitives added between beginPrimitivesBatch() and endPrimitivesBatch() are stored in a contiguous ring (of FABGLIB_PRIMITIVES_BATCH_SIZE items)
+   * instead of being sent one by one to the primitives queue. The whole batch is published to the vertical sync interrupt with a single queue operation, when
+   * endPrimitivesBatch() is called or when the ring is full.<br>
+   * Batching applies only when primitives are executed in background (see enableBackgroundPrimitiveExecution()) and only to primitives added by the
+   * calling task: while a task is batching, primitives added by other tasks go directly to the queue.<br>
+   * Primitives with parameters in the primitives arena (texts, paths, raw data and small bitmaps) are never batched: they publish the collected
+   * primitives and go directly to the queue.<br>
+   * This method maintains a counter so can be nested.
+   */
+  void beginPrimitivesBatch();
+
+  /**
+   * @brief Publish primitives collected after beginPrimitivesBatch().
+   */
+  void endPrimitivesBatch();
+
   /**
    * @brief Enable or disable drawings inside vertical retracing time.
    *
@@ -705,8 +1239,9 @@ public:
    * @brief Suspend drawings.
    *
    * Suspends drawings disabling vertical sync interrupt.<br>
-   * After call to suspendBackgroundPrimitiveExecution() adding new primitives may cause a deadlock.<br>
-   * To avoid it a call to "processPrimitives()" should be performed very often.<br>
+   * Primitives added meanwhile by calling task are executed by the task itself when the queue is full or a fence is waited,
+   * other tasks sleep until resumeBackgroundPrimitiveExecution().<br>
+   * To avoid long pauses a call to "processPrimitives()" should be performed very often.<br>
    * This method maintains a counter so can be nested.
    */
   void suspendBackgroundPrimitiveExecution();
@@ -718,6 +1253,29 @@ public:
    */
   void resumeBackgroundPrimitiveExecution();
 
+  /**
+   * @brief Execute queued primitives in a dedicated task instead of the vertical sync interrupt.
+   *
+   * When enabled a high priority task, pinned to FABGLIB_RENDER_TASK_CORE, continuously executes primitives as they are queued, so drawings
+   * are no more limited to the vertical retracing time. Vertical sync is only used to execute SwapBuffers, that waits for next retracing.
+   * Flickering may occur because drawings are executed out of retracing time.<br>
+   * suspendBackgroundPrimitiveExecution() stops the task after the primitive it is executing, primitivesExecutionWait() waits for the task to be idle.
+   *
+   * @param value When true queued primitives are executed by the render task, when false they are executed by the vertical sync interrupt.
+   *
+   * Example:
+   *
+   *     VGAController.enableRenderTask(true);
+   */
+  void enableRenderTask(bool value);
+
+  /**
+   * @brief Return true if queued primitives are executed by the render task (see enableRenderTask()).
+   *
+   * @return True if the render task is enabled.
+   */
+  bool isRenderTaskEnabled() { return m_renderTask != NULL; }
+
   /**
    * @brief Draw immediately all primitives in the queue.
    *
@@ -802,6 +1360,81 @@ public:
    */
   void refreshSprites();
 
+  /**
+   * @brief Keep current drawing as background layer of the sprites compositor (double buffered mode only).
+   *
+   * Without background layer, in double buffered mode, the application needs to draw again the whole scene at each frame, because sprites are
+   * painted without saving their background.<br>
+   * With a background layer the scene drawn until now is kept in a separate buffer (and copied to the visible buffer). Then VGAControllerClass.refreshSprites()
+   * restores, from the background layer, only the areas where sprites have been painted in the back buffer and paints sprites at their current position.
+   * At each frame the application just need to update sprites, call refreshSprites() and CanvasClass.swapBuffers().<br>
+   * Draw the scene before sprites become visible, then call setBackgroundLayer() again whenever the scene changes.
+   * Other drawings performed inside sprite areas are overwritten at next refresh.
+   *
+   * @return False if double buffering is not enabled or there isn't enough memory for the layer.
+   *
+   * Example:
+   *
+   *     VGAController.setResolution(VGA_320x200_75Hz, -1, -1, true);
+   *     drawScene();
+   *     VGAController.setBackgroundLayer();
+   *     VGAController.setSprites(sprites, spritesCount);
+   *     while (true) {
+   *       moveSprites();
+   *       VGAController.refreshSprites();
+   *       Canvas.swapBuffers();
+   *     }
+   */
+  bool setBackgroundLayer();
+
+  /**
+   * @brief Release the background layer set by VGAControllerClass.setBackgroundLayer().
+   */
+  void removeBackgroundLayer();
+
+  /**
+   * @brief Return sprites refresh counters.
+   *
+   * Sprites are restored and painted again only when they have been changed or when a drawing overlaps them.
+   * These counters tell how many sprites have been restored, painted or left untouched.
+   *
+   * @return Reference to sprites refresh counters.
+   */
+  SpritesStats const & getSpritesStats() { return m_spritesStats; }
+
+  /**
+   * @brief Reset sprites refresh counters.
+   */
+  void resetSpritesStats();
+
+#if FABGLIB_HAS_FRAME_STATS
+  /**
+   * @brief Get frame time, VSync budget and per primitive timing counters.
+   *
+   * Counters are updated while primitives are executed, so they may change while being read.
+   *
+   * @return Reference to frame counters.
+   *
+   * Example:
+   *
+   *     FrameStats const & stats = VGAController.getFrameStats();
+   *     Serial.printf("queue high water = %d, budget exceeded = %d\n", stats.queueHighWater, stats.budgetExceeded);
+   */
+  FrameStats const & getFrameStats() { return m_frameStats; }
+
+  /**
+   * @brief Reset frame time, VSync budget and per primitive timing counters.
+   */
+  void resetFrameStats();
+
+  /**
+   * @brief Return maximum time in microseconds a VSync interrupt can spend executing primitives.
+   *
+   * @return Time budget in microseconds of each VSync interrupt.
+   */
+  int getMaxVSyncISRTime() { return m_maxVSyncISRTime; }
+#endif
+
   /**
    * @brief Return true if VGAControllerClass is on double buffered mode.
    *
@@ -840,55 +1473,121 @@ private:
   void init(gpio_num_t VSyncGPIO);
 
   uint8_t preparePixel(RGB rgb, bool HSync = false, bool VSync = false);
+  uint8_t preparePattern(RGB rgb);
+
+  // pixels access, handle palette pixel formats
+  void setRowPixel(uint8_t volatile * row, int x, uint8_t value);
+  uint8_t getRowPixel(uint8_t volatile * row, int x);
+  void drawPalettePixel(uint8_t volatile * row, int x, uint8_t src);
+  int getViewPortRowSize() { return m_viewPortWidth >> m_pixelShift; }
+
+  void updatePaletteTables();
+  void applyPixelFormat();
+  void expandPaletteRow(uint8_t volatile * dest, uint8_t volatile * src);
+  void prepareLineBuffer(int line);
+  void updateMouseCursorOverlay();
+  void patchMouseCursorOverlayRow(int ringRow, uint8_t * line, bool patch);
+  bool usesLineBuffers() { return m_pixelShift || m_scanlineCallback; }
+  static void I2SInterrupt(void * arg);
 
   void freeBuffers();
   void fillHorizBuffers(int offsetX);
   void fillVertBuffers(int offsetY);
   int fill(uint8_t volatile * buffer, int startPos, int length, uint8_t red, uint8_t green, uint8_t blue, bool hsync, bool vsync);
-  void allocateViewPort();
+  bool allocateViewPort(int buffersSize);
+  int calcBuffersVideoMemory();
   void freeViewPort();
+  bool reserveVideoMemory(int size, int unit);
+  int availableVideoMemory(int unit);
+  void * allocVideoMemory(int size);
+  void releaseVideoMemory();
   int calcRequiredDMABuffersCount(int viewPortHeight);
+  void getViewPortLineDMABuffers(int * buffersPerLine, int * viewPos);
+  void setViewPortRingOffset(int offset);
+  void resetViewPortRing();
 
   void execPrimitive(Primitive const & prim);
 
+  void flushPrimitivesBatch();
+  void execQueuedPrimitives();
+  bool mustExecQueue() { return m_VSyncInterruptSuspended > 0 && m_suspendingTask == xTaskGetCurrentTaskHandle(); }
+
+  uint32_t sendArenaPrimitive(Primitive const & primitive);
+  bool copyToArena(Primitive & primitive);
+  void * allocArena(int size);
+  void releaseArena(void const * ptr);
+
   void execSetPixel(Point const & position);
   void execLineTo(Point const & position);
   void execFillRect(Rect const & rect);
   void execFillEllipse(Size const & size);
+  void execFillRoundRect(RoundRectInfo const & info);
   void execDrawEllipse(Size const & size);
   void execClear();
   void execVScroll(int scroll);
+  bool execSmoothVScrollStep(Primitive * prim);
   void execHScroll(int scroll);
   void execDrawGlyph(Glyph const & glyph, GlyphOptions glyphOptions, RGB penColor, RGB brushColor);
   void execDrawGlyph_full(Glyph const & glyph, GlyphOptions glyphOptions, RGB penColor, RGB brushColor);
   void execDrawGlyph_light(Glyph const & glyph, GlyphOptions glyphOptions, RGB penColor, RGB brushColor);
+
+  void execDrawText(DrawTextInfo const & textInfo);
   void execInvertRect(Rect const & rect);
   void execCopyRect(Rect const & source);
   void execSwapFGBG(Rect const & rect);
   void execReadRawData(RawData const & rawData);
   void execWriteRawData(RawData const & rawData);
+  void execReadRLERows(RLERows * rows);
+  void execWriteRLERows(RLERows const * rows);
   void execRenderGlyphsBuffer(GlyphsBufferRenderInfo const & glyphsBufferRenderInfo);
+  void drawGlyphsBufferItem(int destX, int destY, int glyphsWidth, int glyphsHeight, uint8_t const * glyphData, uint8_t penPattern, uint8_t brushPattern);
+  void prepareGlyphRowCache(uint8_t penPattern, uint8_t brushPattern);
   void execDrawBitmap(BitmapDrawingInfo const & bitmapDrawingInfo);
   void execSwapBuffers();
   void execDrawPath(Path const & path);
   void execFillPath(Path const & path);
+  void fillPolygon(Point const * points, int pointsCount, int minY, int maxY, uint8_t pattern);
 
   void updateAbsoluteClippingRect();
 
   void drawBitmap(int destX, int destY, Bitmap const * bitmap, uint8_t * saveBackground, bool ignoreClippingRect);
+  void restoreBackground(int destX, int destY, int width, int height, uint8_t const * savedBackground);
 
   void fillRow(int y, int x1, int x2, uint8_t pattern);
+  void fillClippedRow(int y, int x1, int x2, uint8_t pattern);
   void swapRows(int yA, int yB, int x1, int x2);
 
   void drawLine(int X1, int Y1, int X2, int Y2, uint8_t pattern);
 
   void hideSprites();
+  void hideSprites(int X1, int Y1, int X2, int Y2);
   void showSprites();
 
+  void composeSprites();
+  void restoreLayerRect(Rect const & rect);
+  void freeBackgroundLayer();
+
+  #if FABGLIB_HAS_FRAME_STATS
+  void updatePrimitiveStats(PrimitiveCmd cmd, int64_t startTime);
+  void updateQueueHighWater();
+  void updateFrameStats(int64_t startTime, uint32_t executedBefore, bool hasBudget);
+  #endif
+
+  // the mouse cursor is handled as the last (topmost) sprite
+  Sprite * getSprite(int index) { return index < m_spritesCount ? (Sprite*)((uint8_t*)m_sprites + index * m_spriteSize) : &m_mouseCursor; }
+
   void setSprites(Sprite * sprites, int count, int spriteSize);
 
   static void VSyncInterrupt();
 
+  static void renderTask(void * arg);
+  void renderTaskExecPrimitive(Primitive const & prim);
+
+  uint32_t sendPrimitive(Primitive const & primitive);
+  void notifyPrimitivesFenceWaiter();
+  void renderTaskWaitVSync();
+  void renderTaskSetIdle();
+
   static void setupGPIO(gpio_num_t gpio, int bit, gpio_mode_t mode);
 
   // DMA related methods
@@ -921,11 +1620,63 @@ private:
   volatile uint8_t * *   m_viewPort;
   volatile uint8_t * *   m_viewPortVisible;
 
-  uint8_t *              m_viewPortMemoryPool[FABGLIB_VIEWPORT_MEMORY_POOL_COUNT + 1];  // last allocated pool is NULL
+  // when hardware vertical scroll is enabled m_viewPortRing contains two copies of the lines pointers (2 * m_viewPortHeight items) and m_viewPort
+  // points to m_viewPortRing + m_viewPortRingOffset. m_viewPortRingOffset is also the viewport line displayed by the first DMA descriptors of the viewport.
+  // NULL when hardware vertical scroll is disabled
+  volatile uint8_t * *   m_viewPortRing;
+  int16_t                m_viewPortRingOffset;
+
+  // video memory: DMA capable blocks holding blank lines, DMA descriptors, line buffers and viewport lines. Blocks are freed only by
+  // freeUnusedVideoMemory(), they are carved again from the start by each setResolution(), so mode changes don't reallocate nor fragment the heap.
+  VideoMemoryBlock       m_videoMemory[FABGLIB_VIEWPORT_MEMORY_POOL_COUNT];
+  int                    m_videoMemoryBlocks;
+
+  // line buffers support (palette pixel formats and scanline mode). Viewport line "y" is displayed from line buffer "y % FABGLIB_LINE_BUFFERS_COUNT",
+  // prepared by I2SInterrupt() while previous lines are sent.
+  // In palette formats viewport rows contain palette indexes (pixel 0 at most significant bits), converted to colors.
+  // In scanline mode m_viewPort is NULL and lines are generated by m_scanlineCallback.
+  ScanlineCallback       m_scanlineCallback;
+  void *                 m_scanlineCallbackArg;
+  PixelFormat            m_pixelFormat;
+  PixelFormat            m_pendingPixelFormat; // applied by next setResolution() (see setPixelFormat())
+  bool                   m_pixelFormatPending;
+  uint8_t                m_pixelShift;         // log2 of pixels per byte: 0 = RGB222, 1 = Palette16, 2 = Palette4
+  RGB                    m_paletteColors[16];
+  uint8_t                m_palette[16];        // palette items as raw pixels
+  uint8_t                m_paletteIndex[64];   // RGB222 color to nearest palette index
+
+  // glyphs buffer rendering: 4 bits of glyph row to 4 pixels word, for the last used pen and brush patterns
+  uint32_t               m_glyphRowCache[16];
+  int16_t                m_glyphRowCachePen;   // -1 = invalid
+  int16_t                m_glyphRowCacheBrush;
+  uint32_t *             m_paletteExpand;      // byte of packed indexes to raw pixels (see updatePaletteTables())
+  volatile uint8_t *     m_lineBuffers;
+  int16_t                m_lineDMABuffers;     // number of DMA buffers of each viewport line (all scans)
+  intr_handle_t          m_I2SInterruptHandle;
 
   volatile QueueHandle_t m_execQueue;
   PaintState             m_paintState;
 
+  // batch ring: producer writes at m_batchWritePos, vertical sync interrupt reads at m_batchReadPos (positions wrap using FABGLIB_PRIMITIVES_BATCH_SIZE - 1 mask)
+  Primitive *            m_batch;              // allocated by first beginPrimitivesBatch()
+  TaskHandle_t           m_batchOwner;         // task that is batching
+  int                    m_batchLevel;         // >0 when batching
+  uint32_t               m_batchWritePos;
+  uint32_t               m_batchPublishedPos;  // primitives before this position have been sent to m_execQueue
+  volatile uint32_t      m_batchReadPos;
+
+  // polygons fill scratch memory (FABGLIB_MAX_PATH_EDGES items), allocated by first FillPath primitive
+  PathEdge *             m_pathEdges;
+  int16_t *              m_pathActiveEdges;
+
+  // primitives arena (FABGLIB_PRIMITIVES_ARENA_SIZE bytes), a ring of blocks holding parameters of queued primitives, allocated on first use.
+  // Producers hold m_arenaMutex from allocation to queue send, so blocks are consumed in order and the executor frees them moving
+  // m_arenaReadPos after each block.
+  uint8_t *              m_arena;
+  SemaphoreHandle_t      m_arenaMutex;
+  int                    m_arenaWritePos;
+  volatile int           m_arenaReadPos;
+
   // when double buffer is enabled the running DMA buffer is always m_DMABuffersRunning
   // when double buffer is not enabled then m_DMABuffers = m_DMABuffersRunning
   lldesc_t volatile *    m_DMABuffersHead;
@@ -935,20 +1686,60 @@ private:
   int                    m_DMABuffersCount;
 
   gpio_num_t             m_VSyncGPIO;
-  int                    m_VSyncInterruptSuspended;             // 0 = enabled, >0 suspended
+  volatile int           m_VSyncInterruptSuspended;             // 0 = enabled, >0 suspended
+  TaskHandle_t           m_suspendingTask;                      // task that suspended background execution (it must execute queued primitives itself)
   bool                   m_backgroundPrimitiveExecutionEnabled; // when False primitives are execute immediately
 
+  // render task (see enableRenderTask())
+  TaskHandle_t           m_renderTask;
+  volatile bool          m_renderTaskBusy;   // true while render task is executing primitives or painting sprites
+  volatile TaskHandle_t  m_renderTaskIdleWaitTask; // task to notify when m_renderTaskBusy becomes false
+
+  // primitives fences (see waitPrimitivesFence())
+  volatile uint32_t      m_primitivesSubmitted;  // number of items sent to m_execQueue
+  volatile uint32_t      m_primitivesCompleted;  // number of m_execQueue items executed
+  volatile TaskHandle_t  m_fenceWaitTask;        // task to notify when some items have been executed
+
+  // vertical sync notification (see waitVSync())
+  volatile uint32_t      m_VSyncCount;
+  volatile TaskHandle_t  m_VSyncWaitTask;
+
   void *                 m_sprites;       // pointer to array of sprite structures
   int                    m_spriteSize;    // size of sprite structure
   int                    m_spritesCount;  // number of sprites in m_sprites array
 
-  bool                   m_spritesHidden; // true between hideSprites() and showSprites()
+  SpritesStats           m_spritesStats;
+
+  #if FABGLIB_HAS_FRAME_STATS
+  FrameStats             m_frameStats;
+  #endif
 
   // mouse cursor (mouse pointer) support
   Sprite                 m_mouseCursor;
   int16_t                m_mouseHotspotX;
   int16_t                m_mouseHotspotY;
 
+  // mouse cursor overlay (see FABGLIB_MOUSE_CURSOR_OVERLAY). When enabled m_mouseCursor is not painted as a sprite, it just holds position
+  // and bitmap. updateMouseCursorOverlay() takes a snapshot of them at VSync (m_overlayX, m_overlayY, m_overlayBitmap) and, for RGB222,
+  // composites rows under the cursor into m_overlayLines, linking them to the DMA descriptors of "m_overlayRows" ring rows from m_overlayRingRow.
+  bool                   m_mouseCursorOverlay;
+  Bitmap const * volatile m_overlayCursor;   // current cursor bitmap, NULL = no cursor
+  volatile bool          m_overlayDirty;      // cursor changed or moved, or viewport under it has been drawn
+  bool                   m_overlayDamaged;    // viewport under the cursor is being drawn (set by hideSprites(), moved to m_overlayDirty by showSprites())
+  uint8_t *              m_overlayLines;
+  int16_t                m_overlayX;
+  int16_t                m_overlayY;
+  Bitmap const *         m_overlayBitmap;
+  int16_t                m_overlayRingRow;
+  int16_t                m_overlayRows;
+
+  // sprites compositor background layer (see setBackgroundLayer())
+  uint8_t *              m_backgroundLayer;
+  Rect *                 m_layerRects[2];        // areas where sprites have been painted, for each buffer
+  int16_t                m_layerRectsCount[2];
+  int16_t                m_layerRectsSize;       // capacity of m_layerRects[]
+  uint8_t                m_backBufferIndex;      // m_layerRects[] index of buffer pointed by m_viewPort
+
 };
 
 
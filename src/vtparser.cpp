@@ -0,0 +1,279 @@
+/*
+  Created by Fabrizio Di Vittorio (fdivitto2013@gmail.com) - <http://www.fabgl.com>
+  Copyright (c) 2019 Fabrizio Di Vittorio.
+  All rights reserved.
+
+  This file is part of FabGL Library.
+
+  FabGL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  FabGL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with FabGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+
+#include "vtparser.h"
+
+
+
+namespace fabgl {
+
+
+
+// this file must not depend on hardware or RTOS, so it can be built on a host
+
+
+// classes of received bytes (columns of the transitions table)
+enum {
+  CLASS_CTRL,     // 0x00..0x1F (but ESC) and DEL
+  CLASS_ESC,      // ESC
+  CLASS_DIGIT,    // 0..9
+  CLASS_SEMI,     // ;
+  CLASS_QUEST,    // ?
+  CLASS_CSI,      // [
+  CLASS_DCS,      // P
+  CLASS_INTER,    // # ( ) * +
+  CLASS_SPC,      // SPC
+  CLASS_QUOT,     // "
+  CLASS_OTHER,    // any other printable character, 0x80..0xFF included
+  CLASSES_COUNT,
+};
+
+
+// actions executed on transitions
+enum {
+  ACT_NONE,
+  ACT_PRINT,          // printable character (ground state)
+  ACT_EXECUTE,        // execute control character
+  ACT_ESCAPE,         // start of ESC sequence (ANSI or VT52)
+  ACT_ESC_DISPATCH,   // final code of ESC sequence
+  ACT_COLLECT,        // intermediate character
+  ACT_CLEAR,          // start of CSI or DCS sequence
+  ACT_PARAM,          // parameter digit or separator
+  ACT_PRIVATE,        // private marker
+  ACT_CSI_DISPATCH,   // final code of CSI sequence
+  ACT_DCS_PUT,        // DCS content character
+  ACT_DCS_END,        // character after ESC in DCS content (should be '\')
+  ACT_VT52_DISPATCH,  // final code of VT52 ESC sequence
+  ACT_VT52_ROW,       // row of VT52 "ESC Y"
+  ACT_VT52_COL,       // column of VT52 "ESC Y"
+};
+
+
+// a transition is made of action (high nibble) and next state (low nibble)
+#define TR(action, state) (((action) << 4) | (state))
+
+#define TR_ALL(action, state) TR(action, state), TR(action, state), TR(action, state), TR(action, state), TR(action, state), TR(action, state), \
+                              TR(action, state), TR(action, state), TR(action, state), TR(action, state), TR(action, state)
+
+// maximum value of a parameter
+#define VTPARSER_MAX_PARAM 0xFFFF
+
+
+VTParser::VTParser()
+{
+  reset();
+}
+
+
+void VTParser::reset()
+{
+  m_state  = Ground;
+  m_action = VTAction::NoAction;
+  clear();
+}
+
+
+void VTParser::clear()
+{
+  m_intermediate    = 0;
+  m_privateMarker   = false;
+  m_paramsCount     = 1;  // one parameter is always assumed (even if not exists)
+  memset(m_params, 0, sizeof(m_params));
+  m_contentLength   = 0;
+  m_contentOverflow = false;
+}
+
+
+static inline __attribute__((always_inline)) int byteClass(uint8_t c)
+{
+  if (c < 0x20 || c == 0x7F)
+    return c == 0x1B ? CLASS_ESC : CLASS_CTRL;
+  if (c >= '0' && c <= '9')
+    return CLASS_DIGIT;
+  switch (c) {
+    case ';':
+      return CLASS_SEMI;
+    case '?':
+      return CLASS_QUEST;
+    case '[':
+      return CLASS_CSI;
+    case 'P':
+      return CLASS_DCS;
+    case '#':
+    case '(':
+    case ')':
+    case '*':
+    case '+':
+      return CLASS_INTER;
+    case ' ':
+      return CLASS_SPC;
+    case '"':
+      return CLASS_QUOT;
+    default:
+      return CLASS_OTHER;
+  }
+}
+
+
+int VTParser::parse(char const * data, int size, bool ANSIMode)
+{
+  // columns:                 CTRL                          ESC                     DIGIT                        SEMI                         QUEST                          CSI                          DCS                          INTER                              SPC                                QUOT                               OTHER
+  static const uint8_t VTPARSER_TABLE[StatesCount][CLASSES_COUNT] = {
+    /* Ground             */ { TR(ACT_EXECUTE, Ground),             TR(ACT_ESCAPE, Escape), TR(ACT_PRINT, Ground),        TR(ACT_PRINT, Ground),        TR(ACT_PRINT, Ground),          TR(ACT_PRINT, Ground),        TR(ACT_PRINT, Ground),        TR(ACT_PRINT, Ground),             TR(ACT_PRINT, Ground),             TR(ACT_PRINT, Ground),             TR(ACT_PRINT, Ground) },
+    /* Escape             */ { TR(ACT_EXECUTE, Escape),             TR(ACT_ESCAPE, Escape), TR(ACT_ESC_DISPATCH, Ground), TR(ACT_ESC_DISPATCH, Ground), TR(ACT_ESC_DISPATCH, Ground),   TR(ACT_CLEAR, CSIParam),      TR(ACT_CLEAR, DCSParam),      TR(ACT_COLLECT, EscapeIntermediate), TR(ACT_COLLECT, EscapeIntermediate), TR(ACT_ESC_DISPATCH, Ground),    TR(ACT_ESC_DISPATCH, Ground) },
+    /* EscapeIntermediate */ { TR(ACT_EXECUTE, EscapeIntermediate), TR(ACT_ESCAPE, Escape), TR(ACT_ESC_DISPATCH, Ground), TR(ACT_ESC_DISPATCH, Ground), TR(ACT_ESC_DISPATCH, Ground),   TR(ACT_ESC_DISPATCH, Ground), TR(ACT_ESC_DISPATCH, Ground), TR(ACT_ESC_DISPATCH, Ground),      TR(ACT_ESC_DISPATCH, Ground),      TR(ACT_ESC_DISPATCH, Ground),      TR(ACT_ESC_DISPATCH, Ground) },
+    /* CSIParam           */ { TR(ACT_EXECUTE, CSIParam),           TR(ACT_ESCAPE, Escape), TR(ACT_PARAM, CSIParam),      TR(ACT_PARAM, CSIParam),      TR(ACT_PRIVATE, CSIParam),      TR(ACT_CSI_DISPATCH, Ground), TR(ACT_CSI_DISPATCH, Ground), TR(ACT_CSI_DISPATCH, Ground),      TR(ACT_COLLECT, CSIIntermediate),  TR(ACT_COLLECT, CSIIntermediate),  TR(ACT_CSI_DISPATCH, Ground) },
+    /* CSIIntermediate    */ { TR(ACT_EXECUTE, CSIIntermediate),    TR(ACT_ESCAPE, Escape), TR(ACT_CSI_DISPATCH, Ground), TR(ACT_CSI_DISPATCH, Ground), TR(ACT_CSI_DISPATCH, Ground),   TR(ACT_CSI_DISPATCH, Ground), TR(ACT_CSI_DISPATCH, Ground), TR(ACT_CSI_DISPATCH, Ground),      TR(ACT_CSI_DISPATCH, Ground),      TR(ACT_CSI_DISPATCH, Ground),      TR(ACT_CSI_DISPATCH, Ground) },
+    /* DCSParam           */ { TR(ACT_EXECUTE, DCSParam),           TR(ACT_ESCAPE, Escape), TR(ACT_PARAM, DCSParam),      TR(ACT_PARAM, DCSParam),      TR(ACT_PRIVATE, DCSParam),      TR(ACT_DCS_PUT, DCSContent),  TR(ACT_DCS_PUT, DCSContent),  TR(ACT_DCS_PUT, DCSContent),       TR(ACT_DCS_PUT, DCSContent),       TR(ACT_DCS_PUT, DCSContent),       TR(ACT_DCS_PUT, DCSContent) },
+    /* DCSContent         */ { TR(ACT_DCS_PUT, DCSContent),         TR(ACT_NONE, DCSEscape),TR(ACT_DCS_PUT, DCSContent),  TR(ACT_DCS_PUT, DCSContent),  TR(ACT_DCS_PUT, DCSContent),    TR(ACT_DCS_PUT, DCSContent),  TR(ACT_DCS_PUT, DCSContent),  TR(ACT_DCS_PUT, DCSContent),       TR(ACT_DCS_PUT, DCSContent),       TR(ACT_DCS_PUT, DCSContent),       TR(ACT_DCS_PUT, DCSContent) },
+    /* DCSEscape          */ { TR_ALL(ACT_DCS_END, Ground) },
+    /* VT52Escape         */ { TR_ALL(ACT_VT52_DISPATCH, Ground) },
+    /* VT52Row            */ { TR_ALL(ACT_VT52_ROW, VT52Col) },
+    /* VT52Col            */ { TR_ALL(ACT_VT52_COL, Ground) },
+  };
+
+  m_action = VTAction::NoAction;
+
+  int i = 0;
+  while (i < size) {
+
+    if (m_state == Ground) {
+      // fast path: a run of printable characters (0x80..0xFF included) is returned as a single action
+      int count = 0;
+      for (uint8_t c; i + count < size && (c = data[i + count]) >= 0x20 && c != 0x7F; )
+        ++count;
+      if (count > 0) {
+        m_printChars = data + i;
+        m_printCount = count;
+        m_action     = VTAction::PrintChars;
+        return i + count;
+      }
+    }
+
+    const uint8_t c  = data[i++];
+    const uint8_t tr = VTPARSER_TABLE[m_state][byteClass(c)];
+    m_state = (State) (tr & 0x0F);
+
+    switch (tr >> 4) {
+
+      case ACT_PRINT:
+        m_printChars = data + i - 1;
+        m_printCount = 1;
+        m_action     = VTAction::PrintChars;
+        break;
+
+      case ACT_EXECUTE:
+        m_code   = c;
+        m_action = VTAction::ExecuteCtrl;
+        break;
+
+      case ACT_ESCAPE:
+        clear();
+        m_state = ANSIMode ? Escape : VT52Escape;
+        break;
+
+      case ACT_ESC_DISPATCH:
+        m_code   = c;
+        m_action = VTAction::ESCDispatch;
+        break;
+
+      case ACT_COLLECT:
+        m_intermediate = c;
+        break;
+
+      case ACT_CLEAR:
+        clear();
+        break;
+
+      case ACT_PARAM:
+        // parameters exceeding FABGLIB_MAX_CSI_PARAMS are discarded
+        if (c == ';') {
+          if (m_paramsCount <= FABGLIB_MAX_CSI_PARAMS)
+            ++m_paramsCount;
+        } else if (m_paramsCount <= FABGLIB_MAX_CSI_PARAMS) {
+          int * p = m_params + m_paramsCount - 1;
+          *p = *p * 10 + (c - '0');
+          if (*p > VTPARSER_MAX_PARAM)
+            *p = VTPARSER_MAX_PARAM;
+        }
+        break;
+
+      case ACT_PRIVATE:
+        m_privateMarker = true;
+        break;
+
+      case ACT_CSI_DISPATCH:
+        if (m_paramsCount > FABGLIB_MAX_CSI_PARAMS)
+          m_paramsCount = FABGLIB_MAX_CSI_PARAMS;
+        m_code   = c;
+        m_action = VTAction::CSIDispatch;
+        break;
+
+      case ACT_DCS_PUT:
+        if (m_contentLength < FABGLIB_MAX_DCS_CONTENT)
+          m_content[m_contentLength++] = c;
+        else
+          m_contentOverflow = true;
+        break;
+
+      case ACT_DCS_END:
+        if (m_paramsCount > FABGLIB_MAX_CSI_PARAMS)
+          m_paramsCount = FABGLIB_MAX_CSI_PARAMS;
+        m_code   = c;
+        m_action = (c == '\\' && !m_contentOverflow) ? VTAction::DCSDispatch : VTAction::DCSFail;
+        break;
+
+      case ACT_VT52_DISPATCH:
+        if (c == 'Y') {
+          // ESC Y row col : row and column follow
+          m_state = VT52Row;
+        } else {
+          m_code   = c;
+          m_action = VTAction::VT52Dispatch;
+        }
+        break;
+
+      case ACT_VT52_ROW:
+        m_params[0] = c - 31;
+        break;
+
+      case ACT_VT52_COL:
+        m_params[1]   = c - 31;
+        m_paramsCount = 2;
+        m_code        = 'Y';
+        m_action      = VTAction::VT52Dispatch;
+        break;
+
+    }
+
+    if (m_action != VTAction::NoAction)
+      break;
+  }
+
+  return i;
+}
+
+
+
+} // end of namespace
@@ -0,0 +1,180 @@
+/*
+  Created by Fabrizio Di Vittorio (fdivitto2013@gmail.com) - <http://www.fabgl.com>
+  Copyright (c) 2019 Fabrizio Di Vittorio.
+  All rights reserved.
+
+  This file is part of FabGL Library.
+
+  FabGL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  FabGL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with FabGL.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _VTPARSER_H_INCLUDED
+#define _VTPARSER_H_INCLUDED
+
+
+/**
+ * @file
+ *
+ * @brief This file contains fabgl::VTParser class definition
+ */
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "fabglconf.h"
+
+
+
+namespace fabgl {
+
+
+
+/** @brief Actions returned by VTParser.parse(). */
+enum VTAction {
+  NoAction,       /**< All bytes consumed, the sequence (if any) is not complete yet */
+  PrintChars,     /**< Printable characters (see VTParser.getPrintChars() and VTParser.getPrintCount()) */
+  ExecuteCtrl,    /**< Control character (see VTParser.getCode()) */
+  ESCDispatch,    /**< ESC sequence: optional intermediate (SPC # ( ) * +) and final code */
+  CSIDispatch,    /**< CSI sequence: parameters, optional private marker (?), optional intermediate (SPC or ") and final code */
+  DCSDispatch,    /**< DCS sequence terminated by ST: parameters and content */
+  DCSFail,        /**< DCS sequence not terminated by ST or content too long */
+  VT52Dispatch,   /**< VT52 ESC sequence: final code. Row and column of "ESC Y" are the first two parameters */
+};
+
+
+/**
+ * @brief Resumable, table driven parser of ANSI/VT and VT52 escape sequences.
+ *
+ * The parser consumes a slice of received bytes up to the first complete action, keeping the state of an incomplete sequence
+ * for the next call, so a whole received block can be processed without blocking. It does not depend on the hardware and can be
+ * built and tested on a host.
+ *
+ * Example:
+ *
+ *     VTParser parser;
+ *     while (size > 0) {
+ *       int consumed = parser.parse(data, size, true);
+ *       switch (parser.getAction()) {
+ *         case VTAction::PrintChars:
+ *           // parser.getPrintChars(), parser.getPrintCount()
+ *           break;
+ *         case VTAction::CSIDispatch:
+ *           // parser.getCode(), parser.getParams()...
+ *           break;
+ *         ...
+ *       }
+ *       data += consumed;
+ *       size -= consumed;
+ *     }
+ */
+class VTParser {
+
+public:
+
+  VTParser();
+
+  /**
+   * @brief Abort current sequence and go to ground state.
+   */
+  void reset();
+
+  /**
+   * @brief Consume bytes up to the first complete action.
+   *
+   * @param data Received bytes.
+   * @param size Number of received bytes.
+   * @param ANSIMode If true ESC introduces ANSI/VT sequences, otherwise VT52 sequences.
+   *
+   * @return Number of consumed bytes. The action is returned by getAction(), which is VTAction::NoAction when all bytes are consumed without completing any action.
+   */
+  int parse(char const * data, int size, bool ANSIMode);
+
+  /** @brief Return the last parsed action. */
+  VTAction getAction() { return m_action; }
+
+  /** @brief Return the control character (VTAction::ExecuteCtrl) or the final code of a sequence. */
+  char getCode() { return m_code; }
+
+  /** @brief Return the intermediate character of a sequence, or 0 if none. */
+  char getIntermediate() { return m_intermediate; }
+
+  /** @brief Return true if the CSI or DCS sequence contains the private marker (?). */
+  bool getPrivateMarker() { return m_privateMarker; }
+
+  /** @brief Return sequence parameters. Non specified parameters are zero, up to FABGLIB_MAX_CSI_PARAMS. */
+  int const * getParams() { return m_params; }
+
+  /** @brief Return the number of parameters (at least one is always assumed). */
+  int getParamsCount() { return m_paramsCount; }
+
+  /** @brief Return the printable characters of VTAction::PrintChars (they point to the parsed data). */
+  char const * getPrintChars() { return m_printChars; }
+
+  /** @brief Return the number of printable characters of VTAction::PrintChars. */
+  int getPrintCount() { return m_printCount; }
+
+  /** @brief Return the content of the DCS sequence, the first character is the DCS final code. */
+  char const * getContent() { return m_content; }
+
+  /** @brief Return the content length of the DCS sequence. */
+  int getContentLength() { return m_contentLength; }
+
+private:
+
+  // parser states, see VTPARSER_TABLE
+  enum State {
+    Ground,
+    Escape,
+    EscapeIntermediate,
+    CSIParam,
+    CSIIntermediate,
+    DCSParam,
+    DCSContent,
+    DCSEscape,
+    VT52Escape,
+    VT52Row,
+    VT52Col,
+    StatesCount,
+  };
+
+  void clear();
+
+  State         m_state;
+  VTAction      m_action;
+
+  char          m_code;
+  char          m_intermediate;
+  bool          m_privateMarker;
+
+  int           m_params[FABGLIB_MAX_CSI_PARAMS];
+  int           m_paramsCount;
+
+  char const *  m_printChars;
+  int           m_printCount;
+
+  char          m_content[FABGLIB_MAX_DCS_CONTENT];
+  int           m_contentLength;
+  bool          m_contentOverflow;
+
+};
+
+
+
+} // end of namespace
+
+
+
+#endif
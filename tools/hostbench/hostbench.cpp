@@ -0,0 +1,409 @@
+// Host benchmark of the VGA controller rasterizers and of the terminal
+//
+// usage:
+//    hostbench [kilobytes]
+//
+// The library runs on the host over include/hostshim.h and hoststubs.cpp: FreeRTOS tasks are threads, the VSync
+// interrupt is a 60Hz thread and the viewport is a memory framebuffer (video output does nothing).
+//
+// Primitives are measured as Benchmarks.ino does:
+//   - "raster"  : primitives are queued with background execution suspended and executed by processPrimitives()
+//                 (double buffering: executed while added)
+//   - "vsync"   : primitives are executed by the VSync interrupt, inside the vertical blanking time budget
+//   - "render"  : primitives are executed by the render task (VGAControllerClass.enableRenderTask())
+// "glyphs refresh" renders the whole 80x25 glyphs buffer with one primitive. "sprites" moves 32 sprites and refreshes
+// them, each frame is executed before the next one (so with "vsync" it runs at up to the VSync rate).
+//
+// Terminal streams (see ../vtbench/vtstreams.h) are written to the terminal and consumed by its task, with
+// "vsync" and "render" execution. Time ends when all primitives have been executed. Results are in KB/s and
+// primitives/s.
+//
+// Build (from this directory):
+//    g++ -O2 -std=gnu++11 -Iinclude -I../../src -I../vtbench hostbench.cpp hoststubs.cpp ../../src/canvas.cpp
+//        ../../src/vgacontroller.cpp ../../src/terminal.cpp ../../src/vtparser.cpp ../../src/fabutils.cpp
+//        ../../src/keyboard.cpp ../../src/ps2device.cpp -lpthread -o hostbench
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string>
+#include <atomic>
+
+#include "vgacontroller.h"
+#include "canvas.h"
+#include "terminal.h"
+#include "vtstreams.h"
+
+
+using fabgl::Color;
+using fabgl::Point;
+using fabgl::Bitmap;
+using fabgl::Sprite;
+using fabgl::GlyphOptions;
+using fabgl::GlyphsBuffer;
+using fabgl::TerminalClass;
+
+
+// minimum duration of each primitives test
+#define TEST_TIME_US 300000
+
+// primitives queued between checks of elapsed time
+#define OPS_STEP 64
+
+#define SPRITES_COUNT 32
+
+
+TerminalClass Terminal;
+
+
+enum class Pipeline { Raster, VSync, Render };
+
+
+uint8_t      bitmapData[32 * 32];
+Bitmap *     bitmap;
+Point        star[10];
+uint32_t     seed;
+GlyphsBuffer glyphsBuffer;
+uint8_t      spriteData[16 * 16];
+Bitmap *     spriteBitmap;
+Sprite       sprites[SPRITES_COUNT];
+
+
+// deterministic pseudo random numbers, so every run draws the same things
+int rnd(int max)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) % max;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// primitives
+
+
+struct Benchmark {
+  char const * name;
+  void (*prepare)();     // called once before the test (state primitives)
+  void (*exec)(int i);   // queues the i-th primitive
+  void (*cleanup)();
+  bool frames;           // each exec() is a frame, completed before the next one
+};
+
+
+void prepareColors()
+{
+  Canvas.setPenColor(Color::BrightYellow);
+  Canvas.setBrushColor(Color::Blue);
+}
+
+
+void prepareGlyphs()
+{
+  prepareColors();
+  Canvas.setGlyphOptions(GlyphOptions().FillBackground(true));
+}
+
+
+void prepareScroll()
+{
+  prepareColors();
+  Canvas.setScrollingRegion(0, 0, Canvas.getWidth() - 1, Canvas.getHeight() - 1);
+}
+
+
+// 80x25 glyphs buffer with 8x14 font (as the terminal), random characters and colors
+void prepareGlyphsBuffer()
+{
+  fabgl::FontInfo const * font = Canvas.getPresetFontInfo(80, 25);
+  glyphsBuffer.glyphsWidth  = font->width;
+  glyphsBuffer.glyphsHeight = font->height;
+  glyphsBuffer.glyphsData   = font->data;
+  glyphsBuffer.columns      = Canvas.getWidth() / font->width;
+  glyphsBuffer.rows         = Canvas.getHeight() / font->height;
+  delete [] glyphsBuffer.map;
+  glyphsBuffer.map = new uint32_t[glyphsBuffer.columns * glyphsBuffer.rows];
+  seed = 1;
+  for (int i = 0; i < glyphsBuffer.columns * glyphsBuffer.rows; ++i)
+    glyphsBuffer.map[i] = GLYPHMAP_ITEM_MAKE(32 + rnd(95), rnd(8), 8 + rnd(8), GlyphOptions());
+}
+
+
+void prepareSprites()
+{
+  for (int i = 0; i < SPRITES_COUNT; ++i) {
+    sprites[i].clearBitmaps();
+    sprites[i].addBitmap(spriteBitmap);
+    sprites[i].moveTo(rnd(Canvas.getWidth() - 16), rnd(Canvas.getHeight() - 16));
+    sprites[i].visible = true;
+  }
+  VGAController.setSprites(sprites, SPRITES_COUNT);
+}
+
+
+void cleanupSprites()
+{
+  VGAController.removeSprites();
+}
+
+
+void execFillRectangle(int i)
+{
+  int x = rnd(Canvas.getWidth() - 32), y = rnd(Canvas.getHeight() - 32);
+  Canvas.fillRectangle(x, y, x + 31, y + 31);
+}
+
+
+void execDrawGlyph(int i)
+{
+  fabgl::FontInfo const * font = Canvas.getFontInfo();
+  Canvas.drawGlyph(rnd(Canvas.getWidth() - font->width), rnd(Canvas.getHeight() - font->height), font->width, font->height, font->data, 'A' + i % 26);
+}
+
+
+void execCopyRect(int i)
+{
+  Canvas.copyRect(rnd(Canvas.getWidth() - 64), rnd(Canvas.getHeight() - 64), rnd(Canvas.getWidth() - 64), rnd(Canvas.getHeight() - 64), 64, 64);
+}
+
+
+void execDrawBitmap(int i)
+{
+  Canvas.drawBitmap(rnd(Canvas.getWidth() - bitmap->width), rnd(Canvas.getHeight() - bitmap->height), bitmap);
+}
+
+
+void execFillPath(int i)
+{
+  Canvas.fillPath(star, 10);
+}
+
+
+void execScroll(int i)
+{
+  Canvas.scroll(0, -8);
+}
+
+
+void execGlyphsRefresh(int i)
+{
+  Canvas.renderGlyphsBuffer(0, 0, &glyphsBuffer, glyphsBuffer.columns, glyphsBuffer.rows);
+}
+
+
+// moves all sprites, then refreshes the screen
+void execSprites(int i)
+{
+  for (int j = 0; j < SPRITES_COUNT; ++j)
+    sprites[j].move(1 + (j & 3), 1 + (j >> 3 & 3));
+  VGAController.refreshSprites();
+}
+
+
+const Benchmark Benchmarks[] = {
+  { "fillRectangle",  prepareColors,       execFillRectangle, NULL,           false },
+  { "drawGlyph",      prepareGlyphs,       execDrawGlyph,     NULL,           false },
+  { "copyRect",       prepareColors,       execCopyRect,      NULL,           false },
+  { "drawBitmap",     prepareColors,       execDrawBitmap,    NULL,           false },
+  { "fillPath",       prepareColors,       execFillPath,      NULL,           false },
+  { "scroll",         prepareScroll,       execScroll,        NULL,           false },
+  { "glyphs refresh", prepareGlyphsBuffer, execGlyphsRefresh, NULL,           false },
+  { "sprites",        prepareSprites,      execSprites,       cleanupSprites, true },
+};
+
+
+// returns primitives (or frames) per second. Pipelines: primitives are queued for TEST_TIME_US (the queue fills up), then
+// the time to execute the queued ones is added.
+double runBenchmark(Benchmark const & benchmark, Pipeline pipeline)
+{
+  VGAController.enableRenderTask(pipeline == Pipeline::Render);
+
+  if (pipeline == Pipeline::Raster)
+    VGAController.suspendBackgroundPrimitiveExecution();
+
+  seed = 1;
+  benchmark.prepare();
+  Canvas.waitCompletion(false);
+
+  const int step = benchmark.frames ? 1 : OPS_STEP;
+  int count = 0;
+  int64_t startTime = esp_timer_get_time();
+  do {
+    for (int i = 0; i < step; ++i, ++count)
+      benchmark.exec(count);
+    if (pipeline == Pipeline::Raster)
+      VGAController.processPrimitives();
+    else if (benchmark.frames)
+      Canvas.waitCompletion();
+  } while (esp_timer_get_time() - startTime < TEST_TIME_US);
+  if (pipeline != Pipeline::Raster)
+    Canvas.waitCompletion();
+  int64_t elapsed = esp_timer_get_time() - startTime;
+
+  if (pipeline == Pipeline::Raster)
+    VGAController.resumeBackgroundPrimitiveExecution();
+
+  if (benchmark.cleanup)
+    benchmark.cleanup();
+  Canvas.waitCompletion();
+
+  return count * 1000000.0 / elapsed;
+}
+
+
+void setupMode(char const * modeline, bool doubleBuffered)
+{
+  VGAController.enableRenderTask(false);
+  VGAController.setResolution(modeline, -1, -1, doubleBuffered);
+  Canvas.selectFont(Canvas.getPresetFontInfo(80, 25));
+  Canvas.setBrushColor(Color::Black);
+  Canvas.clear();
+  Canvas.waitCompletion();
+
+  // a 5 pointed star (concave polygon) at the center of the screen
+  for (int i = 0; i < 10; ++i) {
+    double a = i * M_PI / 5, r = (i & 1) ? 40 : 100;
+    star[i] = Point(Canvas.getWidth() / 2 + r * sin(a), Canvas.getHeight() / 2 - r * cos(a));
+  }
+}
+
+
+void benchPrimitives(char const * modeline, bool doubleBuffered)
+{
+  setupMode(modeline, doubleBuffered);
+
+  printf("\n%dx%d %s buffered\n", VGAController.getViewPortWidth(), VGAController.getViewPortHeight(), doubleBuffered ? "double" : "single");
+  printf("%-16s %12s %12s %12s\n", "Primitive", "raster/s", "vsync/s", "render/s");
+
+  for (auto const & benchmark : Benchmarks) {
+    printf("%-16s %12.0f", benchmark.name, runBenchmark(benchmark, Pipeline::Raster));
+    // with double buffering primitives are always executed while added
+    if (doubleBuffered)
+      printf(" %12s %12s\n", "-", "-");
+    else {
+      printf(" %12.0f", runBenchmark(benchmark, Pipeline::VSync));
+      printf(" %12.0f\n", runBenchmark(benchmark, Pipeline::Render));
+    }
+    fflush(stdout);
+  }
+
+  VGAController.enableRenderTask(false);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// terminal
+
+
+// number of cursor position reports received (see terminalSync())
+std::atomic<int> reportsCount;
+
+
+// drains replies to status requests, which otherwise would fill the output queue and stop the terminal
+void * terminalReader(void * arg)
+{
+  while (true)
+    if (Terminal.read() == 'R')
+      ++reportsCount;
+  return NULL;
+}
+
+
+// returns when the terminal has processed all received codes: waits for the reply to a cursor position request
+void terminalSync()
+{
+  int count = reportsCount;
+  Terminal.write("\e[6n");
+  while (reportsCount == count)
+    usleep(100);
+  Canvas.waitCompletion();
+}
+
+
+void benchTerminalStream(char const * name, void (*gen)(std::string &, size_t), size_t size, Pipeline pipeline)
+{
+  std::string s;
+  s.reserve(size + 128);
+  gen(s, size);
+
+  VGAController.enableRenderTask(pipeline == Pipeline::Render);
+
+  Terminal.write("\ec");   // RIS
+  terminalSync();
+
+  uint32_t startFence = VGAController.getPrimitivesFence();
+  int64_t startTime = esp_timer_get_time();
+
+  Terminal.write((uint8_t const *) s.data(), s.size());
+  terminalSync();
+
+  double secs = (esp_timer_get_time() - startTime) / 1e6;
+  uint32_t primitives = VGAController.getPrimitivesFence() - startFence;
+
+  printf("%-14s %-8s %10.1f %12.0f\n", name, pipeline == Pipeline::VSync ? "vsync" : "render", s.size() / secs / 1000, primitives / secs);
+  fflush(stdout);
+}
+
+
+void benchTerminal(size_t size)
+{
+  setupMode(VGA_640x480_60Hz, false);
+
+  Terminal.begin();
+  Terminal.connectLocally();
+
+  pthread_t reader;
+  pthread_create(&reader, NULL, terminalReader, NULL);
+  pthread_detach(reader);
+
+  printf("\nTerminal %dx%d, %d columns, %d KB per stream\n", VGAController.getViewPortWidth(), VGAController.getViewPortHeight(), Terminal.getColumns(), (int) (size / 1000));
+  printf("%-14s %-8s %10s %12s\n", "Stream", "Pipeline", "KB/s", "prims/s");
+
+  Pipeline const pipelines[] = { Pipeline::VSync, Pipeline::Render };
+  for (auto pipeline : pipelines) {
+    benchTerminalStream("text",         genText,        size, pipeline);
+    benchTerminalStream("colored list", genColoredList, size, pipeline);
+    benchTerminalStream("full screen",  genFullScreen,  size, pipeline);
+    benchTerminalStream("vttest",       genVTTest,      size, pipeline);
+  }
+
+  VGAController.enableRenderTask(false);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+
+
+int main(int argc, char * argv[])
+{
+  size_t size = (argc > 1 ? atoi(argv[1]) : 256) * 1000;
+
+  VGAController.begin(GPIO_NUM_22, GPIO_NUM_21, GPIO_NUM_19, GPIO_NUM_18, GPIO_NUM_5, GPIO_NUM_4, GPIO_NUM_23, GPIO_NUM_15);
+
+  // 32x32 opaque checkerboard
+  for (int y = 0; y < 32; ++y)
+    for (int x = 0; x < 32; ++x)
+      bitmapData[x + y * 32] = ((x ^ y) & 4) ? 0xC3 : 0xFC;
+  bitmap = new Bitmap(32, 32, bitmapData);
+
+  // 16x16 sprite, a disk with transparent corners
+  for (int y = 0; y < 16; ++y)
+    for (int x = 0; x < 16; ++x)
+      spriteData[x + y * 16] = (x - 8) * (x - 8) + (y - 8) * (y - 8) < 64 ? 0xF3 : 0x00;
+  spriteBitmap = new Bitmap(16, 16, spriteData);
+
+  printf("FabGL host benchmark, VSync interrupt emulated at 60Hz\n");
+
+  benchPrimitives(QVGA_320x240_60Hz, false);
+  benchPrimitives(VGA_640x480_60Hz, false);
+  benchPrimitives(VGA_640x480_60Hz, true);
+
+  benchTerminal(size);
+
+  return 0;
+}
@@ -0,0 +1,925 @@
+/*
+  Host (Linux) emulation of the ESP-IDF, FreeRTOS and Arduino APIs used by FabGL, see include/hostshim.h
+*/
+
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hostshim.h"
+
+#include "ps2controller.h"
+#include "swgenerator.h"
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// time
+
+
+static int64_t nowMicros()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+int64_t esp_timer_get_time()
+{
+  return nowMicros();
+}
+
+
+uint32_t millis()
+{
+  return nowMicros() / 1000;
+}
+
+
+uint32_t micros()
+{
+  return nowMicros();
+}
+
+
+TickType_t xTaskGetTickCount()
+{
+  return millis() / portTICK_PERIOD_MS;
+}
+
+
+void vTaskDelay(TickType_t ticks)
+{
+  usleep(ticks * portTICK_PERIOD_MS * 1000);
+}
+
+
+void delay(uint32_t ms)
+{
+  vTaskDelay(ms / portTICK_PERIOD_MS);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// blocking waits with FreeRTOS timeouts (ticks, 0 = don't wait, portMAX_DELAY = forever)
+
+
+static void initCond(pthread_cond_t * cond)
+{
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+
+static void unlockMutex(void * mutex)
+{
+  pthread_mutex_unlock((pthread_mutex_t *) mutex);
+}
+
+
+struct Deadline {
+
+  Deadline(TickType_t ticks)
+    : m_ticks(ticks)
+  {
+    if (ticks != portMAX_DELAY) {
+      int64_t t = nowMicros() + (int64_t) ticks * portTICK_PERIOD_MS * 1000;
+      m_time.tv_sec  = t / 1000000;
+      m_time.tv_nsec = (t % 1000000) * 1000;
+    }
+  }
+
+  // "mutex" must be locked. Returns false on timeout. Cancelling the waiting thread (vTaskDelete()) releases "mutex".
+  bool wait(pthread_cond_t * cond, pthread_mutex_t * mutex)
+  {
+    if (m_ticks == 0)
+      return false;
+    int r = 0;
+    pthread_cleanup_push(unlockMutex, mutex);
+    if (m_ticks == portMAX_DELAY)
+      pthread_cond_wait(cond, mutex);
+    else
+      r = pthread_cond_timedwait(cond, mutex, &m_time);
+    pthread_cleanup_pop(0);
+    return r == 0;
+  }
+
+  TickType_t m_ticks;
+  timespec   m_time;
+};
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// critical sections
+
+
+static pthread_mutex_t s_criticalMutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+
+void hostEnterCritical()
+{
+  pthread_mutex_lock(&s_criticalMutex);
+}
+
+
+void hostExitCritical()
+{
+  pthread_mutex_unlock(&s_criticalMutex);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// tasks
+
+
+struct HostTask {
+  pthread_t       thread;
+  TaskFunction_t  code;
+  void *          params;
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  uint32_t        notifyValue;
+  bool            notifyPending;
+};
+
+
+static __thread HostTask * s_currentTask;
+
+
+static HostTask * newTask(TaskFunction_t code, void * params)
+{
+  HostTask * task = new HostTask;
+  task->code          = code;
+  task->params        = params;
+  task->notifyValue   = 0;
+  task->notifyPending = false;
+  pthread_mutex_init(&task->mutex, NULL);
+  initCond(&task->cond);
+  return task;
+}
+
+
+static void * taskThread(void * arg)
+{
+  s_currentTask = (HostTask *) arg;
+  s_currentTask->code(s_currentTask->params);
+  return NULL;
+}
+
+
+BaseType_t xTaskCreate(TaskFunction_t code, char const * name, uint32_t stackDepth, void * params, UBaseType_t priority, TaskHandle_t * handle)
+{
+  HostTask * task = newTask(code, params);
+  if (handle)
+    *handle = task;
+  pthread_create(&task->thread, NULL, taskThread, task);
+  pthread_detach(task->thread);
+  return pdPASS;
+}
+
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, char const * name, uint32_t stackDepth, void * params, UBaseType_t priority, TaskHandle_t * handle, BaseType_t coreID)
+{
+  return xTaskCreate(code, name, stackDepth, params, priority, handle);
+}
+
+
+// the handle is not freed, other threads may still reference it
+void vTaskDelete(TaskHandle_t task)
+{
+  if (task == NULL || task == xTaskGetCurrentTaskHandle())
+    pthread_exit(NULL);
+  pthread_cancel(task->thread);
+}
+
+
+// only the keyboard (not available on the host) suspends tasks
+void vTaskSuspend(TaskHandle_t task)
+{
+}
+
+
+void vTaskResume(TaskHandle_t task)
+{
+}
+
+
+// threads not created by xTaskCreate() (main, timers, interrupts) get a task on first request
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+  if (s_currentTask == NULL) {
+    s_currentTask = newTask(NULL, NULL);
+    s_currentTask->thread = pthread_self();
+  }
+  return s_currentTask;
+}
+
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action)
+{
+  BaseType_t ret = pdPASS;
+  pthread_mutex_lock(&task->mutex);
+  switch (action) {
+    case eNoAction:
+      break;
+    case eSetBits:
+      task->notifyValue |= value;
+      break;
+    case eIncrement:
+      ++task->notifyValue;
+      break;
+    case eSetValueWithOverwrite:
+      task->notifyValue = value;
+      break;
+    case eSetValueWithoutOverwrite:
+      if (task->notifyPending)
+        ret = pdFAIL;
+      else
+        task->notifyValue = value;
+      break;
+  }
+  task->notifyPending = true;
+  pthread_cond_broadcast(&task->cond);
+  pthread_mutex_unlock(&task->mutex);
+  return ret;
+}
+
+
+BaseType_t xTaskNotifyFromISR(TaskHandle_t task, uint32_t value, eNotifyAction action, BaseType_t * higherPriorityTaskWoken)
+{
+  return xTaskNotify(task, value, action);
+}
+
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+  return xTaskNotify(task, 0, eIncrement);
+}
+
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t * higherPriorityTaskWoken)
+{
+  xTaskNotify(task, 0, eIncrement);
+}
+
+
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait)
+{
+  HostTask * task = xTaskGetCurrentTaskHandle();
+  Deadline deadline(ticksToWait);
+  pthread_mutex_lock(&task->mutex);
+  while (task->notifyValue == 0 && deadline.wait(&task->cond, &task->mutex))
+    ;
+  uint32_t value = task->notifyValue;
+  if (value)
+    task->notifyValue = clearCountOnExit ? 0 : value - 1;
+  task->notifyPending = false;
+  pthread_mutex_unlock(&task->mutex);
+  return value;
+}
+
+
+BaseType_t xTaskNotifyWait(uint32_t bitsToClearOnEntry, uint32_t bitsToClearOnExit, uint32_t * notificationValue, TickType_t ticksToWait)
+{
+  HostTask * task = xTaskGetCurrentTaskHandle();
+  Deadline deadline(ticksToWait);
+  pthread_mutex_lock(&task->mutex);
+  if (!task->notifyPending)
+    task->notifyValue &= ~bitsToClearOnEntry;
+  while (!task->notifyPending && deadline.wait(&task->cond, &task->mutex))
+    ;
+  if (notificationValue)
+    *notificationValue = task->notifyValue;
+  bool received = task->notifyPending;
+  if (received)
+    task->notifyValue &= ~bitsToClearOnExit;
+  task->notifyPending = false;
+  pthread_mutex_unlock(&task->mutex);
+  return received ? pdTRUE : pdFALSE;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// queues
+
+
+struct HostQueue {
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;     // signaled on send and receive
+  uint8_t *       items;
+  int             itemSize;
+  int             length;
+  int             head;
+  int             count;
+};
+
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+  HostQueue * queue = new HostQueue;
+  pthread_mutex_init(&queue->mutex, NULL);
+  initCond(&queue->cond);
+  queue->items    = (uint8_t *) malloc(length * itemSize);
+  queue->itemSize = itemSize;
+  queue->length   = length;
+  queue->head     = 0;
+  queue->count    = 0;
+  return queue;
+}
+
+
+void vQueueDelete(QueueHandle_t queue)
+{
+  if (queue) {
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->cond);
+    free(queue->items);
+    delete queue;
+  }
+}
+
+
+static BaseType_t queueSend(QueueHandle_t queue, void const * item, TickType_t ticksToWait, bool front)
+{
+  Deadline deadline(ticksToWait);
+  pthread_mutex_lock(&queue->mutex);
+  while (queue->count == queue->length && deadline.wait(&queue->cond, &queue->mutex))
+    ;
+  bool sent = queue->count < queue->length;
+  if (sent) {
+    int pos;
+    if (front) {
+      queue->head = (queue->head + queue->length - 1) % queue->length;
+      pos = queue->head;
+    } else
+      pos = (queue->head + queue->count) % queue->length;
+    memcpy(queue->items + pos * queue->itemSize, item, queue->itemSize);
+    ++queue->count;
+    pthread_cond_broadcast(&queue->cond);
+  }
+  pthread_mutex_unlock(&queue->mutex);
+  return sent ? pdTRUE : pdFALSE;
+}
+
+
+static BaseType_t queueReceive(QueueHandle_t queue, void * item, TickType_t ticksToWait, bool remove)
+{
+  Deadline deadline(ticksToWait);
+  pthread_mutex_lock(&queue->mutex);
+  while (queue->count == 0 && deadline.wait(&queue->cond, &queue->mutex))
+    ;
+  bool received = queue->count > 0;
+  if (received) {
+    memcpy(item, queue->items + queue->head * queue->itemSize, queue->itemSize);
+    if (remove) {
+      queue->head = (queue->head + 1) % queue->length;
+      --queue->count;
+      pthread_cond_broadcast(&queue->cond);
+    }
+  }
+  pthread_mutex_unlock(&queue->mutex);
+  return received ? pdTRUE : pdFALSE;
+}
+
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, void const * item, TickType_t ticksToWait)
+{
+  return queueSend(queue, item, ticksToWait, false);
+}
+
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, void const * item, TickType_t ticksToWait)
+{
+  return queueSend(queue, item, ticksToWait, true);
+}
+
+
+BaseType_t xQueueSendToBackFromISR(QueueHandle_t queue, void const * item, BaseType_t * higherPriorityTaskWoken)
+{
+  return queueSend(queue, item, 0, false);
+}
+
+
+BaseType_t xQueueSendToFrontFromISR(QueueHandle_t queue, void const * item, BaseType_t * higherPriorityTaskWoken)
+{
+  return queueSend(queue, item, 0, true);
+}
+
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void * item, TickType_t ticksToWait)
+{
+  return queueReceive(queue, item, ticksToWait, true);
+}
+
+
+BaseType_t xQueueReceiveFromISR(QueueHandle_t queue, void * item, BaseType_t * higherPriorityTaskWoken)
+{
+  return queueReceive(queue, item, 0, true);
+}
+
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void * item, TickType_t ticksToWait)
+{
+  return queueReceive(queue, item, ticksToWait, false);
+}
+
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+  pthread_mutex_lock(&queue->mutex);
+  int count = queue->count;
+  pthread_mutex_unlock(&queue->mutex);
+  return count;
+}
+
+
+UBaseType_t uxQueueMessagesWaitingFromISR(QueueHandle_t queue)
+{
+  return uxQueueMessagesWaiting(queue);
+}
+
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+  return queue->length - uxQueueMessagesWaiting(queue);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// mutexes
+
+
+struct HostSemaphore {
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  HostTask *      owner;
+  int             depth;    // recursive mutexes only
+};
+
+
+static SemaphoreHandle_t newSemaphore()
+{
+  HostSemaphore * semaphore = new HostSemaphore;
+  pthread_mutex_init(&semaphore->mutex, NULL);
+  initCond(&semaphore->cond);
+  semaphore->owner = NULL;
+  semaphore->depth = 0;
+  return semaphore;
+}
+
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+  return newSemaphore();
+}
+
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex()
+{
+  return newSemaphore();
+}
+
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+  if (semaphore) {
+    pthread_mutex_destroy(&semaphore->mutex);
+    pthread_cond_destroy(&semaphore->cond);
+    delete semaphore;
+  }
+}
+
+
+static BaseType_t semaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait, bool recursive)
+{
+  HostTask * task = xTaskGetCurrentTaskHandle();
+  Deadline deadline(ticksToWait);
+  pthread_mutex_lock(&semaphore->mutex);
+  bool taken = recursive && semaphore->owner == task;
+  if (!taken) {
+    while (semaphore->owner && deadline.wait(&semaphore->cond, &semaphore->mutex))
+      ;
+    taken = semaphore->owner == NULL;
+    if (taken)
+      semaphore->owner = task;
+  }
+  if (taken)
+    ++semaphore->depth;
+  pthread_mutex_unlock(&semaphore->mutex);
+  return taken ? pdTRUE : pdFALSE;
+}
+
+
+static BaseType_t semaphoreGive(SemaphoreHandle_t semaphore)
+{
+  pthread_mutex_lock(&semaphore->mutex);
+  bool given = semaphore->owner != NULL;
+  if (given && --semaphore->depth == 0) {
+    semaphore->owner = NULL;
+    pthread_cond_broadcast(&semaphore->cond);
+  }
+  pthread_mutex_unlock(&semaphore->mutex);
+  return given ? pdTRUE : pdFALSE;
+}
+
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait)
+{
+  return semaphoreTake(semaphore, ticksToWait, false);
+}
+
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+  return semaphoreGive(semaphore);
+}
+
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t semaphore, TickType_t ticksToWait)
+{
+  return semaphoreTake(semaphore, ticksToWait, true);
+}
+
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t semaphore)
+{
+  return semaphoreGive(semaphore);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// software timers (a thread each)
+
+
+struct HostTimer {
+  pthread_t               thread;
+  pthread_mutex_t         mutex;
+  pthread_cond_t          cond;     // signaled on start, stop and delete
+  TickType_t              period;
+  bool                    autoReload;
+  void *                  timerID;
+  TimerCallbackFunction_t callback;
+  bool                    active;
+  bool                    deleted;
+};
+
+
+static void * timerThread(void * arg)
+{
+  HostTimer * timer = (HostTimer *) arg;
+  pthread_mutex_lock(&timer->mutex);
+  while (!timer->deleted) {
+    if (!timer->active) {
+      pthread_cond_wait(&timer->cond, &timer->mutex);
+      continue;
+    }
+    Deadline deadline(timer->period);
+    if (deadline.wait(&timer->cond, &timer->mutex) || !timer->active || timer->deleted)
+      continue; // restarted, stopped or deleted
+    if (!timer->autoReload)
+      timer->active = false;
+    pthread_mutex_unlock(&timer->mutex);
+    timer->callback(timer);
+    pthread_mutex_lock(&timer->mutex);
+  }
+  pthread_mutex_unlock(&timer->mutex);
+  pthread_mutex_destroy(&timer->mutex);
+  pthread_cond_destroy(&timer->cond);
+  delete timer;
+  return NULL;
+}
+
+
+TimerHandle_t xTimerCreate(char const * name, TickType_t period, UBaseType_t autoReload, void * timerID, TimerCallbackFunction_t callback)
+{
+  HostTimer * timer = new HostTimer;
+  pthread_mutex_init(&timer->mutex, NULL);
+  initCond(&timer->cond);
+  timer->period     = period;
+  timer->autoReload = autoReload;
+  timer->timerID    = timerID;
+  timer->callback   = callback;
+  timer->active     = false;
+  timer->deleted    = false;
+  pthread_create(&timer->thread, NULL, timerThread, timer);
+  pthread_detach(timer->thread);
+  return timer;
+}
+
+
+static BaseType_t timerCommand(TimerHandle_t timer, bool active, bool deleted)
+{
+  pthread_mutex_lock(&timer->mutex);
+  timer->active  = active;
+  timer->deleted = deleted;
+  pthread_cond_broadcast(&timer->cond);
+  pthread_mutex_unlock(&timer->mutex);
+  return pdPASS;
+}
+
+
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticksToWait)
+{
+  return timerCommand(timer, true, false);
+}
+
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t ticksToWait)
+{
+  return timerCommand(timer, false, false);
+}
+
+
+// the timer thread frees the timer
+BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t ticksToWait)
+{
+  return timerCommand(timer, false, true);
+}
+
+
+void * pvTimerGetTimerID(TimerHandle_t timer)
+{
+  return timer->timerID;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// heap
+
+
+void * heap_caps_malloc(size_t size, uint32_t caps)
+{
+  return malloc(size);
+}
+
+
+void * heap_caps_realloc(void * ptr, size_t size, uint32_t caps)
+{
+  return realloc(ptr, size);
+}
+
+
+void heap_caps_free(void * ptr)
+{
+  free(ptr);
+}
+
+
+// more than any video mode needs, the viewport is allocated in one block
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+  return 4 * 1024 * 1024;
+}
+
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+  return heap_caps_get_largest_free_block(caps);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// interrupts
+//
+// Only the VSync pin interrupt is emulated: a thread calls its handler at 60Hz inside a critical section.
+// The I2S interrupt (line buffers of palette pixel formats) never fires.
+
+
+#define VSYNC_PERIOD_US (1000000 / 60)
+
+
+static void (*s_VSyncHandler)();
+static pthread_t s_VSyncThread;
+static bool      s_VSyncThreadStarted;
+
+
+static void * VSyncThread(void * arg)
+{
+  int64_t next = nowMicros();
+  while (true) {
+    next += VSYNC_PERIOD_US;
+    int64_t wait = next - nowMicros();
+    if (wait > 0)
+      usleep(wait);
+    else
+      next = nowMicros();   // late, skip missed frames
+    hostEnterCritical();
+    if (s_VSyncHandler)
+      s_VSyncHandler();
+    hostExitCritical();
+  }
+  return NULL;
+}
+
+
+void attachInterrupt(uint8_t pin, void (*handler)(), int mode)
+{
+  hostEnterCritical();
+  s_VSyncHandler = handler;
+  if (!s_VSyncThreadStarted) {
+    s_VSyncThreadStarted = true;
+    pthread_create(&s_VSyncThread, NULL, VSyncThread, NULL);
+    pthread_detach(s_VSyncThread);
+  }
+  hostExitCritical();
+}
+
+
+// returns when the handler is not executing
+void detachInterrupt(uint8_t pin)
+{
+  hostEnterCritical();
+  s_VSyncHandler = NULL;
+  hostExitCritical();
+}
+
+
+esp_err_t esp_intr_alloc(int source, int flags, intr_handler_t handler, void * arg, intr_handle_t * retHandle)
+{
+  if (retHandle)
+    *retHandle = (intr_handle_t) &s_VSyncHandler;  // any non null handle
+  return ESP_OK;
+}
+
+
+esp_err_t esp_intr_free(intr_handle_t handle)
+{
+  return ESP_OK;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// video hardware (no-op)
+
+
+uint32_t const GPIO_PIN_MUX_REG[GPIO_NUM_MAX] = { 0 };
+
+HostI2S I2S1;
+
+
+esp_err_t gpio_set_direction(gpio_num_t gpio, gpio_mode_t mode)
+{
+  return ESP_OK;
+}
+
+
+void gpio_matrix_out(uint32_t gpio, uint32_t signalIdx, bool outInv, bool oenInv)
+{
+}
+
+
+void periph_module_enable(periph_module_t module)
+{
+}
+
+
+void periph_module_disable(periph_module_t module)
+{
+}
+
+
+fabgl::SquareWaveGeneratorClass SquareWaveGenerator;
+
+
+namespace fabgl {
+
+
+// the I2S clock and DMA output stage (swgenerator.cpp) is replaced by nothing
+
+
+void SquareWaveGeneratorClass::begin()
+{
+  m_DMAStarted = false;
+}
+
+
+void SquareWaveGeneratorClass::begin(bool div1_onGPIO0, gpio_num_t div2, gpio_num_t div4, gpio_num_t div8, gpio_num_t div16, gpio_num_t div32, gpio_num_t div64, gpio_num_t div128, gpio_num_t div256)
+{
+  m_DMAStarted = false;
+}
+
+
+void SquareWaveGeneratorClass::end()
+{
+}
+
+
+void SquareWaveGeneratorClass::play(int freq, lldesc_t volatile * dmaBuffers)
+{
+  m_DMAStarted = true;
+}
+
+
+void SquareWaveGeneratorClass::stop()
+{
+  m_DMAStarted = false;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// PS/2 controller: no devices connected, so the keyboard never becomes available
+
+
+void PS2ControllerClass::begin(gpio_num_t port0_clkGPIO, gpio_num_t port0_datGPIO, gpio_num_t port1_clkGPIO, gpio_num_t port1_datGPIO)
+{
+}
+
+
+int PS2ControllerClass::dataAvailable(int PS2Port)
+{
+  return 0;
+}
+
+
+bool PS2ControllerClass::waitData(int timeOutMS, int PS2Port)
+{
+  vTaskDelay(timeOutMS / portTICK_PERIOD_MS);
+  return false;
+}
+
+
+int PS2ControllerClass::getData(int PS2Port)
+{
+  return -1;
+}
+
+
+void PS2ControllerClass::sendData(uint8_t data, int PS2Port)
+{
+}
+
+
+void PS2ControllerClass::injectInRXBuffer(int value, int PS2Port)
+{
+}
+
+
+} // end of namespace
+
+
+fabgl::PS2ControllerClass PS2Controller;
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Arduino
+
+
+size_t Print::write(uint8_t const * buffer, size_t size)
+{
+  size_t count = 0;
+  while (size-- && write(*buffer++))
+    ++count;
+  return count;
+}
+
+
+size_t Print::printf(char const * format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  int size = vsnprintf(NULL, 0, format, ap);
+  va_end(ap);
+  if (size <= 0)
+    return 0;
+  char buf[size + 1];
+  va_start(ap, format);
+  vsnprintf(buf, size + 1, format, ap);
+  va_end(ap);
+  return write((uint8_t const *) buf, size);
+}
+
+
+char * itoa(int value, char * str, int base)
+{
+  char digits[33];
+  unsigned int v = (value < 0 && base == 10) ? -value : value;
+  int len = 0;
+  do {
+    int d = v % base;
+    digits[len++] = d < 10 ? '0' + d : 'a' + d - 10;
+    v /= base;
+  } while (v);
+  char * p = str;
+  if (value < 0 && base == 10)
+    *p++ = '-';
+  while (len)
+    *p++ = digits[--len];
+  *p = 0;
+  return str;
+}
@@ -0,0 +1 @@
+#include "../hostshim.h"
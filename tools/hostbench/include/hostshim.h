@@ -0,0 +1,334 @@
+/*
+  Host (Linux) emulation of the ESP-IDF, FreeRTOS and Arduino APIs used by FabGL.
+
+  Tasks and software timers are threads, the VSync interrupt is a 60Hz thread and critical sections share
+  one recursive lock with it. Video hardware (GPIO, I2S, DMA, interrupts) does nothing: the viewport is
+  a plain memory framebuffer. See hoststubs.cpp.
+*/
+
+
+#pragma once
+
+
+#include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <sched.h>
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// ESP-IDF attributes and errors
+
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// FreeRTOS
+
+
+typedef int          BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t     TickType_t;
+
+#define pdTRUE             1
+#define pdFALSE            0
+#define pdPASS             1
+#define pdFAIL             0
+#define portMAX_DELAY      0xFFFFFFFF
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms)  ((TickType_t)(ms))
+
+#define portYIELD_FROM_ISR()
+#define taskYIELD()          sched_yield()
+
+
+// critical sections, shared with the emulated interrupts
+typedef int portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED 0
+
+void hostEnterCritical();
+void hostExitCritical();
+
+#define portENTER_CRITICAL(mux)     hostEnterCritical()
+#define portEXIT_CRITICAL(mux)      hostExitCritical()
+#define portENTER_CRITICAL_ISR(mux) hostEnterCritical()
+#define portEXIT_CRITICAL_ISR(mux)  hostExitCritical()
+
+
+// tasks
+
+struct HostTask;
+
+typedef HostTask * TaskHandle_t;
+
+typedef void (*TaskFunction_t)(void *);
+
+typedef enum {
+  eNoAction,
+  eSetBits,
+  eIncrement,
+  eSetValueWithOverwrite,
+  eSetValueWithoutOverwrite,
+} eNotifyAction;
+
+BaseType_t xTaskCreate(TaskFunction_t code, char const * name, uint32_t stackDepth, void * params, UBaseType_t priority, TaskHandle_t * handle);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t code, char const * name, uint32_t stackDepth, void * params, UBaseType_t priority, TaskHandle_t * handle, BaseType_t coreID);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+void vTaskSuspend(TaskHandle_t task);
+void vTaskResume(TaskHandle_t task);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+TickType_t xTaskGetTickCount();
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action);
+BaseType_t xTaskNotifyFromISR(TaskHandle_t task, uint32_t value, eNotifyAction action, BaseType_t * higherPriorityTaskWoken);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t * higherPriorityTaskWoken);
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait);
+BaseType_t xTaskNotifyWait(uint32_t bitsToClearOnEntry, uint32_t bitsToClearOnExit, uint32_t * notificationValue, TickType_t ticksToWait);
+
+
+// queues
+
+struct HostQueue;
+
+typedef HostQueue * QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize);
+void vQueueDelete(QueueHandle_t queue);
+BaseType_t xQueueSendToBack(QueueHandle_t queue, void const * item, TickType_t ticksToWait);
+BaseType_t xQueueSendToFront(QueueHandle_t queue, void const * item, TickType_t ticksToWait);
+BaseType_t xQueueSendToBackFromISR(QueueHandle_t queue, void const * item, BaseType_t * higherPriorityTaskWoken);
+BaseType_t xQueueSendToFrontFromISR(QueueHandle_t queue, void const * item, BaseType_t * higherPriorityTaskWoken);
+BaseType_t xQueueReceive(QueueHandle_t queue, void * item, TickType_t ticksToWait);
+BaseType_t xQueueReceiveFromISR(QueueHandle_t queue, void * item, BaseType_t * higherPriorityTaskWoken);
+BaseType_t xQueuePeek(QueueHandle_t queue, void * item, TickType_t ticksToWait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+UBaseType_t uxQueueMessagesWaitingFromISR(QueueHandle_t queue);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue);
+
+#define xQueueSend xQueueSendToBack
+
+
+// mutexes
+
+struct HostSemaphore;
+
+typedef HostSemaphore * SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex();
+void vSemaphoreDelete(SemaphoreHandle_t semaphore);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticksToWait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t semaphore, TickType_t ticksToWait);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t semaphore);
+
+
+// software timers
+
+struct HostTimer;
+
+typedef HostTimer * TimerHandle_t;
+
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t);
+
+TimerHandle_t xTimerCreate(char const * name, TickType_t period, UBaseType_t autoReload, void * timerID, TimerCallbackFunction_t callback);
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticksToWait);
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t ticksToWait);
+BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t ticksToWait);
+void * pvTimerGetTimerID(TimerHandle_t timer);
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// ESP-IDF system
+
+
+int64_t esp_timer_get_time();
+
+#define MALLOC_CAP_DMA      (1 << 3)
+#define MALLOC_CAP_32BIT    (1 << 1)
+#define MALLOC_CAP_8BIT     (1 << 2)
+#define MALLOC_CAP_SPIRAM   (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+void * heap_caps_malloc(size_t size, uint32_t caps);
+void * heap_caps_realloc(void * ptr, size_t size, uint32_t caps);
+void heap_caps_free(void * ptr);
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+size_t heap_caps_get_free_size(uint32_t caps);
+
+inline bool esp_ptr_internal(void const * ptr) { return true; }
+
+
+// interrupts
+
+typedef struct HostIntr * intr_handle_t;
+
+typedef void (*intr_handler_t)(void *);
+
+#define ETS_I2S1_INTR_SOURCE 33
+#define ESP_INTR_FLAG_LEVEL3 (1 << 3)
+#define ESP_INTR_FLAG_IRAM   (1 << 10)
+
+esp_err_t esp_intr_alloc(int source, int flags, intr_handler_t handler, void * arg, intr_handle_t * retHandle);
+esp_err_t esp_intr_free(intr_handle_t handle);
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// ESP-IDF peripherals
+
+
+typedef enum {
+  GPIO_NUM_0,  GPIO_NUM_1,  GPIO_NUM_2,  GPIO_NUM_3,  GPIO_NUM_4,  GPIO_NUM_5,  GPIO_NUM_6,  GPIO_NUM_7,
+  GPIO_NUM_8,  GPIO_NUM_9,  GPIO_NUM_10, GPIO_NUM_11, GPIO_NUM_12, GPIO_NUM_13, GPIO_NUM_14, GPIO_NUM_15,
+  GPIO_NUM_16, GPIO_NUM_17, GPIO_NUM_18, GPIO_NUM_19, GPIO_NUM_20, GPIO_NUM_21, GPIO_NUM_22, GPIO_NUM_23,
+  GPIO_NUM_24, GPIO_NUM_25, GPIO_NUM_26, GPIO_NUM_27, GPIO_NUM_28, GPIO_NUM_29, GPIO_NUM_30, GPIO_NUM_31,
+  GPIO_NUM_32, GPIO_NUM_33, GPIO_NUM_34, GPIO_NUM_35, GPIO_NUM_36, GPIO_NUM_37, GPIO_NUM_38, GPIO_NUM_39,
+  GPIO_NUM_MAX,
+} gpio_num_t;
+
+typedef enum {
+  GPIO_MODE_INPUT,
+  GPIO_MODE_OUTPUT,
+  GPIO_MODE_INPUT_OUTPUT,
+} gpio_mode_t;
+
+esp_err_t gpio_set_direction(gpio_num_t gpio, gpio_mode_t mode);
+void gpio_matrix_out(uint32_t gpio, uint32_t signalIdx, bool outInv, bool oenInv);
+
+extern uint32_t const GPIO_PIN_MUX_REG[GPIO_NUM_MAX];
+
+#define PIN_FUNC_SELECT(reg, func)
+#define PIN_FUNC_GPIO              2
+#define I2S1O_DATA_OUT0_IDX        166
+
+
+typedef enum {
+  PERIPH_I2S0_MODULE,
+  PERIPH_I2S1_MODULE,
+} periph_module_t;
+
+void periph_module_enable(periph_module_t module);
+void periph_module_disable(periph_module_t module);
+
+
+// I2S registers touched by VGAController (the line buffers interrupt never fires)
+
+struct HostI2SInt {
+  uint32_t val;
+  uint32_t out_eof;
+};
+
+struct HostI2S {
+  HostI2SInt int_ena;
+  HostI2SInt int_clr;
+  HostI2SInt int_st;
+  uint32_t   out_eof_des_addr;
+};
+
+extern HostI2S I2S1;
+
+
+// DMA descriptor
+
+typedef struct lldesc_s {
+  volatile uint32_t size   : 12,
+                    length : 12,
+                    offset : 5,
+                    sosf   : 1,
+                    eof    : 1,
+                    owner  : 1;
+  volatile uint8_t * buf;
+  union {
+    volatile uint32_t empty;
+    struct {
+      struct lldesc_s * stqe_next;
+    } qe;
+  };
+} lldesc_t;
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Arduino
+
+
+#define RISING  1
+#define FALLING 2
+
+inline int digitalPinToInterrupt(int pin) { return pin; }
+
+// the handler attached to the VSync pin is called at 60Hz
+void attachInterrupt(uint8_t pin, void (*handler)(), int mode);
+void detachInterrupt(uint8_t pin);
+
+void delay(uint32_t ms);
+uint32_t millis();
+uint32_t micros();
+
+char * itoa(int value, char * str, int base);
+
+
+class Print {
+public:
+  virtual ~Print() { }
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(uint8_t const * buffer, size_t size);
+  size_t write(char const * str) { return str ? write((uint8_t const *) str, strlen(str)) : 0; }
+  size_t printf(char const * format, ...) __attribute__ ((format (printf, 2, 3)));
+};
+
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() = 0;
+};
+
+
+class Client : public Stream {
+public:
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(uint8_t const * buffer, size_t size) = 0;
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int read(uint8_t * buffer, size_t size) = 0;
+  virtual uint8_t connected() = 0;
+  virtual void stop() = 0;
+};
+
+
+// there aren't serial ports on the host
+class HardwareSerial : public Stream {
+public:
+  size_t write(uint8_t c) { return 1; }
+  size_t write(uint8_t const * buffer, size_t size) { return size; }
+  int available() { return 0; }
+  int availableForWrite() { return 128; }
+  int read() { return -1; }
+  int peek() { return -1; }
+  void flush() { }
+  void setRxBufferSize(size_t size) { }
+  size_t readBytes(uint8_t * buffer, size_t length) { return 0; }
+  using Print::write;
+};
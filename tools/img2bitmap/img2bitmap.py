@@ -3,13 +3,16 @@
 # Converts an image (png, jpeg, ....) to FabGL Bitmap structure
 #
 # usage:
-#    img2bitmap filename [-t x y] [-s width height]
+#    img2bitmap filename [-t x y] [-s width height] [-r] [-f frameWidth]
 #
 # -t = pixel where to take transparent color
 # -s = resize to specified values
+# -r = RLE encoding (only opaque pixels are stored, see Bitmap)
+# -f = split image horizontally in frames of specified width, generating an array of bitmaps (use with Sprite.addBitmaps())
 #
 # Example:
 #   python img2bitmap.py test.png -s 64 64 >out.c
+#   python img2bitmap.py strip.png -r -f 16 >out.c
 #
 # Requires PIL library:
 #   sudo pip install pillow
@@ -20,15 +23,20 @@ from PIL import Image
 
 transpColorPos = None
 newSize = None
+rle = False
+frameWidth = None
 
 if len(sys.argv) < 2:
   print "Converts an image (png, jpeg, ....) to FabGL Bitmap structure"
   print "Usage:"
-  print "  python img2bitmap filename [-t x y] [-s width height]\n"
+  print "  python img2bitmap filename [-t x y] [-s width height] [-r] [-f frameWidth]\n"
   print "  -t = pixel where to take transparent color"
-  print "  -s = resize to specified values\n"
+  print "  -s = resize to specified values"
+  print "  -r = RLE encoding"
+  print "  -f = split image in frames of specified width\n"
   print "Example:"
   print "  python img2bitmap.py input.png -s 64 64 >out.c"
+  print "  python img2bitmap.py strip.png -r -f 16 >out.c"
   sys.exit()
 
 i = 2
@@ -39,8 +47,14 @@ while i < len(sys.argv):
   elif sys.argv[i] == "-s":
     newSize = (int(sys.argv[i + 1]), int(sys.argv[i + 2]))
     i += 3
+  elif sys.argv[i] == "-r":
+    rle = True
+    i += 1
+  elif sys.argv[i] == "-f":
+    frameWidth = int(sys.argv[i + 1])
+    i += 2
   else:
-    ++i
+    i += 1
 
 filename = sys.argv[1]
 name = os.path.basename(os.path.splitext(filename)[0])
@@ -64,18 +78,82 @@ im = im.quantize(64).convert("RGBA")
 pix = im.load()
 
 
+
+def pixelValue(x, y):
+  v = int(3-pix[x, y][0] / 255.0 * 3.0)       # R
+  v |= int(3-pix[x, y][1] / 255.0 * 3.0) << 2 # G
+  v |= int(3-pix[x, y][2] / 255.0 * 3.0) << 4 # B
+  v |= int(pix[x, y][3] / 255.0 * 3.0) << 6   # A
+  return v
+
+
+# returns encoded rows of a frame, as lists of bytes
+def encodeFrame(fx, fwidth):
+  rows = []
+  for y in range(0, im.height):
+    row = [pixelValue(fx + x, y) for x in range(0, fwidth)]
+    if not rle:
+      rows.append(row)
+      continue
+    # runs: skip (transparent pixels), count, opaque pixels
+    runs = []
+    x = 0
+    while x < fwidth:
+      skip = 0
+      while x < fwidth and (row[x] >> 6) == 0 and skip < 255:
+        skip += 1
+        x += 1
+      count = 0
+      while x + count < fwidth and (row[x + count] >> 6) != 0 and count < 255:
+        count += 1
+      if count > 0 or (x < fwidth and skip == 255):
+        runs.append([skip, count] + row[x:x + count])
+      x += count
+    # runs count is stored in a single byte
+    if len(runs) > 255:
+      sys.stderr.write("Error: row {} has {} runs of opaque pixels, RLE encoding supports up to 255 runs per row\n".format(y, len(runs)))
+      sys.exit(1)
+    rows.append([len(runs)] + [v for run in runs for v in run])
+  if rle:
+    # rows offsets table, from the beginning of frame data
+    offset = im.height * 2
+    table = []
+    for row in rows:
+      if offset > 0xffff:
+        sys.stderr.write("Error: RLE encoded frame is larger than 64KB\n")
+        sys.exit(1)
+      table += [offset & 0xff, offset >> 8]
+      offset += len(row)
+    rows.insert(0, table)
+  return rows
+
+
+if frameWidth is None:
+  frameWidth = im.width
+framesCount = im.width / frameWidth
+
+frames = [encodeFrame(f * frameWidth, frameWidth) for f in range(0, framesCount)]
+
 print "const uint8_t {}_data[] = {{".format(name)
 
-for y in range(0, im.height):
-  print "\t",
-  for x in range(0, im.width):
-    v = int(3-pix[x, y][0] / 255.0 * 3.0)       # R
-    v |= int(3-pix[x, y][1] / 255.0 * 3.0) << 2 # G
-    v |= int(3-pix[x, y][2] / 255.0 * 3.0) << 4 # B
-    v |= int(pix[x, y][3] / 255.0 * 3.0) << 6   # A
-    print "0x{:02x},".format(v),
-  print
+offsets = []
+offset = 0
+for rows in frames:
+  offsets.append(offset)
+  for row in rows:
+    print "\t",
+    for v in row:
+      print "0x{:02x},".format(v),
+    print
+    offset += len(row)
 
 print "};"
 
-print "const Bitmap {} = Bitmap({}, {}, &{}_data[0]);".format(name, im.width, im.height, name)
+encoding = ", RLEBitmap" if rle else ""
+if framesCount == 1 and im.width == frameWidth:
+  print "const Bitmap {} = Bitmap({}, {}, &{}_data[0]{});".format(name, frameWidth, im.height, name, encoding)
+else:
+  print "const Bitmap {}[] = {{".format(name)
+  for o in offsets:
+    print "\tBitmap({}, {}, &{}_data[{}]{}),".format(frameWidth, im.height, name, o, encoding)
+  print "};"
@@ -0,0 +1,95 @@
+// Host benchmark of the terminal escape sequences parser (fabgl::VTParser)
+//
+// usage:
+//    vtbench [megabytes]
+//
+// Each stream is generated in memory, then parsed in blocks of the size of the terminal input ring
+// (FABGLIB_TERMINAL_INPUT_QUEUE_SIZE), as the terminal does. Results are in MB/s and actions/s.
+//
+// Build (from this directory):
+//    g++ -O2 -std=gnu++11 -I../../src vtbench.cpp ../../src/vtparser.cpp -o vtbench
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <chrono>
+
+#include "vtparser.h"
+#include "vtstreams.h"
+
+
+using fabgl::VTParser;
+using fabgl::VTAction;
+
+
+static void bench(char const * name, void (*gen)(std::string &, size_t), size_t size)
+{
+  std::string s;
+  s.reserve(size + 128);
+  gen(s, size);
+
+  VTParser parser;
+  bool ANSIMode = true;
+  long actions = 0;
+  long printed = 0;
+  unsigned checksum = 0;
+
+  auto start = std::chrono::steady_clock::now();
+
+  for (size_t pos = 0; pos < s.size(); ) {
+    int blockSize = (int) std::min(s.size() - pos, (size_t) FABGLIB_TERMINAL_INPUT_QUEUE_SIZE);
+    char const * data = s.data() + pos;
+    pos += blockSize;
+    while (blockSize > 0) {
+      int consumed = parser.parse(data, blockSize, ANSIMode);
+      switch (parser.getAction()) {
+        case VTAction::NoAction:
+          break;
+        case VTAction::PrintChars:
+          printed += parser.getPrintCount();
+          checksum += parser.getPrintChars()[0];
+          ++actions;
+          break;
+        case VTAction::CSIDispatch:
+          // follow DECANM, as the terminal does
+          if (parser.getPrivateMarker() && parser.getParams()[0] == 2)
+            ANSIMode = (parser.getCode() == 'h');
+          checksum += parser.getParams()[0];
+          ++actions;
+          break;
+        case VTAction::VT52Dispatch:
+          if (parser.getCode() == '<')
+            ANSIMode = true;
+          ++actions;
+          break;
+        default:
+          checksum += parser.getCode();
+          ++actions;
+          break;
+      }
+      data      += consumed;
+      blockSize -= consumed;
+    }
+  }
+
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("%-14s %8.1f MB/s  %12.0f actions/s  %5.1f%% printable  (checksum %08X)\n",
+         name, s.size() / secs / 1e6, actions / secs, 100.0 * printed / s.size(), checksum);
+}
+
+
+int main(int argc, char * argv[])
+{
+  size_t size = (argc > 1 ? atoi(argv[1]) : 16) * 1000000;
+
+  printf("VTParser, %d MB per stream\n", (int) (size / 1000000));
+  bench("text",         genText,        size);
+  bench("colored list", genColoredList, size);
+  bench("full screen",  genFullScreen,  size);
+  bench("vttest",       genVTTest,      size);
+
+  return 0;
+}
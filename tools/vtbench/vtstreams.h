@@ -0,0 +1,67 @@
+// Escape sequences streams used by the host benchmarks (vtbench, hostbench)
+
+
+#pragma once
+
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+
+// plain text lines, like "cat" of a large text file
+static void genText(std::string & s, size_t size)
+{
+  static const char WORDS[][12] = { "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit", "sed", "do" };
+  int col = 0;
+  for (int i = 0; s.size() < size; ++i) {
+    const char * w = WORDS[(i * 7 + i / 3) % 10];
+    int len = strlen(w);
+    if (col + len + 1 > 79) {
+      s += "\r\n";
+      col = 0;
+    }
+    s += w;
+    s += ' ';
+    col += len + 1;
+  }
+}
+
+
+// colored directory listing, a SGR sequence every few characters
+static void genColoredList(std::string & s, size_t size)
+{
+  char buf[64];
+  for (int i = 0; s.size() < size; ++i) {
+    snprintf(buf, sizeof(buf), "\e[0m\e[01;%dmfile%05d.txt\e[0m  ", 31 + i % 7, i);
+    s += buf;
+    if (i % 5 == 4)
+      s += "\r\n";
+  }
+}
+
+
+// full screen application: cursor positioning, erase line, short texts
+static void genFullScreen(std::string & s, size_t size)
+{
+  char buf[64];
+  for (int i = 0; s.size() < size; ++i) {
+    snprintf(buf, sizeof(buf), "\e[%d;%dH\e[K\e[7m%3d%%\e[27m status", 1 + i % 25, 1 + (i * 13) % 60, i % 100);
+    s += buf;
+  }
+}
+
+
+// vttest-like mix: DEC private modes, scrolling regions, double width lines, character sets, DCS and VT52 sequences
+static void genVTTest(std::string & s, size_t size)
+{
+  static const char * SEQS[] = {
+    "\e[?7h", "\e[?6l", "\e[2;24r", "\e#6Double width\r\n", "\e#5", "\e(0lqqk\e(B", "\e[1;4;5;7mAttrs\e[m\r\n",
+    "\e[10;10H\e[2J", "\e[3g\eH", "\e[?3l", "\e7\e[5;5HSaved\e8", "\e[4hInsert\e[4l", "\eP$q\"p\e\\", "\e[?2l\eY%%VT52\eA\e<",
+    "\e[2 q", "\e[61;1\"p", "\e[5n", "\eM\eD\eE", "\e[S\e[T\e[3L\e[2M\e[4P\e[2@\e[5X",
+  };
+  for (int i = 0; s.size() < size; ++i) {
+    s += SEQS[i % (sizeof(SEQS) / sizeof(SEQS[0]))];
+    s += "Line of text\r\n";
+  }
+}